@@ -0,0 +1,446 @@
+/**
+ * Benchmarks
+ *
+ * Times every force and operator that rebx_load_force and rebx_load_operator
+ * know about over a sweep of N, the raw DE430 and SPK evaluations, opening
+ * the ephemeris files, and end-to-end integration_function propagations.
+ *
+ * Each measurement is written to stdout as one JSON object per line, so the
+ * output can be diffed or fed to a script.  Progress and skipped benchmarks
+ * go to stderr.
+ *
+ * usage: ./bench [min_time [N_max]]
+ *
+ * min_time is the time in seconds spent on each measurement (default 0.2),
+ * N_max the largest N in the sweep (default 10000).  The ephemeris files are
+ * taken from REBX_EPHEM_PLANETS and REBX_EPHEM_ASTEROIDS, or from
+ * examples/ephem_forces, and those benchmarks are skipped if they are missing.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include "rebound.h"
+#include "reboundx.h"
+#include "spk.h"
+#include "planets.h"
+
+#define BENCH_JD0 2458849.5     // 2020 Jan 1, well inside the DE430 and sb431 coverage
+#define BENCH_N_QUADRATIC 1000  // Largest N for effects whose cost grows as N^2 or faster
+
+static double min_time = 0.2;
+
+static double bench_now(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + 1e-9*ts.tv_nsec;
+}
+
+// Star plus N-1 low mass bodies on nearby, mildly eccentric and inclined
+// orbits, in units with G=1.
+static struct reb_simulation* bench_simulation(const int N){
+    struct reb_simulation* sim = reb_create_simulation();
+    sim->dt = 1e-3;
+    sim->heartbeat = NULL;
+    sim->display_data = NULL;
+    struct reb_particle star = {0};
+    star.m = 1.;
+    reb_add(sim, star);
+    for (int i=1; i<N; i++){
+        const double a = 1. + 1e-3*i;
+        const double e = 0.01 + 0.04*(i%7)/7.;
+        const double inc = 0.01*(i%5);
+        struct reb_particle p = reb_tools_orbit_to_particle(sim->G, star, 1e-9, a, e, inc, 0.3*i, 0.7*i, 1.1*i);
+        reb_add(sim, p);
+    }
+    reb_move_to_com(sim);
+    return sim;
+}
+
+static const char* bench_planets_path(void){
+    const char* planets = getenv("REBX_EPHEM_PLANETS");
+    return planets ? planets : "../examples/ephem_forces/linux_p1550p2650.430";
+}
+
+static const char* bench_asteroids_path(void){
+    const char* asteroids = getenv("REBX_EPHEM_ASTEROIDS");
+    return asteroids ? asteroids : "../examples/ephem_forces/sb431-n16s.bsp";
+}
+
+// Shared handle for all ephemeris benchmarks, NULL if the files are missing.
+static struct rebx_ephemeris* bench_ephemeris(void){
+    static int tried = 0;
+    static struct rebx_ephemeris* eph = NULL;
+    if (!tried){
+        tried = 1;
+        const char* const planets = bench_planets_path();
+        const char* const asteroids = bench_asteroids_path();
+        FILE* fp = fopen(planets, "rb");
+        FILE* fa = fopen(asteroids, "rb");
+        if (fp != NULL && fa != NULL){
+            eph = rebx_ephemeris_open(planets, asteroids);
+        }
+        if (fp != NULL){
+            fclose(fp);
+        }
+        if (fa != NULL){
+            fclose(fa);
+        }
+        if (eph == NULL){
+            fprintf(stderr, "ephemeris files not found, skipping ephemeris benchmarks\n");
+        }
+    }
+    return eph;
+}
+
+/**************************
+ * Effect setup
+ *************************/
+
+// Sets up the parameters an effect needs.  Returns 0 if it can't be run.
+typedef int (*bench_setup)(struct reb_simulation* sim, struct rebx_extras* rebx, struct rebx_node** ap);
+
+static int setup_none(struct reb_simulation* sim, struct rebx_extras* rebx, struct rebx_node** ap){
+    return 1;
+}
+
+static int setup_c(struct reb_simulation* sim, struct rebx_extras* rebx, struct rebx_node** ap){
+    rebx_set_param_double(rebx, ap, "c", 1e4);
+    return 1;
+}
+
+static int setup_central_force(struct reb_simulation* sim, struct rebx_extras* rebx, struct rebx_node** ap){
+    rebx_set_param_double(rebx, &sim->particles[0].ap, "Acentral", 1e-4);
+    rebx_set_param_double(rebx, &sim->particles[0].ap, "gammacentral", -1.);
+    return 1;
+}
+
+static int setup_damping(struct reb_simulation* sim, struct rebx_extras* rebx, struct rebx_node** ap){
+    for (int i=1; i<sim->N; i++){
+        rebx_set_param_double(rebx, &sim->particles[i].ap, "tau_a", -1e6);
+        rebx_set_param_double(rebx, &sim->particles[i].ap, "tau_e", -1e5);
+    }
+    return 1;
+}
+
+static int setup_harmonics(struct reb_simulation* sim, struct rebx_extras* rebx, struct rebx_node** ap){
+    rebx_set_param_double(rebx, &sim->particles[0].ap, "J2", 1e-3);
+    rebx_set_param_double(rebx, &sim->particles[0].ap, "J4", -1e-5);
+    rebx_set_param_double(rebx, &sim->particles[0].ap, "R_eq", 1e-3);
+    return 1;
+}
+
+static int setup_radiation(struct reb_simulation* sim, struct rebx_extras* rebx, struct rebx_node** ap){
+    rebx_set_param_double(rebx, ap, "c", 1e4);
+    rebx_set_param_int(rebx, &sim->particles[0].ap, "radiation_source", 1);
+    for (int i=1; i<sim->N; i++){
+        rebx_set_param_double(rebx, &sim->particles[i].ap, "beta", 0.1);
+    }
+    return 1;
+}
+
+static int setup_tides(struct reb_simulation* sim, struct rebx_extras* rebx, struct rebx_node** ap){
+    rebx_set_param_double(rebx, &sim->particles[0].ap, "R_tides", 1e-3);
+    rebx_set_param_double(rebx, &sim->particles[0].ap, "k1", 0.5);
+    for (int i=1; i<sim->N; i++){
+        rebx_set_param_double(rebx, &sim->particles[i].ap, "R_tides", 1e-5);
+        rebx_set_param_double(rebx, &sim->particles[i].ap, "k1", 0.3);
+    }
+    return 1;
+}
+
+// Test particles in the main belt, in AU, solar masses and days as ephemeris_forces expects.
+static int setup_ephemeris(struct reb_simulation* sim, struct rebx_extras* rebx, struct rebx_node** ap){
+    struct rebx_ephemeris* const eph = bench_ephemeris();
+    if (eph == NULL){
+        return 0;
+    }
+    sim->G = 0.295912208285591100E-03;
+    sim->t = BENCH_JD0;
+    sim->dt = 1.;
+    for (int i=0; i<sim->N; i++){
+        const double r = 2.2 + 1e-4*i;
+        const double phi = 0.1*i;
+        const double v = sqrt(sim->G/r);
+        struct reb_particle* const p = &sim->particles[i];
+        p->m = 0.;
+        p->x = r*cos(phi);
+        p->y = r*sin(phi);
+        p->z = 0.01*r*sin(3.*phi);
+        p->vx = -v*sin(phi);
+        p->vy = v*cos(phi);
+        p->vz = 0.;
+    }
+    rebx_set_param_pointer(rebx, ap, "ephemeris", eph);
+    rebx_set_param_int(rebx, ap, "geocentric", 0);
+    rebx_set_param_int(rebx, ap, "N_ephem", 11);
+    rebx_set_param_int(rebx, ap, "N_ast", 16);
+    rebx_set_param_double(rebx, ap, "c", 173.144632674);
+    return 1;
+}
+
+static int setup_mass(struct reb_simulation* sim, struct rebx_extras* rebx, struct rebx_node** ap){
+    for (int i=0; i<sim->N; i++){
+        rebx_set_param_double(rebx, &sim->particles[i].ap, "tau_mass", -1e8);
+    }
+    return 1;
+}
+
+static int setup_integrate_force(struct reb_simulation* sim, struct rebx_extras* rebx, struct rebx_node** ap){
+    struct rebx_force* const gr = rebx_load_force(rebx, "gr");
+    rebx_set_param_double(rebx, &gr->ap, "c", 1e4);
+    rebx_set_param_pointer(rebx, ap, "force", gr);
+    rebx_set_param_int(rebx, ap, "integrator", REBX_INTEGRATOR_RK4);
+    return 1;
+}
+
+static int setup_whfast(struct reb_simulation* sim, struct rebx_extras* rebx, struct rebx_node** ap){
+    sim->integrator = REB_INTEGRATOR_WHFAST;
+    return 1;
+}
+
+static int setup_min_distance(struct reb_simulation* sim, struct rebx_extras* rebx, struct rebx_node** ap){
+    for (int i=1; i<sim->N; i++){
+        rebx_set_param_double(rebx, &sim->particles[i].ap, "min_distance", 10.);
+    }
+    return 1;
+}
+
+struct bench_effect {
+    const char* name;
+    bench_setup setup;
+    int quadratic;          // 1 if the cost grows as N^2
+};
+
+static const struct bench_effect bench_forces[] = {
+    {"gr", setup_c, 1},
+    {"central_force", setup_central_force, 0},
+    {"modify_orbits_forces", setup_damping, 0},
+    {"gr_full", setup_c, 1},
+    {"gravitational_harmonics", setup_harmonics, 0},
+    {"gr_potential", setup_c, 0},
+    {"radiation_forces", setup_radiation, 0},
+    {"tides_precession", setup_tides, 0},
+    {"ephemeris_forces", setup_ephemeris, 0},
+};
+
+static const struct bench_effect bench_operators[] = {
+    {"modify_mass", setup_mass, 0},
+    {"integrate_force", setup_integrate_force, 0},
+    {"drift", setup_none, 0},
+    {"kick", setup_none, 0},
+    {"kepler", setup_whfast, 0},
+    {"jump", setup_whfast, 0},
+    {"interaction", setup_whfast, 1},
+    {"ias15", setup_none, 1},
+    {"modify_orbits_direct", setup_damping, 0},
+    {"track_min_distance", setup_min_distance, 0},
+};
+
+/**************************
+ * Benchmarks
+ *************************/
+
+static void bench_report(const char* kind, const char* name, const int N, const long calls, const double elapsed){
+    printf("{\"kind\": \"%s\", \"name\": \"%s\", \"N\": %d, \"calls\": %ld, \"seconds\": %.6e, \"ns_per_call\": %.6e, \"ns_per_particle_call\": %.6e}\n",
+            kind, name, N, calls, elapsed, 1e9*elapsed/calls, 1e9*elapsed/calls/N);
+    fflush(stdout);
+}
+
+static void bench_force(const struct bench_effect* const effect, const int N){
+    struct reb_simulation* sim = bench_simulation(N);
+    struct rebx_extras* rebx = rebx_attach(sim);
+    struct rebx_force* force = rebx_load_force(rebx, effect->name);
+    if (force == NULL || !effect->setup(sim, rebx, &force->ap)){
+        fprintf(stderr, "skipping force %s\n", effect->name);
+    }
+    else{
+        force->update_accelerations(sim, force, sim->particles, N);    // warm up workspaces and caches
+        long calls = 0;
+        double elapsed = 0.;
+        const double start = bench_now();
+        do{
+            for (int k=0; k<10; k++){
+                force->update_accelerations(sim, force, sim->particles, N);
+            }
+            calls += 10;
+            elapsed = bench_now() - start;
+        } while (elapsed < min_time);
+        bench_report("force", effect->name, N, calls, elapsed);
+    }
+    rebx_free(rebx);
+    reb_free_simulation(sim);
+}
+
+static void bench_operator(const struct bench_effect* const effect, const int N){
+    struct reb_simulation* sim = bench_simulation(N);
+    struct rebx_extras* rebx = rebx_attach(sim);
+    struct rebx_operator* operator = rebx_load_operator(rebx, effect->name);
+    if (operator == NULL || !effect->setup(sim, rebx, &operator->ap)){
+        fprintf(stderr, "skipping operator %s\n", effect->name);
+    }
+    else{
+        reb_update_acceleration(sim);
+        operator->step_function(sim, operator, sim->dt);
+        long calls = 0;
+        double elapsed = 0.;
+        const double start = bench_now();
+        do{
+            operator->step_function(sim, operator, sim->dt);
+            calls++;
+            elapsed = bench_now() - start;
+        } while (elapsed < min_time);
+        bench_report("operator", effect->name, N, calls, elapsed);
+    }
+    rebx_free(rebx);
+    reb_free_simulation(sim);
+}
+
+// Evaluations at pseudo-random dates over a year, so every call has to find its record.
+static void bench_ephemeris_calc(void){
+    if (bench_ephemeris() == NULL){
+        return;
+    }
+    struct _jpl_s* const pl = jpl_init_path(bench_planets_path());
+    struct spk_s* const spl = spk_init(bench_asteroids_path());
+    struct mpos_s pos;
+    unsigned int seed = 1;
+    double sink = 0.;
+
+    if (pl != NULL){
+        long calls = 0;
+        double elapsed = 0.;
+        const double start = bench_now();
+        do{
+            for (int k=0; k<1000; k++){
+                seed = 1103515245u*seed + 12345u;
+                const double jde = BENCH_JD0 + 365.25*(seed >> 8)/16777216.;
+                jpl_calc(pl, &pos, jde, PLAN_SOL + k%(PLAN_PLU - PLAN_SOL + 1), PLAN_BAR);
+                sink += pos.u[0];
+            }
+            calls += 1000;
+            elapsed = bench_now() - start;
+        } while (elapsed < min_time);
+        printf("{\"kind\": \"ephemeris\", \"name\": \"jpl_calc\", \"calls\": %ld, \"seconds\": %.6e, \"calls_per_second\": %.6e}\n", calls, elapsed, calls/elapsed);
+        jpl_free(pl);
+    }
+    if (spl != NULL && spl->num > 0){
+        long calls = 0;
+        double elapsed = 0.;
+        const double start = bench_now();
+        do{
+            for (int k=0; k<1000; k++){
+                seed = 1103515245u*seed + 12345u;
+                const double jde = BENCH_JD0 + 365.25*(seed >> 8)/16777216.;
+                spk_calc(spl, k%spl->num, jde, &pos);
+                sink += pos.u[0];
+            }
+            calls += 1000;
+            elapsed = bench_now() - start;
+        } while (elapsed < min_time);
+        printf("{\"kind\": \"ephemeris\", \"name\": \"spk_calc\", \"calls\": %ld, \"seconds\": %.6e, \"calls_per_second\": %.6e}\n", calls, elapsed, calls/elapsed);
+        spk_free(spl);
+    }
+    if (sink == 42.){   // keeps the evaluations from being optimized away
+        fprintf(stderr, " ");
+    }
+    fflush(stdout);
+}
+
+static void bench_ephemeris_init(void){
+    if (bench_ephemeris() == NULL){
+        return;
+    }
+    long calls = 0;
+    double elapsed = 0.;
+    double start = bench_now();
+    do{
+        struct _jpl_s* const pl = jpl_init_path(bench_planets_path());
+        jpl_free(pl);
+        calls++;
+        elapsed = bench_now() - start;
+    } while (elapsed < min_time);
+    printf("{\"kind\": \"ephemeris\", \"name\": \"jpl_init\", \"calls\": %ld, \"seconds\": %.6e, \"ns_per_call\": %.6e}\n", calls, elapsed, 1e9*elapsed/calls);
+
+    calls = 0;
+    start = bench_now();
+    do{
+        struct spk_s* const spl = spk_init(bench_asteroids_path());
+        spk_free(spl);
+        calls++;
+        elapsed = bench_now() - start;
+    } while (elapsed < min_time);
+    printf("{\"kind\": \"ephemeris\", \"name\": \"spk_init\", \"calls\": %ld, \"seconds\": %.6e, \"ns_per_call\": %.6e}\n", calls, elapsed, 1e9*elapsed/calls);
+    fflush(stdout);
+}
+
+// Propagates n_particles main belt test particles over a year.
+static void bench_integration_function(const int n_particles){
+    struct rebx_ephemeris* const eph = bench_ephemeris();
+    if (eph == NULL){
+        return;
+    }
+    const double trange = 365.25;
+    double* instate = malloc(6*n_particles*sizeof(double));
+    const double G = 0.295912208285591100E-03;
+    for (int i=0; i<n_particles; i++){
+        const double r = 2.2 + 0.01*i;
+        const double phi = 0.5*i;
+        const double v = sqrt(G/r);
+        instate[6*i+0] = r*cos(phi);
+        instate[6*i+1] = r*sin(phi);
+        instate[6*i+2] = 0.;
+        instate[6*i+3] = -v*sin(phi);
+        instate[6*i+4] = v*cos(phi);
+        instate[6*i+5] = 0.;
+    }
+    long calls = 0;
+    long n_out = 0;
+    double elapsed = 0.;
+    const double start = bench_now();
+    do{
+        timestate ts;
+        integration_function_eph(eph, BENCH_JD0, 10., trange, 0, n_particles, instate, &ts);
+        n_out += ts.n_out;
+        rebx_free_timestate(&ts);
+        calls++;
+        elapsed = bench_now() - start;
+    } while (elapsed < min_time);
+    printf("{\"kind\": \"propagation\", \"name\": \"integration_function\", \"N\": %d, \"calls\": %ld, \"seconds\": %.6e, \"particle_days_per_second\": %.6e, \"outputs_per_second\": %.6e}\n",
+            n_particles, calls, elapsed, calls*n_particles*trange/elapsed, n_out/elapsed);
+    fflush(stdout);
+    free(instate);
+}
+
+int main(int argc, char* argv[]){
+    if (argc > 1){
+        min_time = atof(argv[1]);
+    }
+    const int N_max = (argc > 2) ? atoi(argv[2]) : 10000;
+
+    const int n_forces = sizeof(bench_forces)/sizeof(bench_forces[0]);
+    const int n_operators = sizeof(bench_operators)/sizeof(bench_operators[0]);
+    for (int N=10; N<=N_max; N*=10){
+        for (int i=0; i<n_forces; i++){
+            if (!bench_forces[i].quadratic || N <= BENCH_N_QUADRATIC){
+                bench_force(&bench_forces[i], N);
+            }
+        }
+        for (int i=0; i<n_operators; i++){
+            if (!bench_operators[i].quadratic || N <= BENCH_N_QUADRATIC){
+                bench_operator(&bench_operators[i], N);
+            }
+        }
+    }
+
+    bench_ephemeris_init();
+    bench_ephemeris_calc();
+    bench_integration_function(1);
+    bench_integration_function(100);
+
+    if (bench_ephemeris() != NULL){
+        rebx_ephemeris_close(bench_ephemeris());
+    }
+    return 0;
+}
@@ -1,44 +1,64 @@
 from ctypes import *
 import numpy as np
 
-class TimeState(Structure):
-    _fields_ = [
-        ('t', POINTER(c_double)),
-        ('state', POINTER(c_double)),
-        ('n_out', c_int),        
-        ('n_particles', c_int)
-    ]
-    
-rebx_lib = CDLL('/Users/mholman/reboundx/examples/ephem_forces/libreboundx.so')
+import reboundx
+import reboundx.ephemeris
+
+# Use the library that came with the reboundx package rather than a local build.
+rebx_lib = reboundx.clibreboundx
 
 def integration_function(tstart, tstep, trange,
                          geocentric,
                          n_particles,
                          instate_arr):
 
-    InStateArray = 6*n_particles*c_double
-
-    timestate = TimeState()
-
-    _integration_function = rebx_lib.integration_function
-    _integration_function.argtypes = (c_double, c_double, c_double,
-                                      c_int,
-                                      c_int,
-                                      POINTER(c_double),
-                                      POINTER(TimeState))
-
-    _integration_function.restype = None
+    # The returned arrays own the C buffers, which are freed once they are garbage collected.
+    times, states = reboundx.ephemeris.integrate(tstart, tstep, trange,
+                                                 np.asarray(instate_arr).reshape(n_particles, 6),
+                                                 geocentric=geocentric)
+    n_out = times.shape[0]
 
+    return times, states, n_out, n_particles
 
-    return_value = _integration_function(tstart, tstep, trange, geocentric,
-                                         n_particles,
-                                         instate_arr.ctypes.data_as(POINTER(c_double)),
-                                         byref(timestate))
+def integration_function_mmap(tstart, tstep, trange,
+                              geocentric,
+                              n_particles,
+                              instate_arr,
+                              filename):
+    """
+    Integrates like integration_function, but writes the output to filename
+    rather than keeping it in memory, and returns it with read_trajectory.
+    """
+    _integration_function_mmap = rebx_lib.integration_function_mmap
+    _integration_function_mmap.argtypes = (c_void_p,
+                                           c_double, c_double, c_double,
+                                           c_int,
+                                           c_int,
+                                           POINTER(c_double),
+                                           c_char_p)
+    _integration_function_mmap.restype = c_int
 
-    n_out = timestate.n_out
-    times  = np.ctypeslib.as_array(timestate.t, shape=(n_out,))
-    states = np.ctypeslib.as_array(timestate.state, shape=(n_particles, 6, n_out))
-    n_particles = timestate.n_particles
+    status = _integration_function_mmap(None, tstart, tstep, trange, geocentric,
+                                        n_particles,
+                                        instate_arr.ctypes.data_as(POINTER(c_double)),
+                                        filename.encode('ascii'))
+    if status != 1:
+        raise RuntimeError("integration_function_mmap failed writing {0}".format(filename))
 
-    return times, states, n_out, n_particles
+    return read_trajectory(filename)
 
+def read_trajectory(filename):
+    """
+    Maps a file written by integration_function_mmap without copying it.
+    Returns times with shape (n_out,) and states with shape (n_out, n_particles, 6).
+    """
+    header = np.fromfile(filename, dtype=np.int32, count=4)
+    with open(filename, 'rb') as f:
+        magic = f.read(8)
+    if magic != b'REBXTRAJ':
+        raise ValueError("{0} is not a REBOUNDx trajectory file".format(filename))
+    n_particles = int(header[3])
+    n_out = int(np.fromfile(filename, dtype=np.int64, count=3)[2])
+    records = np.memmap(filename, dtype=[('t', 'f8'), ('state', 'f8', (n_particles, 6))],
+                        mode='r', offset=32, shape=(n_out,))
+    return records['t'], records['state']
@@ -0,0 +1,37 @@
+/**
+ * Cut down ephemeris files
+ *
+ * Writes copies of the DE430 and massive asteroid files that only cover a
+ * window of time, for jobs that do not need the whole 1550-2650 span.
+ * The results can be used in place of the originals, either through
+ * rebx_ephemeris_open or by pointing REBX_EPHEM_PLANETS and
+ * REBX_EPHEM_ASTEROIDS at them.
+ *
+ * usage: ./extract jd0 jd1 [n_ast [planets_out [asteroids_out]]]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include "rebound.h"
+#include "reboundx.h"
+
+int main(int argc, char* argv[]){
+
+    if (argc < 3){
+        fprintf(stderr, "usage: %s jd0 jd1 [n_ast [planets_out [asteroids_out]]]\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    const double jd0 = atof(argv[1]);
+    const double jd1 = atof(argv[2]);
+    const int n_ast = (argc > 3) ? atoi(argv[3]) : 16;
+    const char* const planets_out = (argc > 4) ? argv[4] : "planets_extract.430";
+    const char* const asteroids_out = (argc > 5) ? argv[5] : "asteroids_extract.bsp";
+
+    if (!rebx_ephemeris_extract("linux_p1550p2650.430", "sb431-n16s.bsp", planets_out, asteroids_out, jd0, jd1, n_ast)){
+        fprintf(stderr, "could not extract %f to %f\n", jd0, jd1);
+        exit(EXIT_FAILURE);
+    }
+
+    printf("Wrote %s and %s\n", planets_out, asteroids_out);
+    return 0;
+}
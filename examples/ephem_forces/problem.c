@@ -6,17 +6,6 @@
 #include "rebound.h"
 #include "reboundx.h"
 
-typedef struct {
-  double t, x, y, z, vx, vy, vz, ax, ay, az;
-} tstate;
-
-typedef struct {
-    double* t;
-    double* state;
-    int n_out;
-    int n_particles;
-} timestate;
-
 void read_inputs(char *filename, double* tstart, double* tstep, double* trange,
 		 int *geocentric,
 		 double **instate,
@@ -43,12 +32,6 @@ int main(int argc, char* argv[]){
 	read_inputs("initial_conditions.txt", &tstart, &tstep, &trange, &geocentric, &instate, &n_particles);
     }
 
-    int integration_function(double tstart, double tstep, double trange,
-			     int geocentric,
-			     int n_particles,
-			     double* instate,
-			     timestate *ts);
-    
     integration_function(tstart, tstep, trange,
 			 geocentric,
 			 n_particles,
@@ -40,9 +40,10 @@ def params(self):
 
 rebound.Particle.params = params
 
-from .extras import Extras, Param, Node, Force, Operator, integrators
+from .extras import Extras, Param, Node, Force, Operator, Harmonics, integrators
 from .simulationarchive import SimulationArchive
 from .tools import coordinates, install_test
 from .params import Params
+from . import ephemeris
 
 __all__ = ["__version__", "__build__", "__githash__", "Extras", "SimulationArchive", "Param", "Params", "coordinates", "integrators"]
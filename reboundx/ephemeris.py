@@ -0,0 +1,352 @@
+"""
+Test particle propagation against the JPL planetary and asteroid ephemerides (the ephemeris_forces effect).
+
+All calls go through ctypes, which releases the GIL for the duration of the C call, so
+propagations started from several Python threads run concurrently. Each call sets up and
+frees its own simulation, and the ephemeris handles are read-only once opened, so one
+Ephemeris can be shared by all threads.
+"""
+from . import clibreboundx
+from ctypes import Structure, POINTER, CFUNCTYPE, byref, cast, c_double, c_int, c_void_p, c_char_p
+import numpy as np
+import threading
+import os
+
+class TimeState(Structure):
+    """
+    Mirrors the C timestate struct
+    """
+    _fields_ = [("t", POINTER(c_double)),
+                ("state", POINTER(c_double)),
+                ("n_out", c_int),
+                ("n_particles", c_int)]
+
+RETIRE_NONE = 0
+RETIRE_IMPACT = 1
+RETIRE_ESCAPE = 2
+RETIRE_CALLBACK = 3
+RETIRE_EPHEMERIS = 4
+
+RETIREFUNCPTR = CFUNCTYPE(c_int, c_void_p, c_int, c_double, POINTER(c_double))
+
+class Retirement(Structure):
+    """
+    Mirrors the C rebx_retirement struct
+    """
+    _fields_ = [("impact_radius", c_double),
+                ("escape_distance", c_double),
+                ("retire", RETIREFUNCPTR),
+                ("ctx", c_void_p),
+                ("reason", POINTER(c_int)),
+                ("t", POINTER(c_double)),
+                ("state", POINTER(c_double))]
+
+clibreboundx.rebx_ephemeris_open.restype = c_void_p
+clibreboundx.rebx_ephemeris_open.argtypes = (c_char_p, c_char_p)
+clibreboundx.rebx_ephemeris_close.restype = None
+clibreboundx.rebx_ephemeris_close.argtypes = (c_void_p,)
+clibreboundx.rebx_free_timestate.restype = None
+clibreboundx.rebx_free_timestate.argtypes = (POINTER(TimeState),)
+clibreboundx.integration_function_eph.restype = c_int
+clibreboundx.integration_function_eph.argtypes = (c_void_p, c_double, c_double, c_double, c_int, c_int, POINTER(c_double), POINTER(TimeState))
+clibreboundx.integration_function_bidirectional.restype = c_int
+clibreboundx.integration_function_bidirectional.argtypes = (c_void_p, c_double, c_double, c_double, c_double, c_int, c_int, POINTER(c_double), POINTER(TimeState))
+clibreboundx.rebx_ephemeris_observe.restype = c_int
+clibreboundx.rebx_ephemeris_observe.argtypes = (c_void_p, POINTER(TimeState), c_int, c_int, POINTER(c_double), POINTER(c_double), c_int, POINTER(c_double), POINTER(c_double))
+clibreboundx.integration_function_epochs.restype = c_int
+clibreboundx.integration_function_epochs.argtypes = (c_void_p, c_double, c_double, c_int, c_int, POINTER(c_double), c_int, POINTER(c_double), POINTER(c_double))
+clibreboundx.integration_function_retire.restype = c_int
+clibreboundx.integration_function_retire.argtypes = (c_void_p, c_double, c_double, c_int, c_int, POINTER(c_double), c_int, POINTER(c_double), POINTER(c_double), POINTER(Retirement))
+clibreboundx.integration_function_groups.restype = c_int
+clibreboundx.integration_function_groups.argtypes = (c_void_p, c_double, c_double, c_int, c_int, POINTER(c_double), c_int, POINTER(c_double), POINTER(c_double), c_int)
+
+class Ephemeris(object):
+    """
+    Open DE430 planetary and SPK asteroid ephemeris files.
+
+    Arguments
+    ---------
+    planets : str
+        Path to the DE430 binary file. Defaults to the REBX_EPHEM_PLANETS environment variable, or linux_p1550p2650.430 in the working directory.
+    asteroids : str
+        Path to the SPK file for the massive asteroids. Defaults to the REBX_EPHEM_ASTEROIDS environment variable, or sb431-n16s.bsp in the working directory.
+    """
+    def __init__(self, planets=None, asteroids=None):
+        if planets is None:
+            planets = os.environ.get("REBX_EPHEM_PLANETS", "linux_p1550p2650.430")
+        if asteroids is None:
+            asteroids = os.environ.get("REBX_EPHEM_ASTEROIDS", "sb431-n16s.bsp")
+        self._handle = clibreboundx.rebx_ephemeris_open(planets.encode("ascii"), asteroids.encode("ascii"))
+        if not self._handle:
+            raise IOError("Could not open ephemeris files {0} and {1}".format(planets, asteroids))
+
+    def close(self):
+        """
+        Close the ephemeris files. No propagation may be using them anymore.
+        """
+        if getattr(self, "_handle", None):
+            clibreboundx.rebx_ephemeris_close(self._handle)
+            self._handle = None
+
+    def __del__(self):
+        self.close()
+
+_default = None
+_default_lock = threading.Lock()
+
+def _ephemeris_handle(ephemeris):
+    # The C library opens its default files lazily, which isn't thread-safe, so open them here once instead.
+    global _default
+    if ephemeris is None:
+        with _default_lock:
+            if _default is None:
+                _default = Ephemeris()
+        ephemeris = _default
+    return ephemeris._handle
+
+class _TimeStateOwner(object):
+    # Frees the C buffers of a timestate once no array viewing them is left
+    def __init__(self, ts):
+        self.ts = ts
+
+    def __del__(self):
+        clibreboundx.rebx_free_timestate(byref(self.ts))
+
+def _owned_array(pointer, shape, owner):
+    size = int(np.prod(shape))
+    buf = (c_double*size).from_address(cast(pointer, c_void_p).value)
+    buf._owner = owner
+    return np.frombuffer(buf, dtype=np.float64).reshape(shape)
+
+def _instate_array(instate):
+    instate = np.ascontiguousarray(instate, dtype=np.float64)
+    if instate.size % 6 != 0:
+        raise ValueError("instate must hold 6 values (x, y, z, vx, vy, vz) per particle")
+    return instate, instate.size//6
+
+def integrate(tstart, tstep, trange, instate, geocentric=False, ephemeris=None):
+    """
+    Integrate test particles with ephemeris_forces, returning the states at the Gauss-Radau substeps of every step.
+
+    Arguments
+    ---------
+    tstart : float
+        Start time (JD, TDB).
+    tstep : float
+        Initial time step in days.
+    trange : float
+        Time span in days.
+    instate : array_like
+        Initial positions and velocities, shape (n_particles, 6).
+    geocentric : bool
+        Whether instate is geocentric rather than barycentric.
+    ephemeris : Ephemeris
+        Ephemeris files to use. Defaults to a shared handle on the default files.
+
+    Returns
+    -------
+    Times with shape (n_out,) and states with shape (n_out, n_particles, 6). The arrays
+    view the buffers allocated by the C library without copying, which are freed once
+    both arrays are garbage collected.
+    """
+    instate, n_particles = _instate_array(instate)
+    handle = _ephemeris_handle(ephemeris)
+    ts = TimeState()
+    status = clibreboundx.integration_function_eph(handle, tstart, tstep, trange, int(geocentric), n_particles, instate.ctypes.data_as(POINTER(c_double)), byref(ts))
+    owner = _TimeStateOwner(ts)
+    if status != 1:
+        raise MemoryError("Could not allocate the output of the ephemeris propagation")
+    if ts.n_out == 0:
+        return np.empty(0), np.empty((0, n_particles, 6))
+    times = _owned_array(ts.t, (ts.n_out,), owner)
+    states = _owned_array(ts.state, (ts.n_out, n_particles, 6), owner)
+    return times, states
+
+def integrate_bidirectional(tstart, tstep, trange_back, trange_forward, instate, geocentric=False, ephemeris=None):
+    """
+    Integrate test particles backwards and forwards from tstart at the same time, on two threads,
+    returning one trajectory in increasing time.
+
+    Arguments
+    ---------
+    tstart : float
+        Start time (JD, TDB).
+    tstep : float
+        Initial time step in days. The sign is ignored.
+    trange_back : float
+        Time span in days to integrate backwards from tstart.
+    trange_forward : float
+        Time span in days to integrate forwards from tstart.
+    instate : array_like
+        Positions and velocities at tstart, shape (n_particles, 6).
+    geocentric : bool
+        Whether instate is geocentric rather than barycentric.
+    ephemeris : Ephemeris
+        Ephemeris files to use. Defaults to a shared handle on the default files.
+
+    Returns
+    -------
+    Times with shape (n_out,) and states with shape (n_out, n_particles, 6), as for integrate.
+    tstart appears once.
+    """
+    instate, n_particles = _instate_array(instate)
+    handle = _ephemeris_handle(ephemeris)
+    ts = TimeState()
+    status = clibreboundx.integration_function_bidirectional(handle, tstart, abs(tstep), abs(trange_back), abs(trange_forward), int(geocentric), n_particles, instate.ctypes.data_as(POINTER(c_double)), byref(ts))
+    owner = _TimeStateOwner(ts)
+    if status != 1:
+        raise MemoryError("Could not allocate the output of the ephemeris propagation")
+    if ts.n_out == 0:
+        return np.empty(0), np.empty((0, n_particles, 6))
+    times = _owned_array(ts.t, (ts.n_out,), owner)
+    states = _owned_array(ts.state, (ts.n_out, n_particles, 6), owner)
+    return times, states
+
+def integrate_epochs(tstart, tstep, instate, epochs, out=None, geocentric=False, ephemeris=None, grouped=False, n_threads=0):
+    """
+    Integrate test particles with ephemeris_forces, returning their states only at the requested epochs.
+
+    Arguments
+    ---------
+    tstart : float
+        Start time (JD, TDB).
+    tstep : float
+        Initial time step in days. Negative to integrate backwards.
+    instate : array_like
+        Initial positions and velocities, shape (n_particles, 6).
+    epochs : array_like
+        Epochs (JD, TDB), sorted in the direction of integration and not before tstart.
+    out : numpy.ndarray
+        Optional C-contiguous float64 array of shape (n_epochs, n_particles, 6) to write the states into.
+    geocentric : bool
+        Whether instate is geocentric rather than barycentric.
+    ephemeris : Ephemeris
+        Ephemeris files to use. Defaults to a shared handle on the default files.
+    grouped : bool
+        Whether to integrate the particles in groups that each take their own step size
+        between epochs, so that particles in close encounters don't slow down the rest.
+        The groups step to every epoch exactly, so that particles can change group there.
+    n_threads : int
+        Number of threads for the groups. 0 uses one per processor.
+
+    Returns
+    -------
+    The states, shape (n_epochs, n_particles, 6) (out, if it was passed).
+    """
+    instate, n_particles = _instate_array(instate)
+    epochs = np.ascontiguousarray(epochs, dtype=np.float64)
+    shape = (epochs.size, n_particles, 6)
+    if out is None:
+        out = np.empty(shape)
+    elif out.shape != shape or out.dtype != np.float64 or not out.flags['C_CONTIGUOUS'] or not out.flags['WRITEABLE']:
+        raise ValueError("out must be a writeable C-contiguous float64 array of shape {0}".format(shape))
+    handle = _ephemeris_handle(ephemeris)
+    if grouped:
+        n_done = clibreboundx.integration_function_groups(handle, tstart, tstep, int(geocentric), n_particles, instate.ctypes.data_as(POINTER(c_double)), epochs.size, epochs.ctypes.data_as(POINTER(c_double)), out.ctypes.data_as(POINTER(c_double)), n_threads)
+    else:
+        n_done = clibreboundx.integration_function_epochs(handle, tstart, tstep, int(geocentric), n_particles, instate.ctypes.data_as(POINTER(c_double)), epochs.size, epochs.ctypes.data_as(POINTER(c_double)), out.ctypes.data_as(POINTER(c_double)))
+    if n_done != epochs.size:
+        raise RuntimeError("Ephemeris propagation only reached {0} of {1} epochs".format(n_done, epochs.size))
+    return out
+
+def integrate_retire(tstart, tstep, instate, epochs, impact_radius=0., escape_distance=0., retire=None, geocentric=False, ephemeris=None):
+    """
+    Integrate test particles like integrate_epochs, taking out particles once they impact the Earth, escape,
+    or can no longer be integrated, so that they stop costing force evaluations.
+
+    Arguments
+    ---------
+    tstart : float
+        Start time (JD, TDB).
+    tstep : float
+        Initial time step in days. Negative to integrate backwards.
+    instate : array_like
+        Initial positions and velocities, shape (n_particles, 6).
+    epochs : array_like
+        Epochs (JD, TDB), sorted in the direction of integration and not before tstart.
+    impact_radius : float
+        Retire particles closer than this to the Earth center (AU). 0 to disable.
+    escape_distance : float
+        Retire particles farther than this from the solar system barycenter (AU). 0 to disable.
+    retire : callable
+        Optional function retire(id, t, state) called at the end of every step, returning True to retire
+        particle id (its index in instate). state is a numpy array of x, y, z, vx, vy, vz.
+    geocentric : bool
+        Whether instate is geocentric rather than barycentric.
+    ephemeris : Ephemeris
+        Ephemeris files to use. Defaults to a shared handle on the default files.
+
+    Returns
+    -------
+    The states, shape (n_epochs, n_particles, 6), NaN after a particle is retired, and the reasons
+    (RETIRE_* constants), times and states at retirement, with shapes (n_particles,), (n_particles,)
+    and (n_particles, 6).
+    """
+    instate, n_particles = _instate_array(instate)
+    epochs = np.ascontiguousarray(epochs, dtype=np.float64)
+    out = np.empty((epochs.size, n_particles, 6))
+    reason = np.zeros(n_particles, dtype=np.intc)
+    t = np.zeros(n_particles)
+    state = np.zeros((n_particles, 6))
+    ret = Retirement()
+    ret.impact_radius = impact_radius
+    ret.escape_distance = escape_distance
+    if retire is not None:
+        def _retire(ctx, id, t, s):
+            return int(bool(retire(id, t, np.ctypeslib.as_array(s, shape=(6,)).copy())))
+        ret.retire = RETIREFUNCPTR(_retire)       # ret keeps the reference alive during the call
+    ret.reason = reason.ctypes.data_as(POINTER(c_int))
+    ret.t = t.ctypes.data_as(POINTER(c_double))
+    ret.state = state.ctypes.data_as(POINTER(c_double))
+    handle = _ephemeris_handle(ephemeris)
+    n_done = clibreboundx.integration_function_retire(handle, tstart, tstep, int(geocentric), n_particles, instate.ctypes.data_as(POINTER(c_double)), epochs.size, epochs.ctypes.data_as(POINTER(c_double)), out.ctypes.data_as(POINTER(c_double)), byref(ret))
+    if n_done != epochs.size:
+        raise RuntimeError("Ephemeris propagation only reached {0} of {1} epochs".format(n_done, epochs.size))
+    return out, reason, t, state
+
+def observe(times, states, t_obs, observer=None, geocentric=False, ephemeris=None, n_threads=0):
+    """
+    Light-time corrected positions of integrated test particles as seen by an observer, for many epochs in one call.
+
+    Arguments
+    ---------
+    times : array_like
+        Output times of a trajectory, as returned by integrate or integrate_bidirectional, in order.
+    states : array_like
+        States of the trajectory, shape (n_out, n_particles, 6).
+    t_obs : array_like
+        Observation epochs (JD, TDB), shape (n_obs,).
+    observer : array_like
+        Offsets of the observer from the Earth's center in au, shape (n_obs, 3). Defaults to the Earth's center.
+    geocentric : bool
+        Whether the trajectory is geocentric rather than barycentric.
+    ephemeris : Ephemeris
+        Ephemeris files to use. Defaults to a shared handle on the default files.
+    n_threads : int
+        Number of threads to use. 0 uses one per processor.
+
+    Returns
+    -------
+    Positions relative to the observer with shape (n_obs, n_particles, 3), and light times in days
+    with shape (n_obs, n_particles). Observations outside the trajectory are NaN.
+    """
+    times = np.ascontiguousarray(times, dtype=np.float64)
+    states = np.ascontiguousarray(states, dtype=np.float64)
+    n_out = times.shape[0]
+    if states.size % (6*max(n_out, 1)) != 0:
+        raise ValueError("states must have shape (n_out, n_particles, 6)")
+    n_particles = states.size//(6*n_out) if n_out > 0 else 0
+    t_obs = np.ascontiguousarray(t_obs, dtype=np.float64).ravel()
+    n_obs = t_obs.shape[0]
+    observer_ptr = None
+    if observer is not None:
+        observer = np.ascontiguousarray(observer, dtype=np.float64)
+        if observer.size != 3*n_obs:
+            raise ValueError("observer must have shape (n_obs, 3)")
+        observer_ptr = observer.ctypes.data_as(POINTER(c_double))
+    ts = TimeState(times.ctypes.data_as(POINTER(c_double)), states.ctypes.data_as(POINTER(c_double)), n_out, n_particles)
+    positions = np.empty((n_obs, n_particles, 3))
+    light_times = np.empty((n_obs, n_particles))
+    handle = _ephemeris_handle(ephemeris)
+    clibreboundx.rebx_ephemeris_observe(handle, byref(ts), int(geocentric), n_obs, t_obs.ctypes.data_as(POINTER(c_double)), observer_ptr, n_threads, positions.ctypes.data_as(POINTER(c_double)), light_times.ctypes.data_as(POINTER(c_double)))
+    return positions, light_times
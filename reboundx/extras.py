@@ -1,10 +1,11 @@
 from . import clibreboundx
-from ctypes import Structure, c_double, POINTER, c_int, c_uint, c_long, c_ulong, c_void_p, c_char_p, CFUNCTYPE, byref, c_uint32, c_uint, cast, c_char
+from ctypes import Structure, c_double, POINTER, c_int, c_uint, c_long, c_ulong, c_void_p, c_char_p, CFUNCTYPE, byref, c_uint32, c_uint, cast, c_char, c_size_t, addressof
 import rebound
 import reboundx
 import warnings
+import numpy as np
 
-integrators = {"implicit_midpoint": 0, "rk4":1, "euler": 2, "rk2": 3, "none": -1}
+integrators = {"implicit_midpoint": 0, "rk4":1, "euler": 2, "rk2": 3, "dp45": 4, "none": -1}
 
 REBX_TIMING = {"pre":-1, "post":1}
 REBX_FORCE_TYPE = {"none":0, "pos":1, "vel":2}
@@ -40,7 +41,7 @@ class Extras(Structure):
         rebx = super(Extras,cls).__new__(cls)
         return rebx
 
-    def __init__(self, sim, filename=None):
+    def __init__(self, sim, filename=None, snapshot=None):
         sim._extras_ref = self # add a reference to this instance in sim to make sure it's not garbage collected_ 
         clibreboundx.rebx_initialize(byref(sim), byref(self))
         # Create simulation
@@ -50,8 +51,12 @@ class Extras(Structure):
         else:
             # Recreate existing simulation.
             # Load registered parameters from binary
+            # A snapshot index selects a snapshot from an archive written with save_archive
             w = c_int(0)
-            clibreboundx.rebx_init_extras_from_binary(byref(self), c_char_p(filename.encode('ascii')), byref(w))
+            if snapshot is None:
+                clibreboundx.rebx_init_extras_from_binary(byref(self), c_char_p(filename.encode('ascii')), byref(w))
+            else:
+                clibreboundx.rebx_init_extras_from_archive(byref(self), c_char_p(filename.encode('ascii')), c_long(snapshot), byref(w))
             for majorerror, value, message in REBX_BINARY_WARNINGS:
                 if w.value & value:
                     if majorerror:
@@ -117,6 +122,30 @@ class Extras(Structure):
             clibreboundx.rebx_add_operator_step(byref(self), byref(operator), c_double(dtfraction), c_int(timingint))
         self.process_messages()
 
+    def add_operator_steps(self, steps, timing="post"):
+        """
+        Adds a list of (operator, dtfraction) stages, run in the order given. Neighbouring stages of the same drift, kepler, jump or interaction operator are merged into one step.
+        """
+        N = len(steps)
+        operators = (c_void_p*N)()
+        dtfractions = (c_double*N)()
+        for i, (operator, dtfraction) in enumerate(steps):
+            if not isinstance(operator, reboundx.extras.Operator):
+                raise TypeError("REBOUNDx Error: Object passed to rebx.add_operator_steps is not a reboundx.Operator instance.")
+            operators[i] = addressof(operator)
+            dtfractions[i] = dtfraction
+        clibreboundx.rebx_add_operator_steps(byref(self), operators, dtfractions, c_int(N), c_int(REBX_TIMING[timing]))
+        self.process_messages()
+
+    def add_splitting(self, scheme, A, B, timing="post"):
+        """
+        Adds one timestep of a named splitting scheme ('leapfrog', 'saba2', 'saba3', 'saba4', 'yoshida4') alternating operators A and B, starting and ending with A.
+        """
+        if not isinstance(A, reboundx.extras.Operator) or not isinstance(B, reboundx.extras.Operator):
+            raise TypeError("REBOUNDx Error: Object passed to rebx.add_splitting is not a reboundx.Operator instance.")
+        clibreboundx.rebx_add_splitting(byref(self), c_char_p(scheme.encode('ascii')), byref(A), byref(B), c_int(REBX_TIMING[timing]))
+        self.process_messages()
+
     def get_force(self, name):
         clibreboundx.rebx_get_force.restype = POINTER(Force)
         ptr = clibreboundx.rebx_get_force(byref(self), c_char_p(name.encode('ascii')))
@@ -148,6 +177,87 @@ class Extras(Structure):
         if not success:
             raise AttributeError("REBOUNDx Error: Operator {0} passed to rebx.remove_operator not found in simulation.")
 
+    #######################################
+    # Profiling
+    #######################################
+
+    def enable_counters(self, enabled=True):
+        """
+        Turn the call counters (see Counters) on all forces and operators on or off.
+        Counters are kept when turned off, and are saved with the binary.
+        """
+        clibreboundx.rebx_set_counters(byref(self), c_int(int(enabled)))
+
+    def reset_counters(self):
+        """
+        Zero the call counters on all forces and operators.
+        """
+        clibreboundx.rebx_reset_counters(byref(self))
+
+    @property
+    def counters(self):
+        """
+        Dictionary from the names of all allocated forces and operators to their Counters.
+        """
+        counters = {}
+        for listptr, objtype in [(self._allocated_forces, Force), (self._allocated_operators, Operator)]:
+            node = listptr
+            while node:
+                obj = cast(node.contents.object, POINTER(objtype)).contents
+                counters[obj.name.decode('ascii')] = obj.counters
+                node = node.contents.next
+        return counters
+
+    #######################################
+    # Particle Parameters
+    #######################################
+
+    def _particle_param_array(self, name, indices, n):
+        param_type = clibreboundx.rebx_get_type(byref(self), c_char_p(name.encode('ascii')))
+        ctype = REBX_CTYPES[param_type]
+        if ctype == c_double:
+            dtype = np.float64
+        elif ctype == c_int:
+            dtype = np.intc
+        elif ctype == None:
+            raise AttributeError("REBOUNDx Error: Parameter '{0}' not found in REBOUNDx. Need to register it first.".format(name))
+        else:
+            raise AttributeError("REBOUNDx Error: Parameter '{0}' is not a double or int parameter.".format(name))
+        if indices is not None:
+            indices = np.ascontiguousarray(indices, dtype=np.intc)
+            n = indices.size
+            indices = indices.ctypes.data_as(POINTER(c_int))
+        return ctype, dtype, indices, n
+
+    def set_particle_params(self, name, values, indices=None):
+        """
+        Set a double or int parameter on many particles in a single call.
+        values is an array with one entry per particle, for particles 0 to len(values)-1 or for the
+        particles at indices. The parameter is kept in a column, so this is much faster than setting
+        sim.particles[i].params[name] in a loop.
+        """
+        n = np.size(values) if indices is None else None
+        ctype, dtype, cindices, n = self._particle_param_array(name, indices, n)
+        values = np.ascontiguousarray(values, dtype=dtype).ravel()
+        if values.size != n:
+            raise ValueError("REBOUNDx Error: values and indices must have the same length.")
+        setter = clibreboundx.rebx_set_param_double_array if ctype == c_double else clibreboundx.rebx_set_param_int_array
+        setter(byref(self), c_char_p(name.encode('ascii')), values.ctypes.data_as(POINTER(ctype)), cindices, c_int(n))
+        self.process_messages()
+
+    def get_particle_params(self, name, indices=None):
+        """
+        Get a double or int parameter for all particles, or for the particles at indices, as a numpy array.
+        Particles without the parameter get nan for double parameters and 0 for int parameters.
+        """
+        n = self._sim.contents.N if indices is None else None
+        ctype, dtype, cindices, n = self._particle_param_array(name, indices, n)
+        values = np.full(n, np.nan) if ctype == c_double else np.zeros(n, dtype=dtype)
+        getter = clibreboundx.rebx_get_param_double_array if ctype == c_double else clibreboundx.rebx_get_param_int_array
+        getter(byref(self), c_char_p(name.encode('ascii')), values.ctypes.data_as(POINTER(ctype)), cindices, c_int(n))
+        self.process_messages()
+        return values
+
     #######################################
     # Input/Output Routines
     #######################################
@@ -158,6 +268,16 @@ class Extras(Structure):
         clibreboundx.rebx_output_binary(byref(self), c_char_p(filename.encode("ascii")))
         self.process_messages()
 
+    def save_archive(self, filename, keyframe_interval=0):
+        """
+        Append a snapshot of the REBOUNDx parameters to an archive, alongside each SimulationArchive snapshot.
+        Snapshots only store the particle parameters that changed since the previous one, apart from keyframes,
+        which are written whenever forces, operators or the number of particles change, and at least every 
+        keyframe_interval snapshots if keyframe_interval > 0.
+        """
+        clibreboundx.rebx_output_archive(byref(self), c_char_p(filename.encode("ascii")), c_int(keyframe_interval))
+        self.process_messages()
+
     #######################################
     # Convenience Functions
     #######################################
@@ -202,6 +322,16 @@ class Extras(Structure):
         clibreboundx.rebx_gravitational_harmonics_potential.restype = c_double
         return clibreboundx.rebx_gravitational_harmonics_potential(byref(self))
 
+    def total_energy(self):
+        """
+        Total energy including the potentials of all added conservative effects, in a single pass over the particles.
+        Uses the gr or gr_full Hamiltonian in place of the classical energy if one of them is added.
+        """
+        clibreboundx.rebx_total_energy.restype = c_double
+        E = clibreboundx.rebx_total_energy(byref(self))
+        self.process_messages()
+        return E
+
     def process_messages(self):
         try:
             self._sim.contents.process_messages()
@@ -216,13 +346,79 @@ class Param(Structure): # need to define fields afterward because of circular re
     pass    
 Param._fields_ =  [ ("name", c_char_p),
                     ("type", c_int),
-                    ("value", c_void_p)]
+                    ("value", c_void_p),
+                    ("id", c_int),
+                    ("_column", c_void_p)]
 
 class Node(Structure): # need to define fields afterward because of circular ref in linked list
     pass    
 Node._fields_ =  [  ("object", c_void_p),
                     ("next", POINTER(Node))]
 
+class Pool(Structure): # internal, mirrors struct rebx_pool
+    _fields_ = [("_size", c_size_t),
+                ("_N_next", c_int),
+                ("_free_list", c_void_p),
+                ("_slabs", c_void_p)]
+
+class Counters(Structure):
+    """
+    Call counters kept on each force and operator while enabled with Extras.enable_counters.
+    calls is the number of calls, time the cumulative wall time in seconds, and particles
+    the sum over calls of the number of particles in the simulation.
+    """
+    _fields_ = [("calls", c_ulong),
+                ("time", c_double),
+                ("particles", c_ulong)]
+
+    def __repr__(self):
+        return "<reboundx.Counters calls={0} time={1} particles={2}>".format(self.calls, self.time, self.particles)
+
+class Harmonics(Structure):
+    """
+    Spherical harmonic gravity field of a body, for the harmonics param of gravitational_harmonics.
+    Create with Harmonics.create and set the coefficients with set (fully normalized) or set_J.
+    The simulation only keeps a pointer, so keep a reference for as long as it's in use.
+    """
+    _fields_ = [("degree", c_int),
+                ("order", c_int),
+                ("R_eq", c_double),
+                ("_C", POINTER(c_double)),
+                ("_S", POINTER(c_double)),
+                ("_factors", POINTER(c_double))]
+
+    @classmethod
+    def create(cls, degree, order, R_eq):
+        """
+        Allocate a field up to the given degree and order (0 for a zonal field) with all coefficients zero.
+        """
+        clibreboundx.rebx_create_harmonics.restype = POINTER(cls)
+        ptr = clibreboundx.rebx_create_harmonics(c_int(degree), c_int(order), c_double(R_eq))
+        if not ptr:
+            raise ValueError("Could not create a harmonics field with degree={0}, order={1}, R_eq={2}".format(degree, order, R_eq))
+        h = ptr.contents
+        h._owned = True
+        return h
+
+    def set(self, n, m, C, S=0.):
+        """
+        Set the fully normalized coefficients of degree n and order m.
+        """
+        if not clibreboundx.rebx_harmonics_set(byref(self), c_int(n), c_int(m), c_double(C), c_double(S)):
+            raise ValueError("Degree {0} and order {1} are out of range".format(n, m))
+
+    def set_J(self, n, J):
+        """
+        Set the zonal coefficient of degree n from the unnormalized J_n.
+        """
+        if not clibreboundx.rebx_harmonics_set_J(byref(self), c_int(n), c_double(J)):
+            raise ValueError("Degree {0} is out of range".format(n))
+
+    def __del__(self):
+        if getattr(self, "_owned", False):
+            self._owned = False
+            clibreboundx.rebx_free_harmonics(byref(self))
+
 class Operator(Structure):
     @property
     def operator_type(self):
@@ -255,7 +451,10 @@ Operator._fields_ = [   ("name", c_char_p),
                         ("ap", POINTER(Node)),
                         ("_sim", POINTER(rebound.Simulation)),
                         ("_operator_type", c_int),
-                        ("_step_function", STEPFUNCPTR)]
+                        ("_step_function", STEPFUNCPTR),
+                        ("_param_generation", c_ulong),
+                        ("_param_cache", c_void_p*12),
+                        ("counters", Counters)]
 class Force(Structure):
     @property
     def force_type(self):
@@ -285,7 +484,10 @@ Force._fields_ = [  ("name", c_char_p),
                     ("ap", POINTER(Node)),
                     ("_sim", POINTER(rebound.Simulation)),
                     ("_force_type", c_int),
-                    ("_update_accelerations", FORCEFUNCPTR)]
+                    ("_update_accelerations", FORCEFUNCPTR),
+                    ("_param_generation", c_ulong),
+                    ("_param_cache", c_void_p*12),
+                    ("counters", Counters)]
 
 # Need to put fields after class definition because of self-referencing
 Extras._fields_ =  [("_sim", POINTER(rebound.Simulation)),
@@ -294,7 +496,30 @@ Extras._fields_ =  [("_sim", POINTER(rebound.Simulation)),
                     ("_post_timestep_modifications", POINTER(Node)),
                     ("_registered_params", POINTER(Node)),
                     ("_allocated_forces", POINTER(Node)),
-                    ("_allocated_operators", POINTER(Node))]
+                    ("_allocated_operators", POINTER(Node)),
+                    ("_id_params", c_void_p),
+                    ("_N_registered_params", c_int),
+                    ("_param_ids", POINTER(c_int)),
+                    ("_param_ids_size", c_int),
+                    ("_param_generation", c_ulong),
+                    ("_columns", c_void_p),
+                    ("_N_columns", c_int),
+                    ("_columns_dirty", c_int),
+                    ("_geometry", c_void_p),
+                    ("_N_geometry", c_int),
+                    ("_geometry_particles", c_void_p),
+                    ("_geometry_N", c_int),
+                    ("_geometry_epoch", c_ulong),
+                    ("_accelerations_newtonian", c_int),
+                    ("_scratch", c_void_p),
+                    ("_scratch_used", c_size_t),
+                    ("_in_step_list", c_int),
+                    ("_whfast_deferred", c_int),
+                    ("_archive", c_void_p),
+                    ("_counters_enabled", c_int),
+                    ("_node_pool", Pool),
+                    ("_param_pool", Pool),
+                    ("_value_pool", Pool)]
 
 # This list keeps pairing from C rebx_param_type enum to ctypes type 1-to-1. Derive the required mappings from it
 REBX_C_TO_CTYPES = [["REBX_TYPE_NONE", None], ["REBX_TYPE_DOUBLE", c_double], ["REBX_TYPE_INT",c_int], ["REBX_TYPE_POINTER", c_void_p], ["REBX_TYPE_FORCE", Force], ["REBX_TYPE_UNIT32", c_uint32], ["REBX_TYPE_ORBIT", rebound.Orbit]]
@@ -1,5 +1,7 @@
 import rebound
 import reboundx
+from . import clibreboundx
+from ctypes import c_char_p, c_double, c_long
 
 class SimulationArchive(rebound.SimulationArchive):
     """
@@ -12,18 +14,31 @@ class SimulationArchive(rebound.SimulationArchive):
         filename : str
             Filename of the SimulationArchive file to be opened.
         rebxfilename : str
-            Filename of the REBOUNDx binary file.
+            Filename of the REBOUNDx binary file, or of a REBOUNDx archive written with Extras.save_archive
+            alongside each SimulationArchive snapshot.
         """
         super(SimulationArchive, self).__init__(filename, *args, **kwargs)
         self.rebxfilename = rebxfilename
+        clibreboundx.rebx_archive_N_snapshots.restype = c_long
+        clibreboundx.rebx_archive_find_time.restype = c_long
+        self.rebxN = clibreboundx.rebx_archive_N_snapshots(c_char_p(rebxfilename.encode('ascii')))
         sim, rebx = self[0] # test you can open rebxfilename to warn user if not
 
+    def _load_extras(self, sim, snapshot):
+        # A single REBOUNDx binary applies to every snapshot
+        if self.rebxN > 1:
+            return reboundx.Extras(sim, self.rebxfilename, snapshot=snapshot)
+        return reboundx.Extras(sim, self.rebxfilename)
+
     def __getitem__(self, key):
         sim = super(SimulationArchive, self).__getitem__(key)
-        rebx = reboundx.Extras(sim, self.rebxfilename)
+        rebx = self._load_extras(sim, key)
         return sim, rebx
 
     def getSimulation(self, *args, **kwargs):
         sim = super(SimulationArchive, self).getSimulation(*args, **kwargs)
-        rebx = reboundx.Extras(sim, self.rebxfilename)
+        snapshot = None
+        if self.rebxN > 1:
+            snapshot = clibreboundx.rebx_archive_find_time(c_char_p(self.rebxfilename.encode('ascii')), c_double(sim.t))
+        rebx = self._load_extras(sim, snapshot)
         return sim, rebx
@@ -64,6 +64,26 @@ class TestConservation(unittest.TestCase):
         H = sim.calculate_energy() + rebx.tides_precession_potential(force)
         self.assertLess(abs((H-H0)/H0), 1.e-12)
 
+    def test_tides_precession_primary(self):
+        # the force, its potential and total_energy all take the primary from the same flag
+        sim = rebound.Simulation(binary)
+        sim.integrator = "ias15"
+        rebx = reboundx.Extras(sim)
+        force = rebx.load_force('tides_precession')
+        rebx.add_force(force)
+        ps = sim.particles
+        ps[1].params['tides_primary'] = 1
+        ps[1].params['R_tides'] = 1.e-3
+        ps[1].params['k1'] = 0.4
+        ps[2].params['R_tides'] = 1.e-3
+        ps[2].params['k1'] = 0.4
+        H0 = sim.calculate_energy() + rebx.tides_precession_potential(force)
+        self.assertAlmostEqual(rebx.total_energy(), H0, delta=1.e-14*abs(H0))
+        sim.integrate(1.e4)
+        H = sim.calculate_energy() + rebx.tides_precession_potential(force)
+        self.assertLess(abs((H-H0)/H0), 1.e-12)
+        self.assertAlmostEqual(rebx.total_energy(), H, delta=1.e-14*abs(H))
+
     def test_central_force(self):
         name = 'central_force'
         sim = rebound.Simulation(binary)
@@ -95,5 +115,47 @@ class TestConservation(unittest.TestCase):
         H = sim.calculate_energy() + rebx.gravitational_harmonics_potential()
         self.assertLess(abs((H-H0)/H0), 1.e-12)
 
+    def test_harmonics(self):
+        name = 'gravitational_harmonics'
+        sim = rebound.Simulation(binary)
+        sim.integrator = "ias15"
+        rebx = reboundx.Extras(sim)
+        force = rebx.load_force(name)
+        rebx.add_force(force)
+        ps = sim.particles
+        h = reboundx.Harmonics.create(4, 4, 1.e-3)
+        h.set_J(2, 1.e-3)
+        h.set_J(4, 1.e-3)
+        h.set(3, 2, 1.e-4, 2.e-4)
+        ps[0].params['harmonics'] = h
+        ps[0].params['harmonics_W0'] = 0.3
+        H0 = sim.calculate_energy() + rebx.gravitational_harmonics_potential()
+        sim.integrate(1.e4)
+        H = sim.calculate_energy() + rebx.gravitational_harmonics_potential()
+        self.assertLess(abs((H-H0)/H0), 1.e-12)
+        self.assertAlmostEqual(rebx.total_energy(), H, delta=1.e-14*abs(H))
+
+    def test_total_energy(self):
+        sim = rebound.Simulation(binary)
+        sim.integrator = "ias15"
+        rebx = reboundx.Extras(sim)
+        for name in ['gravitational_harmonics', 'central_force', 'tides_precession', 'gr_potential']:
+            rebx.add_force(rebx.load_force(name))
+        rebx.get_force('gr_potential').params['c'] = 1.e4
+        ps = sim.particles
+        ps[0].params['J2'] = 1.e-3
+        ps[0].params['J4'] = 1.e-3
+        ps[0].params['R_eq'] = 1.e-3
+        ps[0].params['Acentral'] = 1.e-4
+        ps[0].params['gammacentral'] = -1
+        ps[0].params['R_tides'] = 1.e-3
+        ps[0].params['k1'] = 0.4
+        H0 = rebx.total_energy()
+        Hsum = sim.calculate_energy() + rebx.gravitational_harmonics_potential() + rebx.central_force_potential() + rebx.tides_precession_potential(rebx.get_force('tides_precession')) + rebx.gr_potential_potential(rebx.get_force('gr_potential'))
+        self.assertAlmostEqual(H0, Hsum, delta=1.e-14*abs(Hsum))
+        sim.integrate(1.e4)
+        H = rebx.total_energy()
+        self.assertLess(abs((H-H0)/H0), 1.e-12)
+
 if __name__ == '__main__':
     unittest.main()
@@ -1,6 +1,12 @@
 import rebound
 import reboundx
 import unittest
+import math
+from ctypes import Structure, c_void_p, c_double, cast, addressof, POINTER
+
+class Step(Structure): # mirrors struct rebx_step
+    _fields_ = [('operator', c_void_p),
+                ('dt_fraction', c_double)]
 
 class TestForces(unittest.TestCase):
     def setUp(self):
@@ -230,6 +236,260 @@ class TestAddOperator(unittest.TestCase):
         self.sim.step()
         self.assertEqual(self.cust.params['ctr'], 1)
 
+class TestSplitting(unittest.TestCase):
+    def setUp(self):
+        self.sim = rebound.Simulation()
+        self.sim.add(m=1.)
+        self.sim.add(m=1.e-3, a=1., e=0.1)
+        self.sim.add(m=1.e-3, a=1.7, e=0.05)
+        self.sim.move_to_com()
+        self.sim.dt = 1.e-2*self.sim.particles[1].P
+        self.sim.integrator = "none"
+        self.rebx = reboundx.Extras(self.sim)
+        self.kep = self.rebx.load_operator("kepler")
+        self.inter = self.rebx.load_operator("interaction")
+
+    def test_leapfrog(self):
+        sim2 = self.sim.copy()
+        rebx2 = reboundx.Extras(sim2)
+        kep2 = rebx2.load_operator("kepler")
+        inter2 = rebx2.load_operator("interaction")
+        # steps added one at a time run last added first
+        rebx2.add_operator(kep2, dtfraction=0.5, timing="pre")
+        rebx2.add_operator(inter2, dtfraction=1., timing="pre")
+        rebx2.add_operator(kep2, dtfraction=0.5, timing="pre")
+        self.rebx.add_splitting("leapfrog", self.kep, self.inter, timing="pre")
+        self.sim.integrate(10.)
+        sim2.integrate(10.)
+        self.assertAlmostEqual(self.sim.particles[1].x, sim2.particles[1].x, delta=1.e-12)
+
+    def steps(self, timing="pre"):
+        # (operator, dt_fraction) in the order they run
+        node = self.rebx._pre_timestep_modifications if timing == "pre" else self.rebx._post_timestep_modifications
+        steps = []
+        while node:
+            step = cast(node.contents.object, POINTER(Step)).contents
+            steps.append((step.operator, step.dt_fraction))
+            node = node.contents.next
+        return steps
+
+    def test_merge(self):
+        # fused kepler halves between the two timesteps give the same trajectory
+        self.rebx.add_operator_steps([(self.kep, 0.5), (self.inter, 1.), (self.kep, 0.5), (self.kep, 0.5), (self.inter, 1.), (self.kep, 0.5)], timing="pre")
+        kep, inter = addressof(self.kep), addressof(self.inter)
+        self.assertEqual(self.steps(), [(kep, 0.5), (inter, 1.), (kep, 1.), (inter, 1.), (kep, 0.5)])
+        self.sim.dt *= 2.
+        E0 = self.sim.calculate_energy()
+        self.sim.integrate(10.)
+        self.assertLess(abs((self.sim.calculate_energy()-E0)/E0), 1.e-4)
+
+    def test_mergeacrosscalls(self):
+        # the last new stage runs into the first step already in the list
+        self.rebx.add_splitting("leapfrog", self.kep, self.inter, timing="post")
+        self.rebx.add_splitting("leapfrog", self.kep, self.inter, timing="post")
+        kep, inter = addressof(self.kep), addressof(self.inter)
+        self.assertEqual(self.steps("post"), [(kep, 0.5), (inter, 1.), (kep, 1.), (inter, 1.), (kep, 0.5)])
+        self.assertEqual(self.steps("pre"), [])
+
+    def test_cancel(self):
+        self.rebx.add_operator_steps([(self.inter, 1.), (self.kep, 0.3), (self.kep, -0.3), (self.inter, 0.5)], timing="pre")
+        self.assertEqual(self.steps(), [(addressof(self.inter), 1.5)])
+
+    def test_nomerge(self):
+        # stages of another operator of the same kind, or of operators that are not
+        # simple flows, stay separate
+        kep2 = self.rebx.load_operator("kepler")
+        tmd = self.rebx.load_operator("track_min_distance")
+        self.rebx.add_operator_steps([(self.kep, 0.5), (kep2, 0.5), (tmd, 1.), (tmd, 1.), (self.kep, 0.5)], timing="pre")
+        kep = addressof(self.kep)
+        self.assertEqual(self.steps(), [(kep, 0.5), (addressof(kep2), 0.5), (addressof(tmd), 1.), (addressof(tmd), 1.), (kep, 0.5)])
+
+    def test_whfast(self):
+        # kepler-interaction-kepler in the operator list hands the Jacobi coordinates from one step
+        # to the next and converts back only at the end, so it must reproduce REBOUND's WHFast
+        sim2 = self.sim.copy()
+        sim2.integrator = "whfast"
+        sim2.ri_whfast.safe_mode = 1
+        self.rebx.add_operator_steps([(self.kep, 0.5), (self.inter, 1.), (self.kep, 0.5)], timing="pre")
+        self.sim.integrate(10.)
+        sim2.integrate(10.)
+        for p, p2 in zip(self.sim.particles, sim2.particles):
+            for a, b in zip((p.x, p.y, p.z, p.vx, p.vy, p.vz), (p2.x, p2.y, p2.z, p2.vx, p2.vy, p2.vz)):
+                self.assertAlmostEqual(a, b, delta=1.e-12)
+
+    def test_wrongscheme(self):
+        with self.assertRaises(RuntimeError):
+            self.rebx.add_splitting("saba99", self.kep, self.inter)
+
+class TestIntegrateForce(unittest.TestCase):
+    def setUp(self):
+        self.sim = rebound.Simulation()
+        self.sim.add(m=1.)
+        self.sim.add(m=1.e-4, a=1., e=0.2)
+        self.sim.move_to_com()
+        self.sim.dt = 1.e-2*self.sim.particles[1].P
+        self.rebx = reboundx.Extras(self.sim)
+        self.gr = self.rebx.load_force('gr')
+        self.gr.params['c'] = 1e2
+        self.integforce = self.rebx.load_operator("integrate_force")
+        self.integforce.params['force'] = self.gr
+
+    def test_dp45(self):
+        self.integforce.params['integrator'] = reboundx.integrators['dp45']
+        self.integforce.params['dp45_epsilon'] = 1.e-12
+        self.rebx.add_operator(self.integforce)
+        E0 = self.rebx.gr_hamiltonian(self.gr)
+        self.sim.integrate(100)
+        E = self.rebx.gr_hamiltonian(self.gr)
+        self.assertGreater(self.sim.particles[1].pomega, 0.01)
+        self.assertLess(abs((E-E0)/E0), 1.e-4)
+        # substep size is kept on the force between operator calls
+        self.assertGreater(self.gr.params['dp45_dt'], 0.)
+
+class TestTrackMinDistance(unittest.TestCase):
+    def test_flyby(self):
+        # straight line flyby with closest approach 0.1 at t=1, between outputs
+        sim = rebound.Simulation()
+        sim.G = 0.
+        sim.add(m=1.)
+        sim.add(x=-1., y=0.1, vx=1.)
+        sim.integrator = "leapfrog"
+        sim.dt = 0.3
+        rebx = reboundx.Extras(sim)
+        tmd = rebx.load_operator("track_min_distance")
+        rebx.add_operator(tmd)
+        sim.particles[1].params["min_distance"] = 10.
+        sim.integrate(3.)
+        self.assertAlmostEqual(sim.particles[1].params["min_distance"], 0.1, delta=1.e-12)
+
+class TestModifyOrbitsDirect(unittest.TestCase):
+    # The elements are converted for all particles at once.  Compare them with
+    # REBOUND's own conversion of each particle against its primary.
+    taus = [{}, {'a':1.e3, 'Omega':80.}, {'omega':50., 'e':-200.}, {'e':300., 'inc':-40., 'omega':-60.}, {}]
+
+    def setUp(self):
+        self.sim = rebound.Simulation()
+        self.sim.add(m=1.)
+        self.sim.add(m=1.e-3, a=1., e=0.1, inc=0.2, Omega=0.3, omega=0.4, f=0.5)
+        self.sim.add(m=3.e-4, a=2., e=0.3, omega=1.1, f=2.)    # planar
+        self.sim.add(m=1.e-3, a=3.5, e=0.05, inc=2.8, Omega=-1., omega=2.5, f=-2.) # retrograde
+        self.sim.add(m=1.e-5, a=5., e=0.2, inc=0.1, f=1.)
+        self.sim.move_to_com()
+        self.sim.integrator = "none"
+        self.sim.dt = 0.1
+        self.rebx = reboundx.Extras(self.sim)
+        self.mod = self.rebx.load_operator("modify_orbits_direct")
+        self.rebx.add_operator(self.mod)
+
+    def set_taus(self, indices):
+        for i in indices:
+            for name, tau in self.taus[i].items():
+                self.sim.particles[i].params['tau_'+name] = tau
+
+    def expected(self, o, taus):
+        dt = self.sim.dt
+        el = {'a':o.a, 'e':o.e, 'inc':o.inc, 'Omega':o.Omega, 'omega':o.omega, 'f':o.f}
+        for name in ['a', 'e', 'inc']:
+            if name in taus:
+                el[name] *= 1. + dt/taus[name]
+        for name in ['Omega', 'omega']:
+            if name in taus:
+                el[name] += 2.*math.pi*dt/taus[name]
+        return el
+
+    def check(self, primary, indices):
+        ps = self.sim.particles
+        before = [self.expected(ps[i].calculate_orbit(primary=primary(i)), self.taus[i]) for i in indices]
+        self.sim.step()
+        for i, el in zip(indices, before):
+            o = ps[i].calculate_orbit(primary=primary(i))
+            self.assertAlmostEqual(o.a, el['a'], delta=1.e-12*el['a'])
+            self.assertAlmostEqual(o.e, el['e'], delta=1.e-12)
+            self.assertAlmostEqual(o.inc, el['inc'], delta=1.e-12)
+            # Omega is not defined for planar orbits, only the longitude of pericenter
+            angles = [(o.Omega + o.omega, el['Omega'] + el['omega']), (o.f, el['f'])]
+            if el['inc'] > 1.e-8:
+                angles += [(o.Omega, el['Omega']), (o.omega, el['omega'])]
+            for a, b in angles:
+                diff = math.fmod(a - b + 3.*math.pi, 2.*math.pi) - math.pi
+                self.assertAlmostEqual(diff, 0., delta=1.e-11)
+
+    def test_jacobi(self):
+        # each Jacobi orbit only takes its own change, against the center of mass of the particles inside it
+        self.set_taus([1, 2, 3])
+        self.check(lambda i: self.sim.calculate_com(last=i), [1, 2, 3, 4])
+
+    def test_heliocentric(self):
+        # the star's back reaction shifts the other heliocentric orbits, so change one at a time
+        for i in [1, 2, 3]:
+            self.setUp()
+            self.mod.params["coordinates"] = reboundx.coordinates["PARTICLE"]
+            self.sim.particles[0].params["primary"] = 1
+            self.set_taus([i])
+            self.check(lambda i: self.sim.particles[0], [i])
+
+class TestHarmonicsClosedForm(unittest.TestCase):
+    def accelerations(self, engine):
+        sim = rebound.Simulation()
+        sim.add(m=1.)
+        sim.add(m=1.e-3, a=1.e-2, e=0.1, inc=0.7)
+        sim.add(m=1.e-6, a=3.e-3, e=0.3, inc=2.1, Omega=1.)
+        sim.add(m=0., a=1.e-1, inc=0.2)
+        sim.gravity = "none"
+        sim.integrator = "none"
+        rebx = reboundx.Extras(sim)
+        rebx.add_force(rebx.load_force('gravitational_harmonics'))
+        ps = sim.particles
+        if engine:
+            h = reboundx.Harmonics.create(4, 0, 1.e-3)
+            h.set_J(2, 1.e-3)
+            h.set_J(4, -1.e-4)
+            ps[0].params['harmonics'] = h
+        else:
+            ps[0].params['J2'] = 1.e-3
+            ps[0].params['J4'] = -1.e-4
+            ps[0].params['R_eq'] = 1.e-3
+        sim.step()
+        return [(p.ax, p.ay, p.az) for p in ps]
+
+    def test_zonal(self):
+        # the normalized recursion and the closed forms apply the same terms in a different order, so they agree to round-off
+        for a0, a1 in zip(self.accelerations(False), self.accelerations(True)):
+            norm = sum(a*a for a in a0)**0.5
+            diff = sum((a-b)**2 for a, b in zip(a0, a1))**0.5
+            self.assertLessEqual(diff, 1.e-14*norm)
+
+class TestGRReuseGravity(unittest.TestCase):
+    def run_gr(self, reuse, **settings):
+        sim = rebound.Simulation()
+        sim.add(m=1.)
+        sim.add(m=1.e-3, a=1., e=0.2)
+        sim.add(m=1.e-4, a=1.7, e=0.1, inc=0.1)
+        sim.move_to_com()
+        for key, value in settings.items():
+            setattr(sim, key, value)
+        sim.integrator = "leapfrog"
+        sim.dt = 1.e-3
+        rebx = reboundx.Extras(sim)
+        gr = rebx.load_force('gr')
+        rebx.add_force(gr)
+        gr.params['c'] = 1.e2
+        if reuse:
+            gr.params['gr_reuse_gravity'] = 1
+        sim.integrate(10.)
+        return [(p.x, p.y, p.z, p.vx, p.vy, p.vz) for p in sim.particles]
+
+    def test_reuse_gravity(self):
+        # REBOUND sums the Newtonian accelerations in a different order than gr, so they only agree to round-off
+        for p0, p1 in zip(self.run_gr(False), self.run_gr(True)):
+            for a, b in zip(p0, p1):
+                self.assertAlmostEqual(a, b, delta=1.e-12*max(abs(a), 1.))
+
+    def test_falls_back(self):
+        # REBOUND's accelerations are not the full pairwise sum here, so gr recomputes them and the runs match exactly
+        for settings in [{'softening': 1.e-2}, {'N_active': 2}, {'N_active': 1, 'testparticle_type': 1}]:
+            self.assertEqual(self.run_gr(False, **settings), self.run_gr(True, **settings))
+
 if __name__ == '__main__':
     unittest.main()
 
@@ -0,0 +1,204 @@
+import rebound
+import reboundx
+from reboundx import ephemeris
+from reboundx import clibreboundx
+from ctypes import byref, c_double, c_int
+import unittest
+import numpy as np
+import os
+
+THIS_DIR = os.path.dirname(os.path.abspath(__file__))
+EPHEM_DIR = os.path.join(THIS_DIR, '../../examples/ephem_forces')
+planets = os.path.join(EPHEM_DIR, 'linux_p1550p2650.430')
+asteroids = os.path.join(EPHEM_DIR, 'sb431-n16s.bsp')
+
+# Gauss-Radau spacings of the outputs within each step
+h = np.array([0.0, 0.0562625605369221464656521910318, 0.180240691736892364987579942780, 0.352624717113169637373907769648,
+              0.547153626330555383001448554766, 0.734210177215410531523210605558, 0.885320946839095768090359771030, 0.977520613561287501891174488626])
+c = 173.144632674 # au/day
+G = 0.295912208285591100E-03 # au^3/day^2
+R_E = 6378.1263/149597870.700 # au
+
+@unittest.skipUnless(os.path.exists(planets) and os.path.exists(asteroids), "needs the ephemeris files in examples/ephem_forces")
+class TestObserve(unittest.TestCase):
+    def setUp(self):
+        self.eph = ephemeris.Ephemeris(planets, asteroids)
+        self.t0 = 2458849.5
+        self.times = (self.t0 + np.arange(40)[:,None] + h[None,:]).ravel()
+        # straight line through the barycentric frame
+        self.x0 = np.array([2., 0.5, 0.1])
+        self.v = np.array([0.01, 0.005, -0.002])
+        self.t_obs = self.t0 + 5. + 0.13*np.arange(200)
+        self.offset = np.array([[4.e-5*np.cos(i), 4.e-5*np.sin(i), 1.e-5] for i in range(200)])
+
+    def tearDown(self):
+        self.eph.close()
+
+    def earth(self, t):
+        # observing the barycenter itself gives minus the Earth's barycentric position
+        tz = self.t0 - 1. + 0.5*np.arange(90)
+        pos, lt = ephemeris.observe(tz, np.zeros((len(tz), 1, 6)), t, ephemeris=self.eph)
+        return -pos[:,0,:]
+
+    def trajectory(self, geocentric):
+        states = np.zeros((len(self.times), 1, 6))
+        states[:,0,:3] = self.x0 + self.v*(self.times - self.t0)[:,None]
+        states[:,0,3:] = self.v
+        if geocentric:
+            states[:,0,:3] -= self.earth(self.times)
+        return states
+
+    def closed_form(self):
+        # |d - v*tau| = c*tau, with d the geometric position at t_obs
+        d = self.x0 + self.v*(self.t_obs - self.t0)[:,None] - self.earth(self.t_obs) - self.offset
+        dv = d.dot(self.v)
+        dd = (d*d).sum(axis=1)
+        a = c*c - self.v.dot(self.v)
+        tau = (-dv + np.sqrt(dv*dv + a*dd))/a
+        return d - self.v*tau[:,None], tau
+
+    def test_barycentric(self):
+        pos, lt = ephemeris.observe(self.times, self.trajectory(False), self.t_obs, self.offset, ephemeris=self.eph)
+        expected, tau = self.closed_form()
+        self.assertLess(np.abs(pos[:,0,:] - expected).max(), 1.e-10)
+        self.assertLess(np.abs(lt[:,0] - tau).max(), 1.e-12)
+
+    def test_geocentric(self):
+        # the Earth moves about 1e-4 au during the light time, which has to be accounted for
+        pos, lt = ephemeris.observe(self.times, self.trajectory(True), self.t_obs, self.offset, geocentric=True, ephemeris=self.eph)
+        expected, tau = self.closed_form()
+        self.assertLess(np.abs(pos[:,0,:] - expected).max(), 1.e-10)
+        self.assertLess(np.abs(lt[:,0] - tau).max(), 1.e-12)
+
+    def test_outside(self):
+        pos, lt = ephemeris.observe(self.times, self.trajectory(False), [self.t0 - 1.], ephemeris=self.eph)
+        self.assertTrue(np.isnan(pos).all())
+        self.assertTrue(np.isnan(lt).all())
+
+@unittest.skipUnless(os.path.exists(planets) and os.path.exists(asteroids), "needs the ephemeris files in examples/ephem_forces")
+class TestVariational(unittest.TestCase):
+    # The forces without an 'ephemeris' param read the files named by these
+    def setUp(self):
+        os.environ['REBX_EPHEM_PLANETS'] = planets
+        os.environ['REBX_EPHEM_ASTEROIDS'] = asteroids
+        self.t0 = 2458849.5
+
+    def simulation(self, state, geocentric, c=c, integrator="none"):
+        sim = rebound.Simulation()
+        sim.G = G
+        sim.t = self.t0
+        sim.gravity = "none"
+        sim.integrator = integrator
+        rebx = reboundx.Extras(sim)
+        ef = rebx.load_force("ephemeris_forces")
+        ef.params["N_ephem"] = 11
+        ef.params["N_ast"] = 16
+        ef.params["c"] = c
+        ef.params["geocentric"] = int(geocentric)
+        rebx.add_force(ef)
+        sim.add(m=0., x=state[0], y=state[1], z=state[2], vx=state[3], vy=state[4], vz=state[5])
+        return sim, rebx
+
+    def jacobian(self, state, geocentric, c=c):
+        # row k is the acceleration of the variational particle displaced along coordinate k
+        sim, rebx = self.simulation(state, geocentric, c)
+        vs = [sim.add_variation() for k in range(6)]
+        for k, var in enumerate(vs):
+            setattr(var.particles[0], ['x', 'y', 'z', 'vx', 'vy', 'vz'][k], 1.)
+        sim.step()
+        return np.array([[v.particles[0].ax, v.particles[0].ay, v.particles[0].az] for v in vs])
+
+    def acceleration(self, state, geocentric, c=c):
+        sim, rebx = self.simulation(state, geocentric, c)
+        sim.step()
+        p = sim.particles[0]
+        return np.array([p.ax, p.ay, p.az])
+
+    def finite_difference(self, f, state, hrel=1.e-5):
+        # central differences, with steps scaled to the position and velocity
+        state = np.asarray(state, dtype=float)
+        scale = [np.linalg.norm(state[:3])]*3 + [np.linalg.norm(state[3:])]*3
+        rows = []
+        for k in range(6):
+            h = hrel*scale[k]
+            sp = state.copy()
+            sm = state.copy()
+            sp[k] += h
+            sm[k] -= h
+            rows.append((f(sp) - f(sm))/(2.*h))
+        return np.array(rows)
+
+    def assertClose(self, J, F, tol):
+        self.assertLess(np.linalg.norm(J - F), tol*np.linalg.norm(F))
+
+    def sun(self):
+        v = [c_double() for i in range(10)]
+        clibreboundx.ephem(c_double(G), c_int(0), c_double(self.t0), *[byref(x) for x in v])
+        return np.array([x.value for x in v[1:7]])
+
+    def test_point_masses(self):
+        state = [1.2, 0.9, 0.1, -0.008, 0.011, 0.0005]
+        J = self.jacobian(state, False)
+        F = self.finite_difference(lambda s: self.acceleration(s, False), state)
+        self.assertClose(J[:3], F[:3], 1.e-8)
+
+    def test_earth_harmonics(self):
+        # 1.2 Earth radii from the geocenter, where J2 and J4 are largest
+        state = [0.84*R_E, 0.6*R_E, 0.61188*R_E, -0.002, 0.003, 0.001]
+        J = self.jacobian(state, True)
+        F = self.finite_difference(lambda s: self.acceleration(s, True), state)
+        self.assertClose(J[:3], F[:3], 1.e-8)
+        # without GR
+        J0 = self.jacobian(state, True, 1.e12)
+        F0 = self.finite_difference(lambda s: self.acceleration(s, True, 1.e12), state)
+        self.assertClose(J0[:3], F0[:3], 1.e-8)
+        # GR couples to the Earth's acceleration, which dominates here
+        F = self.finite_difference(lambda s: self.acceleration(s, True), state, 1.e-4)
+        F0 = self.finite_difference(lambda s: self.acceleration(s, True, 1.e12), state, 1.e-4)
+        self.assertClose(J[:3] - J0[:3], F[:3] - F0[:3], 1.e-3)
+        self.assertClose(J[3:] - J0[3:], F[3:] - F0[3:], 1.e-3)
+
+    def test_sun(self):
+        # close to the Sun, where the solar J2 and GR matter most
+        d = 0.006
+        vc = np.sqrt(G/d)
+        state = self.sun() + [0.6*d, 0.64*d, 0.48*d, -0.8*vc, 0.6*vc, 0.1*vc]
+        J = self.jacobian(state, False)
+        F = self.finite_difference(lambda s: self.acceleration(s, False), state)
+        self.assertClose(J[:3], F[:3], 1.e-8)
+        self.assertClose(J[3:], F[3:], 1.e-4)
+        # the GR part on its own
+        J0 = self.jacobian(state, False, 1.e12)
+        F0 = self.finite_difference(lambda s: self.acceleration(s, False, 1.e12), state)
+        self.assertClose(J[:3] - J0[:3], F[:3] - F0[:3], 1.e-4)
+        self.assertClose(J[3:] - J0[3:], F[3:] - F0[3:], 1.e-4)
+
+    def propagate(self, state, geocentric, dt, n, variations=False):
+        sim, rebx = self.simulation(state, geocentric, integrator="ias15")
+        sim.ri_ias15.epsilon = 0.
+        sim.dt = dt
+        vs = []
+        if variations:
+            vs = [sim.add_variation() for k in range(6)]
+            for k, var in enumerate(vs):
+                setattr(var.particles[0], ['x', 'y', 'z', 'vx', 'vy', 'vz'][k], 1.)
+        for i in range(n):
+            sim.step()
+        ps = [sim.particles[0]] + [v.particles[0] for v in vs]
+        return np.array([[p.x, p.y, p.z, p.vx, p.vy, p.vz] for p in ps])
+
+    def check_propagation(self, state, geocentric, dt, n):
+        out = self.propagate(state, geocentric, dt, n, True)
+        F = self.finite_difference(lambda s: self.propagate(s, geocentric, dt, n)[0], state, 1.e-6)
+        for k in range(6):
+            self.assertClose(out[1+k], F[k], 1.e-6)
+
+    def test_propagation_barycentric(self):
+        self.check_propagation([1.2, 0.9, 0.1, -0.008, 0.011, 0.0005], False, 1., 30)
+
+    def test_propagation_geocentric(self):
+        # a pass about 0.01 au from the Earth
+        self.check_propagation([0.01, 0.002, -0.001, -0.0005, 0.004, 0.0002], True, 0.05, 40)
+
+if __name__ == '__main__':
+    unittest.main()
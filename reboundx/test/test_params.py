@@ -3,8 +3,9 @@ import reboundx
 from reboundx import data
 import unittest
 import math
+import gc
 import numpy as np
-from ctypes import c_uint, c_uint8, c_uint32, c_uint64
+from ctypes import c_uint, c_uint8, c_uint32, c_uint64, c_void_p
 
 def mycomp(obj1, obj2):
     if type(obj1) != type(obj2):
@@ -199,5 +200,194 @@ class TestParams(unittest.TestCase):
         with self.assertRaises(AttributeError):
             del self.gr.params["b"]
 
+class TestParticleParamArrays(unittest.TestCase):
+    def setUp(self):
+        self.sim = rebound.Simulation()
+        self.sim.add(m=1.)
+        for i in range(5):
+            self.sim.add(a=1.+i)
+        self.rebx = reboundx.Extras(self.sim)
+
+    def tearDown(self):
+        self.sim = None
+
+    def test_setdouble(self):
+        self.rebx.set_particle_params('beta', [0., 0.1, 0.2])
+        self.assertAlmostEqual(self.sim.particles[2].params['beta'], 0.2, delta=1.e-15)
+        beta = self.rebx.get_particle_params('beta')
+        self.assertEqual(len(beta), 6)
+        self.assertAlmostEqual(beta[1], 0.1, delta=1.e-15)
+        self.assertTrue(math.isnan(beta[4]))
+
+    def test_setindices(self):
+        self.sim.particles[3].params['beta'] = 0.5
+        self.rebx.set_particle_params('beta', np.array([0.3, 0.4]), indices=[3, 5])
+        self.assertAlmostEqual(self.sim.particles[3].params['beta'], 0.3, delta=1.e-15)
+        self.assertAlmostEqual(self.sim.particles[5].params['beta'], 0.4, delta=1.e-15)
+        beta = self.rebx.get_particle_params('beta', indices=[5, 3])
+        self.assertAlmostEqual(beta[0], 0.4, delta=1.e-15)
+        self.assertAlmostEqual(beta[1], 0.3, delta=1.e-15)
+
+    def test_setint(self):
+        self.rebx.set_particle_params('gr_source', [0, 1], indices=[1, 2])
+        self.assertEqual(self.sim.particles[2].params['gr_source'], 1)
+        self.assertEqual(list(self.rebx.get_particle_params('gr_source')), [0, 0, 1, 0, 0, 0])
+
+    def test_notregistered(self):
+        with self.assertRaises(AttributeError):
+            self.rebx.set_particle_params('asdf', [1.])
+
+    def test_outofrange(self):
+        with self.assertRaises(RuntimeError):
+            self.rebx.set_particle_params('beta', [1.], indices=[6])
+
+    def test_lengthmismatch(self):
+        with self.assertRaises(ValueError):
+            self.rebx.set_particle_params('beta', [1., 2.], indices=[1])
+
+    def check_columns(self, beta, gr_source):
+        # through the columns and through each particle's own params
+        self.assertEqual(len(self.sim.particles), len(beta))
+        got = self.rebx.get_particle_params('beta')
+        for i, b in enumerate(beta):
+            if b is None:
+                self.assertTrue(math.isnan(got[i]))
+                with self.assertRaises(AttributeError):
+                    self.sim.particles[i].params['beta']
+            else:
+                self.assertEqual(got[i], b)
+                self.assertEqual(self.sim.particles[i].params['beta'], b)
+        self.assertEqual(list(self.rebx.get_particle_params('gr_source')), gr_source)
+        for i, g in enumerate(gr_source):
+            if g:
+                self.assertEqual(self.sim.particles[i].params['gr_source'], g)
+
+    def setcolumns(self):
+        # particle 4 has neither, particle 5 only beta
+        self.rebx.set_particle_params('beta', [0.1, 0.2, 0.3, 0.5], indices=[1, 2, 3, 5])
+        self.rebx.set_particle_params('gr_source', [7, 1, 2, 3], indices=[0, 1, 2, 3])
+
+    def test_removemiddle(self):
+        self.setcolumns()
+        self.sim.remove(2)
+        self.check_columns([None, 0.1, 0.3, None, 0.5], [7, 1, 3, 0, 0])
+        # the rows line up again for later writes and added particles
+        self.rebx.set_particle_params('beta', [0.6, 0.7], indices=[2, 3])
+        self.sim.add(a=7.)
+        self.sim.particles[5].params['beta'] = 0.8
+        self.check_columns([None, 0.1, 0.6, 0.7, 0.5, 0.8], [7, 1, 3, 0, 0, 0])
+
+    def test_removeunsorted(self):
+        # the last particle is moved into the removed slot
+        self.setcolumns()
+        self.sim.remove(2, keepSorted=False)
+        self.check_columns([None, 0.1, 0.5, 0.3, None], [7, 1, 0, 3, 0])
+        self.sim.remove(1, keepSorted=False)
+        self.check_columns([None, None, 0.5, 0.3], [7, 0, 0, 3])
+
+    def test_removeseveral(self):
+        self.setcolumns()
+        self.sim.remove(1)
+        self.sim.remove(3)
+        self.sim.remove(0)
+        self.check_columns([0.2, 0.3, 0.5], [2, 3, 0])
+        self.rebx.set_particle_params('gr_source', [4], indices=[2])
+        self.check_columns([0.2, 0.3, 0.5], [2, 3, 4])
+
+def pool_stats(pool):
+    # number of slabs and of free objects, following the next pointers at the start of each
+    counts = []
+    for head in [pool._slabs, pool._free_list]:
+        n = 0
+        while head:
+            n += 1
+            head = cast(c_void_p(head), POINTER(c_void_p))[0]
+        counts.append(n)
+    return counts
+
+class TestParamPools(unittest.TestCase):
+    def setUp(self):
+        self.sim = rebound.Simulation()
+        self.sim.add(m=1.)
+        for i in range(30):
+            self.sim.add(a=1.+0.1*i)
+        self.rebx = reboundx.Extras(self.sim)
+
+    def stats(self):
+        return [pool_stats(pool) for pool in (self.rebx._node_pool, self.rebx._param_pool, self.rebx._value_pool)]
+
+    def setparams(self, indices, k=0):
+        for i in indices:
+            ps = self.sim.particles
+            ps[i].params['beta'] = 0.01*i + k
+            ps[i].params['tau_a'] = -1.e3*i - k
+            ps[i].params['gr_source'] = i + k
+
+    def checkparams(self, hashes, k=0):
+        # i is the index the particle had when its params were set
+        for h, i in hashes:
+            p = self.sim.particles[h]
+            self.assertEqual(p.params['beta'], 0.01*i + k)
+            self.assertEqual(p.params['tau_a'], -1.e3*i - k)
+            self.assertEqual(p.params['gr_source'], i + k)
+
+    def label(self):
+        for i, p in enumerate(self.sim.particles):
+            p.hash = i
+
+    def test_overwrite(self):
+        self.label()
+        self.setparams(range(31))
+        stats = self.stats()
+        for k in range(1, 20):
+            self.setparams(range(31), k)
+        # values are written in place
+        self.assertEqual(self.stats(), stats)
+        self.checkparams([(rebound.hash(i), i) for i in range(31)], 19)
+
+    def test_remove(self):
+        self.label()
+        self.setparams(range(31))
+        stats = self.stats()
+        for i in range(20):
+            self.sim.remove(5)
+        # every param of the removed particles goes back to its pool, one node, param and value each
+        for (slabs, free), (slabs0, free0) in zip(self.stats(), stats):
+            self.assertEqual(slabs, slabs0)
+            self.assertEqual(free, free0 + 60)
+        self.checkparams([(rebound.hash(i), i) for i in list(range(5)) + list(range(25, 31))])
+        # and is reused for new ones
+        for i in range(20):
+            self.sim.add(a=10.+i, hash=100+i)
+        self.setparams(range(11, 31))
+        self.assertEqual(self.stats(), stats)
+        self.checkparams([(rebound.hash(i), i) for i in list(range(5)) + list(range(25, 31))])
+        self.checkparams([(rebound.hash(100+i), 11+i) for i in range(20)])
+
+    def reattach(self, detach):
+        self.setparams(range(31))
+        if detach:
+            self.rebx.detach(self.sim)
+        else:
+            self.sim._extras_ref = None
+        # frees the pools along with the params in them
+        self.rebx = None
+        gc.collect()
+        self.sim.remove(3)
+        self.rebx = reboundx.Extras(self.sim)
+        for p in self.sim.particles:
+            with self.assertRaises(AttributeError):
+                p.params['beta']
+        self.label()
+        self.setparams(range(30), 2)
+        self.sim.remove(7)
+        self.checkparams([(rebound.hash(i), i) for i in range(30) if i != 7], 2)
+
+    def test_free_reattach(self):
+        self.reattach(False)
+
+    def test_detach_free_reattach(self):
+        self.reattach(True)
+
 if __name__ == '__main__':
     unittest.main()
@@ -17,5 +17,27 @@ class TestRebx(unittest.TestCase):
         self.sim.integrate(10)
         self.assertGreater(self.sim.particles[1].pomega, 1.e-4)
 
+    def test_counters(self):
+        self.gr = self.rebx.load_force('gr')
+        self.rebx.add_force(self.gr)
+        self.gr.params['c'] = 1e2
+        self.mm = self.rebx.load_operator('modify_mass')
+        self.rebx.add_operator(self.mm)
+
+        self.sim.integrate(1)
+        self.assertEqual(self.gr.counters.calls, 0)
+        self.rebx.enable_counters()
+        self.sim.integrate(2)
+        self.rebx.enable_counters(False)
+        self.sim.integrate(3)
+        counters = self.rebx.counters
+        self.assertGreater(counters['gr'].calls, 0)
+        self.assertGreater(counters['modify_mass'].calls, 0)
+        self.assertLess(counters['modify_mass'].calls, counters['gr'].calls) # IAS15 evaluates forces several times per step
+        self.assertEqual(counters['gr'].particles, 2*counters['gr'].calls)
+        self.assertGreater(counters['gr'].time, 0.)
+        self.rebx.reset_counters()
+        self.assertEqual(self.gr.counters.calls, 0)
+
 if __name__ == '__main__':
     unittest.main()
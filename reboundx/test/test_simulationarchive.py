@@ -143,6 +143,30 @@ class TestSimulationArchive(unittest.TestCase):
                 sim.integrate(tmax)
                 self.assertEqual(self.sim.particles[1].x, sim.particles[1].x, msg='REB integrator: {0}, REBX integrator: {1}'.format(integrator, rebxintegrator))
 
+    def test_archive(self):
+        self.sim.add(m=1.e-4, a=2., e=0.1)
+        self.rebx.add_force(self.gr)
+        mof = self.rebx.load_force('modify_orbits_forces')
+        self.rebx.add_force(mof)
+        import os
+        if os.path.isfile('test.rebxa'):
+            os.remove('test.rebxa')
+        for i in range(6):
+            self.sim.particles[1].params['tau_a'] = -1.e4*(i+1)
+            if i == 3:
+                self.gr.params['c'] = 2e2
+            self.sim.integrate(10.*(i+1))
+            self.sim.simulationarchive_snapshot('test.sa', deletefile=(i==0))
+            self.rebx.save_archive('test.rebxa', keyframe_interval=4)
+
+        sa = reboundx.SimulationArchive('test.sa', 'test.rebxa')
+        for i in range(6):
+            sim, rebx = sa[i]
+            self.assertEqual(sim.particles[1].params['tau_a'], -1.e4*(i+1))
+            self.assertEqual(rebx.get_force('gr').params['c'], 2e2 if i >= 3 else 1e2)
+        sim, rebx = sa.getSimulation(25.)
+        self.assertEqual(sim.particles[1].params['tau_a'], -2.e4)
+
 if __name__ == '__main__':
     unittest.main()
 
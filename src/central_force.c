@@ -62,15 +62,16 @@
 
 static void rebx_calculate_central_force(struct reb_simulation* const sim, struct reb_particle* const particles, const int N, const double A, const double gamma, const int source_index){
     const struct reb_particle source = particles[source_index];
+    const struct rebx_geometry* const geo = rebx_get_geometry(sim->extras, particles, N, source_index);
     for (int i=0; i<N; i++){
         if(i == source_index){
             continue;
         }
         const struct reb_particle p = particles[i];
-        const double dx = p.x - source.x;
-        const double dy = p.y - source.y;
-        const double dz = p.z - source.z;
-        const double r2 = dx*dx + dy*dy + dz*dz;
+        const double dx = geo ? geo->dx[i] : p.x - source.x;
+        const double dy = geo ? geo->dy[i] : p.y - source.y;
+        const double dz = geo ? geo->dz[i] : p.z - source.z;
+        const double r2 = geo ? geo->r2[i] : dx*dx + dy*dy + dz*dz;
         const double prefac = A*pow(r2, (gamma-1.)/2.);
 
         particles[i].ax += prefac*dx;
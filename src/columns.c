@@ -0,0 +1,422 @@
+/**
+ * @file    columns.c
+ * @brief   Dense per-particle storage for parameters
+ * @author  Dan Tamayo <tamayo.daniel@gmail.com>
+ *
+ * @section     LICENSE
+ * Copyright (c) 2015 Dan Tamayo, Hanno Rein
+ *
+ * This file is part of reboundx.
+ *
+ * reboundx is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * reboundx is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with rebound.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/* A rebx_column keeps one parameter for all particles in a single array,
+ * with row i holding the value for sim->particles[i].  The particles keep
+ * their rebx_param nodes as before, but the values point into the column.
+ *
+ * REBOUND can shift particles down when one is removed, and we are only
+ * told about the removal (through free_particle_ap), so removals mark the
+ * columns dirty and the rows are matched up again from the particle lists
+ * the next time a column is asked for.  Adding particles only appends rows.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stddef.h>
+#include "core.h"
+#include "rebound.h"
+#include "reboundx.h"
+#include "linkedlist.h"
+
+static size_t rebx_column_size(const struct rebx_column* const col){
+    return col->type == REBX_TYPE_DOUBLE ? sizeof(double) : sizeof(int);
+}
+
+static void rebx_column_set_present(struct rebx_column* const col, const int row, const int on){
+    if (on){
+        col->present[row >> 3] |= (uint8_t)(1u << (row & 7));
+    }
+    else{
+        col->present[row >> 3] &= (uint8_t)~(1u << (row & 7));
+    }
+}
+
+// Allocates empty arrays for N_alloc rows. Returns 0 on failure.
+static int rebx_column_alloc(struct rebx_column* const col, const int N_alloc, void** values, uint8_t** present, struct rebx_param*** owner){
+    *values = malloc((size_t)N_alloc*rebx_column_size(col));
+    *present = calloc((N_alloc + 7)/8, 1);
+    *owner = calloc(N_alloc, sizeof(**owner));
+    if (*values == NULL || *present == NULL || *owner == NULL){
+        free(*values);
+        free(*present);
+        free(*owner);
+        return 0;
+    }
+    return 1;
+}
+
+static void rebx_column_install(struct rebx_column* const col, const int N_alloc, void* values, uint8_t* present, struct rebx_param** owner){
+    free(col->values);
+    free(col->present);
+    free(col->owner);
+    col->values = values;
+    col->present = present;
+    col->owner = owner;
+    col->N_alloc = N_alloc;
+}
+
+// Matches every row up with sim->particles again by walking the particle
+// lists. Params of the column's id that still have their own allocation
+// (set before the column was added, or read from a binary) are moved in.
+static int rebx_columns_rebuild(struct rebx_extras* const rebx){
+    struct reb_simulation* const sim = rebx->sim;
+    const int N = sim->N;
+    const int N_alloc = N > 0 ? N : 1;
+    void* values[rebx->N_columns];
+    uint8_t* present[rebx->N_columns];
+    struct rebx_param** owner[rebx->N_columns];
+    for (int id=0; id<rebx->N_columns; id++){
+        struct rebx_column* const col = rebx->columns[id];
+        if (col == NULL){
+            continue;
+        }
+        if (!rebx_column_alloc(col, N_alloc, &values[id], &present[id], &owner[id])){
+            for (int j=0; j<id; j++){
+                if (rebx->columns[j] != NULL){
+                    free(values[j]);
+                    free(present[j]);
+                    free(owner[j]);
+                }
+            }
+            rebx_error(rebx, "REBOUNDx Error: Could not allocate memory for parameter columns.\n");
+            return 0;
+        }
+    }
+
+    for (int i=0; i<N; i++){
+        for (struct rebx_node* node = sim->particles[i].ap; node != NULL; node = node->next){
+            struct rebx_param* const param = node->object;
+            if (param->id < 0 || param->id >= rebx->N_columns || rebx->columns[param->id] == NULL){
+                continue;
+            }
+            struct rebx_column* const col = rebx->columns[param->id];
+            const size_t size = rebx_column_size(col);
+            void* const row = (char*)values[param->id] + (size_t)i*size;
+            if (param->value != NULL){
+                memcpy(row, param->value, size);
+            }
+            if (param->column == NULL){
+                rebx_pool_free(&rebx->value_pool, param->value);
+                param->column = col;
+            }
+            param->value = row;
+            owner[param->id][i] = param;
+            present[param->id][i >> 3] |= (uint8_t)(1u << (i & 7));
+        }
+    }
+
+    for (int id=0; id<rebx->N_columns; id++){
+        struct rebx_column* const col = rebx->columns[id];
+        if (col == NULL){
+            continue;
+        }
+        rebx_column_install(col, N_alloc, values[id], present[id], owner[id]);
+        col->N_rows = N;
+    }
+    rebx->columns_dirty = 0;
+    rebx->param_generation++;
+    return 1;
+}
+
+// Grows a column that is in sync to N rows, repointing the values of its
+// owners if the array moved.
+static int rebx_column_grow(struct rebx_extras* const rebx, struct rebx_column* const col, const int N){
+    if (N > col->N_alloc){
+        int N_alloc = col->N_alloc ? col->N_alloc : 1;
+        while (N_alloc < N){
+            N_alloc *= 2;
+        }
+        void* values;
+        uint8_t* present;
+        struct rebx_param** owner;
+        if (!rebx_column_alloc(col, N_alloc, &values, &present, &owner)){
+            rebx_error(rebx, "REBOUNDx Error: Could not allocate memory for parameter columns.\n");
+            return 0;
+        }
+        const size_t size = rebx_column_size(col);
+        memcpy(values, col->values, (size_t)col->N_rows*size);
+        memcpy(present, col->present, (col->N_rows + 7)/8);
+        memcpy(owner, col->owner, (size_t)col->N_rows*sizeof(*owner));
+        for (int i=0; i<col->N_rows; i++){
+            if (owner[i] != NULL){
+                owner[i]->value = (char*)values + (size_t)i*size;
+            }
+        }
+        rebx_column_install(col, N_alloc, values, present, owner);
+        rebx->param_generation++;
+    }
+    col->N_rows = N;
+    return 1;
+}
+
+static int rebx_columns_sync(struct rebx_extras* const rebx){
+    const int N = rebx->sim->N;
+    if (rebx->columns_dirty){
+        return rebx_columns_rebuild(rebx);
+    }
+    for (int id=0; id<rebx->N_columns; id++){
+        struct rebx_column* const col = rebx->columns[id];
+        if (col == NULL || col->N_rows == N){
+            continue;
+        }
+        if (col->N_rows > N){ // particles went away without us hearing about it
+            return rebx_columns_rebuild(rebx);
+        }
+        if (!rebx_column_grow(rebx, col, N)){
+            return 0;
+        }
+    }
+    return 1;
+}
+
+struct rebx_column* rebx_add_column(struct rebx_extras* const rebx, const char* const param_name){
+    if (rebx->sim == NULL){
+        rebx_error(rebx, ""); // rebx_error gives meaningful err
+        return NULL;
+    }
+    const int id = rebx_get_param_id(rebx, param_name);
+    if (id < 0){
+        char str[300];
+        sprintf(str, "REBOUNDx Error: Need to register parameter name '%s' before storing it in a column.\n", param_name);
+        rebx_error(rebx, str);
+        return NULL;
+    }
+    const enum rebx_param_type type = rebx->id_params[id]->type;
+    if (type != REBX_TYPE_DOUBLE && type != REBX_TYPE_INT){
+        char str[300];
+        sprintf(str, "REBOUNDx Error: Only double and int parameters can be stored in columns ('%s').\n", param_name);
+        rebx_error(rebx, str);
+        return NULL;
+    }
+    if (id < rebx->N_columns && rebx->columns[id] != NULL){
+        return rebx->columns[id];
+    }
+
+    if (id >= rebx->N_columns){
+        const int N_columns = rebx->N_registered_params;
+        struct rebx_column** const columns = realloc(rebx->columns, N_columns*sizeof(*columns));
+        if (columns == NULL){
+            rebx_error(rebx, "REBOUNDx Error: Could not allocate memory for parameter columns.\n");
+            return NULL;
+        }
+        for (int i=rebx->N_columns; i<N_columns; i++){
+            columns[i] = NULL;
+        }
+        rebx->columns = columns;
+        rebx->N_columns = N_columns;
+    }
+
+    struct rebx_column* const col = calloc(1, sizeof(*col));
+    if (col == NULL){
+        rebx_error(rebx, "REBOUNDx Error: Could not allocate memory for parameter columns.\n");
+        return NULL;
+    }
+    col->id = id;
+    col->type = type;
+    rebx->columns[id] = col;
+    rebx->columns_dirty = 1;    // pulls in values already set on particles
+    if (!rebx_columns_sync(rebx)){
+        rebx->columns[id] = NULL;
+        free(col);
+        return NULL;
+    }
+    return col;
+}
+
+struct rebx_column* rebx_get_column(struct rebx_extras* const rebx, const int id){
+    if (id < 0 || id >= rebx->N_columns || rebx->columns[id] == NULL){
+        return NULL;
+    }
+    if (!rebx_columns_sync(rebx)){
+        return NULL;
+    }
+    return rebx->columns[id];
+}
+
+void* rebx_column_attach(struct rebx_extras* const rebx, struct rebx_node** const apptr, struct rebx_param* const param){
+    struct reb_simulation* const sim = rebx->sim;
+    if (sim == NULL || param->id < 0 || param->id >= rebx->N_columns || rebx->columns[param->id] == NULL){
+        return NULL;
+    }
+    // Only particle lists are stored in columns
+    const uintptr_t first = (uintptr_t)&sim->particles[0].ap;
+    const uintptr_t addr = (uintptr_t)apptr;
+    if (sim->N == 0 || addr < first || (addr - first) % sizeof(struct reb_particle) != 0){
+        return NULL;
+    }
+    const size_t i = (addr - first)/sizeof(struct reb_particle);
+    if (i >= (size_t)sim->N){
+        return NULL;
+    }
+    if (!rebx_columns_sync(rebx)){
+        return NULL;
+    }
+    struct rebx_column* const col = rebx->columns[param->id];
+    if (col->owner[i] == param){ // a rebuild in the sync above already took it in
+        return param->value;
+    }
+    if (col->owner[i] != NULL){
+        return NULL;
+    }
+    const size_t size = rebx_column_size(col);
+    void* const row = (char*)col->values + i*size;
+    memset(row, 0, size);
+    col->owner[i] = param;
+    rebx_column_set_present(col, (int)i, 1);
+    param->column = col;
+    return row;
+}
+
+void rebx_column_release(struct rebx_param* const param){
+    struct rebx_column* const col = param->column;
+    const ptrdiff_t row = ((char*)param->value - (char*)col->values)/(ptrdiff_t)rebx_column_size(col);
+    if (row >= 0 && row < col->N_rows && col->owner[row] == param){
+        col->owner[row] = NULL;
+        rebx_column_set_present(col, (int)row, 0);
+    }
+    param->column = NULL;
+    param->value = NULL;
+}
+
+void rebx_free_columns(struct rebx_extras* const rebx){
+    for (int id=0; id<rebx->N_columns; id++){
+        struct rebx_column* const col = rebx->columns[id];
+        if (col == NULL){
+            continue;
+        }
+        // The particle params go with the pools in rebx_free_pointers
+        for (int i=0; i<col->N_rows; i++){
+            struct rebx_param* const param = col->owner[i];
+            if (param != NULL){
+                param->value = NULL;
+                param->column = NULL;
+            }
+        }
+        free(col->values);
+        free(col->present);
+        free(col->owner);
+        free(col);
+    }
+    free(rebx->columns);
+    rebx->columns = NULL;
+    rebx->N_columns = 0;
+}
+
+// Checks that param_name is registered with the given type, for the bulk
+// setters and getters.
+static int rebx_param_array_check(struct rebx_extras* const rebx, const char* const param_name, const enum rebx_param_type type){
+    if (rebx->sim == NULL){
+        rebx_error(rebx, ""); // rebx_error gives meaningful err
+        return 0;
+    }
+    if (rebx_get_type(rebx, param_name) != type){
+        char str[300];
+        sprintf(str, "REBOUNDx Error: Parameter '%s' is not registered as %s.\n", param_name, type == REBX_TYPE_DOUBLE ? "a double" : "an int");
+        rebx_error(rebx, str);
+        return 0;
+    }
+    return 1;
+}
+
+// Rows that already hold the parameter are written straight into its
+// column.  The others get their param as they would from
+// rebx_set_param_double, which places the value in the column as well.
+static int rebx_set_param_array(struct rebx_extras* const rebx, const char* const param_name, const enum rebx_param_type type, const void* const values, const int* const indices, const int n){
+    if (!rebx_param_array_check(rebx, param_name, type)){
+        return 0;
+    }
+    struct rebx_column* const col = rebx_add_column(rebx, param_name);
+    if (col == NULL || rebx_get_column(rebx, col->id) == NULL){
+        return 0;
+    }
+    struct reb_simulation* const sim = rebx->sim;
+    const size_t size = rebx_column_size(col);
+    for (int k=0; k<n; k++){
+        const int i = indices ? indices[k] : k;
+        if (i < 0 || i >= sim->N){
+            char str[300];
+            sprintf(str, "REBOUNDx Error: Particle index %d out of range when setting '%s'.\n", i, param_name);
+            rebx_error(rebx, str);
+            return k;
+        }
+        const void* const value = (const char*)values + (size_t)k*size;
+        void* const row = rebx_column_get(col, i);
+        if (row != NULL){
+            memcpy(row, value, size);
+        }
+        else if (type == REBX_TYPE_DOUBLE){
+            rebx_set_param_double(rebx, (struct rebx_node**)&sim->particles[i].ap, param_name, *(const double*)value);
+        }
+        else{
+            rebx_set_param_int(rebx, (struct rebx_node**)&sim->particles[i].ap, param_name, *(const int*)value);
+        }
+    }
+    return n;
+}
+
+static int rebx_get_param_array(struct rebx_extras* const rebx, const char* const param_name, const enum rebx_param_type type, void* const values, const int* const indices, const int n){
+    if (!rebx_param_array_check(rebx, param_name, type)){
+        return 0;
+    }
+    struct reb_simulation* const sim = rebx->sim;
+    const int id = rebx_get_param_id(rebx, param_name);
+    const struct rebx_column* const col = rebx_get_column(rebx, id);
+    const size_t size = (type == REBX_TYPE_DOUBLE) ? sizeof(double) : sizeof(int);
+    int found = 0;
+    for (int k=0; k<n; k++){
+        const int i = indices ? indices[k] : k;
+        if (i < 0 || i >= sim->N){
+            char str[300];
+            sprintf(str, "REBOUNDx Error: Particle index %d out of range when getting '%s'.\n", i, param_name);
+            rebx_error(rebx, str);
+            return found;
+        }
+        const void* const value = col ? rebx_column_get(col, i) : rebx_get_param_by_id(rebx, sim->particles[i].ap, id);
+        if (value != NULL){
+            memcpy((char*)values + (size_t)k*size, value, size);
+            found++;
+        }
+    }
+    return found;
+}
+
+int rebx_set_param_double_array(struct rebx_extras* const rebx, const char* const param_name, const double* const values, const int* const indices, const int n){
+    return rebx_set_param_array(rebx, param_name, REBX_TYPE_DOUBLE, values, indices, n);
+}
+
+int rebx_set_param_int_array(struct rebx_extras* const rebx, const char* const param_name, const int* const values, const int* const indices, const int n){
+    return rebx_set_param_array(rebx, param_name, REBX_TYPE_INT, values, indices, n);
+}
+
+int rebx_get_param_double_array(struct rebx_extras* const rebx, const char* const param_name, double* const values, const int* const indices, const int n){
+    return rebx_get_param_array(rebx, param_name, REBX_TYPE_DOUBLE, values, indices, n);
+}
+
+int rebx_get_param_int_array(struct rebx_extras* const rebx, const char* const param_name, int* const values, const int* const indices, const int n){
+    return rebx_get_param_array(rebx, param_name, REBX_TYPE_INT, values, indices, n);
+}
@@ -24,10 +24,12 @@
  */
 
 /* Main routines called each timestep. */
+#define _DEFAULT_SOURCE     // clock_gettime under -std=c99
 #include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <math.h>
+#include <time.h>
 #include <string.h>
 #include <limits.h>
 #include <float.h>
@@ -60,6 +62,9 @@ void rebx_register_default_params(struct rebx_extras* rebx){
     rebx_register_param(rebx, "J2", REBX_TYPE_DOUBLE);
     rebx_register_param(rebx, "J4", REBX_TYPE_DOUBLE);
     rebx_register_param(rebx, "R_eq", REBX_TYPE_DOUBLE);
+    rebx_register_param(rebx, "harmonics", REBX_TYPE_POINTER);
+    rebx_register_param(rebx, "harmonics_W0", REBX_TYPE_DOUBLE);
+    rebx_register_param(rebx, "harmonics_Wdot", REBX_TYPE_DOUBLE);
     rebx_register_param(rebx, "coordinates", REBX_TYPE_INT);
     rebx_register_param(rebx, "p", REBX_TYPE_DOUBLE);
     rebx_register_param(rebx, "tau_a", REBX_TYPE_DOUBLE);
@@ -75,20 +80,44 @@ void rebx_register_default_params(struct rebx_extras* rebx){
     rebx_register_param(rebx, "k1", REBX_TYPE_DOUBLE);
     rebx_register_param(rebx, "integrator", REBX_TYPE_INT);
     rebx_register_param(rebx, "free_arrays", REBX_TYPE_POINTER);
+    rebx_register_param(rebx, "orbits_workspace", REBX_TYPE_POINTER);
     rebx_register_param(rebx, "im_ps_final", REBX_TYPE_POINTER);
     rebx_register_param(rebx, "im_ps_prev", REBX_TYPE_POINTER);
     rebx_register_param(rebx, "im_ps_avg", REBX_TYPE_POINTER);
+    rebx_register_param(rebx, "im_tolerance", REBX_TYPE_DOUBLE);
+    rebx_register_param(rebx, "im_max_iterations", REBX_TYPE_INT);
+    rebx_register_param(rebx, "im_anderson", REBX_TYPE_INT);
     rebx_register_param(rebx, "rk2_k2", REBX_TYPE_POINTER);
     rebx_register_param(rebx, "rk4_k2", REBX_TYPE_POINTER);
     rebx_register_param(rebx, "rk4_k3", REBX_TYPE_POINTER);
+    rebx_register_param(rebx, "dp45_workspace", REBX_TYPE_POINTER);
+    rebx_register_param(rebx, "dp45_dt", REBX_TYPE_DOUBLE);
+    rebx_register_param(rebx, "dp45_epsilon", REBX_TYPE_DOUBLE);
     rebx_register_param(rebx, "min_distance", REBX_TYPE_DOUBLE);
     rebx_register_param(rebx, "min_distance_from", REBX_TYPE_UINT32);
     rebx_register_param(rebx, "min_distance_orbit", REBX_TYPE_ORBIT);
+    rebx_register_param(rebx, "min_distance_workspace", REBX_TYPE_POINTER);
     rebx_register_param(rebx, "N_ephem", REBX_TYPE_INT);
     rebx_register_param(rebx, "N_ast", REBX_TYPE_INT);
     rebx_register_param(rebx, "geocentric", REBX_TYPE_INT);
     rebx_register_param(rebx, "outstate", REBX_TYPE_POINTER);
     rebx_register_param(rebx, "n_out", REBX_TYPE_INT);        
+    rebx_register_param(rebx, "ephem_cache", REBX_TYPE_POINTER);
+    rebx_register_param(rebx, "ephemeris", REBX_TYPE_POINTER);
+    rebx_register_param(rebx, "ephem_prefetch", REBX_TYPE_INT);
+    rebx_register_param(rebx, "ephem_min_chunk", REBX_TYPE_INT);
+    rebx_register_param(rebx, "ephem_offload", REBX_TYPE_INT);
+    rebx_register_param(rebx, "ephem_cull_tol", REBX_TYPE_DOUBLE);
+    rebx_register_param(rebx, "ephem_cull_refresh", REBX_TYPE_INT);
+    rebx_register_param(rebx, "ephem_shared", REBX_TYPE_POINTER);
+    rebx_register_param(rebx, "gr_full_workspace", REBX_TYPE_POINTER);
+    rebx_register_param(rebx, "harmonics_workspace", REBX_TYPE_POINTER);
+    rebx_register_param(rebx, "gr_reuse_gravity", REBX_TYPE_INT);
+    rebx_register_param(rebx, "radiation_workspace", REBX_TYPE_POINTER);
+    rebx_register_param(rebx, "ias15_warm_start", REBX_TYPE_INT);
+    rebx_register_param(rebx, "ias15_own_state", REBX_TYPE_INT);
+    rebx_register_param(rebx, "ias15_dt", REBX_TYPE_DOUBLE);
+    rebx_register_param(rebx, "ias15_state", REBX_TYPE_POINTER);
 }
 
 void rebx_register_param(struct rebx_extras* const rebx, const char* name, enum rebx_param_type type){
@@ -108,14 +137,81 @@ void rebx_register_param(struct rebx_extras* const rebx, const char* name, enum
     if (param == NULL){
         return;
     }
+    if (!rebx_intern_param(rebx, param)){
+        rebx_free_param(rebx, param);
+        return;
+    }
     int success = rebx_add_param(rebx, &rebx->registered_params, param);
     if(!success){
-        rebx_free_param(param);
+        rebx_free_param(rebx, param);
     }
     
     return;
 }
 
+// FNV-1a
+static uint32_t rebx_hash_name(const char* name){
+    uint32_t hash = 2166136261u;
+    for (; *name != '\0'; name++){
+        hash ^= (unsigned char)*name;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// Slot in param_ids holding name, or the empty slot where it would go.
+static int rebx_find_slot(const struct rebx_extras* const rebx, const char* const name){
+    const int mask = rebx->param_ids_size - 1;
+    int slot = rebx_hash_name(name) & mask;
+    while (rebx->param_ids[slot] != -1 && strcmp(rebx->id_params[rebx->param_ids[slot]]->name, name) != 0){
+        slot = (slot + 1) & mask;
+    }
+    return slot;
+}
+
+// Hands out the next id to a registered param and adds its name to the
+// hash table, which is kept at most half full.
+int rebx_intern_param(struct rebx_extras* const rebx, struct rebx_param* const param){
+    const int id = rebx->N_registered_params;
+    if ((id & (id - 1)) == 0){ // grow id_params at powers of two
+        struct rebx_param** const id_params = realloc(rebx->id_params, (id ? 2*id : 1)*sizeof(*id_params));
+        if (id_params == NULL){
+            rebx_error(rebx, "REBOUNDx Error: Could not allocate memory.\n");
+            return 0;
+        }
+        rebx->id_params = id_params;
+    }
+    if (2*(id + 1) > rebx->param_ids_size){
+        const int size = rebx->param_ids_size ? 2*rebx->param_ids_size : 64;
+        int* const param_ids = malloc(size*sizeof(*param_ids));
+        if (param_ids == NULL){
+            rebx_error(rebx, "REBOUNDx Error: Could not allocate memory.\n");
+            return 0;
+        }
+        free(rebx->param_ids);
+        rebx->param_ids = param_ids;
+        rebx->param_ids_size = size;
+        for (int i=0; i<size; i++){
+            param_ids[i] = -1;
+        }
+        for (int i=0; i<id; i++){
+            param_ids[rebx_find_slot(rebx, rebx->id_params[i]->name)] = i;
+        }
+    }
+    rebx->id_params[id] = param;
+    rebx->param_ids[rebx_find_slot(rebx, param->name)] = id;
+    rebx->N_registered_params++;
+    param->id = id;
+    return 1;
+}
+
+int rebx_get_param_id(struct rebx_extras* const rebx, const char* const param_name){
+    if (rebx->param_ids_size == 0){
+        return -1;
+    }
+    return rebx->param_ids[rebx_find_slot(rebx, param_name)];
+}
+
 struct rebx_extras* rebx_attach(struct reb_simulation* sim){  // reboundx.h
     if (sim == NULL){
         fprintf(stderr, "REBOUNDx Error: Simulation pointer passed to rebx_attach was NULL.\n");
@@ -139,6 +235,10 @@ void rebx_detach(struct reb_simulation* sim, struct rebx_extras* rebx){
     rebx->sim = NULL;
     
     if (sim->extras == rebx){
+        // The particle params live in rebx's pools, so they can't outlive it
+        for (int i=0; i<sim->N; i++){
+            sim->particles[i].ap = NULL;
+        }
         if (sim->additional_forces == rebx_additional_forces){
             sim->additional_forces = NULL;
         }
@@ -151,6 +251,10 @@ void rebx_detach(struct reb_simulation* sim, struct rebx_extras* rebx){
         if (sim->free_particle_ap == rebx_free_particle_ap){
             sim->free_particle_ap = NULL;
         }
+        if (sim->extras_cleanup == rebx_extras_cleanup){
+            sim->extras_cleanup = NULL;
+        }
+        sim->extras = NULL;
     }
 }
 
@@ -168,6 +272,29 @@ void rebx_initialize(struct reb_simulation* sim, struct rebx_extras* rebx){
     rebx->allocated_forces=NULL;
     rebx->allocated_operators=NULL;
     rebx->registered_params=NULL;
+    rebx->id_params=NULL;
+    rebx->N_registered_params=0;
+    rebx->param_ids=NULL;
+    rebx->param_ids_size=0;
+    rebx->param_generation=1;   // forces and operators start at 0, so their caches start stale
+    rebx->columns=NULL;
+    rebx->N_columns=0;
+    rebx->columns_dirty=0;
+    rebx->geometry=NULL;
+    rebx->N_geometry=0;
+    rebx->geometry_particles=NULL;
+    rebx->geometry_N=0;
+    rebx->geometry_epoch=0;
+    rebx->accelerations_newtonian=0;
+    rebx->scratch=NULL;
+    rebx->scratch_used=0;
+    rebx->in_step_list=0;
+    rebx->whfast_deferred=0;
+    rebx->archive=NULL;
+    rebx->counters_enabled = 0;
+    rebx_pool_init(&rebx->node_pool, sizeof(struct rebx_node));
+    rebx_pool_init(&rebx->param_pool, sizeof(struct rebx_param));
+    rebx_pool_init(&rebx->value_pool, sizeof(double)); // also holds ints and uint32s
     
     sim->free_particle_ap = rebx_free_particle_ap;
     sim->extras_cleanup = rebx_extras_cleanup;
@@ -199,6 +326,8 @@ struct rebx_force* rebx_create_force(struct rebx_extras* const rebx, const char*
     force->sim = rebx->sim;
     force->force_type = REBX_FORCE_NONE;
     force->update_accelerations = NULL;
+    force->param_generation = 0;
+    force->counters = (struct rebx_counters){0};
     force->name = NULL;
     if(name != NULL)
     {
@@ -289,11 +418,13 @@ struct rebx_operator* rebx_create_operator(struct rebx_extras* const rebx, const
     operator->sim = rebx->sim;
     operator->operator_type = REBX_OPERATOR_NONE;
     operator->step_function = NULL;
+    operator->param_generation = 0;
+    operator->counters = (struct rebx_counters){0};
     operator->name = NULL;
     if(name != NULL){
         operator->name = rebx_malloc(rebx, strlen(name) + 1); // +1 for \0 at end
         if (operator->name == NULL){
-            rebx_free_operator(operator);
+            rebx_free_operator(rebx, operator);
             return NULL;
         }
         else{
@@ -304,7 +435,7 @@ struct rebx_operator* rebx_create_operator(struct rebx_extras* const rebx, const
     // Add operator to allocated_operators list for later freeing
     struct rebx_node* node = rebx_create_node(rebx);
     if (node == NULL){
-        rebx_free_operator(operator);
+        rebx_free_operator(rebx, operator);
         return NULL;
     }
     node->object = operator;
@@ -504,6 +635,105 @@ int rebx_add_operator(struct rebx_extras* rebx, struct rebx_operator* operator){
     return 0; // didn't reach a successful outcome
 }
 
+// Operators whose flow over a then b equals that over a+b, so neighbouring
+// stages can be run as one
+static int rebx_operator_mergeable(const struct rebx_operator* const operator){
+    return operator->step_function == rebx_drift_step || operator->step_function == rebx_kepler_step || operator->step_function == rebx_jump_step || operator->step_function == rebx_interaction_step;
+}
+
+int rebx_add_operator_steps(struct rebx_extras* rebx, struct rebx_operator* const* operators, const double* dt_fractions, const int N, enum rebx_timing timing){
+    if (rebx->sim == NULL){
+        rebx_error(rebx, ""); // rebx_error gives meaningful err
+        return 0;
+    }
+    if (timing != REBX_TIMING_PRE && timing != REBX_TIMING_POST){
+        rebx_error(rebx, "REBOUNDx error: Timing passed to rebx_add_operator_steps must be pre or post.\n");
+        return 0;
+    }
+    // Steps are pushed onto the front of the list, which runs first, so add
+    // the stages back to front. Each one then only has to be compared with
+    // the head, which is the stage (or previously added step) run right after it.
+    struct rebx_node** const head = (timing == REBX_TIMING_PRE) ? &rebx->pre_timestep_modifications : &rebx->post_timestep_modifications;
+    for (int i=N-1; i>=0; i--){
+        struct rebx_operator* const operator = operators[i];
+        if (operator == NULL){
+            rebx_error(rebx, "REBOUNDx error: Passed NULL pointer to rebx_add_operator_steps.\n");
+            return 0;
+        }
+        const double dt_fraction = dt_fractions[i];
+        if (*head != NULL && rebx_operator_mergeable(operator)){
+            struct rebx_step* const next = (*head)->object;
+            if (next->operator == operator){
+                next->dt_fraction += dt_fraction;
+                if (next->dt_fraction == 0.){    // cancelled out
+                    struct rebx_node* const node = *head;
+                    *head = node->next;
+                    rebx_free_step(next);
+                    free(node);
+                }
+                continue;
+            }
+        }
+        if (dt_fraction == 0. && rebx_operator_mergeable(operator)){
+            continue;
+        }
+        if (!rebx_add_operator_step(rebx, operator, dt_fraction, timing)){
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Symmetric splittings A(c1) B(d1) A(c2) ... B(d1) A(c1) of one timestep.
+// Only the first half of the coefficients is listed: c1, d1, c2, d2, ...
+// up to and including the middle one.
+struct rebx_splitting{
+    const char* name;
+    int N_half;
+    double coefficients[8];
+};
+
+int rebx_add_splitting(struct rebx_extras* rebx, const char* scheme, struct rebx_operator* A, struct rebx_operator* B, enum rebx_timing timing){
+    const double sqrt3 = sqrt(3.);
+    const double sqrt15 = sqrt(15.);
+    const double sqrt30 = sqrt(30.);
+    const double saba4p = sqrt(525. + 70.*sqrt30);
+    const double saba4m = sqrt(525. - 70.*sqrt30);
+    const double cbrt2 = cbrt(2.);
+    const double w1 = 1./(2. - cbrt2);
+    const double w0 = -cbrt2/(2. - cbrt2);
+    // Laskar & Robutel (2001) for SABA, Yoshida (1990) for the triple jump
+    const struct rebx_splitting splittings[] = {
+        {"leapfrog", 2, {0.5, 1.}},
+        {"saba2", 3, {0.5 - sqrt3/6., 0.5, sqrt3/3.}},
+        {"saba3", 4, {0.5 - sqrt15/10., 5./18., sqrt15/10., 4./9.}},
+        {"saba4", 5, {0.5 - saba4p/70., 0.25 - sqrt30/72., (saba4p - saba4m)/70., 0.25 + sqrt30/72., saba4m/35.}},
+        {"yoshida4", 4, {w1/2., w1, (w0 + w1)/2., w0}},
+    };
+    const struct rebx_splitting* splitting = NULL;
+    for (size_t k=0; k<sizeof(splittings)/sizeof(splittings[0]); k++){
+        if (strcmp(scheme, splittings[k].name) == 0){
+            splitting = &splittings[k];
+            break;
+        }
+    }
+    if (splitting == NULL){
+        char str[300];
+        sprintf(str, "REBOUNDx error: Splitting scheme '%s' not found.\n", scheme);
+        rebx_error(rebx, str);
+        return 0;
+    }
+    
+    const int N = 2*splitting->N_half - 1;
+    struct rebx_operator* operators[15];
+    double dt_fractions[15];
+    for (int k=0; k<splitting->N_half; k++){
+        operators[k] = operators[N-1-k] = (k % 2 == 0) ? A : B;
+        dt_fractions[k] = dt_fractions[N-1-k] = splitting->coefficients[k];
+    }
+    return rebx_add_operator_steps(rebx, operators, dt_fractions, N, timing);
+}
+
 /*****************************************************************
  User interface for setting parameter values
  *****************************************************************/
@@ -533,7 +763,7 @@ static struct rebx_param* rebx_get_or_add_param(struct rebx_extras* const rebx,
         }
         int success = rebx_add_param(rebx, apptr, param);
         if(!success){
-            rebx_free_param(param);
+            rebx_free_param(rebx, param);
             return NULL;
         }
     }
@@ -545,7 +775,10 @@ void rebx_set_param_pointer(struct rebx_extras* const rebx, struct rebx_node** a
     if (param == NULL){
         return;
     }
-    param->value = val;
+    if (param->value != val){
+        param->value = val;
+        rebx->param_generation++;
+    }
     return;
 }
 
@@ -555,7 +788,10 @@ void rebx_set_param_double(struct rebx_extras* const rebx, struct rebx_node** ap
         return;
     }
     if (param->value == NULL){ // new parameter, allocate
-        param->value = rebx_malloc(rebx, sizeof(double));
+        param->value = rebx_column_attach(rebx, apptr, param);
+    }
+    if (param->value == NULL){
+        param->value = rebx_pool_value(rebx);
     }
     // Update new or existing param value
     double* valptr = param->value;
@@ -570,7 +806,10 @@ void rebx_set_param_int(struct rebx_extras* const rebx, struct rebx_node** apptr
         return;
     }
     if (param->value == NULL){ // new parameter, allocate
-        param->value = rebx_malloc(rebx, sizeof(int));
+        param->value = rebx_column_attach(rebx, apptr, param);
+    }
+    if (param->value == NULL){
+        param->value = rebx_pool_value(rebx);
     }
     // Update new or existing param value
     int* valptr = param->value;
@@ -585,7 +824,7 @@ void rebx_set_param_uint32(struct rebx_extras* const rebx, struct rebx_node** ap
         return;
     }
     if (param->value == NULL){ // new parameter, allocate
-        param->value = rebx_malloc(rebx, sizeof(uint32_t));
+        param->value = rebx_pool_value(rebx);
     }
     // Update new or existing param value
     uint32_t* valptr = param->value;
@@ -599,10 +838,13 @@ void rebx_set_param_uint32(struct rebx_extras* const rebx, struct rebx_node** ap
  *******************************************************************/
 
 struct rebx_param* rebx_get_param_struct(struct rebx_extras* rebx, struct rebx_node* ap, const char* const param_name){
+    // Compare ids rather than strings where we can. Only params whose
+    // names were never registered (id -1) need a strcmp.
+    const int id = rebx_get_param_id(rebx, param_name);
     struct rebx_node* current = ap;
     while(current != NULL){
         struct rebx_param* param = current->object;
-        if(strcmp(param->name, param_name) == 0){
+        if(param->id >= 0 ? param->id == id : strcmp(param->name, param_name) == 0){
             return param;
         }
         current = current->next;
@@ -611,6 +853,29 @@ struct rebx_param* rebx_get_param_struct(struct rebx_extras* rebx, struct rebx_n
     return NULL;   // name not found. Don't want warnings for optional parameters so don't reb_error
 }
 
+struct rebx_param* rebx_get_param_struct_by_id(struct rebx_extras* const rebx, struct rebx_node* ap, const int id){
+    if (id < 0){
+        return NULL;
+    }
+    struct rebx_node* current = ap;
+    while(current != NULL){
+        struct rebx_param* param = current->object;
+        if(param->id == id){
+            return param;
+        }
+        current = current->next;
+    }
+    return NULL;
+}
+
+void* rebx_get_param_by_id(struct rebx_extras* const rebx, struct rebx_node* ap, const int id){
+    struct rebx_param* param = rebx_get_param_struct_by_id(rebx, ap, id);
+    if (param == NULL){
+        return NULL;
+    }
+    return param->value;
+}
+
 void* rebx_get_param(struct rebx_extras* rebx, struct rebx_node* ap, const char* const param_name){
     struct rebx_param* param = rebx_get_param_struct(rebx, ap, param_name);
     if (param == NULL){
@@ -647,6 +912,29 @@ struct rebx_operator* rebx_get_operator(struct rebx_extras* const rebx, const ch
     return NULL;
 }
 
+void rebx_set_counters(struct rebx_extras* const rebx, const int enabled){
+    rebx->counters_enabled = enabled ? 1 : 0;
+}
+
+void rebx_reset_counters(struct rebx_extras* const rebx){
+    for (struct rebx_node* current = rebx->allocated_forces; current != NULL; current = current->next){
+        struct rebx_force* const force = current->object;
+        force->counters = (struct rebx_counters){0};
+    }
+    for (struct rebx_node* current = rebx->allocated_operators; current != NULL; current = current->next){
+        struct rebx_operator* const operator = current->object;
+        operator->counters = (struct rebx_counters){0};
+    }
+}
+
+int rebx_param_cache_stale(struct rebx_extras* const rebx, unsigned long* const generation){
+    if (*generation == rebx->param_generation){
+        return 0;
+    }
+    *generation = rebx->param_generation;
+    return 1;
+}
+
 /*******************************************************************
  User interface for removing REBOUNDx objects
  *******************************************************************/
@@ -697,7 +985,7 @@ static int rebx_remove_step_node(struct rebx_node** head, struct rebx_operator*
 int rebx_remove_operator(struct rebx_extras* rebx, struct rebx_operator* operator){
     int allocated = rebx_remove_node(&rebx->allocated_operators, operator);
     if(allocated){
-        rebx_free_operator(operator);
+        rebx_free_operator(rebx, operator);
         
     }
     
@@ -737,32 +1025,227 @@ void* rebx_malloc(struct rebx_extras* const rebx, size_t memsize){
     return ptr;
 }
 
-void rebx_free_param(struct rebx_param* param){
-    if(param->name){
+// Objects are threaded onto the free list a slab at a time. Slabs start
+// small and double up to REBX_POOL_SLAB_MAX objects.
+#define REBX_POOL_SLAB_MIN 64
+#define REBX_POOL_SLAB_MAX 4096
+
+struct rebx_pool_slab{
+    struct rebx_pool_slab* next;
+};
+
+// Slab header padded so the objects after it stay aligned for doubles and pointers
+#define REBX_POOL_ALIGN (sizeof(double) > sizeof(void*) ? sizeof(double) : sizeof(void*))
+#define REBX_POOL_HEADER ((sizeof(struct rebx_pool_slab) + REBX_POOL_ALIGN - 1)/REBX_POOL_ALIGN*REBX_POOL_ALIGN)
+
+void rebx_pool_init(struct rebx_pool* const pool, const size_t size){
+    pool->size = (size + REBX_POOL_ALIGN - 1)/REBX_POOL_ALIGN*REBX_POOL_ALIGN;
+    pool->N_next = REBX_POOL_SLAB_MIN;
+    pool->free_list = NULL;
+    pool->slabs = NULL;
+}
+
+// Returns NULL if out of memory, leaving the error to the caller
+void* rebx_pool_alloc(struct rebx_pool* const pool){
+    if (pool->free_list == NULL){
+        const int n = pool->N_next;
+        struct rebx_pool_slab* const slab = malloc(REBX_POOL_HEADER + (size_t)n*pool->size);
+        if (slab == NULL){
+            return NULL;
+        }
+        slab->next = pool->slabs;
+        pool->slabs = slab;
+        char* const objects = (char*)slab + REBX_POOL_HEADER;
+        for (int i=n-1; i>=0; i--){
+            void* const object = objects + (size_t)i*pool->size;
+            *(void**)object = pool->free_list;
+            pool->free_list = object;
+        }
+        if (2*n <= REBX_POOL_SLAB_MAX){
+            pool->N_next = 2*n;
+        }
+    }
+    void* const object = pool->free_list;
+    pool->free_list = *(void**)object;
+    return object;
+}
+
+void rebx_pool_free(struct rebx_pool* const pool, void* const object){
+    if (object == NULL){
+        return;
+    }
+    *(void**)object = pool->free_list;
+    pool->free_list = object;
+}
+
+static void rebx_pool_release(struct rebx_pool* const pool){
+    struct rebx_pool_slab* slab = pool->slabs;
+    while (slab != NULL){
+        struct rebx_pool_slab* const next = slab->next;
+        free(slab);
+        slab = next;
+    }
+    rebx_pool_init(pool, pool->size);
+}
+
+void* rebx_pool_value(struct rebx_extras* const rebx){
+    void* const value = rebx_pool_alloc(&rebx->value_pool);
+    if (value == NULL){
+        rebx_error(rebx, "REBOUNDx Error: Could not allocate memory.\n");
+    }
+    return value;
+}
+
+#define REBX_SCRATCH_ALIGN 64
+
+static struct rebx_scratch_block* rebx_scratch_block(const size_t base, const size_t size){
+    struct rebx_scratch_block* const block = malloc(sizeof(*block));
+    if (block == NULL){
+        return NULL;
+    }
+    block->mem = malloc(size + REBX_SCRATCH_ALIGN - 1);
+    if (block->mem == NULL){
+        free(block);
+        return NULL;
+    }
+    block->data = (char*)(((uintptr_t)block->mem + REBX_SCRATCH_ALIGN - 1) & ~(uintptr_t)(REBX_SCRATCH_ALIGN - 1));
+    block->next = NULL;
+    block->base = base;
+    block->size = size;
+    return block;
+}
+
+void* rebx_scratch_alloc(struct rebx_extras* const rebx, const size_t size){
+    const size_t need = (size + REBX_SCRATCH_ALIGN - 1)/REBX_SCRATCH_ALIGN*REBX_SCRATCH_ALIGN;
+    struct rebx_scratch_block* block = rebx->scratch;
+    if (block == NULL || rebx->scratch_used + need > block->base + block->size){
+        // Start a new block rather than growing this one, which would move memory already handed out
+        size_t grow = block ? 2*block->size : 64*1024;
+        if (grow < need){
+            grow = need;
+        }
+        struct rebx_scratch_block* const next = rebx_scratch_block(rebx->scratch_used, grow);
+        if (next == NULL){
+            rebx_error(rebx, "REBOUNDx Error: Could not allocate memory.\n");
+            return NULL;
+        }
+        next->next = block;
+        rebx->scratch = next;
+        block = next;
+    }
+    void* const ptr = block->data + (rebx->scratch_used - block->base);
+    rebx->scratch_used += need;
+    return ptr;
+}
+
+size_t rebx_scratch_mark(struct rebx_extras* const rebx){
+    return rebx->scratch_used;
+}
+
+void rebx_scratch_release(struct rebx_extras* const rebx, const size_t mark){
+    rebx->scratch_used = mark;
+    struct rebx_scratch_block* const block = rebx->scratch;
+    if (mark > 0 || block == NULL || block->next == NULL){
+        return;
+    }
+    // Everything is back, so merge the blocks into one that fits the peak use
+    const size_t size = block->base + block->size;
+    struct rebx_scratch_block* current = block;
+    while (current != NULL){
+        struct rebx_scratch_block* const next = current->next;
+        free(current->mem);
+        free(current);
+        current = next;
+    }
+    rebx->scratch = rebx_scratch_block(0, size); // NULL on failure just means starting over
+}
+
+static void rebx_free_scratch(struct rebx_extras* const rebx){
+    struct rebx_scratch_block* current = rebx->scratch;
+    while (current != NULL){
+        struct rebx_scratch_block* const next = current->next;
+        free(current->mem);
+        free(current);
+        current = next;
+    }
+    rebx->scratch = NULL;
+    rebx->scratch_used = 0;
+}
+
+// Names of params on particles, forces and operators point to the name of
+// the registered param, which owns it
+static int rebx_param_owns_name(const struct rebx_extras* const rebx, const struct rebx_param* const param){
+    if (param->id < 0 || param->id >= rebx->N_registered_params){
+        return 1;
+    }
+    const struct rebx_param* const reg = rebx->id_params[param->id];
+    return reg == param || reg->name != param->name;
+}
+
+static int rebx_param_pooled_value(const struct rebx_param* const param){
+    return param->type == REBX_TYPE_INT || param->type == REBX_TYPE_DOUBLE || param->type == REBX_TYPE_UINT32;
+}
+
+void rebx_free_param(struct rebx_extras* const rebx, struct rebx_param* param){
+    if(param->name && rebx_param_owns_name(rebx, param)){
         free(param->name);
     }
+    // Values stored in a column belong to the column
+    if(param->column){
+        rebx_column_release(param);
+    }
     // Don't free pointers to structs
-    if(param->type == REBX_TYPE_INT || param->type == REBX_TYPE_DOUBLE){
-        if(param->value){
-            free(param->value);
+    else if(rebx_param_pooled_value(param)){
+        rebx_pool_free(&rebx->value_pool, param->value);
+    }
+    rebx_pool_free(&rebx->param_pool, param);
+}
+
+// Moves the name and value of a param that was read in with malloc over to
+// the interned name and the value pool. Returns 0 if out of memory, with the
+// value freed.
+int rebx_param_adopt(struct rebx_extras* const rebx, struct rebx_param* const param){
+    if (param->id >= 0 && param->id < rebx->N_registered_params && rebx_param_owns_name(rebx, param)){
+        free(param->name);
+        param->name = rebx->id_params[param->id]->name;
+    }
+    if (param->value != NULL && rebx_param_pooled_value(param)){
+        void* const value = rebx_pool_alloc(&rebx->value_pool);
+        if (value != NULL){
+            const size_t size = (param->type == REBX_TYPE_DOUBLE) ? sizeof(double) : (param->type == REBX_TYPE_INT ? sizeof(int) : sizeof(uint32_t));
+            memcpy(value, param->value, size);
+        }
+        free(param->value);
+        param->value = value;
+        if (value == NULL){
+            return 0;
         }
     }
-    free(param);
+    return 1;
 }
 
-void rebx_free_ap(struct rebx_node** ap){
+void rebx_free_ap(struct rebx_extras* const rebx, struct rebx_node** ap){
     struct rebx_node* current = *ap;
     struct rebx_node* next;
     while (current != NULL){
         next = current->next;
-        rebx_free_param(current->object);
-        free(current);
+        rebx_free_param(rebx, current->object);
+        rebx_pool_free(&rebx->node_pool, current);
         current = next;
     }
+    *ap = NULL;
 }
 
 void rebx_free_particle_ap(struct reb_particle* p){
-    rebx_free_ap(&p->ap);
+    // Params live in the pools of the rebx the simulation is attached to
+    if (p->sim == NULL || p->sim->extras == NULL){
+        return;
+    }
+    struct rebx_extras* const rebx = p->sim->extras;
+    rebx_free_ap(rebx, (struct rebx_node**)&p->ap);
+    // REBOUND may now shift the remaining particles down
+    rebx->columns_dirty = 1;
+    rebx->param_generation++;   // so anything holding particle indices looks again
 }
 
 void rebx_free_force(struct rebx_extras* rebx, struct rebx_force* force){
@@ -773,15 +1256,19 @@ void rebx_free_force(struct rebx_extras* rebx, struct rebx_force* force){
     if(force->name){
         free(force->name);
     }
-    rebx_free_ap(&force->ap);
+    rebx_free_ap(rebx, &force->ap);
     free(force);
 }
 
-void rebx_free_operator(struct rebx_operator* operator){
+void rebx_free_operator(struct rebx_extras* rebx, struct rebx_operator* operator){
+    void (*free_arrays)(struct rebx_extras* rebx, struct rebx_operator* operator) = rebx_get_param(rebx, operator->ap, "free_arrays");
+    if (free_arrays){
+        free_arrays(rebx, operator);
+    }
     if(operator->name){
         free(operator->name);
     }
-    rebx_free_ap(&operator->ap);
+    rebx_free_ap(rebx, &operator->ap);
     free(operator);
 }
 
@@ -789,17 +1276,26 @@ void rebx_free_step(struct rebx_step* step){
     free(step);
 }
 
-void rebx_free_reg_param(struct rebx_param* param){
+void rebx_free_reg_param(struct rebx_extras* const rebx, struct rebx_param* param){
     if(param->name){
         free(param->name);
     }
-    free(param);
+    rebx_pool_free(&rebx->param_pool, param);
 }
 
 void rebx_free_pointers(struct rebx_extras* rebx){
     if (rebx == NULL){
         return;
     }
+    rebx_free_columns(rebx);
+    for (int k=0; k<rebx->N_geometry; k++){
+        free(rebx->geometry[k].dx);
+    }
+    free(rebx->geometry);
+    rebx_free_scratch(rebx);
+    rebx_free_archive(rebx->archive);
+    rebx->archive = NULL;
+    // Particle params are all in the pools, which go in one piece below
     rebx_detach(rebx->sim, rebx);
     struct rebx_node* current;
     struct rebx_node* next;
@@ -815,7 +1311,7 @@ void rebx_free_pointers(struct rebx_extras* rebx){
     current = rebx->allocated_operators;
     while (current != NULL){
         next = current->next;
-        rebx_free_operator(current->object);
+        rebx_free_operator(rebx, current->object);
         free(current);
         current = next;
     }
@@ -847,10 +1343,16 @@ void rebx_free_pointers(struct rebx_extras* rebx){
     current = rebx->registered_params;
     while (current != NULL){
         next = current->next;
-        rebx_free_reg_param(current->object);
-        free(current);
+        rebx_free_reg_param(rebx, current->object);
+        rebx_pool_free(&rebx->node_pool, current);
         current = next;
     }
+    
+    free(rebx->id_params);
+    free(rebx->param_ids);
+    rebx_pool_release(&rebx->node_pool);
+    rebx_pool_release(&rebx->param_pool);
+    rebx_pool_release(&rebx->value_pool);
 }
 
 /**********************************************
@@ -865,18 +1367,110 @@ void rebx_reset_accelerations(struct reb_particle* const ps, const int N){
     }
 }
 
+static double rebx_wall_time(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + 1e-9*ts.tv_nsec;
+}
+
+static void rebx_counters_add(struct rebx_counters* const counters, const double start, const int N){
+    counters->time += rebx_wall_time() - start;
+    counters->calls++;
+    counters->particles += N;
+}
+
 void rebx_additional_forces(struct reb_simulation* sim){
     struct rebx_extras* rebx = sim->extras;
     struct rebx_node* current = rebx->additional_forces;
+    // Only worth keeping separations around if more than one force can use them
+    rebx->geometry_epoch++;
+    if (current != NULL && current->next != NULL){
+        rebx->geometry_particles = sim->particles;
+        rebx->geometry_N = sim->N - sim->N_var;
+    }
+    // REBOUND has just filled in gravity. Only basic and compensated gravity give every pairwise term.
+    rebx->accelerations_newtonian = (sim->gravity == REB_GRAVITY_BASIC || sim->gravity == REB_GRAVITY_COMPENSATED) && sim->gravity_ignore_terms == 0;
     while(current != NULL){
         /*if(sim->force_is_velocity_dependent && sim->integrator==REB_INTEGRATOR_WHFAST){
          reb_warning(sim, "REBOUNDx: Passing a velocity-dependent force to WHFAST. Need to apply as an operator.");
          }*/
         struct rebx_force* force = current->object;
         const double N = sim->N - sim->N_var;
-        force->update_accelerations(sim, force, sim->particles, N);
+        if (rebx->counters_enabled){
+            const double start = rebx_wall_time();
+            force->update_accelerations(sim, force, sim->particles, N);
+            rebx_counters_add(&force->counters, start, N);
+        }
+        else{
+            force->update_accelerations(sim, force, sim->particles, N);
+        }
+        rebx->accelerations_newtonian = 0;
         current = current->next;
     }
+    rebx->geometry_particles = NULL;
+}
+
+const struct rebx_geometry* rebx_get_geometry(struct rebx_extras* const rebx, const struct reb_particle* const particles, const int N, const int source_index){
+    if (particles == NULL || particles != rebx->geometry_particles || N != rebx->geometry_N){
+        return NULL;
+    }
+    struct rebx_geometry* geo = NULL;
+    for (int k=0; k<rebx->N_geometry; k++){
+        if (rebx->geometry[k].source == source_index){
+            geo = &rebx->geometry[k];
+            break;
+        }
+    }
+    if (geo == NULL){
+        struct rebx_geometry* const geometry = realloc(rebx->geometry, (rebx->N_geometry + 1)*sizeof(*geometry));
+        if (geometry == NULL){
+            return NULL;
+        }
+        rebx->geometry = geometry;
+        geo = &geometry[rebx->N_geometry++];
+        geo->source = source_index;
+        geo->epoch = 0;
+        geo->N_alloc = 0;
+        geo->dx = NULL;
+    }
+    if (geo->epoch == rebx->geometry_epoch){
+        return geo;
+    }
+    if (N > geo->N_alloc){
+        double* const rows = realloc(geo->dx, 6*(size_t)N*sizeof(*rows));
+        if (rows == NULL){
+            return NULL;
+        }
+        geo->N_alloc = N;
+        geo->dx = rows;
+    }
+    geo->dy = geo->dx + geo->N_alloc;
+    geo->dz = geo->dy + geo->N_alloc;
+    geo->r2 = geo->dz + geo->N_alloc;
+    geo->r = geo->r2 + geo->N_alloc;
+    geo->r3inv = geo->r + geo->N_alloc;
+
+    const struct reb_particle source = particles[source_index];
+    for (int i=0; i<N; i++){
+        const double dx = particles[i].x - source.x;
+        const double dy = particles[i].y - source.y;
+        const double dz = particles[i].z - source.z;
+        const double r2 = dx*dx + dy*dy + dz*dz;
+        const double r = sqrt(r2);
+        geo->dx[i] = dx;
+        geo->dy[i] = dy;
+        geo->dz[i] = dz;
+        geo->r2[i] = r2;
+        geo->r[i] = r;
+        geo->r3inv[i] = r2 > 0. ? 1./(r2*r) : 0.;
+    }
+    geo->epoch = rebx->geometry_epoch;
+    return geo;
+}
+
+// Steppers that can leave their state in sim->ri_whfast.p_jh for the next one
+static int rebx_is_whfast_stepper(const struct rebx_operator* const operator){
+    return operator->step_function == rebx_kepler_step || operator->step_function == rebx_jump_step || operator->step_function == rebx_interaction_step;
 }
 
 void rebx_pre_timestep_modifications(struct reb_simulation* sim){
@@ -884,15 +1478,28 @@ void rebx_pre_timestep_modifications(struct reb_simulation* sim){
     struct rebx_node* current = rebx->pre_timestep_modifications;
     const double dt = sim->dt;
     
+    rebx->in_step_list = 1;
     while(current != NULL){
         struct rebx_step* step = current->object;
         struct rebx_operator* operator = step->operator;
         if(sim->integrator==REB_INTEGRATOR_IAS15 && sim->ri_ias15.epsilon != 0 && operator->operator_type == REBX_OPERATOR_UPDATER){
             reb_warning(sim, "REBOUNDx: Operators that affect particle trajectories with adaptive timesteps can give spurious results. Use sim.ri_ias15.epsilon=0 for fixed timestep with IAS, or use a different integrator.");
         }
-        operator->step_function(sim, operator, dt*step->dt_fraction);
+        if (!rebx_is_whfast_stepper(operator)){
+            rebx_whfast_sync(sim);
+        }
+        if (rebx->counters_enabled){
+            const double start = rebx_wall_time();
+            operator->step_function(sim, operator, dt*step->dt_fraction);
+            rebx_counters_add(&operator->counters, start, sim->N - sim->N_var);
+        }
+        else{
+            operator->step_function(sim, operator, dt*step->dt_fraction);
+        }
         current = current->next;
     }
+    rebx_whfast_sync(sim);
+    rebx->in_step_list = 0;
 }
 
 void rebx_post_timestep_modifications(struct reb_simulation* sim){
@@ -900,15 +1507,28 @@ void rebx_post_timestep_modifications(struct reb_simulation* sim){
     struct rebx_node* current = rebx->post_timestep_modifications;
     const double dt = sim->dt;
     
+    rebx->in_step_list = 1;
     while(current != NULL){
         struct rebx_step* step = current->object;
         struct rebx_operator* operator = step->operator;
         if(sim->integrator==REB_INTEGRATOR_IAS15 && sim->ri_ias15.epsilon != 0 && operator->operator_type == REBX_OPERATOR_UPDATER){
             reb_warning(sim, "REBOUNDx: Operators that affect particle trajectories with adaptive timesteps can give spurious results. Use sim.ri_ias15.epsilon=0 for fixed timestep with IAS, or use a different integrator.");
         }
-        operator->step_function(sim, operator, dt*step->dt_fraction);
+        if (!rebx_is_whfast_stepper(operator)){
+            rebx_whfast_sync(sim);
+        }
+        if (rebx->counters_enabled){
+            const double start = rebx_wall_time();
+            operator->step_function(sim, operator, dt*step->dt_fraction);
+            rebx_counters_add(&operator->counters, start, sim->N - sim->N_var);
+        }
+        else{
+            operator->step_function(sim, operator, dt*step->dt_fraction);
+        }
         current = current->next;
     }
+    rebx_whfast_sync(sim);
+    rebx->in_step_list = 0;
 }
 
 /****************************************************************
@@ -927,14 +1547,22 @@ struct rebx_node* rebx_create_node(struct rebx_extras* rebx){
 
 struct rebx_param* rebx_create_param(struct rebx_extras* rebx, const char* name, enum rebx_param_type type){
     // Allocate and initialize new param struct
-    struct rebx_param* param = rebx_malloc(rebx, sizeof(*param));
+    struct rebx_param* param = rebx_pool_alloc(&rebx->param_pool);
     if (param == NULL){
+        rebx_error(rebx, "REBOUNDx Error: Could not allocate memory.\n");
         return NULL;
     }
     param->type = type;
     param->value = NULL;
+    param->column = NULL;
+    param->id = rebx_get_param_id(rebx, name);
+    if (param->id >= 0){ // share the registered name
+        param->name = rebx->id_params[param->id]->name;
+        return param;
+    }
     param->name = rebx_malloc(rebx, strlen(name) + 1); // +1 for \0 at end
     if (param->name == NULL){
+        rebx_pool_free(&rebx->param_pool, param);
         return NULL;
     }
     else{
@@ -945,24 +1573,27 @@ struct rebx_param* rebx_create_param(struct rebx_extras* rebx, const char* name,
 }
 
 int rebx_add_param(struct rebx_extras* const rebx, struct rebx_node** apptr, struct rebx_param* param){
-    struct rebx_node* node = rebx_create_node(rebx);
+    struct rebx_node* node = rebx_pool_alloc(&rebx->node_pool);
     if (node == NULL){
+        rebx_error(rebx, "REBOUNDx Error: Could not allocate memory.\n");
         return 0;
     }
     node->object = param;
+    node->next = NULL;
     rebx_add_node(apptr, node);
+    rebx->param_generation++;
     return 1;
 }
 
 // needed from Python
 enum rebx_param_type rebx_get_type(struct rebx_extras* rebx, const char* name){
-    struct rebx_param* param = rebx_get_param_struct(rebx, rebx->registered_params, name);
+    const int id = rebx_get_param_id(rebx, name);
     
-    if (param == NULL){ // param not found
+    if (id < 0){ // param not found
         return REBX_TYPE_NONE;
     }
     
-    return param->type;
+    return rebx->id_params[id]->type;
 }
 
 size_t rebx_sizeof(struct rebx_extras* rebx, enum rebx_param_type type){
@@ -59,6 +59,7 @@ void rebx_post_timestep_modifications(struct reb_simulation* sim);  // Calls all
 //struct rebx_param* rebx_add_node(struct reb_simulation* const sim, struct rebx_param** head, const char* const param_name, enum rebx_param_type param_type, const int ndim, const int* const shape);
 size_t rebx_sizeof(struct rebx_extras* rebx, enum rebx_param_type type); // Returns size in bytes of the corresponding rebx_param_type type
 void rebx_reset_accelerations(struct reb_particle* const ps, const int N);
+double rebx_harmonics_field_potential(struct rebx_extras* const rebx, struct reb_simulation* const sim, const struct rebx_harmonics* const field, const int source_index); // Potential energy of all particles in the harmonics field of particles[source_index]
 
 /****************************************
 Force prototypes
@@ -88,18 +89,32 @@ void rebx_track_min_distance(struct reb_simulation* const sim, struct rebx_opera
 void rebx_integrator_euler_integrate(struct reb_simulation* const sim, const double dt, struct rebx_force* const force);
 void rebx_integrator_rk2_integrate(struct reb_simulation* const sim, const double dt, struct rebx_force* const force);
 void rebx_integrator_rk4_integrate(struct reb_simulation* const sim, const double dt, struct rebx_force* const force);
-void rebx_integrator_implicit_midpoint_integrate(struct reb_simulation* const sim, const double dt, struct rebx_force* const force);
+void rebx_integrator_dp45_integrate(struct reb_simulation* const sim, struct rebx_operator* const operator, const double dt, struct rebx_force* const force);
+void rebx_integrator_implicit_midpoint_integrate(struct reb_simulation* const sim, struct rebx_operator* const operator, const double dt, struct rebx_force* const force);
+
+void rebx_whfast_sync(struct reb_simulation* const sim); // Brings sim->particles up to date if WHFast stepper operators deferred it
 
 void* rebx_malloc(struct rebx_extras* const rebx, size_t memsize);
-void rebx_free_ap(struct rebx_node** ap);
+void rebx_pool_init(struct rebx_pool* const pool, const size_t size);
+void* rebx_pool_alloc(struct rebx_pool* const pool);    // NULL if out of memory, without an error
+void rebx_pool_free(struct rebx_pool* const pool, void* const object);
+void* rebx_pool_value(struct rebx_extras* const rebx);  // Slot for a double, int or uint32 value
+void rebx_free_ap(struct rebx_extras* const rebx, struct rebx_node** ap);
 void rebx_free_particle_ap(struct reb_particle* p);
 void rebx_free_force(struct rebx_extras* rebx, struct rebx_force* force);
-void rebx_free_operator(struct rebx_operator* operator);
+void rebx_free_operator(struct rebx_extras* rebx, struct rebx_operator* operator);
 void rebx_free_step(struct rebx_step* step);
 void rebx_free_pointers(struct rebx_extras* rebx);
-void rebx_free_param(struct rebx_param* param);
+void rebx_free_param(struct rebx_extras* const rebx, struct rebx_param* param);
+int rebx_param_adopt(struct rebx_extras* const rebx, struct rebx_param* const param); // Moves a param read in with malloc over to the interned name and value pool
+void rebx_free_archive(struct rebx_archive* archive);
 
 enum rebx_param_type rebx_get_type(struct rebx_extras* rebx, const char* name);
+int rebx_intern_param(struct rebx_extras* const rebx, struct rebx_param* const param);
+
+void* rebx_column_attach(struct rebx_extras* const rebx, struct rebx_node** const apptr, struct rebx_param* const param); // Row for a new particle param if its id is stored in a column, else NULL
+void rebx_column_release(struct rebx_param* const param);
+void rebx_free_columns(struct rebx_extras* const rebx);
 
 struct rebx_param* rebx_create_param(struct rebx_extras* rebx, const char* name, enum rebx_param_type type);
 int rebx_add_param(struct rebx_extras* const rebx, struct rebx_node** apptr, struct rebx_param* param);
@@ -0,0 +1,273 @@
+/**
+ * @file    energy.c
+ * @brief   Combined energy diagnostic for all attached conservative effects
+ * @author  Dan Tamayo <tamayo.daniel@gmail.com>
+ *
+ * @section     LICENSE
+ * Copyright (c) 2015 Dan Tamayo, Hanno Rein
+ *
+ * This file is part of reboundx.
+ *
+ * reboundx is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * reboundx is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with rebound.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/* rebx_total_energy adds up the classical energy and the potentials of
+ * gr_potential, gravitational_harmonics, central_force and tides_precession
+ * in a single loop over the particles (general harmonics fields are added
+ * afterwards, through the harmonics engine).  The particle params are looked up
+ * once per particle up front, rather than once per source in each of the
+ * separate rebx_*_potential functions.  Each term matches the corresponding
+ * rebx_*_potential function.
+ *
+ * gr and gr_full have Hamiltonians that replace the classical energy rather
+ * than add to it, so when one of them is attached its Hamiltonian is used
+ * as the base and the fused loop only adds the other potentials.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <float.h>
+#include "rebound.h"
+#include "reboundx.h"
+#include "core.h"
+
+// Below this many particles the loop stays serial
+#define REBX_ENERGY_MIN_PARALLEL 64
+
+// A particle that is the source of a harmonics or central force potential
+struct rebx_energy_source{
+    int index;
+    double J2R2;        // J2*R_eq^2, 0 if no J2
+    double J4R4;        // J4*R_eq^4, 0 if no J4
+    double Acentral;    // 0 if no central force
+    double gammacentral;
+    const struct rebx_harmonics* field; // NULL if no harmonics field
+};
+
+static int rebx_energy_force_attached(struct rebx_extras* const rebx, const char* const name, struct rebx_force** force){
+    for (struct rebx_node* current = rebx->additional_forces; current != NULL; current = current->next){
+        struct rebx_force* const f = current->object;
+        if (strcmp(f->name, name) == 0){
+            if (force){
+                *force = f;
+            }
+            return 1;
+        }
+    }
+    return 0;
+}
+
+double rebx_total_energy(struct rebx_extras* const rebx){
+    if (rebx->sim == NULL){
+        rebx_error(rebx, ""); // rebx_error gives meaningful err
+        return 0;
+    }
+    struct reb_simulation* const sim = rebx->sim;
+    struct reb_particle* const particles = sim->particles;
+    const int N_real = sim->N - sim->N_var;
+    const double G = sim->G;
+
+    struct rebx_force* gr = NULL;
+    struct rebx_force* gr_full = NULL;
+    struct rebx_force* gr_potential = NULL;
+    rebx_energy_force_attached(rebx, "gr", &gr);
+    rebx_energy_force_attached(rebx, "gr_full", &gr_full);
+    rebx_energy_force_attached(rebx, "gr_potential", &gr_potential);
+    const int harmonics = rebx_energy_force_attached(rebx, "gravitational_harmonics", NULL);
+    const int central = rebx_energy_force_attached(rebx, "central_force", NULL);
+    const int tides = rebx_energy_force_attached(rebx, "tides_precession", NULL);
+
+    double E_base = 0.;
+    const int classical = (gr == NULL && gr_full == NULL);
+    if (gr_full){
+        if (gr){
+            reb_warning(sim, "REBOUNDx Warning: Both gr and gr_full are attached. rebx_total_energy uses the gr_full Hamiltonian.\n");
+        }
+        E_base = rebx_gr_full_hamiltonian(rebx, gr_full);
+    }
+    else if (gr){
+        E_base = rebx_gr_hamiltonian(rebx, gr);
+    }
+    else{
+        E_base = sim->energy_offset;
+    }
+    if (N_real == 0){
+        return E_base;
+    }
+
+    double gr_prefac = 0.;
+    if (gr_potential){
+        const double* const c = rebx_get_param(rebx, gr_potential->ap, "c");
+        if (c == NULL){
+            rebx_error(rebx, "Need to set speed of light in gr effect.  See examples in documentation.\n");
+            return 0;
+        }
+        const double mu = G*particles[0].m;
+        gr_prefac = 3.*mu*mu/((*c)*(*c));
+    }
+
+    // Gather all the params in one pass over the particles
+    struct rebx_energy_source* sources = NULL;
+    double* k1R5 = NULL;
+    int N_sources = 0;
+    int tides_source = 0;
+    if (harmonics || central){
+        sources = malloc(N_real*sizeof(*sources));
+    }
+    if (tides){
+        k1R5 = malloc(N_real*sizeof(*k1R5));
+    }
+    if ((sources == NULL && (harmonics || central)) || (k1R5 == NULL && tides)){
+        free(sources);
+        free(k1R5);
+        rebx_error(rebx, "REBOUNDx Error: Could not allocate memory in rebx_total_energy.\n");
+        return 0;
+    }
+    for (int i=0; i<N_real; i++){
+        struct rebx_node* const ap = particles[i].ap;
+        if (harmonics || central){
+            struct rebx_energy_source s = {.index = i};
+            int is_source = 0;
+            if (harmonics){
+                s.field = rebx_get_param(rebx, ap, "harmonics");
+                if (s.field != NULL){
+                    is_source = 1;
+                }
+                const double* const R_eq = rebx_get_param(rebx, ap, "R_eq");
+                if (R_eq != NULL){
+                    const double R2 = (*R_eq)*(*R_eq);
+                    const double* const J2 = rebx_get_param(rebx, ap, "J2");
+                    const double* const J4 = rebx_get_param(rebx, ap, "J4");
+                    if (J2 != NULL){
+                        s.J2R2 = (*J2)*R2;
+                        is_source = 1;
+                    }
+                    if (J4 != NULL){
+                        s.J4R4 = (*J4)*R2*R2;
+                        is_source = 1;
+                    }
+                }
+            }
+            if (central){
+                const double* const Acentral = rebx_get_param(rebx, ap, "Acentral");
+                const double* const gammacentral = rebx_get_param(rebx, ap, "gammacentral");
+                if (Acentral != NULL && gammacentral != NULL){
+                    s.Acentral = *Acentral;
+                    s.gammacentral = *gammacentral;
+                    is_source = 1;
+                }
+            }
+            if (is_source){
+                sources[N_sources++] = s;
+            }
+        }
+        if (tides){
+            const double* const R = rebx_get_param(rebx, ap, "R_tides");
+            const double* const k1 = rebx_get_param(rebx, ap, "k1");
+            const double Rp = R ? *R : 0.;
+            k1R5[i] = (k1 ? *k1 : 0.)*Rp*Rp*Rp*Rp*Rp;
+            if (rebx_get_param(rebx, ap, "tides_primary") != NULL){
+                tides_source = i;
+            }
+        }
+    }
+
+    // Classical energy over the same particles and pairs as reb_tools_energy
+    const int N_active = (sim->N_active == -1) ? N_real : sim->N_active;
+    const int N_interact = (sim->testparticle_type == 0) ? N_active : N_real;
+    const struct reb_particle source0 = particles[0];
+    const struct reb_particle tides_p0 = particles[tides_source];
+    const double m0_tides = tides_p0.m;
+    const double fac0_tides = tides ? k1R5[tides_source] : 0.;
+
+    double e_kin = 0.;
+    double e_pot = 0.;
+    double e_rebx = 0.;
+#pragma omp parallel for schedule(dynamic, 16) reduction(+:e_kin,e_pot,e_rebx) if(N_real >= REBX_ENERGY_MIN_PARALLEL)
+    for (int i=0; i<N_real; i++){
+        const struct reb_particle pi = particles[i];
+        if (classical){
+            if (i < N_interact){
+                e_kin += 0.5*pi.m*(pi.vx*pi.vx + pi.vy*pi.vy + pi.vz*pi.vz);
+            }
+            if (i < N_active){
+                for (int j=i+1; j<N_interact; j++){
+                    const struct reb_particle pj = particles[j];
+                    const double dx = pi.x - pj.x;
+                    const double dy = pi.y - pj.y;
+                    const double dz = pi.z - pj.z;
+                    e_pot -= G*pi.m*pj.m/sqrt(dx*dx + dy*dy + dz*dz);
+                }
+            }
+        }
+        if (gr_potential && i > 0){
+            const double dx = pi.x - source0.x;
+            const double dy = pi.y - source0.y;
+            const double dz = pi.z - source0.z;
+            e_rebx -= gr_prefac*pi.m/(dx*dx + dy*dy + dz*dz);
+        }
+        for (int k=0; k<N_sources; k++){
+            const struct rebx_energy_source s = sources[k];
+            if (s.index == i){
+                continue;
+            }
+            const struct reb_particle ps = particles[s.index];
+            const double dx = pi.x - ps.x;
+            const double dy = pi.y - ps.y;
+            const double dz = pi.z - ps.z;
+            const double r2 = dx*dx + dy*dy + dz*dz;
+            if (s.J2R2 != 0. || s.J4R4 != 0.){
+                const double r = sqrt(r2);
+                const double costheta2 = dz*dz/r2;
+                const double prefac = G*pi.m*ps.m/r2/r;
+                const double P2 = 0.5*(3.*costheta2-1.);
+                const double P4 = (35.*costheta2*costheta2 - 30.*costheta2+3.)/8.;
+                e_rebx += prefac*(s.J2R2*P2 + s.J4R4/r2*P4);
+            }
+            if (s.Acentral != 0.){
+                if (fabs(s.gammacentral+1.) < DBL_EPSILON){ // F propto 1/r
+                    e_rebx -= pi.m*s.Acentral*log(sqrt(r2));
+                }
+                else{
+                    e_rebx -= pi.m*s.Acentral*pow(r2, (s.gammacentral+1.)/2.)/(s.gammacentral+1.);
+                }
+            }
+        }
+        if (tides && i != tides_source){
+            const double mratio = pi.m/m0_tides;
+            if (mratio >= DBL_MIN){ // m1 = 0 would overflow
+                const double fac = fac0_tides*mratio + k1R5[i]/mratio;
+                const double dx = pi.x - tides_p0.x;
+                const double dy = pi.y - tides_p0.y;
+                const double dz = pi.z - tides_p0.z;
+                const double dr2 = dx*dx + dy*dy + dz*dz;
+                e_rebx += -3./6.*G*(m0_tides + pi.m)*pi.m/(dr2*dr2*dr2)*fac;
+            }
+        }
+    }
+
+    // Fields of arbitrary degree go through the harmonics engine, which batches the particles itself
+    for (int k=0; k<N_sources; k++){
+        if (sources[k].field != NULL){
+            e_rebx += rebx_harmonics_field_potential(rebx, sim, sources[k].field, sources[k].index);
+        }
+    }
+
+    free(sources);
+    free(k1R5);
+    return E_base + e_kin + e_pot + e_rebx;
+}
@@ -38,7 +38,7 @@
  *    span of the integration, and the time step come from a file.  We probably want to 
  *    allow the user to specific barycentric or geocentric. DONE.
  * 
- * 2. Rearrange the ephem() function so that it returns all the positions in one shot.
+ * 2. Rearrange the ephem() function so that it returns all the positions in one shot.  DONE.
  * 
  * 3. Check position of the moon.  DONE.
  * 
@@ -56,12 +56,27 @@
  * 
  * 9. Develop sensible code that transitions to and from geocentric system.
  *
+ * 10. First order variational equations, so that the state transition matrix
+ *     comes out of a single integration.  DONE.
+ *
  */
 
+#define _DEFAULT_SOURCE     // MADV_WILLNEED and ftruncate under -std=c99
 #include <stdlib.h>
 #include <stdio.h>
 #include <math.h>
 #include <float.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 #include "rebound.h"
 #include "reboundx.h"
 
@@ -83,6 +98,146 @@ int ebody[11] = {
 };
 
 
+// The values below are G*mass, so we need to divide by G.
+// Units are solar masses, au, days.
+static const double JPL_GM[11] =
+    {
+	0.295912208285591100E-03, // 0  sun  
+	0.491248045036476000E-10, // 1  mercury
+	0.724345233264412000E-09, // 2  venus
+	0.888769244512563400E-09, // 3  earth
+	0.109318945074237400E-10, // 4  moon
+	0.954954869555077000E-10, // 5  mars
+	0.282534584083387000E-06, // 6  jupiter
+	0.845970607324503000E-07, // 7  saturn
+	0.129202482578296000E-07, // 8  uranus
+	0.152435734788511000E-07, // 9  neptune
+	0.217844105197418000E-11, // 10 pluto
+    };
+
+// An open planetary ephemeris plus (optionally) the massive asteroid
+// file.  Both are memory mapped and only ever read, so a single handle
+// can be shared between simulations running on different threads.
+struct rebx_ephemeris {
+    struct _jpl_s *pl;          // DE430 planets
+    struct spk_s *spl;          // massive asteroids, NULL if not loaded
+};
+
+// Open an asteroid file.  If REBX_EPHEM_INDEX is set in the environment its
+// segment index is kept in a sidecar <path>.idx, which saves walking the
+// summary records on every start.
+static struct spk_s* ephem_spk_init(const char* const path){
+    if (getenv("REBX_EPHEM_INDEX") == NULL){
+        return spk_init(path);
+    }
+    char* const idx = malloc(strlen(path) + 5);
+    sprintf(idx, "%s.idx", path);
+    struct spk_s* const spl = spk_init_index(path, idx);
+    free(idx);
+    return spl;
+}
+
+struct rebx_ephemeris* rebx_ephemeris_open(const char* const planets_path, const char* const asteroids_path){
+    struct rebx_ephemeris* eph = calloc(1, sizeof(*eph));
+    if ((eph->pl = jpl_init_path(planets_path)) == NULL){
+        free(eph);
+        return NULL;
+    }
+    if (asteroids_path != NULL && (eph->spl = ephem_spk_init(asteroids_path)) == NULL){
+        jpl_free(eph->pl);
+        free(eph);
+        return NULL;
+    }
+    return eph;
+}
+
+int rebx_ephemeris_lock(struct rebx_ephemeris* const eph, const double jd0, const double jd1){
+    if (eph == NULL){
+        return 0;
+    }
+    int ret = jpl_lock(eph->pl, jd0, jd1, 1);
+    if (eph->spl != NULL){
+        ret |= spk_lock(eph->spl, jd0, jd1, 1);
+    }
+    return ret == 0;
+}
+
+int rebx_ephemeris_unlock(struct rebx_ephemeris* const eph, const double jd0, const double jd1){
+    if (eph == NULL){
+        return 0;
+    }
+    int ret = jpl_lock(eph->pl, jd0, jd1, 0);
+    if (eph->spl != NULL){
+        ret |= spk_lock(eph->spl, jd0, jd1, 0);
+    }
+    return ret == 0;
+}
+
+// Ask the kernel to start reading the records for the next n_ahead DE430
+// blocks in the direction of integration, so that a sequential run does
+// not stall on a page fault each time it enters a new block.
+static void ephem_prefetch(const struct rebx_ephemeris* const eph, const double jde, const double dir, const int n_ahead){
+    const double jd1 = jde + dir*n_ahead*eph->pl->inc;
+    jpl_advise(eph->pl, jde, jd1, MADV_WILLNEED);
+    if (eph->spl != NULL){
+        spk_advise(eph->spl, jde, jd1, MADV_WILLNEED);
+    }
+}
+
+int rebx_ephemeris_extract(const char* const planets_in, const char* const asteroids_in,
+                           const char* const planets_out, const char* const asteroids_out,
+                           const double jd0, const double jd1, const int n_ast){
+    if (jpl_extract(planets_in, planets_out, jd0, jd1) < 0){
+        return 0;
+    }
+    if (asteroids_in != NULL && asteroids_out != NULL){
+        if (spk_extract(asteroids_in, asteroids_out, n_ast, jd0, jd1) < 0){
+            return 0;
+        }
+    }
+    return 1;
+}
+
+void rebx_ephemeris_close(struct rebx_ephemeris* const eph){
+    if (eph == NULL){
+        return;
+    }
+    jpl_free(eph->pl);
+    spk_free(eph->spl);
+    free(eph);
+}
+
+// Process-wide handle on the default files in the working directory, used
+// by ephem() and by forces without an 'ephemeris' param.  The environment
+// variables REBX_EPHEM_PLANETS and REBX_EPHEM_ASTEROIDS override the paths,
+// e.g. to use extracts made with rebx_ephemeris_extract.  This is opened
+// lazily and is not thread-safe at initialisation; threaded callers should
+// open their own handle with rebx_ephemeris_open first.
+static struct rebx_ephemeris* ephem_default(void){
+
+    static struct rebx_ephemeris eph = {NULL, NULL};
+
+    if (eph.pl == NULL){
+      const char* const planets = getenv("REBX_EPHEM_PLANETS");
+      const char* const asteroids = getenv("REBX_EPHEM_ASTEROIDS");
+      if ((eph.pl = (planets != NULL) ? jpl_init_path(planets) : jpl_init()) == NULL) {
+	fprintf(stderr, "could not load DE430 file, fool!\n");
+	exit(EXIT_FAILURE);
+      }
+      // The asteroids are only required once N_ast > 0.
+      eph.spl = ephem_spk_init((asteroids != NULL) ? asteroids : "sb431-n16s.bsp");
+    }
+
+    return &eph;
+}
+
+// Convert from km, km/s and km/s^2 to au/day and au/day^2
+static void ephem_units(const struct _jpl_s* const pl, struct mpos_s* const now){
+    vecpos_div(now->u, pl->cau);
+    vecpos_div(now->v, pl->cau/86400.);
+    vecpos_div(now->w, pl->cau/(86400.*86400.));
+}
+
 // Added gravitational constant G (2020 Feb 26)
 // Added vx, vy, vz for GR stuff (2020 Feb 27)
 // Consolidated the routine, removing the if block.
@@ -92,60 +247,20 @@ void ephem(const double G, const int i, const double jde, double* const m,
 	   double* const vx, double* const vy, double* const vz,
 	   double* const ax, double* const ay, double* const az){
 
-    static int initialized = 0;
-
-    static struct _jpl_s *pl;
+    struct _jpl_s *pl = ephem_default()->pl;
     struct mpos_s now;
 
-    static double M[11];
-
     if(i<0 || i>10){
       fprintf(stderr, "body out of range\n");
       exit(EXIT_FAILURE);
     }
 
-    if (initialized == 0){
-      
-      if ((pl = jpl_init()) == NULL) {
-	fprintf(stderr, "could not load DE430 file, fool!\n");
-	exit(EXIT_FAILURE);
-      }
-
-      // The values below are G*mass, so we need to divide by G.
-      // Units are solar masses, au, days.
-      const static double JPL_GM[11] =
-	{
-	  0.295912208285591100E-03, // 0  sun  
-	  0.491248045036476000E-10, // 1  mercury
-	  0.724345233264412000E-09, // 2  venus
-	  0.888769244512563400E-09, // 3  earth
-	  0.109318945074237400E-10, // 4  moon
-	  0.954954869555077000E-10, // 5  mars
-	  0.282534584083387000E-06, // 6  jupiter
-	  0.845970607324503000E-07, // 7  saturn
-	  0.129202482578296000E-07, // 8  uranus
-	  0.152435734788511000E-07, // 9  neptune
-	  0.217844105197418000E-11, // 10 pluto
-	};
-
-      for(int k=0; k<11; k++){
-	M[k] = JPL_GM[k]/G;
-      }
-      
-      initialized = 1;
-
-    }
-
     // Get position, velocity, and mass of body i in barycentric coords. 
     
-    *m = M[i];
+    *m = JPL_GM[i]/G;
 
     jpl_calc(pl, &now, jde, ebody[i], PLAN_BAR); 
-
-    // Convert to au/day and au/day^2
-    vecpos_div(now.u, pl->cau);
-    vecpos_div(now.v, pl->cau/86400.);
-    vecpos_div(now.w, pl->cau/(86400.*86400.));
+    ephem_units(pl, &now);
 
     *x = now.u[0];
     *y = now.u[1];
@@ -159,93 +274,780 @@ void ephem(const double G, const int i, const double jde, double* const m,
     
 }
 
-static void ast_ephem(const double G, const int i, const double jde, double* const m, double* const x, double* const y, double* const z){
+// Get the masses and barycentric states of all 11 bodies at once,
+// in ebody order.  This reads the DE430 record a single time.
+static void ephem_all(const struct rebx_ephemeris* const eph, const double G, const double jde, double* const m, struct mpos_s* const now){
+
+    struct _jpl_s *pl = eph->pl;
+
+    if (jpl_calc_all(pl, now, jde) < 0){
+      fprintf(stderr, "epoch %f not covered by DE430 file\n", jde);
+      exit(EXIT_FAILURE);
+    }
 
-    static int initialized = 0;
+    for(int k=0; k<11; k++){
+	m[k] = JPL_GM[k]/G;
+	ephem_units(pl, &now[k]);
+    }
+}
 
-    static struct spk_s *spl;
-    struct mpos_s pos;
+// 1 Ceres, 4 Vesta, 2 Pallas, 10 Hygiea, 31 Euphrosyne, 704 Interamnia,
+// 511 Davida, 15 Eunomia, 3 Juno, 16 Psyche, 65 Cybele, 88 Thisbe, 
+// 48 Doris, 52 Europa, 451 Patientia, 87 Sylvia
+
+// The values below are G*mass, so we need to divide by G.
+// Units are solar masses, au, days.      
+static const double AST_GM[16] =
+    {
+	1.400476556172344e-13, // ceres
+	3.854750187808810e-14, // vesta
+	3.104448198938713e-14, // pallas
+	1.235800787294125e-14, // hygiea
+	6.343280473648602e-15, // euphrosyne
+	5.256168678493662e-15, // interamnia
+	5.198126979457498e-15, // davida
+	4.678307418350905e-15, // eunomia
+	3.617538317147937e-15, // juno
+	3.411586826193812e-15, // psyche
+	3.180659282652541e-15, // cybele
+	2.577114127311047e-15, // thisbe
+	2.531091726015068e-15, // doris
+	2.476788101255867e-15, // europa
+	2.295559390637462e-15, // patientia
+	2.199295173574073e-15, // sylvia
+    };
 
-    static double M[16];    
+// Get the masses and heliocentric states of the first n asteroids at once.
+// The current SPK records are tracked in cur, which belongs to the caller.
+static void ast_ephem_all(const struct rebx_ephemeris* const eph, struct spk_cur_s* const cur, const double G, const double jde, const int n, double* const m, struct mpos_s* const pos){
 
-    if(i<0 || i>15){
+    if(n<0 || n>16){
       fprintf(stderr, "asteroid out of range\n");
       exit(EXIT_FAILURE);
     }
 
-    if (initialized == 0){
-      
-      if ((spl = spk_init("sb431-n16s.bsp")) == NULL) {
-	fprintf(stderr, "could not load sb431-n16 file, fool!\n");
-	exit(EXIT_FAILURE);
-      }
+    if (n == 0){
+      return;
+    }
 
-      // 1 Ceres, 4 Vesta, 2 Pallas, 10 Hygiea, 31 Euphrosyne, 704 Interamnia,
-      // 511 Davida, 15 Eunomia, 3 Juno, 16 Psyche, 65 Cybele, 88 Thisbe, 
-      // 48 Doris, 52 Europa, 451 Patientia, 87 Sylvia
-
-      // The values below are G*mass, so we need to divide by G.
-      // Units are solar masses, au, days.      
-      const static double JPL_GM[16] =
-	{
-	  1.400476556172344e-13, // ceres
-	  3.854750187808810e-14, // vesta
-	  3.104448198938713e-14, // pallas
-	  1.235800787294125e-14, // hygiea
-	  6.343280473648602e-15, // euphrosyne
-	  5.256168678493662e-15, // interamnia
-	  5.198126979457498e-15, // davida
-	  4.678307418350905e-15, // eunomia
-	  3.617538317147937e-15, // juno
-	  3.411586826193812e-15, // psyche
-	  3.180659282652541e-15, // cybele
-	  2.577114127311047e-15, // thisbe
-	  2.531091726015068e-15, // doris
-	  2.476788101255867e-15, // europa
-	  2.295559390637462e-15, // patientia
-	  2.199295173574073e-15, // sylvia
-	};
-      
-      for(int k=0; k<16; k++){
-	M[k] = JPL_GM[i]/ G;
-      }
-      
-      initialized = 1;
+    if (eph->spl == NULL){
+      fprintf(stderr, "could not load sb431-n16 file, fool!\n");
+      exit(EXIT_FAILURE);
+    }
 
+    if (spk_calc_all(eph->spl, cur, n, jde, pos) < 0){
+      fprintf(stderr, "epoch %f not covered by sb431-n16 file\n", jde);
+      exit(EXIT_FAILURE);
     }
 
-    *m = M[i];
-    spk_calc(spl, i, jde, &pos);          
-    *x = pos.u[0];
-    *y = pos.u[1];
-    *z = pos.u[2];
-    
+    for(int k=0; k<n; k++){
+	m[k] = AST_GM[k]/G;
+    }
 }
 
-void rebx_ephemeris_forces(struct reb_simulation* const sim, struct rebx_force* const force, struct reb_particle* const particles, const int N){
+// Perturber states at the most recent epoch.  IAS15 evaluates the forces
+// several times at the same substep time while the predictor-corrector
+// converges, and the ephemeris is a pure function of time, so we only
+// need to look the perturbers up when sim->t changes.
+struct rebx_ephem_cache {
+    int valid;                  // 0 until the first fill
+    const struct rebx_ephemeris* eph; // handle the states came from
+    struct spk_cur_s cur;       // current asteroid records in eph
+    double t;                   // epoch of the cached states
+    double G;                   // G used for the masses
+    int N_ast;                  // number of asteroids filled
+    double M[11];               // planet masses
+    struct mpos_s pstate[11];   // planet barycentric states
+    double Mast[16];            // asteroid masses
+    double xa[16], ya[16], za[16]; // asteroid barycentric positions
+    int prefetched;             // 1 once a prefetch window was issued
+    long prefetch_blk;          // DE430 block it was issued from
+    struct rebx_harmonics* earth_field; // Earth J2 and J4
+    struct rebx_harmonics* sun_field;   // Solar J2
+    double* dev_state;          // particle positions and velocities mirrored on the offload device
+    double* dev_acc;            // particle accelerations mirrored on the offload device
+    int dev_N;                  // number of particles the device buffers hold
+    int offload_warned;         // 1 once the missing offload support was reported
+    long n_epochs;              // number of epochs filled so far
+    uint32_t* cull_mask;        // per particle, bit i set if perturber i is evaluated
+    int cull_N;                 // number of particles cull_mask holds
+    int cull_Np;                // number of perturbers the masks were built for
+    double cull_tol;            // tolerance the masks were built for
+    long cull_epoch;            // n_epochs at the last refresh
+};
+
+// Perturber states shared by several simulations stepping through the
+// same span with the same ephemeris, such as the groups of integration_function_groups.  Each
+// substep time is looked up once, by whichever simulation gets there
+// first.  An entry is filled before it is published under the write lock
+// and never changes afterwards until it is evicted, so readers only copy
+// it into their own rebx_ephem_cache.
+#define REBX_EPHEM_SHARED_SLOTS 256
+
+struct rebx_ephem_shared_entry {
+    int valid;
+    double t;
+    double G;
+    int N_ast;
+    double M[11];
+    struct mpos_s pstate[11];
+    double Mast[16];
+    double xa[16], ya[16], za[16];
+};
+
+struct rebx_ephem_shared {
+    pthread_rwlock_t lock;
+    struct rebx_ephem_shared_entry entry[REBX_EPHEM_SHARED_SLOTS];
+};
+
+static struct rebx_ephem_shared* rebx_ephem_shared_create(void){
+    struct rebx_ephem_shared* const shared = calloc(1, sizeof(*shared));
+    if (shared != NULL && pthread_rwlock_init(&shared->lock, NULL) != 0){
+        free(shared);
+        return NULL;
+    }
+    return shared;
+}
+
+static void rebx_ephem_shared_free(struct rebx_ephem_shared* const shared){
+    if (shared != NULL){
+        pthread_rwlock_destroy(&shared->lock);
+        free(shared);
+    }
+}
+
+// Direct-mapped on the bits of t.
+static int rebx_ephem_shared_slot(const double t){
+    uint64_t u;
+    memcpy(&u, &t, sizeof(u));
+    u ^= u >> 33;
+    u *= 0xff51afd7ed558ccdULL;
+    u ^= u >> 33;
+    return (int)(u % REBX_EPHEM_SHARED_SLOTS);
+}
+
+// Copies the states at t into cache, returns 0 if no simulation filled them yet.
+static int rebx_ephem_shared_get(struct rebx_ephem_shared* const shared, const double t, const double G, const int N_ast, struct rebx_ephem_cache* const cache){
+    const struct rebx_ephem_shared_entry* const e = &shared->entry[rebx_ephem_shared_slot(t)];
+    int found = 0;
+    pthread_rwlock_rdlock(&shared->lock);
+    if (e->valid && e->t == t && e->G == G && e->N_ast >= N_ast){
+        memcpy(cache->M, e->M, sizeof(cache->M));
+        memcpy(cache->pstate, e->pstate, sizeof(cache->pstate));
+        memcpy(cache->Mast, e->Mast, sizeof(cache->Mast));
+        memcpy(cache->xa, e->xa, sizeof(cache->xa));
+        memcpy(cache->ya, e->ya, sizeof(cache->ya));
+        memcpy(cache->za, e->za, sizeof(cache->za));
+        found = 1;
+    }
+    pthread_rwlock_unlock(&shared->lock);
+    return found;
+}
+
+static void rebx_ephem_shared_put(struct rebx_ephem_shared* const shared, const struct rebx_ephem_cache* const cache){
+    struct rebx_ephem_shared_entry* const e = &shared->entry[rebx_ephem_shared_slot(cache->t)];
+    pthread_rwlock_wrlock(&shared->lock);
+    e->t = cache->t;
+    e->G = cache->G;
+    e->N_ast = cache->N_ast;
+    memcpy(e->M, cache->M, sizeof(e->M));
+    memcpy(e->pstate, cache->pstate, sizeof(e->pstate));
+    memcpy(e->Mast, cache->Mast, sizeof(e->Mast));
+    memcpy(e->xa, cache->xa, sizeof(e->xa));
+    memcpy(e->ya, cache->ya, sizeof(e->ya));
+    memcpy(e->za, cache->za, sizeof(e->za));
+    e->valid = 1;
+    pthread_rwlock_unlock(&shared->lock);
+}
+
+// Earth and Sun gravity fields.  Hard-coded constants.  BEWARE!
+static const double rebx_ephem_J2e = 0.00108262545*1.001;
+static const double rebx_ephem_J4e = -0.000001616;
+static const double rebx_ephem_Re_eq = 6378.1263/149597870.700;
+static const double rebx_ephem_J2s = 2.1106088532726840e-07;
+static const double rebx_ephem_Rs_eq = 696000.0/149597870.700;
+// Degree of the Earth field, the higher of the two.
+#define REBX_EPHEM_FIELD_DEGREE 4
+
+// Releases the device buffers, if any.
+static void rebx_ephemeris_device_release(struct rebx_ephem_cache* const cache){
+#ifdef REBX_OFFLOAD
+    double* const state = cache->dev_state;
+    double* const acc = cache->dev_acc;
+    const int n = cache->dev_N;
+    if (n > 0){
+#pragma omp target exit data map(delete: state[0:6*n], acc[0:3*n])
+    }
+#endif // REBX_OFFLOAD
+    free(cache->dev_state);
+    free(cache->dev_acc);
+    cache->dev_state = NULL;
+    cache->dev_acc = NULL;
+    cache->dev_N = 0;
+}
+
+void rebx_ephemeris_free_arrays(struct rebx_extras* rebx, struct rebx_force* force){
+    struct rebx_ephem_cache* const cache = rebx_get_param(rebx, force->ap, "ephem_cache");
+    if (cache != NULL){
+        rebx_free_harmonics(cache->earth_field);
+        rebx_free_harmonics(cache->sun_field);
+        rebx_ephemeris_device_release(cache);
+        free(cache->cull_mask);
+    }
+    free(cache);
+}
+
+// Slots in force->param_cache, filled by rebx_ephemeris_params.
+enum {
+    EPHEM_PARAM_N_EPHEM,
+    EPHEM_PARAM_N_AST,
+    EPHEM_PARAM_C,
+    EPHEM_PARAM_GEOCENTRIC,
+    EPHEM_PARAM_MIN_CHUNK,
+    EPHEM_PARAM_CACHE,
+    EPHEM_PARAM_EPHEMERIS,
+    EPHEM_PARAM_PREFETCH,
+    EPHEM_PARAM_OFFLOAD,
+    EPHEM_PARAM_CULL_TOL,
+    EPHEM_PARAM_CULL_REFRESH,
+    EPHEM_PARAM_SHARED,
+};
+
+// The force's params are only looked up again after some param was added
+// or repointed, rather than on every substep.
+static void** rebx_ephemeris_params(struct rebx_extras* const rebx, struct rebx_force* const force){
+    void** const params = force->param_cache;
+    if (rebx_param_cache_stale(rebx, &force->param_generation)){
+        params[EPHEM_PARAM_N_EPHEM] = rebx_get_param(rebx, force->ap, "N_ephem");
+        params[EPHEM_PARAM_N_AST] = rebx_get_param(rebx, force->ap, "N_ast");
+        params[EPHEM_PARAM_C] = rebx_get_param(rebx, force->ap, "c");
+        params[EPHEM_PARAM_GEOCENTRIC] = rebx_get_param(rebx, force->ap, "geocentric");
+        params[EPHEM_PARAM_MIN_CHUNK] = rebx_get_param(rebx, force->ap, "ephem_min_chunk");
+        params[EPHEM_PARAM_CACHE] = rebx_get_param(rebx, force->ap, "ephem_cache");
+        params[EPHEM_PARAM_EPHEMERIS] = rebx_get_param(rebx, force->ap, "ephemeris");
+        params[EPHEM_PARAM_PREFETCH] = rebx_get_param(rebx, force->ap, "ephem_prefetch");
+        params[EPHEM_PARAM_OFFLOAD] = rebx_get_param(rebx, force->ap, "ephem_offload");
+        params[EPHEM_PARAM_CULL_TOL] = rebx_get_param(rebx, force->ap, "ephem_cull_tol");
+        params[EPHEM_PARAM_CULL_REFRESH] = rebx_get_param(rebx, force->ap, "ephem_cull_refresh");
+        params[EPHEM_PARAM_SHARED] = rebx_get_param(rebx, force->ap, "ephem_shared");
+    }
+    return params;
+}
+
+static struct rebx_ephem_cache* rebx_ephemeris_perturbers(struct reb_simulation* const sim, struct rebx_force* const force, void** const params, const int N_ast){
+    struct rebx_extras* const rebx = sim->extras;
+    struct rebx_ephem_cache* cache = params[EPHEM_PARAM_CACHE];
+    if (cache == NULL){
+        cache = calloc(1, sizeof(*cache));
+        if (cache == NULL){
+            reb_error(sim, "REBOUNDx Error: Could not allocate memory for the ephemeris_forces cache.\n");
+            return NULL;
+        }
+        cache->earth_field = rebx_create_harmonics(REBX_EPHEM_FIELD_DEGREE, 0, rebx_ephem_Re_eq);
+        cache->sun_field = rebx_create_harmonics(2, 0, rebx_ephem_Rs_eq);
+        if (cache->earth_field == NULL || cache->sun_field == NULL){
+            rebx_free_harmonics(cache->earth_field);
+            rebx_free_harmonics(cache->sun_field);
+            free(cache);
+            reb_error(sim, "REBOUNDx Error: Could not allocate memory for the ephemeris_forces cache.\n");
+            return NULL;
+        }
+        rebx_harmonics_set_J(cache->earth_field, 2, rebx_ephem_J2e);
+        rebx_harmonics_set_J(cache->earth_field, 4, rebx_ephem_J4e);
+        rebx_harmonics_set_J(cache->sun_field, 2, rebx_ephem_J2s);
+        rebx_set_param_pointer(rebx, &force->ap, "ephem_cache", cache);
+        rebx_set_param_pointer(rebx, &force->ap, "free_arrays", rebx_ephemeris_free_arrays);
+        params[EPHEM_PARAM_CACHE] = cache;
+    }
+
+    const struct rebx_ephemeris* eph = params[EPHEM_PARAM_EPHEMERIS];
+    if (eph == NULL){
+        eph = ephem_default();
+    }
+    if (eph != cache->eph){
+        memset(&cache->cur, 0, sizeof(cache->cur));
+        cache->eph = eph;
+        cache->valid = 0;
+        cache->prefetched = 0;
+    }
 
     const double G = sim->G;
     const double t = sim->t;
+    if (cache->valid && cache->t == t && cache->G == G && cache->N_ast >= N_ast){
+        return cache;
+    }
+
+    struct rebx_ephem_shared* const shared = params[EPHEM_PARAM_SHARED];
+    if (shared != NULL && rebx_ephem_shared_get(shared, t, G, N_ast, cache)){
+        cache->t = t;
+        cache->G = G;
+        cache->N_ast = N_ast;
+        cache->valid = 1;
+        cache->n_epochs++;
+        return cache;
+    }
+
+    const int* const prefetch = params[EPHEM_PARAM_PREFETCH];
+    if (prefetch != NULL && *prefetch > 0){
+        const long blk = (long)floor((t - eph->pl->beg)/eph->pl->inc);
+        if (!cache->prefetched || blk != cache->prefetch_blk){
+            ephem_prefetch(eph, t, copysign(1., sim->dt), *prefetch);
+            cache->prefetch_blk = blk;
+            cache->prefetched = 1;
+        }
+    }
+
+    ephem_all(eph, G, t, cache->M, cache->pstate);
+
+    // Translate massive asteroids from heliocentric to barycentric.
+    struct mpos_s apos[16];
+    ast_ephem_all(eph, &cache->cur, G, t, N_ast, cache->Mast, apos);
+
+    const struct mpos_s* const sun = &cache->pstate[0];
+    for (int i=0; i<N_ast; i++){
+        cache->xa[i] = apos[i].u[0] + sun->u[0];
+        cache->ya[i] = apos[i].u[1] + sun->u[1];
+        cache->za[i] = apos[i].u[2] + sun->u[2];
+    }
+
+    cache->t = t;
+    cache->G = G;
+    cache->N_ast = N_ast;
+    cache->valid = 1;
+    cache->n_epochs++;
+    if (shared != NULL){
+        rebx_ephem_shared_put(shared, cache);
+    }
+    return cache;
+}
+
+// Particles are processed in blocks of this many, see below.
+#define REBX_EPHEM_BLOCK 256
+// Default for the smallest number of particles given to each thread.
+#define REBX_EPHEM_MIN_CHUNK 1024
+// Default number of epochs between refreshes of the culling masks.
+#define REBX_EPHEM_CULL_REFRESH 64
+
+// Rotation into the equatorial frame of a body with the given pole
+// unit vector: about z by the longitude of the node, then about x by
+// the inclination.
+struct rebx_ephem_frame {
+    double cosr, sinr;          // cos, sin of -longnode
+    double cosd, sind;          // cos, sin of -incl
+};
+
+static struct rebx_ephem_frame rebx_ephemeris_frame(const double xp, const double yp, const double zp){
+    struct rebx_ephem_frame f;
+    const double incl = acos(zp);
+    double longnode;
+    if(xp != 0.0 || yp !=0.0) {    
+      longnode = atan2(xp, -yp);
+    } else {
+      longnode = 0.0;
+    }
+    f.cosr = cos(-longnode);
+    f.sinr = sin(-longnode);
+    f.cosd = cos(-incl);
+    f.sind = sin(-incl);
+    return f;
+}
+
+#pragma omp declare target
+static inline void rebx_ephemeris_to_frame(const struct rebx_ephem_frame* const f, double* const x, double* const y, double* const z){
+    // Rotate around z by RA
+    const double xp =  *x * f->cosr - *y * f->sinr;
+    const double yp =  *x * f->sinr + *y * f->cosr;
+    const double zp =  *z;
+
+    // Rotate around x by Dec
+    *x =  xp;
+    *y =  yp * f->cosd - zp * f->sind;
+    *z =  yp * f->sind + zp * f->cosd;
+}
+
+static inline void rebx_ephemeris_from_frame(const struct rebx_ephem_frame* const f, double* const x, double* const y, double* const z){
+    // Rotate around x by -Dec
+    const double xp =  *x;
+    const double yp =  *y * f->cosd + *z * f->sind;
+    const double zp = -*y * f->sind + *z * f->cosd;
+
+    // Rotate around z by -RA
+    *x =  xp * f->cosr + yp * f->sinr;
+    *y = -xp * f->sinr + yp * f->cosr;
+    *z =  zp;
+}
+
+// Adds the solar GR correction for a particle at (x, y, z) with velocity
+// (vx, vy, vz) relative to the Sun, given the acceleration accumulated so
+// far.  Returns 1 if the velocity iteration did not converge.
+static inline int rebx_ephemeris_gr(const double mu, const double C2, const int max_iterations,
+        const double x, const double y, const double z, const double vx, const double vy, const double vz,
+        double* const ax, double* const ay, double* const az){
+    struct reb_vec3d vi;
+
+    vi.x = vx;
+    vi.y = vy;
+    vi.z = vz;
+    double vi2=vi.x*vi.x + vi.y*vi.y + vi.z*vi.z;
+    const double ri = sqrt(x*x + y*y + z*z);
+
+    int q = 0;
+    double A = (0.5*vi2 + 3.*mu/ri)/C2;
+    struct reb_vec3d old_v;
+    for(q=0; q<max_iterations; q++){
+        old_v.x = vi.x;
+        old_v.y = vi.y;
+        old_v.z = vi.z;
+        vi.x = vx/(1.-A);
+        vi.y = vy/(1.-A);
+        vi.z = vz/(1.-A);
+        vi2 =vi.x*vi.x + vi.y*vi.y + vi.z*vi.z;
+        A = (0.5*vi2 + 3.*mu/ri)/C2;
+        const double dvx = vi.x - old_v.x;
+        const double dvy = vi.y - old_v.y;
+        const double dvz = vi.z - old_v.z;
+        if ((dvx*dvx + dvy*dvy + dvz*dvz)/vi2 < DBL_EPSILON*DBL_EPSILON){
+            break;
+        }
+    }
+
+    const double B = (mu/ri - 1.5*vi2)*mu/(ri*ri*ri)/C2;
+    const double rdotrdot = x*vx + y*vy + z*vz;
+
+    struct reb_vec3d vidot;
+    vidot.x = *ax + B*x;
+    vidot.y = *ay + B*y;
+    vidot.z = *az + B*z;
+
+    const double vdotvdot = vi.x*vidot.x + vi.y*vidot.y + vi.z*vidot.z;
+    const double D = (vdotvdot - 3.*mu/(ri*ri*ri)*rdotrdot)/C2;
+
+    const double gx = B*(1.-A)*x - A*(*ax) - D*vi.x;
+    const double gy = B*(1.-A)*y - A*(*ay) - D*vi.y;
+    const double gz = B*(1.-A)*z - A*(*az) - D*vi.z;
+    *ax += gx;
+    *ay += gy;
+    *az += gz;
+    return q == max_iterations;
+}
+#pragma omp end declare target
+
+// Acceleration from one point mass GM on N particles held as structure of
+// arrays, with (ox, oy, oz) the particle offset minus the perturber position.
+// Kept free of the reb_particle layout so that it vectorizes.
+static void rebx_ephemeris_point_mass(const double GM, const double ox, const double oy, const double oz, const int N,
+        const double* const restrict x, const double* const restrict y, const double* const restrict z,
+        double* const restrict ax, double* const restrict ay, double* const restrict az){
+    for (int j=0; j<N; j++){
+        // Compute position vector of test particle j relative to the massive body.
+        const double dx = x[j] + ox;
+        const double dy = y[j] + oy;
+        const double dz = z[j] + oz;
+        const double _r = sqrt(dx*dx + dy*dy + dz*dz);
+        const double prefac = GM/(_r*_r*_r);
+        ax[j] -= prefac*dx;
+        ay[j] -= prefac*dy;
+        az[j] -= prefac*dz;
+    }
+}
+
+// As rebx_ephemeris_point_mass, but only for the particles with the given
+// bit set in their mask.
+static void rebx_ephemeris_point_mass_masked(const double GM, const double ox, const double oy, const double oz, const int N,
+        const uint32_t* const restrict mask, const uint32_t bit,
+        const double* const restrict x, const double* const restrict y, const double* const restrict z,
+        double* const restrict ax, double* const restrict ay, double* const restrict az){
+    for (int j=0; j<N; j++){
+        if (!(mask[j] & bit)){
+            continue;
+        }
+        const double dx = x[j] + ox;
+        const double dy = y[j] + oy;
+        const double dz = z[j] + oz;
+        const double _r = sqrt(dx*dx + dy*dy + dz*dz);
+        const double prefac = GM/(_r*_r*_r);
+        ax[j] -= prefac*dx;
+        ay[j] -= prefac*dy;
+        az[j] -= prefac*dz;
+    }
+}
+
+// Builds the culling masks of N particles.  Bit i of mask[j] is set if
+// the acceleration of perturber i on particle j is at least tol/Np of the
+// magnitude of the summed point-mass acceleration, so the terms left out
+// add up to at most tol of it, at the positions used here.
+static void rebx_ephemeris_cull(const int Np, const double* const GMp, const double* const oxp, const double* const oyp, const double* const ozp,
+        const double tol, const int N, const double* const x, const double* const y, const double* const z, uint32_t* const mask){
+    for (int j=0; j<N; j++){
+        double a[27];
+        double sx = 0., sy = 0., sz = 0.;
+        for (int i=0; i<Np; i++){
+            const double dx = x[j] + oxp[i];
+            const double dy = y[j] + oyp[i];
+            const double dz = z[j] + ozp[i];
+            const double r2 = dx*dx + dy*dy + dz*dz;
+            const double r = sqrt(r2);
+            a[i] = GMp[i]/r2;
+            sx -= a[i]*dx/r;
+            sy -= a[i]*dy/r;
+            sz -= a[i]*dz/r;
+        }
+        const double threshold = tol/Np*sqrt(sx*sx + sy*sy + sz*sz);
+        uint32_t m = 0;
+        for (int i=0; i<Np; i++){
+            if (a[i] >= threshold){
+                m |= (uint32_t)1 << i;
+            }
+        }
+        mask[j] = m;
+    }
+}
+
+// Adds the accelerations from the gravity field of a body at the
+// positions (x, y, z) + (ox, oy, oz) relative to it, evaluated in the
+// body's equatorial frame.  The fields are at most of degree
+// REBX_EPHEM_FIELD_DEGREE, so the harmonics workspace fits on the stack
+// of each thread.
+static void rebx_ephemeris_field(const struct rebx_harmonics* const field, const double GM, const struct rebx_ephem_frame* const frame,
+        const double ox, const double oy, const double oz, const int n,
+        const double* const x, const double* const y, const double* const z,
+        double* const ax, double* const ay, double* const az){
+    double bx[REBX_EPHEM_BLOCK], by[REBX_EPHEM_BLOCK], bz[REBX_EPHEM_BLOCK];
+    double bax[REBX_EPHEM_BLOCK], bay[REBX_EPHEM_BLOCK], baz[REBX_EPHEM_BLOCK];
+    double work[REBX_HARMONICS_WORK_SIZE(REBX_EPHEM_FIELD_DEGREE)];
+    for (int j=0; j<n; j++){
+        bx[j] = x[j] + ox;
+        by[j] = y[j] + oy;
+        bz[j] = z[j] + oz;
+        rebx_ephemeris_to_frame(frame, &bx[j], &by[j], &bz[j]);
+        bax[j] = 0.;
+        bay[j] = 0.;
+        baz[j] = 0.;
+    }
+    rebx_harmonics_accelerations(field, GM, n, bx, by, bz, bax, bay, baz, work);
+    for (int j=0; j<n; j++){
+        rebx_ephemeris_from_frame(frame, &bax[j], &bay[j], &baz[j]);
+        ax[j] += bax[j];
+        ay[j] += bay[j];
+        az[j] += baz[j];
+    }
+}
+
+#ifdef REBX_OFFLOAD
+#pragma omp declare target(rebx_harmonics_zonal_point)
+
+// Everything the device kernel needs besides the particles.  Copied to
+// the device as one on every call.
+struct rebx_ephem_kernel {
+    int Np;
+    double GMp[27];             // point masses
+    double oxp[27], oyp[27], ozp[27]; // particle offset minus their positions
+    double GMe, GMs;            // Earth and Sun
+    struct rebx_ephem_frame earth, sun;
+    double oxe, oye, oze;       // particle offset minus the Earth position
+    double oxs, oys, ozs;       // particle offset minus the Sun state
+    double ovxs, ovys, ovzs;
+    double mu, C2;
+    int max_iterations;
+    int geo;
+    double axe, aye, aze;       // Earth acceleration, taken out if geocentric
+};
+
+// Adds the gravity field on a single particle, as rebx_ephemeris_field.
+#pragma omp declare target
+static inline void rebx_ephemeris_field_point(const int degree, const double R_eq, const double* const C, const double* const factors,
+        const double GM, const struct rebx_ephem_frame* const frame, double x, double y, double z,
+        double* const ax, double* const ay, double* const az){
+    double bax = 0., bay = 0., baz = 0.;
+    rebx_ephemeris_to_frame(frame, &x, &y, &z);
+    rebx_harmonics_zonal_point(degree, R_eq, C, factors, GM, x, y, z, &bax, &bay, &baz);
+    rebx_ephemeris_from_frame(frame, &bax, &bay, &baz);
+    *ax += bax;
+    *ay += bay;
+    *az += baz;
+}
+#pragma omp end declare target
+
+// Makes sure the device buffers hold at least N particles.  They are only
+// grown, so that repeated calls reuse the same device allocations.
+static int rebx_ephemeris_device_buffers(struct rebx_ephem_cache* const cache, const int N){
+    if (N <= cache->dev_N){
+        return 1;
+    }
+    rebx_ephemeris_device_release(cache);
+    double* const state = malloc(6*N*sizeof(*state));
+    double* const acc = malloc(3*N*sizeof(*acc));
+    if (state == NULL || acc == NULL){
+        free(state);
+        free(acc);
+        return 0;
+    }
+#pragma omp target enter data map(alloc: state[0:6*N], acc[0:3*N])
+    cache->dev_state = state;
+    cache->dev_acc = acc;
+    cache->dev_N = N;
+    return 1;
+}
+
+// Computes the test particle accelerations on the offload device, with one
+// device thread per particle.  The positions change on every substep, so
+// the particles are copied over on every call, but into buffers that stay
+// allocated on the device.  The arithmetic matches the host path.  Returns
+// -1 if the buffers could not be allocated, otherwise 1 if the GR
+// iteration failed to converge for some particle and 0 if not.
+static int rebx_ephemeris_forces_device(struct rebx_ephem_cache* const cache, const struct rebx_ephem_kernel* const kernel,
+        struct reb_particle* const particles, const int N){
+    if (!rebx_ephemeris_device_buffers(cache, N)){
+        return -1;
+    }
+    double* const state = cache->dev_state;
+    double* const acc = cache->dev_acc;
+    for (int j=0; j<N; j++){
+        state[6*j]   = particles[j].x;
+        state[6*j+1] = particles[j].y;
+        state[6*j+2] = particles[j].z;
+        state[6*j+3] = particles[j].vx;
+        state[6*j+4] = particles[j].vy;
+        state[6*j+5] = particles[j].vz;
+        acc[3*j]   = particles[j].ax;
+        acc[3*j+1] = particles[j].ay;
+        acc[3*j+2] = particles[j].az;
+    }
+#pragma omp target update to(state[0:6*N], acc[0:3*N])
+
+    const struct rebx_ephem_kernel k = *kernel;
+    const int de = cache->earth_field->degree;
+    const double Re = cache->earth_field->R_eq;
+    const double* const Ce = cache->earth_field->C;
+    const double* const fe = cache->earth_field->factors;
+    const int nCe = (de+1)*(de+2)/2;
+    const int nfe = rebx_harmonics_factors_size(de);
+    const int ds = cache->sun_field->degree;
+    const double Rs = cache->sun_field->R_eq;
+    const double* const Cs = cache->sun_field->C;
+    const double* const fs = cache->sun_field->factors;
+    const int nCs = (ds+1)*(ds+2)/2;
+    const int nfs = rebx_harmonics_factors_size(ds);
+    int gr_failed = 0;
+
+#pragma omp target teams distribute parallel for map(to: k, Ce[0:nCe], fe[0:nfe], Cs[0:nCs], fs[0:nfs]) map(alloc: state[0:6*N], acc[0:3*N]) map(tofrom: gr_failed) reduction(|:gr_failed)
+    for (int j=0; j<N; j++){
+        const double x = state[6*j];
+        const double y = state[6*j+1];
+        const double z = state[6*j+2];
+        double ax = acc[3*j];
+        double ay = acc[3*j+1];
+        double az = acc[3*j+2];
+
+        for (int i=0; i<k.Np; i++){
+            const double dx = x + k.oxp[i];
+            const double dy = y + k.oyp[i];
+            const double dz = z + k.ozp[i];
+            const double _r = sqrt(dx*dx + dy*dy + dz*dz);
+            const double prefac = k.GMp[i]/(_r*_r*_r);
+            ax -= prefac*dx;
+            ay -= prefac*dy;
+            az -= prefac*dz;
+        }
+
+        rebx_ephemeris_field_point(de, Re, Ce, fe, k.GMe, &k.earth, x + k.oxe, y + k.oye, z + k.oze, &ax, &ay, &az);
+        rebx_ephemeris_field_point(ds, Rs, Cs, fs, k.GMs, &k.sun, x + k.oxs, y + k.oys, z + k.ozs, &ax, &ay, &az);
+
+        gr_failed |= rebx_ephemeris_gr(k.mu, k.C2, k.max_iterations,
+                x + k.oxs, y + k.oys, z + k.ozs,
+                state[6*j+3] + k.ovxs, state[6*j+4] + k.ovys, state[6*j+5] + k.ovzs,
+                &ax, &ay, &az);
+
+        if(k.geo == 1){
+            ax -= k.axe;
+            ay -= k.aye;
+            az -= k.aze;
+        }
+
+        acc[3*j]   = ax;
+        acc[3*j+1] = ay;
+        acc[3*j+2] = az;
+    }
+
+#pragma omp target update from(acc[0:3*N])
+    for (int j=0; j<N; j++){
+        particles[j].ax = acc[3*j];
+        particles[j].ay = acc[3*j+1];
+        particles[j].az = acc[3*j+2];
+    }
+    return gr_failed;
+}
+#endif // REBX_OFFLOAD
+
+// Change in the J2 and J4 acceleration of an oblate body for a small
+// displacement (*ddx, *ddy, *ddz) of the position (x, y, z), both in the
+// body equatorial frame.  The result overwrites the displacement.  K2 and
+// K4 are 3/2 GM J2 R^2 and 5/8 GM J4 R^4.
+//
+// The acceleration has the form a_i = g x_i + h z delta_iz, where g and h
+// depend only on r and z, so its Jacobian is
+// g delta_ij + x_i dg/dx_j + delta_iz (h delta_jz + z dh/dx_j).
+static void rebx_ephemeris_zonal_var(const double K2, const double K4, const double x, const double y, const double z,
+        double* const ddx, double* const ddy, double* const ddz){
+    const double r2 = x*x + y*y + z*z;
+    const double r = sqrt(r2);
+    const double z2 = z*z;
+    const double ir2 = 1./r2;
+    const double ir5 = ir2*ir2/r;
+    const double ir7 = ir5*ir2;
+    const double ir9 = ir7*ir2;
+    const double ir11 = ir9*ir2;
+    const double ir13 = ir11*ir2;
+
+    const double g = K2*(5.*z2*ir7 - ir5) + K4*(63.*z2*z2*ir11 - 42.*z2*ir9 + 3.*ir7);
+    const double h = -2.*K2*ir5 + K4*(-28.*z2*ir9 + 12.*ir7);
+
+    // grad g = gr*(x, y, z) + gz*(0, 0, 1), and likewise for h.
+    const double gr = K2*(-35.*z2*ir9 + 5.*ir7) + K4*(-693.*z2*z2*ir13 + 378.*z2*ir11 - 21.*ir9);
+    const double gz = 10.*K2*z*ir7 + K4*(252.*z2*z*ir11 - 84.*z*ir9);
+    const double hr = 10.*K2*ir7 + K4*(252.*z2*ir11 - 84.*ir9);
+    const double hz = -56.*K4*z*ir9;
+
+    const double dx = *ddx;
+    const double dy = *ddy;
+    const double dz = *ddz;
+    const double rdd = x*dx + y*dy + z*dz;
+    const double dg = gr*rdd + gz*dz;
+    const double dh = hr*rdd + hz*dz;
+
+    *ddx = g*dx + x*dg;
+    *ddy = g*dy + y*dg;
+    *ddz = g*dz + z*dg + h*dz + z*dh;
+}
+
+void rebx_ephemeris_forces(struct reb_simulation* const sim, struct rebx_force* const force, struct reb_particle* const particles, const int N){
 
-    const int* const N_ephem = rebx_get_param(sim->extras, force->ap, "N_ephem");
+    const double G = sim->G;
+    void** const params = rebx_ephemeris_params(sim->extras, force);
+
+    const int* const N_ephem = params[EPHEM_PARAM_N_EPHEM];
     if (N_ephem == NULL){
         fprintf(stderr, "REBOUNDx Error: Need to set N_ephem for ephemeris_forces\n");
         return;
     }
+    if (*N_ephem < 0 || *N_ephem > 11){
+        reb_error(sim, "REBOUNDx Error: N_ephem must be between 0 and 11 for ephemeris_forces.\n");
+        return;
+    }
     
-    const int* const N_ast = rebx_get_param(sim->extras, force->ap, "N_ast");
-    if (N_ephem == NULL){
+    const int* const N_ast = params[EPHEM_PARAM_N_AST];
+    if (N_ast == NULL){
         fprintf(stderr, "REBOUNDx Error: Need to set N_ast for ephemeris_forces\n");
         return;
     }
 
-    double* c = rebx_get_param(sim->extras, force->ap, "c");
+    double* c = params[EPHEM_PARAM_C];
     if (c == NULL){
         reb_error(sim, "REBOUNDx Error: Need to set speed of light in gr effect.  See examples in documentation.\n");
         return;
     }
 
-    int* geo = rebx_get_param(sim->extras, force->ap, "geocentric"); // Make sure there is a default set.
+    int* geo = params[EPHEM_PARAM_GEOCENTRIC]; // Make sure there is a default set.
     if (geo == NULL){
         reb_error(sim, "REBOUNDx Error: Need to set geo flag.  See examples in documentation.\n");
         return;
@@ -253,16 +1055,30 @@ void rebx_ephemeris_forces(struct reb_simulation* const sim, struct rebx_force*
 
     const double C2 = (*c)*(*c);  // This could be stored as C2.
     
-    double m, x, y, z, vx, vy, vz, ax, ay, az;
-    double xs, ys, zs, vxs, vys, vzs, axs, ays, azs;
+    double xs, ys, zs, vxs, vys, vzs;
     double xe, ye, ze, vxe, vye, vze, axe, aye, aze;
     double xo, yo, zo, vxo, vyo, vzo;
-    double xr, yr, zr, vxr, vyr, vzr;
 
-    // Get mass, position, velocity, and acceleration of the Earth and Sun
-    // for later use
-    ephem(G, 3, t, &m, &xe, &ye, &ze, &vxe, &vye, &vze, &axe, &aye, &aze);
-    ephem(G, 0, t, &m, &xs, &ys, &zs, &vxs, &vys, &vzs, &axs, &ays, &azs);     
+    if (*N_ast < 0 || *N_ast > 16){
+        reb_error(sim, "REBOUNDx Error: N_ast must be between 0 and 16 for ephemeris_forces.\n");
+        return;
+    }
+
+    // Get masses, positions, velocities, and accelerations of all
+    // the perturbers, reusing them if we are still at the same epoch.
+    struct rebx_ephem_cache* const cache = rebx_ephemeris_perturbers(sim, force, params, *N_ast);
+    if (cache == NULL){
+        return;
+    }
+    const double* const M = cache->M;
+    const struct mpos_s* const pstate = cache->pstate;
+
+    // Keep the Earth and Sun for later use
+    xe  = pstate[3].u[0]; ye  = pstate[3].u[1]; ze  = pstate[3].u[2];
+    vxe = pstate[3].v[0]; vye = pstate[3].v[1]; vze = pstate[3].v[2];
+    axe = pstate[3].w[0]; aye = pstate[3].w[1]; aze = pstate[3].w[2];
+    xs  = pstate[0].u[0]; ys  = pstate[0].u[1]; zs  = pstate[0].u[2];
+    vxs = pstate[0].v[0]; vys = pstate[0].v[1]; vzs = pstate[0].v[2];
 
     // The offset position is used to adjust the particle positions.
     if(*geo == 1){
@@ -273,314 +1089,48 @@ void rebx_ephemeris_forces(struct reb_simulation* const sim, struct rebx_force*
       vxo = 0.0; vyo = 0.0; vzo = 0.0;      
     }
 
-    // Calculate acceleration due to sun and planets
-    // Rearrange to get all the planet positions at once
+    // Gather the sun, planets and massive asteroids into one list.
+    const int Np = *N_ephem + *N_ast;
+    double GMp[27], xpb[27], ypb[27], zpb[27];
     for (int i=0; i<*N_ephem; i++){
-
-        // Get position and mass of massive body i.
-        ephem(G, i, t, &m, &x, &y, &z, &vx, &vy, &vz, &ax, &ay, &az); 
-
-        for (int j=0; j<N; j++){
-  	  // Compute position vector of test particle j relative to massive body i.
-	  const double dx =  particles[j].x + (xo - x); 
-	  const double dy =  particles[j].y + (yo - y);
-	  const double dz =  particles[j].z + (zo - z);
-	  const double _r = sqrt(dx*dx + dy*dy + dz*dz);
-	  const double prefac = G*m/(_r*_r*_r);
-
-	  //printf("%le %le %le\n", dx, dy, dz);
-	  
-	  particles[j].ax -= prefac*dx;
-	  particles[j].ay -= prefac*dy;
-	  particles[j].az -= prefac*dz;
-
-        }
+        GMp[i] = G*M[i];
+        xpb[i] = pstate[i].u[0];
+        ypb[i] = pstate[i].u[1];
+        zpb[i] = pstate[i].u[2];
     }
-
-    // Calculate acceleration due to massive asteroids
-    // Rearrange to get all the asteroid positions at once
     for (int i=0; i<*N_ast; i++){
-
-        ast_ephem(G, i, t, &m, &x, &y, &z); // Get position and mass of asteroid i.
-
-	// Translate massive asteroids from heliocentric to barycentric.
-	x += xs; y += ys; z += zs;
-	
-        for (int j=0; j<N; j++){
-  	  // Compute position vector of test particle j relative to massive body i.
-	    const double dx = particles[j].x + (xo - x);
-	    const double dy = particles[j].y + (yo - y);
-	    const double dz = particles[j].z + (zo - z); 	    	    
-            const double _r = sqrt(dx*dx + dy*dy + dz*dz);
-	    
-            const double prefac = G*m/(_r*_r*_r);
-            particles[j].ax -= prefac*dx;
-            particles[j].ay -= prefac*dy;
-            particles[j].az -= prefac*dz;
-        }
+        GMp[*N_ephem+i] = G*cache->Mast[i];
+        xpb[*N_ephem+i] = cache->xa[i];
+        ypb[*N_ephem+i] = cache->ya[i];
+        zpb[*N_ephem+i] = cache->za[i];
     }
 
-    // Here is the treatment of the Earth's J2 and J4.
-    // Borrowed code from gravitational_harmonics example.
-    // Assumes the coordinates are geocentric.
-    // Also assuming that Earth's pole is along the z
-    // axis.  This is only precisely true at the J2000
-    // epoch.
-    //
-
-    // The geocenter is the reference for the J2/J4 calculations.
-    xr = xe;  yr = ye;  zr = ze;
-
-    // Hard-coded constants.  BEWARE!
-    // Clean up on aisle 3!
+    // Here is the treatment of the Earth's J2 and J4, through
+    // the harmonics engine in the Earth equatorial frame.
+    // Assumes the pole orientation at the J2000 epoch.
     const double Mearth = 0.888769244512563400E-09/G;
-    const double J2e = 0.00108262545*1.001;
-    const double J4e = -0.000001616;
-    const double au = 149597870.700;
-    const double Re_eq = 6378.1263/au;
 
     // Unit vector to equatorial pole at the epoch
     // Clean this up!
-
-    double RAs =  359.87123273*M_PI/180.;
-    double Decs =  89.88809752*M_PI/180.;
-
+    //double RAs =  359.87123273*M_PI/180.;
+    //double Decs =  89.88809752*M_PI/180.;
     //double xp = cos(Decs)*cos(RAs);
     //double yp = cos(Decs)*sin(RAs);
     //double zp = sin(Decs);
+    const struct rebx_ephem_frame earth = rebx_ephemeris_frame(0.0019111736356920146, -1.2513100974355823e-05, 0.9999981736277104);
 
-    //printf("%lf %lf %lf\n", xp, yp, zp);
-
-    double xp =  0.0019111736356920146;
-    double yp = -1.2513100974355823e-05;
-    double zp =   0.9999981736277104;
-
-    //xp = 0.0;
-    //yp = 0.0;
-    //zp = 1.0;
-    
-    double incl = acos(zp);
-    double longnode;
-    if(xp != 0.0 || yp !=0.0) {    
-      longnode = atan2(xp, -yp);
-    } else {
-      longnode = 0.0;
-    }
-
-    // Rearrange this loop for efficiency
-    for (int j=0; j<N; j++){
-        const struct reb_particle p = particles[j];
-        double dx = p.x + (xo - xr);
-        double dy = p.y + (yo - yr);
-        double dz = p.z + (zo - zr);
-
-        const double r2 = dx*dx + dy*dy + dz*dz;
-        const double r = sqrt(r2);
-	
-	// Rotate to Earth equatorial frame
-	// This could be a single rotation
-
-	// Rotate around z by RA
-	double cosr = cos(-longnode);
-	double sinr = sin(-longnode);
-
-	double dxp =  dx * cosr - dy * sinr;
-	double dyp =  dx * sinr + dy * cosr;
-	double dzp =  dz;
-
-	// Rotate around x by Dec
-	double cosd = cos(-incl);
-	double sind = sin(-incl);
-	
-	dx =  dxp;
-	dy =  dyp * cosd - dzp * sind;
-	dz =  dyp * sind + dzp * cosd;
-
-	// Calculate acceleration in body frame
-	
-        const double costheta2 = dz*dz/r2;
-        const double J2e_prefac = 3.*J2e*Re_eq*Re_eq/r2/r2/r/2.;
-        const double J2e_fac = 5.*costheta2-1.;
-
-	double resx = G*Mearth*J2e_prefac*J2e_fac*dx;
-	double resy = G*Mearth*J2e_prefac*J2e_fac*dy;
-	double resz = G*Mearth*J2e_prefac*(J2e_fac-2.)*dz;	
-
-        const double J4e_prefac = 5.*J4e*Re_eq*Re_eq*Re_eq*Re_eq/r2/r2/r2/r/8.;
-        const double J4e_fac = 63.*costheta2*costheta2-42.*costheta2 + 3.;
-
-        resx += G*Mearth*J4e_prefac*J4e_fac*dx;
-        resy += G*Mearth*J4e_prefac*J4e_fac*dy;
-        resz += G*Mearth*J4e_prefac*(J4e_fac+12.-28.*costheta2)*dz;
-
-	// Rotate back to original frame
-	// Rotate around x by -Dec
-	double resxp =  resx;
-	double resyp =  resy * cosd + resz * sind;
-	double reszp = -resy * sind + resz * cosd;
-	
-	// Rotate around z by -RA
-	resx =  resxp * cosr + resyp * sinr;
-	resy = -resxp * sinr + resyp * cosr;
-	resz =  reszp;
-
-	particles[j].ax += resx;
-        particles[j].ay += resy; 
-        particles[j].az += resz;
-	
-    }
-
-    // Here is the treatment of the Sun's J2.
-    // Borrowed code from gravitational_harmonics.
-    // Also assuming that Sun's pole is along the z
-    // axis.  This is not true.  Will correct soon.
-
-    // The Sun center is reference for these calculations.
-    xr = xs;  yr = ys;  zr = zs;
-
-    // Hard-coded constants.  BEWARE!
-    // Clean up on aisle 3!
+    // Here is the treatment of the Sun's J2, likewise.
     // Mass of sun in solar masses.    
     const double Msun = 1.0;  // hard-code parameter.
-    const double Rs_eq = 696000.0/au;
-    const double J2s = 2.1106088532726840e-07;
-
-    RAs = 268.13*M_PI/180.;
-    Decs = 63.87*M_PI/180.;
 
-    xp = cos(Decs)*cos(RAs);
-    yp = cos(Decs)*sin(RAs);
-    zp = sin(Decs);
-
-    incl = acos(zp);
-    if(xp != 0.0 || yp !=0.0) {    
-      longnode = atan2(xp, -yp);
-    } else {
-      longnode = 0.0;
-    }
-    
-    for (int j=0; j<N; j++){
-        const struct reb_particle p = particles[j];
-        double dx = p.x + (xo - xr);
-        double dy = p.y + (yo - yr);
-        double dz = p.z + (zo - zr);
-
-        const double r2 = dx*dx + dy*dy + dz*dz;
-        const double r = sqrt(r2);
-
-	// Rotate to solar equatorial frame
-
-	// Rotate around z by RA
-	double cosr = cos(-longnode);
-	double sinr = sin(-longnode);
-	
-	// Rotate around z by RA
-	double dxp =  dx * cosr - dy * sinr;
-	double dyp =  dx * sinr + dy * cosr;
-	double dzp =  dz;
-
-	// Rotate around x by Dec
-	double cosd = cos(-incl);
-	double sind = sin(-incl);
-
-	dx =  dxp;
-	dy =  dyp * cosd - dzp * sind;
-	dz =  dyp * sind + dzp * cosd;
-
-	const double costheta2 = dz*dz/r2;
-        const double J2s_prefac = 3.*J2s*Rs_eq*Rs_eq/r2/r2/r/2.;
-        const double J2s_fac = 5.*costheta2-1.;
-
-	// Calculate acceleration
-	double resx = G*Msun*J2s_prefac*J2s_fac*dx;
-	double resy = G*Msun*J2s_prefac*J2s_fac*dy;
-	double resz = G*Msun*J2s_prefac*(J2s_fac-2.)*dz;
-
-	// Rotate back to original frame
-	// Rotate around x by -Dec
-	double resxp =  resx;
-	double resyp =  resy * cosd + resz * sind;
-	double reszp = -resy * sind + resz * cosd;
-	
-	// Rotate around z by -RA
-	resx =  resxp * cosr + resyp * sinr;
-	resy = -resxp * sinr + resyp * cosr;
-	resz =  reszp;
-
-        particles[j].ax += resx;
-        particles[j].ay += resy;
-        particles[j].az += resz;
-	
-    }
+    const double RAs = 268.13*M_PI/180.;
+    const double Decs = 63.87*M_PI/180.;
+    const struct rebx_ephem_frame sun = rebx_ephemeris_frame(cos(Decs)*cos(RAs), cos(Decs)*sin(RAs), sin(Decs));
 
     // Here is the Solar GR treatment
     // The Sun is the reference for these calculations.    
-    xr  = xs;  yr  = ys;  zr = zs;
-    vxr = vxs; vyr = vys; vzr = vzs;
-
-    //xr = 0.0;  yr = 0.0;  zr = 0.0;
-    //vxr = 0.0; vyr = 0.0; vzr = 0.0;      
-
     const double mu = G*Msun; 
     const int max_iterations = 10; // hard-coded parameter.
-    for (int j=0; j<N; j++){
-        struct reb_particle p = particles[j];
-        struct reb_vec3d vi;
-
-	p.x += (xo - xr);
-	p.y += (yo - yr);
-	p.z += (zo - zr);
-	p.vx += (vxo - vxr);
-	p.vy += (vyo - vyr);
-	p.vz += (vzo - vzr);
-	
-        vi.x = p.vx;
-        vi.y = p.vy;
-        vi.z = p.vz;
-        double vi2=vi.x*vi.x + vi.y*vi.y + vi.z*vi.z;
-        const double ri = sqrt(p.x*p.x + p.y*p.y + p.z*p.z);
-	
-        int q = 0;
-        double A = (0.5*vi2 + 3.*mu/ri)/C2;
-        struct reb_vec3d old_v;
-        for(q=0; q<max_iterations; q++){
-            old_v.x = vi.x;
-            old_v.y = vi.y;
-            old_v.z = vi.z;
-            vi.x = p.vx/(1.-A);
-            vi.y = p.vy/(1.-A);
-            vi.z = p.vz/(1.-A);
-            vi2 =vi.x*vi.x + vi.y*vi.y + vi.z*vi.z;
-            A = (0.5*vi2 + 3.*mu/ri)/C2;
-            const double dvx = vi.x - old_v.x;
-            const double dvy = vi.y - old_v.y;
-            const double dvz = vi.z - old_v.z;
-            if ((dvx*dvx + dvy*dvy + dvz*dvz)/vi2 < DBL_EPSILON*DBL_EPSILON){
-                break;
-            }
-        }
-        const int default_max_iterations = 10;
-        if(q==default_max_iterations){
-            reb_warning(sim, "REBOUNDx Warning: 10 iterations in ephemeris forces failed to converge. This is typically because the perturbation is too strong for the current implementation.");
-        }
-  
-        const double B = (mu/ri - 1.5*vi2)*mu/(ri*ri*ri)/C2;
-        const double rdotrdot = p.x*p.vx + p.y*p.vy + p.z*p.vz;
-        
-        struct reb_vec3d vidot;
-        vidot.x = p.ax + B*p.x;
-        vidot.y = p.ay + B*p.y;
-        vidot.z = p.az + B*p.z;
-        
-        const double vdotvdot = vi.x*vidot.x + vi.y*vidot.y + vi.z*vidot.z;
-        const double D = (vdotvdot - 3.*mu/(ri*ri*ri)*rdotrdot)/C2;
-	
-        particles[j].ax += B*(1.-A)*p.x - A*p.ax - D*vi.x;
-        particles[j].ay += B*(1.-A)*p.y - A*p.ay - D*vi.y;
-        particles[j].az += B*(1.-A)*p.z - A*p.az - D*vi.z;
-
-    }
-
 
     // The expressions below are in here for another purpose.
     /*
@@ -588,18 +1138,333 @@ void rebx_ephemeris_forces(struct reb_simulation* const sim, struct rebx_force*
     double rho = sqrt(G*Msun/ae);
     */
 
-    if(*geo == 1){
-
-      for (int j=0; j<N; j++){    
-
-	particles[j].ax -= axe;
-	particles[j].ay -= aye;
-	particles[j].az -= aze;
-
-      }
-
-    }
-
+    // Work through the particles in blocks small enough to stay in cache.
+    // Each block is gathered into structure-of-arrays buffers for the
+    // point-mass kernel, and then every other contribution is added in a
+    // single pass over the block, so each particle is only read and
+    // written once per call.
+    //
+    // The test particles do not interact, so with OpenMP the blocks are
+    // shared out between threads, each getting at least ephem_min_chunk
+    // particles so that small problems stay serial.
+    const int* const min_chunk_param = params[EPHEM_PARAM_MIN_CHUNK];
+    const int min_chunk = (min_chunk_param != NULL && *min_chunk_param > 0) ? *min_chunk_param : REBX_EPHEM_MIN_CHUNK;
+    const int chunk_blocks = (min_chunk + REBX_EPHEM_BLOCK - 1)/REBX_EPHEM_BLOCK;
+    int gr_failed = 0;
+
+    // With ephem_offload set, at least that many particles are instead
+    // handed to the offload device in one go.  The host blocks below are
+    // then skipped, and used as the fallback.
+    const int* const offload = params[EPHEM_PARAM_OFFLOAD];
+    int on_device = 0;
+    if (offload != NULL && *offload > 0 && N >= *offload){
+#ifdef REBX_OFFLOAD
+        struct rebx_ephem_kernel kernel = {
+            .Np = Np, .GMe = G*Mearth, .GMs = G*Msun, .earth = earth, .sun = sun,
+            .oxe = xo - xe, .oye = yo - ye, .oze = zo - ze,
+            .oxs = xo - xs, .oys = yo - ys, .ozs = zo - zs,
+            .ovxs = vxo - vxs, .ovys = vyo - vys, .ovzs = vzo - vzs,
+            .mu = mu, .C2 = C2, .max_iterations = max_iterations,
+            .geo = *geo, .axe = axe, .aye = aye, .aze = aze,
+        };
+        for (int i=0; i<Np; i++){
+            kernel.GMp[i] = GMp[i];
+            kernel.oxp[i] = xo - xpb[i];
+            kernel.oyp[i] = yo - ypb[i];
+            kernel.ozp[i] = zo - zpb[i];
+        }
+        const int ret = rebx_ephemeris_forces_device(cache, &kernel, particles, N);
+        if (ret >= 0){
+            gr_failed = ret;
+            on_device = 1;
+        }
+        else if (!cache->offload_warned){
+            reb_warning(sim, "REBOUNDx Warning: Could not allocate the offload buffers for ephemeris_forces. Computing the accelerations on the host.\n");
+            cache->offload_warned = 1;
+        }
+#else
+        if (!cache->offload_warned){
+            reb_warning(sim, "REBOUNDx Warning: ephem_offload is set, but REBOUNDx was compiled without offload support (make OFFLOAD=1). Computing the accelerations on the host.\n");
+            cache->offload_warned = 1;
+        }
+#endif // REBX_OFFLOAD
+    }
+    const int Nblocks = on_device ? 0 : (N + REBX_EPHEM_BLOCK - 1)/REBX_EPHEM_BLOCK;
+
+    // With ephem_cull_tol set, each particle only feels the perturbers in
+    // its mask, see rebx_ephemeris_cull.  The bound on the dropped terms
+    // holds when the masks are built, and drifts as the particles move
+    // relative to the perturbers until the next refresh, every
+    // ephem_cull_refresh new epochs.  The fields and GR are always
+    // included.  Culling is only done for barycentric integrations, since
+    // the geocentric frame correction would need the dropped terms, and
+    // not on the offload device.
+    const double* const cull_tol = params[EPHEM_PARAM_CULL_TOL];
+    const uint32_t* cull_mask = NULL;
+    int cull_refresh = 0;
+    double oxp[27], oyp[27], ozp[27];
+    if (cull_tol != NULL && *cull_tol > 0. && *geo == 0 && !on_device){
+        const int* const refresh_param = params[EPHEM_PARAM_CULL_REFRESH];
+        const long refresh = (refresh_param != NULL && *refresh_param > 0) ? *refresh_param : REBX_EPHEM_CULL_REFRESH;
+        if (cache->cull_N != N){
+            free(cache->cull_mask);
+            cache->cull_mask = malloc(N*sizeof(*cache->cull_mask));
+            cache->cull_N = (cache->cull_mask == NULL) ? 0 : N;
+            cull_refresh = 1;
+        }
+        if (cache->cull_Np != Np || cache->cull_tol != *cull_tol || cache->n_epochs - cache->cull_epoch >= refresh){
+            cull_refresh = 1;
+        }
+        if (cache->cull_mask != NULL){
+            if (cull_refresh){
+                cache->cull_Np = Np;
+                cache->cull_tol = *cull_tol;
+                cache->cull_epoch = cache->n_epochs;
+                for (int i=0; i<Np; i++){
+                    oxp[i] = xo - xpb[i];
+                    oyp[i] = yo - ypb[i];
+                    ozp[i] = zo - zpb[i];
+                }
+            }
+            cull_mask = cache->cull_mask;
+        }
+    }
+
+#pragma omp parallel for schedule(static, chunk_blocks) reduction(|:gr_failed) if(N >= 2*min_chunk)
+    for (int blk=0; blk<Nblocks; blk++){
+        double sx[REBX_EPHEM_BLOCK], sy[REBX_EPHEM_BLOCK], sz[REBX_EPHEM_BLOCK];
+        double sax[REBX_EPHEM_BLOCK], say[REBX_EPHEM_BLOCK], saz[REBX_EPHEM_BLOCK];
+        const int j0 = blk*REBX_EPHEM_BLOCK;
+        struct reb_particle* const ps = particles + j0;
+        const int Nb = (N - j0 < REBX_EPHEM_BLOCK) ? N - j0 : REBX_EPHEM_BLOCK;
+
+        for (int j=0; j<Nb; j++){
+            sx[j] = ps[j].x;
+            sy[j] = ps[j].y;
+            sz[j] = ps[j].z;
+            sax[j] = ps[j].ax;
+            say[j] = ps[j].ay;
+            saz[j] = ps[j].az;
+        }
+
+        // Calculate acceleration due to sun, planets and massive asteroids.
+        if (cull_mask == NULL){
+            for (int i=0; i<Np; i++){
+                rebx_ephemeris_point_mass(GMp[i], xo - xpb[i], yo - ypb[i], zo - zpb[i], Nb, sx, sy, sz, sax, say, saz);
+            }
+        }
+        else{
+            // Perturbers kept by every particle in the block go through the
+            // vectorized kernel, those dropped by all of them are skipped.
+            uint32_t* const bm = cache->cull_mask + j0;
+            if (cull_refresh){
+                rebx_ephemeris_cull(Np, GMp, oxp, oyp, ozp, *cull_tol, Nb, sx, sy, sz, bm);
+            }
+            uint32_t any = 0;
+            uint32_t all = ~(uint32_t)0;
+            for (int j=0; j<Nb; j++){
+                any |= bm[j];
+                all &= bm[j];
+            }
+            for (int i=0; i<Np; i++){
+                const uint32_t bit = (uint32_t)1 << i;
+                if (all & bit){
+                    rebx_ephemeris_point_mass(GMp[i], xo - xpb[i], yo - ypb[i], zo - zpb[i], Nb, sx, sy, sz, sax, say, saz);
+                }
+                else if (any & bit){
+                    rebx_ephemeris_point_mass_masked(GMp[i], xo - xpb[i], yo - ypb[i], zo - zpb[i], Nb, bm, bit, sx, sy, sz, sax, say, saz);
+                }
+            }
+        }
+
+        // Earth J2 and J4 (the geocenter is the reference) and solar J2
+        // (the Sun center is the reference).
+        rebx_ephemeris_field(cache->earth_field, G*Mearth, &earth, xo - xe, yo - ye, zo - ze, Nb, sx, sy, sz, sax, say, saz);
+        rebx_ephemeris_field(cache->sun_field, G*Msun, &sun, xo - xs, yo - ys, zo - zs, Nb, sx, sy, sz, sax, say, saz);
+
+        for (int j=0; j<Nb; j++){
+            const struct reb_particle p = ps[j];
+            double ax = sax[j];
+            double ay = say[j];
+            double az = saz[j];
+
+            // Solar GR, relative to the Sun, using the accelerations
+            // accumulated so far.
+            gr_failed |= rebx_ephemeris_gr(mu, C2, max_iterations,
+                    p.x + (xo - xs), p.y + (yo - ys), p.z + (zo - zs),
+                    p.vx + (vxo - vxs), p.vy + (vyo - vys), p.vz + (vzo - vzs),
+                    &ax, &ay, &az);
+
+            if(*geo == 1){
+                ax -= axe;
+                ay -= aye;
+                az -= aze;
+            }
+
+            ps[j].ax = ax;
+            ps[j].ay = ay;
+            ps[j].az = az;
+        }
+    }
+
+    // Warn once, outside the parallel region.
+    if(gr_failed){
+        reb_warning(sim, "REBOUNDx Warning: 10 iterations in ephemeris forces failed to converge. This is typically because the perturbation is too strong for the current implementation.");
+    }
+
+    // Variational particles.  The test particles do not interact, so each
+    // variational particle only sees the Jacobian of the accelerations of
+    // its own real particle.  The geocentric correction -a_earth does not
+    // depend on the particle and drops out.  For GR the Jacobian is taken
+    // of the leading order test-particle form
+    // mu/(c^2 r^3) [(4 mu/r - v^2) r + 4 (r.v) v] plus the terms through
+    // which the iterated expression above couples to the acceleration from
+    // the other bodies, which it agrees with to first order in 1/c^2.
+    const double Re2 = rebx_ephem_Re_eq*rebx_ephem_Re_eq;
+    const double K2e = 1.5*G*Mearth*rebx_ephem_J2e*Re2;
+    const double K4e = 0.625*G*Mearth*rebx_ephem_J4e*Re2*Re2;
+    const double K2s = 1.5*G*Msun*rebx_ephem_J2s*rebx_ephem_Rs_eq*rebx_ephem_Rs_eq;
+    const double k_gr = mu/C2;
+
+    for (int v=0; v<sim->var_config_N; v++){
+        const struct reb_variational_configuration* const vc = &sim->var_config[v];
+        if (vc->order != 1){
+            reb_error(sim, "REBOUNDx Error: ephemeris_forces only supports first order variational equations.\n");
+            return;
+        }
+        // One variational particle for a single test particle, otherwise
+        // one for each real particle.
+        const int j_first = (vc->testparticle >= 0) ? vc->testparticle : 0;
+        const int n_var = (vc->testparticle >= 0) ? 1 : N;
+        struct reb_particle* const vps = sim->particles + vc->index;
+
+#pragma omp parallel for schedule(static) if(n_var >= 2*min_chunk)
+        for (int k=0; k<n_var; k++){
+            const struct reb_particle p = particles[j_first + k];
+            struct reb_particle* const vp = &vps[k];
+            const double ddx = vp->x;
+            const double ddy = vp->y;
+            const double ddz = vp->z;
+            const double ddvx = vp->vx;
+            const double ddvy = vp->vy;
+            const double ddvz = vp->vz;
+            double dax = 0.;
+            double day = 0.;
+            double daz = 0.;
+            double asx = 0., asy = 0., asz = 0.;
+            double dasx = 0., dasy = 0., dasz = 0.;
+
+            // Point masses: -GM (I/r^3 - 3 r r^T/r^5).
+            for (int i=0; i<Np; i++){
+                const double dx = p.x + (xo - xpb[i]);
+                const double dy = p.y + (yo - ypb[i]);
+                const double dz = p.z + (zo - zpb[i]);
+                const double r2 = dx*dx + dy*dy + dz*dz;
+                const double _r = sqrt(r2);
+                const double prefac = GMp[i]/(r2*_r);
+                const double rdd = 3.*prefac*(dx*ddx + dy*ddy + dz*ddz)/r2;
+                dax += rdd*dx - prefac*ddx;
+                day += rdd*dy - prefac*ddy;
+                daz += rdd*dz - prefac*ddz;
+                if (i == 0){
+                    // The Sun's own point mass, which the GR coupling below leaves out.
+                    asx = -prefac*dx;
+                    asy = -prefac*dy;
+                    asz = -prefac*dz;
+                    dasx = rdd*dx - prefac*ddx;
+                    dasy = rdd*dy - prefac*ddy;
+                    dasz = rdd*dz - prefac*ddz;
+                }
+            }
+
+            // Earth J2 and J4, in the Earth equatorial frame.
+            {
+                double dx = p.x + (xo - xe);
+                double dy = p.y + (yo - ye);
+                double dz = p.z + (zo - ze);
+                double resx = ddx;
+                double resy = ddy;
+                double resz = ddz;
+                rebx_ephemeris_to_frame(&earth, &dx, &dy, &dz);
+                rebx_ephemeris_to_frame(&earth, &resx, &resy, &resz);
+                rebx_ephemeris_zonal_var(K2e, K4e, dx, dy, dz, &resx, &resy, &resz);
+                rebx_ephemeris_from_frame(&earth, &resx, &resy, &resz);
+                dax += resx;
+                day += resy;
+                daz += resz;
+            }
+
+            // Solar J2, in the solar equatorial frame.
+            {
+                double dx = p.x + (xo - xs);
+                double dy = p.y + (yo - ys);
+                double dz = p.z + (zo - zs);
+                double resx = ddx;
+                double resy = ddy;
+                double resz = ddz;
+                rebx_ephemeris_to_frame(&sun, &dx, &dy, &dz);
+                rebx_ephemeris_to_frame(&sun, &resx, &resy, &resz);
+                rebx_ephemeris_zonal_var(K2s, 0., dx, dy, dz, &resx, &resy, &resz);
+                rebx_ephemeris_from_frame(&sun, &resx, &resy, &resz);
+                dax += resx;
+                day += resy;
+                daz += resz;
+            }
+
+            // Solar GR, a = f r + g v with
+            // f = k (4 mu/r^4 - v^2/r^3) and g = 4 k (r.v)/r^3.
+            {
+                const double x = p.x + (xo - xs);
+                const double y = p.y + (yo - ys);
+                const double z = p.z + (zo - zs);
+                const double vx = p.vx + (vxo - vxs);
+                const double vy = p.vy + (vyo - vys);
+                const double vz = p.vz + (vzo - vzs);
+                const double r2 = x*x + y*y + z*z;
+                const double ri = sqrt(r2);
+                const double ir3 = 1./(r2*ri);
+                const double v2 = vx*vx + vy*vy + vz*vz;
+                const double rv = x*vx + y*vy + z*vz;
+                const double f = k_gr*(4.*mu/ri - v2)*ir3;
+                const double g = 4.*k_gr*rv*ir3;
+
+                const double rdd = x*ddx + y*ddy + z*ddz;
+                const double vdd = vx*ddx + vy*ddy + vz*ddz;
+                const double rddv = x*ddvx + y*ddvy + z*ddvz;
+                const double vddv = vx*ddvx + vy*ddvy + vz*ddvz;
+
+                // Changes in f and g.
+                const double df = k_gr*ir3*((-16.*mu/ri + 3.*v2)*rdd/r2 - 2.*vddv);
+                const double dg = 4.*k_gr*ir3*(vdd + rddv - 3.*rv*rdd/r2);
+
+                // Coupling to the acceleration a' from everything but the
+                // Sun's point mass, -A a' - (v.a') v/c^2 with
+                // A = (v^2/2 + 3 mu/r)/c^2.  Near the Earth this dominates.
+                const double apx = p.ax + (*geo == 1 ? axe : 0.) - asx;
+                const double apy = p.ay + (*geo == 1 ? aye : 0.) - asy;
+                const double apz = p.az + (*geo == 1 ? aze : 0.) - asz;
+                const double dapx = dax - dasx;
+                const double dapy = day - dasy;
+                const double dapz = daz - dasz;
+                const double A = (0.5*v2 + 3.*mu/ri)/C2;
+                const double dA = (vddv - 3.*mu*rdd*ir3)/C2;
+                const double va = (vx*apx + vy*apy + vz*apz)/C2;
+                const double dva = (ddvx*apx + ddvy*apy + ddvz*apz + vx*dapx + vy*dapy + vz*dapz)/C2;
+
+                dax += f*ddx + g*ddvx + df*x + dg*vx;
+                day += f*ddy + g*ddvy + df*y + dg*vy;
+                daz += f*ddz + g*ddvz + df*z + dg*vz;
+
+                dax -= dA*apx + A*dapx + dva*vx + va*ddvx;
+                day -= dA*apy + A*dapy + dva*vy + va*ddvy;
+                daz -= dA*apz + A*dapz + dva*vz + va*ddvz;
+            }
+
+            vp->ax += dax;
+            vp->ay += day;
+            vp->az += daz;
+        }
+    }
 }
 
 /**
@@ -632,34 +1497,94 @@ typedef struct {
   double t, x, y, z, vx, vy, vz, ax, ay, az;
 } tstate;
 
-typedef struct {
-    double* t;
-    double* state;
-    int n_out;
-    int n_particles;
-} timestate;
 
 // Gauss Radau spacings
 static const double h[9]    = { 0.0, 0.0562625605369221464656521910318, 0.180240691736892364987579942780, 0.352624717113169637373907769648, 0.547153626330555383001448554766, 0.734210177215410531523210605558, 0.885320946839095768090359771030, 0.977520613561287501891174488626, 1.0};
 
-int integration_function(double tstart, double tstep, double trange,
-			 int geocentric,
-			 int n_particles,
-			 double* instate,
-			 timestate *ts){
+void store_function(struct reb_simulation* r, int n_out, int n_particles, tstate* last, double* outtime, double* outstate);
+static void interpolate_state(struct reb_simulation* r, int n_particles, tstate* last, double hn, double* out);
+static void interpolate_b(const double dt, const struct reb_dpconst7 b, int n_particles, const tstate* last, double hn, double* out);
+static void store_step(const double t, const double dt, const struct reb_dpconst7 b, int n_out, int n_particles, const tstate* last, double* outtime, double* outstate);
+
+// Thread pool for the drivers below that run independent arcs, groups or
+// observations at once.  It uses pthreads rather than OpenMP, so that
+// they also run in parallel in the default build, which does not pass
+// -fopenmp.  Items are handed out one at a time, since arcs and groups
+// can take very different times.
+typedef void (*rebx_work_fn)(void* ctx, int i);
+
+struct rebx_work {
+    rebx_work_fn fn;
+    void* ctx;
+    int n;
+    int next;           // next item to hand out
+    pthread_mutex_t lock;
+};
 
-    void store_function(struct reb_simulation* r, int n_out, int n_particles, tstate* last, double* outtime, double* outstate);
-    struct reb_simulation* r = reb_create_simulation();
+static void* rebx_work_thread(void* arg){
+    struct rebx_work* const w = arg;
+    while (1){
+        pthread_mutex_lock(&w->lock);
+        const int i = w->next++;
+        pthread_mutex_unlock(&w->lock);
+        if (i >= w->n){
+            break;
+        }
+        w->fn(w->ctx, i);
+    }
+    return NULL;
+}
+
+// Number of threads to use for n_threads, 0 meaning the OpenMP default if
+// compiled with OpenMP and one per online processor otherwise.
+static int rebx_work_threads(const int n_threads){
+    if (n_threads > 0){
+        return n_threads;
+    }
+#ifdef _OPENMP
+    return omp_get_max_threads();
+#else
+    const long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return (n > 0) ? (int)n : 1;
+#endif
+}
+
+// Runs fn(ctx, i) for i from 0 to n-1 on up to nt threads, the calling
+// thread included.  Threads that cannot be started leave their share to
+// the others.
+static void rebx_parallel_for(const int n, const int nt, rebx_work_fn fn, void* ctx){
+    const int n_workers = (nt < n) ? nt : n;
+    if (n_workers <= 1){
+        for (int i=0; i<n; i++){
+            fn(ctx, i);
+        }
+        return;
+    }
+    struct rebx_work w = {.fn = fn, .ctx = ctx, .n = n, .next = 0};
+    pthread_mutex_init(&w.lock, NULL);
+    pthread_t* const threads = malloc((n_workers-1)*sizeof(*threads));
+    int n_started = 0;
+    if (threads != NULL){
+        while (n_started < n_workers-1 && pthread_create(&threads[n_started], NULL, rebx_work_thread, &w) == 0){
+            n_started++;
+        }
+    }
+    rebx_work_thread(&w);
+    for (int k=0; k<n_started; k++){
+        pthread_join(threads[k], NULL);
+    }
+    free(threads);
+    pthread_mutex_destroy(&w.lock);
+}
+
+// Called after every completed step of integrate_arc, with last holding
+// the state at the start of the step.  Nonzero return stops the arc.
+typedef int (*arc_step_fn)(struct reb_simulation* r, int n_particles, tstate* last, void* ctx);
+
+// Attaches REBOUNDx with the ephemeris_forces effect to r.  eph is the
+// ephemeris handle for the effect, or NULL for the default one.
+static void arc_attach_forces(struct reb_simulation* const r, struct rebx_ephemeris* const eph, int geocentric){
 
-    // Set up simulation constants
-    r->G = 0.295912208285591100E-03; // Gravitational constant (AU, solar masses, days)
-    r->integrator = REB_INTEGRATOR_IAS15;
-    r->heartbeat = NULL;
-    r->display_data = NULL;
-    r->collision = REB_COLLISION_NONE;  // This is important and needs to be considered carefully.
-    r->collision_resolve = reb_collision_resolve_merge;
-    r->gravity = REB_GRAVITY_NONE;
-    
     struct rebx_extras* rebx = rebx_attach(r);
 
     // Also add "ephemeris_forces" 
@@ -668,6 +1593,10 @@ int integration_function(double tstart, double tstep, double trange,
 
     rebx_set_param_int(rebx, &ephem_forces->ap, "geocentric", geocentric);
 
+    if (eph != NULL){
+        rebx_set_param_pointer(rebx, &ephem_forces->ap, "ephemeris", eph);
+    }
+
     // Set number of ephemeris bodies
     rebx_set_param_int(rebx, &ephem_forces->ap, "N_ephem", 11);
 
@@ -677,15 +1606,28 @@ int integration_function(double tstart, double tstep, double trange,
     // Set speed of light in right units (set by G & initial conditions).
     // Here we use default units of AU/(yr/2pi)
     rebx_set_param_double(rebx, &ephem_forces->ap, "c", 173.144632674);
+}
 
-    int fac = 5;
-    int n_out = (int)fac*8*fabs(trange/tstep);
-    
-    double* outstate = (double *) malloc(n_out*n_particles*6*sizeof(double));
-    double* outtime  = (double *) malloc(n_out*sizeof(double));    
+// Sets up the simulation for one arc, with the accelerations at tstart
+// already evaluated.
+static struct reb_simulation* arc_create(struct rebx_ephemeris* const eph,
+			 double tstart, double tstep,
+			 int geocentric,
+			 int n_particles,
+			 double* instate){
 
-    rebx_set_param_int(rebx, &ephem_forces->ap, "n_out", 0);
-    rebx_set_param_pointer(rebx, &ephem_forces->ap, "outstate", outstate);
+    struct reb_simulation* r = reb_create_simulation();
+
+    // Set up simulation constants
+    r->G = 0.295912208285591100E-03; // Gravitational constant (AU, solar masses, days)
+    r->integrator = REB_INTEGRATOR_IAS15;
+    r->heartbeat = NULL;
+    r->display_data = NULL;
+    r->collision = REB_COLLISION_NONE;  // This is important and needs to be considered carefully.
+    r->collision_resolve = reb_collision_resolve_merge;
+    r->gravity = REB_GRAVITY_NONE;
+    
+    arc_attach_forces(r, eph, geocentric);
 
     for(int i=0; i<n_particles; i++){
 
@@ -701,36 +1643,37 @@ int integration_function(double tstart, double tstep, double trange,
 	reb_add(r, tp);
     }
 
-    int N = r->N;
-    
     r->t = tstart;    // set simulation internal time to the time of test particle initial conditions.
     r->dt = tstep;    // time step in days
 
-    outtime[0] = r->t;	
-    
-    for(int j=0; j<N; j++){
-	int offset = j*6;
-	outstate[offset+0] = r->particles[j].x;
-	outstate[offset+1] = r->particles[j].y;
-	outstate[offset+2] = r->particles[j].z;
-	outstate[offset+3] = r->particles[j].vx;
-	outstate[offset+4] = r->particles[j].vy;
-	outstate[offset+5] = r->particles[j].vz;
-    }
-
-    tstate last[n_particles];
-
     //reb_integrate(r, times[0]); // Not sure this is needed.
     reb_update_acceleration(r); // This is needed to save the acceleration.
- 
-    double tmax = tstart+trange;
-    int i = 1;
+
+    return r;
+}
+
+static void arc_free(struct reb_simulation* const r){
+    rebx_free(r->extras);    // this explicitly frees all the memory allocated by REBOUNDx 
+    reb_free_simulation(r);
+}
+
+// Integrates a simulation from arc_create for trange.  The accelerations
+// of the particles must be up to date.
+static int arc_run(struct reb_simulation* const r, double trange,
+			 int n_particles,
+			 arc_step_fn step, void* ctx){
+
+    tstate* last = malloc(n_particles*sizeof(tstate));
+
+    double tmax = r->t+trange;
+    int status = 1;
     const double dtsign = copysign(1.,r->dt);   // Used to determine integration direction
 
     while((r->t)*dtsign<tmax*dtsign){ 
 
-	// This could be a helper function
-	for(int j=0; j<N; j++){
+	// This could be a helper function.  step may have removed
+	// particles, so this goes by r->N.
+	for(int j=0; j<r->N; j++){
 	    last[j].t = r->t;	
 	    last[j].x = r->particles[j].x;
 	    last[j].y = r->particles[j].y;
@@ -745,138 +1688,1311 @@ int integration_function(double tstart, double tstep, double trange,
 
 	reb_step(r);
 
-	store_function(r, 8*(i-1), n_particles, last, outtime, outstate);
+	if (step(r, n_particles, last, ctx) != 0){
+	    status = 0;
+	    break;
+	}
 	reb_update_acceleration(r); // This is needed to save the acceleration.
 
-	i++;
+    }
+
+    free(last);
+
+    return status;
+}
 
+// Integrate one arc with its own simulation.  Output is left to step, so
+// memory use does not grow with the arc.
+static int integrate_arc(struct rebx_ephemeris* const eph,
+			 double tstart, double tstep, double trange,
+			 int geocentric,
+			 int n_particles,
+			 double* instate,
+			 arc_step_fn step, void* ctx){
+    struct reb_simulation* const r = arc_create(eph, tstart, tstep, geocentric, n_particles, instate);
+    const int status = arc_run(r, trange, n_particles, step, ctx);
+    arc_free(r);
+    return status;
+}
+
+// Hands the Gauss-Radau substeps of each step to a rebx_ephem_sink.
+struct stream_ctx {
+    rebx_ephem_sink sink;
+    void* ctx;
+    double* outtime;    // One step worth of output, reused for every step.
+    double* outstate;
+};
+
+static int stream_step(struct reb_simulation* r, int n_particles, tstate* last, void* ctx){
+    struct stream_ctx* const sc = ctx;
+    store_function(r, 0, n_particles, last, sc->outtime, sc->outstate);
+    return sc->sink(sc->ctx, 8, n_particles, sc->outtime, sc->outstate);
+}
+
+// Sink that collects everything into one growing timestate.
+struct timestate_buf {
+    timestate* ts;
+    int n_alloc;
+};
+
+static int timestate_sink(void* ctx, int n, int n_particles, const double* t, const double* state){
+    struct timestate_buf* const buf = ctx;
+    timestate* const ts = buf->ts;
+    if (ts->n_out + n > buf->n_alloc){
+        int n_alloc = buf->n_alloc ? 2*buf->n_alloc : 64;
+        while (n_alloc < ts->n_out + n){
+            n_alloc *= 2;
+        }
+        double* const tn = realloc(ts->t, n_alloc*sizeof(double));
+        if (tn == NULL){
+            return 1;
+        }
+        ts->t = tn;
+        double* const sn = realloc(ts->state, (size_t)n_alloc*n_particles*6*sizeof(double));
+        if (sn == NULL){
+            return 1;
+        }
+        ts->state = sn;
+        buf->n_alloc = n_alloc;
     }
+    memcpy(ts->t + ts->n_out, t, n*sizeof(double));
+    memcpy(ts->state + (size_t)ts->n_out*n_particles*6, state, (size_t)n*n_particles*6*sizeof(double));
+    ts->n_out += n;
+    return 0;
+}
 
-    ts->t = outtime;
-    ts->state = outstate;
+static int integrate_arc_timestate(struct rebx_ephemeris* const eph,
+			 double tstart, double tstep, double trange,
+			 int geocentric,
+			 int n_particles,
+			 double* instate,
+			 timestate *ts){
+    struct timestate_buf buf = {ts, 0};
+    ts->t = NULL;
+    ts->state = NULL;
+    ts->n_out = 0;
     ts->n_particles = n_particles;
-    ts->n_out = (i-1)*8;
-    //*nout =  n_out;
+    return integration_function_stream(eph, tstart, tstep, trange, geocentric, n_particles, instate, timestate_sink, &buf);
+}
 
+int integration_function(double tstart, double tstep, double trange,
+			 int geocentric,
+			 int n_particles,
+			 double* instate,
+			 timestate *ts){
+    return integrate_arc_timestate(NULL, tstart, tstep, trange, geocentric, n_particles, instate, ts);
+}
 
-    rebx_free(rebx);    // this explicitly frees all the memory allocated by REBOUNDx 
-    reb_free_simulation(r);
+int integration_function_eph(struct rebx_ephemeris* const eph,
+			 double tstart, double tstep, double trange,
+			 int geocentric,
+			 int n_particles,
+			 double* instate,
+			 timestate *ts){
+    return integrate_arc_timestate(eph, tstart, tstep, trange, geocentric, n_particles, instate, ts);
+}
+
+void rebx_free_timestate(timestate* const ts){
+    free(ts->t);
+    free(ts->state);
+    ts->t = NULL;
+    ts->state = NULL;
+    ts->n_out = 0;
+}
 
+// Pipelined output for integration_function_stream_async.  After every
+// step the integration thread only copies the start-of-step state and the
+// IAS15 coefficients into a free slot of a small ring.  A writer thread
+// evaluates the interpolants and calls the sink, overlapping with the
+// next step.
+#define REBX_STREAM_RING 4
+
+struct stream_slot {
+    double t;           // end of the step
+    double dt;          // its length
+    tstate* last;       // n_particles states at the start of the step
+    double* b;          // 7*3*n_particles IAS15 coefficients
+};
+
+struct stream_async {
+    struct stream_ctx* sc;
+    int n_particles;
+    struct stream_slot slot[REBX_STREAM_RING];
+    int head;           // oldest filled slot
+    int count;          // number of filled slots
+    int done;           // 1 once the integration has finished
+    int stopped;        // 1 once the sink has asked to stop
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+};
 
-    return(1);
+static struct reb_dpconst7 stream_slot_b(const struct stream_slot* const slot, const int n_particles){
+    const size_t n3 = 3*(size_t)n_particles;
+    struct reb_dpconst7 b = {
+        .p0 = slot->b,
+        .p1 = slot->b + n3,
+        .p2 = slot->b + 2*n3,
+        .p3 = slot->b + 3*n3,
+        .p4 = slot->b + 4*n3,
+        .p5 = slot->b + 5*n3,
+        .p6 = slot->b + 6*n3,
+    };
+    return b;
 }
 
-void store_function(struct reb_simulation* r, int n_out, int n_particles, tstate* last, double* outtime, double* outstate){
-    
-    int N = r->N;
-    int N3 = 3*N;
-    double s[9]; // Summation coefficients
+static void* stream_writer(void* arg){
+    struct stream_async* const sa = arg;
+    struct stream_ctx* const sc = sa->sc;
+    pthread_mutex_lock(&sa->lock);
+    while (1){
+        while (sa->count == 0 && !sa->done){
+            pthread_cond_wait(&sa->cond, &sa->lock);
+        }
+        if (sa->count == 0){
+            break;
+        }
+        const struct stream_slot* const slot = &sa->slot[sa->head];
+        pthread_mutex_unlock(&sa->lock);
+
+        store_step(slot->t, slot->dt, stream_slot_b(slot, sa->n_particles), 0, sa->n_particles, slot->last, sc->outtime, sc->outstate);
+        const int stop = sc->sink(sc->ctx, 8, sa->n_particles, sc->outtime, sc->outstate);
+
+        pthread_mutex_lock(&sa->lock);
+        sa->head = (sa->head + 1) % REBX_STREAM_RING;
+        sa->count--;
+        pthread_cond_signal(&sa->cond);
+        if (stop){
+            sa->stopped = 1;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&sa->lock);
+    return NULL;
+}
 
-    outtime[n_out] = last[0].t;    
+static int stream_step_async(struct reb_simulation* r, int n_particles, tstate* last, void* ctx){
+    struct stream_async* const sa = ctx;
+    pthread_mutex_lock(&sa->lock);
+    while (sa->count == REBX_STREAM_RING && !sa->stopped){
+        pthread_cond_wait(&sa->cond, &sa->lock);
+    }
+    if (sa->stopped){
+        pthread_mutex_unlock(&sa->lock);
+        return 1;
+    }
+    // The writer never touches slots past the filled ones.
+    struct stream_slot* const slot = &sa->slot[(sa->head + sa->count) % REBX_STREAM_RING];
+    pthread_mutex_unlock(&sa->lock);
+
+    const size_t n3 = 3*(size_t)n_particles;
+    const struct reb_dp7 br = r->ri_ias15.br;
+    double* const src[7] = {br.p0, br.p1, br.p2, br.p3, br.p4, br.p5, br.p6};
+    slot->t = r->t;
+    slot->dt = r->dt_last_done;
+    memcpy(slot->last, last, n_particles*sizeof(tstate));
+    for (int k=0; k<7; k++){
+        memcpy(slot->b + k*n3, src[k], n3*sizeof(double));
+    }
 
-    for(int j=0; j<n_particles; j++){
-	int offset = (n_out*n_particles+j)*6;
-	outstate[offset+0] = last[j].x;
-	outstate[offset+1] = last[j].y;	
-	outstate[offset+2] = last[j].z;
-	outstate[offset+3] = last[j].vx;	
-	outstate[offset+4] = last[j].vy;
-	outstate[offset+5] = last[j].vz;	
+    pthread_mutex_lock(&sa->lock);
+    sa->count++;
+    pthread_cond_signal(&sa->cond);
+    pthread_mutex_unlock(&sa->lock);
+    return 0;
+}
+
+static int integrate_stream(struct reb_simulation* const r, double trange,
+			 int n_particles,
+			 rebx_ephem_sink sink, void* ctx,
+			 const int async){
+    struct stream_ctx sc = {sink, ctx, NULL, NULL};
+    sc.outtime = malloc(8*sizeof(double));
+    sc.outstate = malloc(8*n_particles*6*sizeof(double));
+
+    struct stream_async sa = {.sc = &sc, .n_particles = n_particles};
+    int status;
+    int pipelined = 0;
+    if (async){
+        pipelined = 1;
+        for (int k=0; k<REBX_STREAM_RING; k++){
+            sa.slot[k].last = malloc(n_particles*sizeof(tstate));
+            sa.slot[k].b = malloc(21*(size_t)n_particles*sizeof(double));
+            if (sa.slot[k].last == NULL || sa.slot[k].b == NULL){
+                pipelined = 0;
+            }
+        }
+        if (pipelined){
+            pthread_mutex_init(&sa.lock, NULL);
+            pthread_cond_init(&sa.cond, NULL);
+            pthread_t writer;
+            if (pthread_create(&writer, NULL, stream_writer, &sa) == 0){
+                status = arc_run(r, trange, n_particles, stream_step_async, &sa);
+                pthread_mutex_lock(&sa.lock);
+                sa.done = 1;
+                pthread_cond_signal(&sa.cond);
+                pthread_mutex_unlock(&sa.lock);
+                pthread_join(writer, NULL);
+                // The writer may only have seen the sink stop after the
+                // last step was queued.
+                if (sa.stopped){
+                    status = 0;
+                }
+            }
+            else{
+                pipelined = 0;
+            }
+            pthread_cond_destroy(&sa.cond);
+            pthread_mutex_destroy(&sa.lock);
+        }
+        for (int k=0; k<REBX_STREAM_RING; k++){
+            free(sa.slot[k].last);
+            free(sa.slot[k].b);
+        }
     }
-    
-    // Convenience variable.  The 'br' field contains the 
-    // set of coefficients from the last completed step.
-    const struct reb_dpconst7 b  = dpcast(r->ri_ias15.br);
+    // Without the buffers or the thread the output is written in line.
+    if (!pipelined){
+        status = arc_run(r, trange, n_particles, stream_step, &sc);
+    }
+    free(sc.outtime);
+    free(sc.outstate);
+    return status;
+}
 
-    double* x0 = malloc(sizeof(double)*N3);
-    double* v0 = malloc(sizeof(double)*N3);
-    double* a0 = malloc(sizeof(double)*N3);
+int integration_function_stream(struct rebx_ephemeris* const eph,
+			 double tstart, double tstep, double trange,
+			 int geocentric,
+			 int n_particles,
+			 double* instate,
+			 rebx_ephem_sink sink, void* ctx){
+    struct reb_simulation* const r = arc_create(eph, tstart, tstep, geocentric, n_particles, instate);
+    const int status = integrate_stream(r, trange, n_particles, sink, ctx, 0);
+    arc_free(r);
+    return status;
+}
 
-    for(int j=0;j<N;j++) {
+int integration_function_stream_async(struct rebx_ephemeris* const eph,
+			 double tstart, double tstep, double trange,
+			 int geocentric,
+			 int n_particles,
+			 double* instate,
+			 rebx_ephem_sink sink, void* ctx){
+    struct reb_simulation* const r = arc_create(eph, tstart, tstep, geocentric, n_particles, instate);
+    const int status = integrate_stream(r, trange, n_particles, sink, ctx, 1);
+    arc_free(r);
+    return status;
+}
 
-	const int k0 = 3*j+0;
-	const int k1 = 3*j+1;
-	const int k2 = 3*j+2;
+// Fills in the requested epochs that fall inside each completed step.
+struct epochs_ctx {
+    int n_epochs;
+    const double* epochs;
+    double* outstate;
+    int n_done;
+    double dt_next;     // step IAS15 would take next
+};
 
-	x0[k0] = last[j].x;
-	x0[k1] = last[j].y;
-	x0[k2] = last[j].z;	
+static int epochs_step(struct reb_simulation* r, int n_particles, tstate* last, void* ctx){
+    struct epochs_ctx* const ec = ctx;
+    const double t0 = last[0].t;
+    const double dt = r->dt_last_done;
+    const double dtsign = copysign(1., dt);
+    ec->dt_next = r->dt;
+    while (ec->n_done < ec->n_epochs && ec->epochs[ec->n_done]*dtsign <= r->t*dtsign){
+        const double hn = (ec->epochs[ec->n_done] - t0)/dt;
+        interpolate_state(r, n_particles, last, hn, ec->outstate + (size_t)ec->n_done*n_particles*6);
+        ec->n_done++;
+    }
+    return ec->n_done == ec->n_epochs;
+}
+
+// Checks that the epochs run from tstart in the direction of tstep.
+static int epochs_sorted(const char* const caller, const double tstart, const double tstep, const int n_epochs, const double* const epochs){
+    const double dtsign = copysign(1., tstep);
+    if ((epochs[0] - tstart)*dtsign < 0.){
+        fprintf(stderr, "REBOUNDx Error: %s: epochs must not precede tstart in the direction of integration.\n", caller);
+        return 0;
+    }
+    for (int i=1; i<n_epochs; i++){
+        if ((epochs[i] - epochs[i-1])*dtsign < 0.){
+            fprintf(stderr, "REBOUNDx Error: %s: epochs must be sorted in the direction of integration.\n", caller);
+            return 0;
+        }
+    }
+    return 1;
+}
 
-	v0[k0] = last[j].vx;
-	v0[k1] = last[j].vy;
-	v0[k2] = last[j].vz;	
+int integration_function_epochs(struct rebx_ephemeris* const eph,
+			 double tstart, double tstep,
+			 int geocentric,
+			 int n_particles,
+			 double* instate,
+			 int n_epochs, const double* epochs,
+			 double* outstate){
+    if (n_epochs <= 0){
+        return 0;
+    }
+    if (!epochs_sorted("integration_function_epochs", tstart, tstep, n_epochs, epochs)){
+        return 0;
+    }
 
-	a0[k0] = last[j].ax;
-	a0[k1] = last[j].ay;
-	a0[k2] = last[j].az;
+    struct epochs_ctx ec = {n_epochs, epochs, outstate, 0, tstep};
 
+    // Epochs at tstart itself don't need a step.
+    while (ec.n_done < n_epochs && epochs[ec.n_done] == tstart){
+        memcpy(outstate + (size_t)ec.n_done*n_particles*6, instate, n_particles*6*sizeof(double));
+        ec.n_done++;
+    }
+    if (ec.n_done == n_epochs){
+        return n_epochs;
     }
 
-    // Loop over interval using Gauss-Radau spacings      
-    for(int n=1;n<8;n++) {                          
+    integrate_arc(eph, tstart, tstep, epochs[n_epochs-1] - tstart, geocentric, n_particles, instate, epochs_step, &ec);
+    return ec.n_done;
+}
 
-	s[0] = r->dt_last_done * h[n];
-
-	s[1] = s[0] * s[0] / 2.;
-	s[2] = s[1] * h[n] / 3.;
-	s[3] = s[2] * h[n] / 2.;
-	s[4] = 3. * s[3] * h[n] / 5.;
-	s[5] = 2. * s[4] * h[n] / 3.;
-	s[6] = 5. * s[5] * h[n] / 7.;
-	s[7] = 3. * s[6] * h[n] / 4.;
-	s[8] = 7. * s[7] * h[n] / 9.;
-
-	// Predict positions at interval n using b values	
-	for(int j=0;j<N;j++) {  
-	  //int mj = j;
-	  const int k0 = 3*j+0;
-	  const int k1 = 3*j+1;
-	  const int k2 = 3*j+2;
-
-	  double xx0 = x0[k0] + (s[8]*b.p6[k0] + s[7]*b.p5[k0] + s[6]*b.p4[k0] + s[5]*b.p3[k0] + s[4]*b.p2[k0] + s[3]*b.p1[k0] + s[2]*b.p0[k0] + s[1]*a0[k0] + s[0]*v0[k0] );
-	  double xy0 = x0[k1] + (s[8]*b.p6[k1] + s[7]*b.p5[k1] + s[6]*b.p4[k1] + s[5]*b.p3[k1] + s[4]*b.p2[k1] + s[3]*b.p1[k1] + s[2]*b.p0[k1] + s[1]*a0[k1] + s[0]*v0[k1] );
-	  double xz0 = x0[k2] + (s[8]*b.p6[k2] + s[7]*b.p5[k2] + s[6]*b.p4[k2] + s[5]*b.p3[k2] + s[4]*b.p2[k2] + s[3]*b.p1[k2] + s[2]*b.p0[k2] + s[1]*a0[k2] + s[0]*v0[k2] );
-
-	  double t = r->t + r->dt_last_done * (h[n] - 1.0);
-
-	  int offset = ((n_out+n)*n_particles+j)*6;	  
-	  outtime[n_out+n] = t;
-	  outstate[offset+0] = xx0;
-	  outstate[offset+1] = xy0;	  	  
-	  outstate[offset+2] = xz0;
-	  
-	}
+// Particles whose free-fall times differ by less than this factor share a
+// group in integration_function_groups.
+#define REBX_GROUP_RATIO 4.
+#define REBX_GROUP_MAX 8
+
+// Shortest free-fall time sqrt(r^3/GM) of a particle about the Sun and
+// planets at time t.  A stand-in for the step IAS15 will need, which
+// drops sharply during close encounters.
+static void group_timescales(const struct rebx_ephemeris* const eph, const double t, const int geocentric,
+        const int n_particles, const double* const state, double* const tau){
+    const double G = 0.295912208285591100E-03;
+    double M[11];
+    struct mpos_s pstate[11];
+    ephem_all(eph, G, t, M, pstate);
+    const double* const earth = pstate[3].u;
+    for (int j=0; j<n_particles; j++){
+        double x = state[6*j+0];
+        double y = state[6*j+1];
+        double z = state[6*j+2];
+        if (geocentric == 1){
+            x += earth[0];
+            y += earth[1];
+            z += earth[2];
+        }
+        double tau_min = INFINITY;
+        for (int i=0; i<11; i++){
+            const double dx = x - pstate[i].u[0];
+            const double dy = y - pstate[i].u[1];
+            const double dz = z - pstate[i].u[2];
+            const double r2 = dx*dx + dy*dy + dz*dz;
+            const double tau_i = sqrt(r2*sqrt(r2)/(G*M[i]));
+            if (tau_i < tau_min){
+                tau_min = tau_i;
+            }
+        }
+        tau[j] = tau_min;
+    }
+}
 
-	s[0] = r->dt_last_done * h[n];
-	s[1] =      s[0] * h[n] / 2.;
-	s[2] = 2. * s[1] * h[n] / 3.;
-	s[3] = 3. * s[2] * h[n] / 4.;
-	s[4] = 4. * s[3] * h[n] / 5.;
-	s[5] = 5. * s[4] * h[n] / 6.;
-	s[6] = 6. * s[5] * h[n] / 7.;
-	s[7] = 7. * s[6] * h[n] / 8.;
+// One group of integration_function_groups.  The simulation lives from
+// the epoch the group first gets members until it runs out of them.
+struct group_sim {
+    struct reb_simulation* r;
+    int* ids;           // index in instate of the particle in each slot
+};
 
-	// Predict velocities at interval n using b values	
-	for(int j=0;j<N;j++) {
+// Steps r to t1 exactly, so that particles can move between the groups
+// there.  The step is only cut short for t1.  IAS15 may reject the cut
+// step and finish a shorter one, in which case it just carries on from
+// there.  Once t1 is reached, the next step is the smaller of the one
+// IAS15 asked for before the cut and the one it proposes after it.
+static void group_advance(struct reb_simulation* const r, const double t1){
+    const double dtsign = copysign(1., r->dt);
+    while (r->t*dtsign < t1*dtsign){
+        const double t0 = r->t;
+        const double dt = r->dt;
+        const int cut = ((t0 + dt - t1)*dtsign >= 0.);
+        if (cut){
+            r->dt = t1 - t0;
+        }
+        reb_step(r);
+        if (cut && r->dt_last_done == t1 - t0){
+            // Only absorbs the rounding in r->t
+            r->t = t1;
+            r->dt = (fabs(r->dt) < fabs(dt)) ? r->dt : dt;
+        }
+    }
+}
 
-	  const int k0 = 3*j+0;
-	  const int k1 = 3*j+1;
-	  const int k2 = 3*j+2;
+struct groups_work {
+    struct group_sim* gs;
+    double t1;
+};
 
-	  double vx0 = v0[k0] + s[7]*b.p6[k0] + s[6]*b.p5[k0] + s[5]*b.p4[k0] + s[4]*b.p3[k0] + s[3]*b.p2[k0] + s[2]*b.p1[k0] + s[1]*b.p0[k0] + s[0]*a0[k0];
-	  double vy0 = v0[k1] + s[7]*b.p6[k1] + s[6]*b.p5[k1] + s[5]*b.p4[k1] + s[4]*b.p3[k1] + s[3]*b.p2[k1] + s[2]*b.p1[k1] + s[1]*b.p0[k1] + s[0]*a0[k1];
-	  double vz0 = v0[k2] + s[7]*b.p6[k2] + s[6]*b.p5[k2] + s[5]*b.p4[k2] + s[4]*b.p3[k2] + s[3]*b.p2[k2] + s[2]*b.p1[k2] + s[1]*b.p0[k2] + s[0]*a0[k2];
+static void groups_work(void* ctx, int g){
+    struct groups_work* const gw = ctx;
+    if (gw->gs[g].r != NULL){
+        group_advance(gw->gs[g].r, gw->t1);
+    }
+}
 
-	  int offset = ((n_out+n)*n_particles+j)*6;	  
-	  outstate[offset+3] = vx0;
-	  outstate[offset+4] = vy0;	  	  
-	  outstate[offset+5] = vz0;
+int integration_function_groups(struct rebx_ephemeris* eph,
+			 double tstart, double tstep,
+			 int geocentric,
+			 int n_particles,
+			 double* instate,
+			 int n_epochs, const double* epochs,
+			 double* outstate,
+			 const int n_threads){
+    if (n_epochs <= 0 || n_particles <= 0){
+        return 0;
+    }
+    if (!epochs_sorted("integration_function_groups", tstart, tstep, n_epochs, epochs)){
+        return 0;
+    }
+    if (eph == NULL){
+        eph = ephem_default();
+    }
 
-	}
+    const int nt = rebx_work_threads(n_threads);
+
+    const size_t state_size = 6*(size_t)n_particles;
+    double* const state = malloc(state_size*sizeof(*state));
+    double* const dt = malloc(n_particles*sizeof(*dt));
+    double* const tau = malloc(n_particles*sizeof(*tau));
+    int* const group = malloc(n_particles*sizeof(*group));
+    int* const group_next = malloc(n_particles*sizeof(*group_next));
+    double* const gstate = malloc(state_size*sizeof(*gstate));
+    int* const ids = malloc(REBX_GROUP_MAX*(size_t)n_particles*sizeof(*ids));
+    struct rebx_ephem_shared* const shared = rebx_ephem_shared_create();
+    if (state == NULL || dt == NULL || tau == NULL || group == NULL || group_next == NULL || gstate == NULL || ids == NULL || shared == NULL){
+        free(state); free(dt); free(tau); free(group); free(group_next); free(gstate); free(ids);
+        rebx_ephem_shared_free(shared);
+        fprintf(stderr, "REBOUNDx Error: integration_function_groups: could not allocate memory.\n");
+        return 0;
+    }
+    memcpy(state, instate, state_size*sizeof(*state));
+    for (int j=0; j<n_particles; j++){
+        dt[j] = tstep;
+        group[j] = -1;
+    }
+    struct group_sim gs[REBX_GROUP_MAX];
+    for (int g=0; g<REBX_GROUP_MAX; g++){
+        gs[g].r = NULL;
+        gs[g].ids = ids + (size_t)g*n_particles;
+    }
+
+    // Each group is one simulation with its own IAS15 step, kept from one
+    // epoch to the next.  The groups stop exactly at every epoch, where the
+    // particles are grouped again, since their encounters come and go.  A
+    // particle that changes group is moved from one simulation to the
+    // other, and only the groups it leaves or joins start their IAS15
+    // predictor over.  All groups look up the perturbers through one
+    // shared cache.
+    double t = tstart;
+    int n_done = 0;
+    while (n_done < n_epochs){
+        const double t1 = epochs[n_done];
+        if (t1 != t){
+            group_timescales(eph, t, geocentric, n_particles, state, tau);
+            double tau_max = 0.;
+            for (int j=0; j<n_particles; j++){
+                tau_max = (tau[j] > tau_max) ? tau[j] : tau_max;
+            }
+            int moved[REBX_GROUP_MAX] = {0};
+            for (int j=0; j<n_particles; j++){
+                // The last group also takes anything degenerate
+                const double ratio = tau_max/tau[j];
+                group_next[j] = (ratio < pow(REBX_GROUP_RATIO, REBX_GROUP_MAX-1)) ? (int)floor(log(ratio)/log(REBX_GROUP_RATIO)) : REBX_GROUP_MAX-1;
+                if (group_next[j] != group[j]){
+                    moved[group_next[j]] = 1;
+                    if (group[j] >= 0){
+                        moved[group[j]] = 1;
+                    }
+                }
+            }
+
+            // Take the particles that leave out of their simulations, keeping
+            // the others in order.
+            for (int g=0; g<REBX_GROUP_MAX; g++){
+                struct reb_simulation* const r = gs[g].r;
+                if (r == NULL || !moved[g]){
+                    continue;
+                }
+                int n_keep = 0;
+                for (int k=0; k<r->N; k++){
+                    const int id = gs[g].ids[k];
+                    if (group_next[id] != g){
+                        continue;
+                    }
+                    r->particles[n_keep] = r->particles[k];
+                    gs[g].ids[n_keep] = id;
+                    n_keep++;
+                }
+                r->N = n_keep;
+                if (n_keep == 0){
+                    arc_free(r);
+                    gs[g].r = NULL;
+                }
+            }
+
+            // Add the ones that join, starting new groups from the smallest
+            // step their members last took.
+            for (int g=0; g<REBX_GROUP_MAX; g++){
+                if (!moved[g]){
+                    continue;
+                }
+                struct reb_simulation* const r = gs[g].r;
+                int n_g = (r != NULL) ? r->N : 0;
+                int n_in = 0;
+                double dt_g = tstep;
+                for (int j=0; j<n_particles; j++){
+                    if (group_next[j] == g && group[j] != g){
+                        memcpy(gstate + 6*(size_t)n_in, state + 6*(size_t)j, 6*sizeof(double));
+                        dt_g = (n_in == 0 || fabs(dt[j]) < fabs(dt_g)) ? dt[j] : dt_g;
+                        gs[g].ids[n_g + n_in] = j;
+                        n_in++;
+                    }
+                }
+                if (r == NULL){
+                    if (n_in > 0){
+                        gs[g].r = arc_create(eph, t, dt_g, geocentric, n_in, gstate);
+                        struct rebx_force* const force = rebx_get_force(gs[g].r->extras, "ephemeris_forces");
+                        rebx_set_param_pointer(gs[g].r->extras, &force->ap, "ephem_shared", shared);
+                    }
+                    continue;
+                }
+                for (int k=0; k<n_in; k++){
+                    struct reb_particle tp = {0};
+                    tp.x  = gstate[6*k+0];
+                    tp.y  = gstate[6*k+1];
+                    tp.z  = gstate[6*k+2];
+                    tp.vx = gstate[6*k+3];
+                    tp.vy = gstate[6*k+4];
+                    tp.vz = gstate[6*k+5];
+                    reb_add(r, tp);
+                }
+                // The IAS15 predictor is laid out by slot, so it starts over.
+                reb_integrator_ias15_reset(r);
+            }
+            memcpy(group, group_next, n_particles*sizeof(*group));
+
+            struct groups_work gw = {gs, t1};
+            rebx_parallel_for(REBX_GROUP_MAX, nt, groups_work, &gw);
+
+            for (int g=0; g<REBX_GROUP_MAX; g++){
+                const struct reb_simulation* const r = gs[g].r;
+                if (r == NULL){
+                    continue;
+                }
+                for (int k=0; k<r->N; k++){
+                    const struct reb_particle p = r->particles[k];
+                    double* const s = state + 6*(size_t)gs[g].ids[k];
+                    s[0] = p.x;
+                    s[1] = p.y;
+                    s[2] = p.z;
+                    s[3] = p.vx;
+                    s[4] = p.vy;
+                    s[5] = p.vz;
+                    dt[gs[g].ids[k]] = r->dt;
+                }
+            }
+            t = t1;
+        }
+        memcpy(outstate + (size_t)n_done*state_size, state, state_size*sizeof(*state));
+        n_done++;
+    }
+
+    for (int g=0; g<REBX_GROUP_MAX; g++){
+        if (gs[g].r != NULL){
+            arc_free(gs[g].r);
+        }
+    }
+    rebx_ephem_shared_free(shared);
+    free(state); free(dt); free(tau); free(group); free(group_next); free(gstate); free(ids);
+    return n_done;
+}
+
+// Fills in the epochs like epochs_step, and retires particles at the end
+// of every step.  Retired particles are taken out of r->particles in one
+// pass that keeps the others in order, with ids mapping each slot back to
+// the particle's index in instate.
+struct retire_ctx {
+    const struct rebx_ephemeris* eph;
+    int geocentric;
+    int n_particles;
+    int n_epochs;
+    const double* epochs;
+    double* outstate;
+    int n_done;
+    int* ids;
+    double* buf;        // one epoch of interpolated states, by slot
+    rebx_retirement* ret;
+    double t_beg;       // span covered by both the planet and asteroid files
+    double t_end;
+};
+
+// Records that the particle in slot k is retired.
+static void retire_particle(struct retire_ctx* const rc, const struct reb_simulation* const r, const int k, const int reason){
+    const int id = rc->ids[k];
+    const struct reb_particle p = r->particles[k];
+    double* const state = rc->ret->state + 6*id;
+    rc->ret->reason[id] = reason;
+    rc->ret->t[id] = r->t;
+    state[0] = p.x;
+    state[1] = p.y;
+    state[2] = p.z;
+    state[3] = p.vx;
+    state[4] = p.vy;
+    state[5] = p.vz;
+}
+
+static int retire_step(struct reb_simulation* r, int n_particles, tstate* last, void* ctx){
+    struct retire_ctx* const rc = ctx;
+    rebx_retirement* const ret = rc->ret;
+    const int N = r->N;
+    const double t0 = last[0].t;
+    const double dt = r->dt_last_done;
+    const double dtsign = copysign(1., dt);
+    while (rc->n_done < rc->n_epochs && rc->epochs[rc->n_done]*dtsign <= r->t*dtsign){
+        const double hn = (rc->epochs[rc->n_done] - t0)/dt;
+        double* const out = rc->outstate + (size_t)rc->n_done*rc->n_particles*6;
+        interpolate_state(r, N, last, hn, rc->buf);
+        for (int k=0; k<N; k++){
+            memcpy(out + 6*rc->ids[k], rc->buf + 6*k, 6*sizeof(double));
+        }
+        rc->n_done++;
+    }
+    if (rc->n_done == rc->n_epochs){
+        return 1;
+    }
+
+    // Nothing can be integrated past the end of either ephemeris.
+    const double t_next = r->t + r->dt;
+    if (t_next < rc->t_beg || t_next > rc->t_end){
+        for (int k=0; k<N; k++){
+            retire_particle(rc, r, k, REBX_RETIRE_EPHEMERIS);
+        }
+        r->N = 0;
+        return 1;
+    }
+
+    // The Earth's position in the frame of the particles, for the impacts,
+    // and the barycenter's, for the escapes.
+    double xe = 0., ye = 0., ze = 0.;
+    double xb = 0., yb = 0., zb = 0.;
+    const int geo = (rc->geocentric == 1);
+    if ((ret->impact_radius > 0. && !geo) || (ret->escape_distance > 0. && geo)){
+        double M[11];
+        struct mpos_s pstate[11];
+        ephem_all(rc->eph, r->G, r->t, M, pstate);
+        if (geo){
+            xb = -pstate[3].u[0];
+            yb = -pstate[3].u[1];
+            zb = -pstate[3].u[2];
+        }
+        else{
+            xe = pstate[3].u[0];
+            ye = pstate[3].u[1];
+            ze = pstate[3].u[2];
+        }
+    }
+    const double R2_impact = ret->impact_radius*ret->impact_radius;
+    const double R2_escape = ret->escape_distance*ret->escape_distance;
+    int n_keep = 0;
+    for (int k=0; k<N; k++){
+        const struct reb_particle p = r->particles[k];
+        int reason = REBX_RETIRE_NONE;
+        const double dxe = p.x - xe;
+        const double dye = p.y - ye;
+        const double dze = p.z - ze;
+        const double dxb = p.x - xb;
+        const double dyb = p.y - yb;
+        const double dzb = p.z - zb;
+        if (ret->impact_radius > 0. && dxe*dxe + dye*dye + dze*dze < R2_impact){
+            reason = REBX_RETIRE_IMPACT;
+        }
+        else if (ret->escape_distance > 0. && dxb*dxb + dyb*dyb + dzb*dzb > R2_escape){
+            reason = REBX_RETIRE_ESCAPE;
+        }
+        else if (ret->retire != NULL){
+            const double state[6] = {p.x, p.y, p.z, p.vx, p.vy, p.vz};
+            if (ret->retire(ret->ctx, rc->ids[k], r->t, state)){
+                reason = REBX_RETIRE_CALLBACK;
+            }
+        }
+        if (reason != REBX_RETIRE_NONE){
+            retire_particle(rc, r, k, reason);
+            continue;
+        }
+        if (n_keep != k){
+            r->particles[n_keep] = p;
+            rc->ids[n_keep] = rc->ids[k];
+        }
+        n_keep++;
+    }
+    if (n_keep < N){
+        // The IAS15 predictor is laid out by slot, so it starts over.
+        r->N = n_keep;
+        reb_integrator_ias15_reset(r);
+    }
+    return r->N == 0;
+}
+
+int integration_function_retire(struct rebx_ephemeris* eph,
+			 double tstart, double tstep,
+			 int geocentric,
+			 int n_particles,
+			 double* instate,
+			 int n_epochs, const double* epochs,
+			 double* outstate,
+			 rebx_retirement* ret){
+    if (n_epochs <= 0 || n_particles <= 0){
+        return 0;
+    }
+    if (!epochs_sorted("integration_function_retire", tstart, tstep, n_epochs, epochs)){
+        return 0;
+    }
+    if (eph == NULL){
+        eph = ephem_default();
+    }
+
+    for (int id=0; id<n_particles; id++){
+        ret->reason[id] = REBX_RETIRE_NONE;
+    }
+    // Retired particles have no state at later epochs.
+    for (size_t k=0; k<(size_t)n_epochs*n_particles*6; k++){
+        outstate[k] = NAN;
+    }
+
+    struct retire_ctx rc = {eph, geocentric, n_particles, n_epochs, epochs, outstate, 0, NULL, NULL, ret, eph->pl->beg, eph->pl->end};
+    double ast_beg, ast_end;
+    if (spk_span(eph->spl, 16, &ast_beg, &ast_end) == 0){
+        rc.t_beg = fmax(rc.t_beg, ast_beg);
+        rc.t_end = fmin(rc.t_end, ast_end);
+    }
+    while (rc.n_done < n_epochs && epochs[rc.n_done] == tstart){
+        memcpy(outstate + (size_t)rc.n_done*n_particles*6, instate, n_particles*6*sizeof(double));
+        rc.n_done++;
+    }
+    if (rc.n_done == n_epochs){
+        return n_epochs;
+    }
+
+    rc.ids = malloc(n_particles*sizeof(*rc.ids));
+    rc.buf = malloc(6*(size_t)n_particles*sizeof(*rc.buf));
+    if (rc.ids == NULL || rc.buf == NULL){
+        free(rc.ids);
+        free(rc.buf);
+        fprintf(stderr, "REBOUNDx Error: integration_function_retire: could not allocate memory.\n");
+        return 0;
+    }
+    for (int id=0; id<n_particles; id++){
+        rc.ids[id] = id;
+    }
+
+    const int status = integrate_arc(eph, tstart, tstep, epochs[n_epochs-1] - tstart, geocentric, n_particles, instate, retire_step, &rc);
+    free(rc.ids);
+    free(rc.buf);
+
+    // Everyone was retired, so the remaining epochs are complete as they are.
+    if (status == 0 && rc.n_done < n_epochs){
+        int n_active = 0;
+        for (int id=0; id<n_particles; id++){
+            n_active += (ret->reason[id] == REBX_RETIRE_NONE);
+        }
+        if (n_active == 0){
+            rc.n_done = n_epochs;
+        }
+    }
+    return rc.n_done;
+}
+
+struct arcs_work {
+    struct rebx_ephemeris* eph;
+    arcstate* arcs;
+};
+
+static void arcs_work(void* ctx, int i){
+    struct arcs_work* const aw = ctx;
+    arcstate* const arc = &aw->arcs[i];
+    arc->status = integrate_arc_timestate(aw->eph, arc->tstart, arc->tstep, arc->trange,
+                                arc->geocentric, arc->n_particles, arc->instate, &arc->ts);
+}
+
+int integration_function_arcs(struct rebx_ephemeris* eph, const int n_arcs, arcstate* const arcs, const int n_threads){
+
+    // Open the default handle up front, since doing it lazily from
+    // several threads at once is not safe.
+    if (eph == NULL){
+        eph = ephem_default();
+    }
+
+    const int nt = rebx_work_threads(n_threads);
+
+    struct arcs_work aw = {eph, arcs};
+    rebx_parallel_for(n_arcs, nt, arcs_work, &aw);
+    int n_failed = 0;
+    for (int i=0; i<n_arcs; i++){
+        if (arcs[i].status != 1){
+            n_failed++;
+        }
+    }
+
+    return n_failed;
+}
+
+struct bidirectional_work {
+    struct reb_simulation** sim;
+    const double* trange;
+    int n_particles;
+    timestate* arc;
+    int* status;
+};
+
+static void bidirectional_work(void* ctx, int d){
+    struct bidirectional_work* const bw = ctx;
+    if (bw->trange[d] != 0.){
+        struct timestate_buf buf = {&bw->arc[d], 0};
+        bw->arc[d].n_particles = bw->n_particles;
+        bw->status[d] = integrate_stream(bw->sim[d], bw->trange[d], bw->n_particles, timestate_sink, &buf, 0);
+    }
+}
+
+int integration_function_bidirectional(struct rebx_ephemeris* eph,
+			 double tstart, double tstep, double trange_back, double trange_forward,
+			 int geocentric,
+			 int n_particles,
+			 double* instate,
+			 timestate *ts){
+
+    ts->t = NULL;
+    ts->state = NULL;
+    ts->n_out = 0;
+    ts->n_particles = n_particles;
+
+    // As in integration_function_arcs, open the default handle before the threads need it.
+    if (eph == NULL){
+        eph = ephem_default();
+    }
+
+    const double dt = fabs(tstep);
+    const double trange[2] = {-fabs(trange_back), fabs(trange_forward)};
+    timestate arc[2] = {{0}};
+    int status[2] = {1, 1};
+
+    // The setup and the accelerations at tstart are the same in both
+    // directions, so they are done once and the backward arc starts from a
+    // copy of the forward simulation.  REBOUNDx is not part of the copy, so
+    // the copy gets its own ephemeris_forces with the same parameters.
+    struct reb_simulation* sim[2] = {NULL, NULL};
+    sim[1] = arc_create(eph, tstart, dt, geocentric, n_particles, instate);
+    if (trange[0] != 0.){
+        sim[0] = reb_copy_simulation(sim[1]);
+        if (sim[0] == NULL){
+            arc_free(sim[1]);
+            fprintf(stderr, "REBOUNDx Error: integration_function_bidirectional: could not copy the simulation.\n");
+            return 0;
+        }
+        sim[0]->dt = -dt;
+        arc_attach_forces(sim[0], eph, geocentric);
+    }
+
+    // Each direction then runs on its own thread.
+    struct bidirectional_work bw = {sim, trange, n_particles, arc, status};
+    rebx_parallel_for(2, 2, bidirectional_work, &bw);
+    for (int d=0; d<2; d++){
+        if (sim[d] != NULL){
+            arc_free(sim[d]);
+        }
+    }
+    if (status[0] != 1 || status[1] != 1){
+        rebx_free_timestate(&arc[0]);
+        rebx_free_timestate(&arc[1]);
+        return 0;
+    }
+
+    // The backward arc runs down in time, so it goes in reversed ahead of
+    // the forward one. Both start with tstart, which is kept only once.
+    const int n_back = (arc[0].n_out > 0 && arc[1].n_out > 0) ? arc[0].n_out - 1 : arc[0].n_out;
+    const int n_out = n_back + arc[1].n_out;
+    const size_t record = (size_t)n_particles*6;
+    if (n_out == 0){
+        return 1;
+    }
+    double* const t = realloc(arc[1].t, n_out*sizeof(double));
+    if (t != NULL){
+        arc[1].t = t;
+    }
+    double* const state = realloc(arc[1].state, n_out*record*sizeof(double));
+    if (state != NULL){
+        arc[1].state = state;
+    }
+    if (t == NULL || state == NULL){
+        rebx_free_timestate(&arc[0]);
+        rebx_free_timestate(&arc[1]);
+        fprintf(stderr, "REBOUNDx Error: integration_function_bidirectional: could not allocate memory.\n");
+        return 0;
+    }
+    memmove(t + n_back, t, arc[1].n_out*sizeof(double));
+    memmove(state + n_back*record, state, arc[1].n_out*record*sizeof(double));
+    for (int k=0; k<n_back; k++){
+        const int src = arc[0].n_out - 1 - k;
+        t[k] = arc[0].t[src];
+        memcpy(state + k*record, arc[0].state + src*record, record*sizeof(double));
+    }
+    rebx_free_timestate(&arc[0]);
+
+    ts->t = t;
+    ts->state = state;
+    ts->n_out = n_out;
+    return 1;
+}
+
+// Position of particle j at time t, from the Lagrange polynomial through
+// the REBX_OBSERVE_WINDOW outputs of ts nearest to t.  The outputs are the
+// Gauss-Radau substeps, so the polynomial spans about one IAS15 step.
+// dir is +1 if the times in ts increase, -1 if they decrease.  Returns 0
+// if t is outside ts.
+#define REBX_OBSERVE_WINDOW 8
+#define REBX_OBSERVE_MAX_ITERATIONS 10
+#define REBX_OBSERVE_LT_TOL 1e-12    // days
+static int observe_position(const timestate* const ts, const double dir, const int j, const double t, double* const x){
+    const int n_out = ts->n_out;
+    if ((t - ts->t[0])*dir < 0. || (t - ts->t[n_out-1])*dir > 0.){
+        return 0;
+    }
+    // The last output at or before t, in the direction of ts.
+    int lo = 0;
+    int hi = n_out-1;
+    while (hi - lo > 1){
+        const int mid = (lo + hi)/2;
+        if ((ts->t[mid] - t)*dir <= 0.){
+            lo = mid;
+        }
+        else{
+            hi = mid;
+        }
+    }
+    const int n_window = (n_out < REBX_OBSERVE_WINDOW) ? n_out : REBX_OBSERVE_WINDOW;
+    int start = lo - n_window/2 + 1;
+    if (start < 0){
+        start = 0;
+    }
+    if (start > n_out - n_window){
+        start = n_out - n_window;
+    }
+    const double* const tw = ts->t + start;
+    x[0] = 0.;
+    x[1] = 0.;
+    x[2] = 0.;
+    for (int k=0; k<n_window; k++){
+        double l = 1.;
+        for (int m=0; m<n_window; m++){
+            if (m != k){
+                l *= (t - tw[m])/(tw[k] - tw[m]);
+            }
+        }
+        const double* const sk = ts->state + ((size_t)(start+k)*ts->n_particles + j)*6;
+        x[0] += l*sk[0];
+        x[1] += l*sk[1];
+        x[2] += l*sk[2];
+    }
+    return 1;
+}
+
+// Barycentric position of the Earth at t.  Returns 0 if t is outside the
+// planetary ephemeris.
+static int observe_earth(const struct rebx_ephemeris* const eph, const double t, double* const e){
+    struct mpos_s earth;
+    if (jpl_calc(eph->pl, &earth, t, PLAN_EAR, PLAN_BAR) != 0){
+        return 0;
+    }
+    ephem_units(eph->pl, &earth);
+    e[0] = earth.u[0];
+    e[1] = earth.u[1];
+    e[2] = earth.u[2];
+    return 1;
+}
+
+struct observe_work {
+    const struct rebx_ephemeris* eph;
+    const timestate* ts;
+    int geocentric;
+    int n_obs;
+    const double* t_obs;
+    const double* observer;
+    double* outpos;
+    double* outlt;
+    int n_particles;
+    double dir;         // +1 if the times in ts increase, -1 if they decrease
+    double c;
+    int n_chunks;
+    int n_failed;
+    pthread_mutex_t lock;
+};
+
+// One contiguous chunk of the observations.
+static void observe_work(void* ctx, int chunk){
+    struct observe_work* const ow = ctx;
+    const int i0 = (int)((long)chunk*ow->n_obs/ow->n_chunks);
+    const int i1 = (int)((long)(chunk+1)*ow->n_obs/ow->n_chunks);
+    int n_failed = 0;
+    for (int i=i0; i<i1; i++){
+        // The light time is worked out in the barycentric frame.  For a
+        // geocentric trajectory the object is put there with the Earth at
+        // the retarded time, not at t_obs, since the Earth moves by about
+        // 1e-4 au during the light time.
+        double o[3] = {0., 0., 0.};
+        const int ok = (ow->ts->n_out > 0) && observe_earth(ow->eph, ow->t_obs[i], o);
+        if (ok && ow->observer != NULL){
+            o[0] += ow->observer[3*i+0];
+            o[1] += ow->observer[3*i+1];
+            o[2] += ow->observer[3*i+2];
+        }
+        for (int j=0; j<ow->n_particles; j++){
+            double* const pos = ow->outpos + ((size_t)i*ow->n_particles + j)*3;
+            double lt = 0.;
+            int found = ok;
+            // Iterate the light time, starting from the geometric distance.
+            for (int it=0; found && it<REBX_OBSERVE_MAX_ITERATIONS; it++){
+                double x[3];
+                double e[3] = {0., 0., 0.};
+                found = observe_position(ow->ts, ow->dir, j, ow->t_obs[i] - lt, x) && (!ow->geocentric || observe_earth(ow->eph, ow->t_obs[i] - lt, e));
+                pos[0] = x[0] + e[0] - o[0];
+                pos[1] = x[1] + e[1] - o[1];
+                pos[2] = x[2] + e[2] - o[2];
+                const double lt_next = sqrt(pos[0]*pos[0] + pos[1]*pos[1] + pos[2]*pos[2])/ow->c;
+                const double dlt = lt_next - lt;
+                lt = lt_next;
+                if (fabs(dlt) < REBX_OBSERVE_LT_TOL){
+                    break;
+                }
+            }
+            if (!found){
+                pos[0] = NAN;
+                pos[1] = NAN;
+                pos[2] = NAN;
+                lt = NAN;
+                n_failed++;
+            }
+            if (ow->outlt != NULL){
+                ow->outlt[(size_t)i*ow->n_particles + j] = lt;
+            }
+        }
+    }
+    pthread_mutex_lock(&ow->lock);
+    ow->n_failed += n_failed;
+    pthread_mutex_unlock(&ow->lock);
+}
+
+int rebx_ephemeris_observe(struct rebx_ephemeris* eph, const timestate* const ts, const int geocentric,
+			 const int n_obs, const double* const t_obs, const double* const observer,
+			 const int n_threads, double* const outpos, double* const outlt){
+
+    // Open the default handle up front, as for integration_function_arcs.
+    if (eph == NULL){
+        eph = ephem_default();
+    }
+
+    const int nt = rebx_work_threads(n_threads);
+
+    struct observe_work ow = {
+        .eph = eph,
+        .ts = ts,
+        .geocentric = geocentric,
+        .n_obs = n_obs,
+        .t_obs = t_obs,
+        .observer = observer,
+        .outpos = outpos,
+        .outlt = outlt,
+        .n_particles = ts->n_particles,
+        .dir = (ts->n_out > 1 && ts->t[ts->n_out-1] < ts->t[0]) ? -1. : 1.,
+        .c = 173.144632674, // speed of light in au/day, as in integrate_arc
+        .n_chunks = (nt < n_obs) ? nt : ((n_obs > 0) ? n_obs : 1),
+        .n_failed = 0,
+    };
+    pthread_mutex_init(&ow.lock, NULL);
+
+    // The observations are independent, so split them evenly.
+    rebx_parallel_for(ow.n_chunks, nt, observe_work, &ow);
+
+    pthread_mutex_destroy(&ow.lock);
+    return ow.n_failed;
+}
+
+
+// Sink that writes each output time straight into a growing memory-mapped
+// trajectory file (see integration_function_mmap for the layout).
+struct mmap_sink {
+    int fd;
+    char* map;
+    size_t len;         // Mapped (and file) size
+    size_t record;      // Bytes per output time
+    int64_t n_out;
+};
+
+static int mmap_sink_grow(struct mmap_sink* const ms, const size_t len){
+    if (ms->map != NULL){
+        munmap(ms->map, ms->len);
+        ms->map = NULL;
+    }
+    if (ftruncate(ms->fd, (off_t)len) != 0){
+        return 0;
+    }
+    void* const map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, ms->fd, 0);
+    if (map == MAP_FAILED){
+        return 0;
+    }
+    ms->map = map;
+    ms->len = len;
+    return 1;
+}
+
+static int mmap_sink(void* ctx, int n, int n_particles, const double* t, const double* state){
+    struct mmap_sink* const ms = ctx;
+    const size_t needed = REBX_TRAJECTORY_HEADER_SIZE + (size_t)(ms->n_out + n)*ms->record;
+    if (needed > ms->len){
+        size_t len = 2*ms->len;
+        while (len < needed){
+            len *= 2;
+        }
+        if (!mmap_sink_grow(ms, len)){
+            return 1;
+        }
+    }
+    char* rec = ms->map + REBX_TRAJECTORY_HEADER_SIZE + (size_t)ms->n_out*ms->record;
+    const size_t state_size = (size_t)n_particles*6*sizeof(double);
+    for (int i=0; i<n; i++){
+        memcpy(rec, &t[i], sizeof(double));
+        memcpy(rec + sizeof(double), state + (size_t)i*n_particles*6, state_size);
+        rec += ms->record;
+    }
+    ms->n_out += n;
+    memcpy(ms->map + 16, &ms->n_out, sizeof(int64_t));   // keep the header current, so a partial file is readable
+    return 0;
+}
+
+int integration_function_mmap(struct rebx_ephemeris* const eph,
+			 double tstart, double tstep, double trange,
+			 int geocentric,
+			 int n_particles,
+			 double* instate,
+			 const char* const filename){
+    struct mmap_sink ms = {-1, NULL, 0, (1 + (size_t)n_particles*6)*sizeof(double), 0};
+    if ((ms.fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0){
+        fprintf(stderr, "REBOUNDx Error: integration_function_mmap: could not open %s.\n", filename);
+        return 0;
+    }
+    // Start with room for 1024 output times (128 steps) and double from there.
+    if (!mmap_sink_grow(&ms, REBX_TRAJECTORY_HEADER_SIZE + 1024*ms.record)){
+        fprintf(stderr, "REBOUNDx Error: integration_function_mmap: could not map %s.\n", filename);
+        close(ms.fd);
+        return 0;
+    }
+
+    const int32_t version = REBX_TRAJECTORY_VERSION;
+    const int32_t np = n_particles;
+    const int64_t record = ms.record;
+    memset(ms.map, 0, REBX_TRAJECTORY_HEADER_SIZE);
+    memcpy(ms.map, "REBXTRAJ", 8);
+    memcpy(ms.map + 8, &version, sizeof(int32_t));
+    memcpy(ms.map + 12, &np, sizeof(int32_t));
+    memcpy(ms.map + 16, &ms.n_out, sizeof(int64_t));
+    memcpy(ms.map + 24, &record, sizeof(int64_t));
+
+    int status = integration_function_stream_async(eph, tstart, tstep, trange, geocentric, n_particles, instate, mmap_sink, &ms);
+    if (ms.map == NULL){
+        fprintf(stderr, "REBOUNDx Error: integration_function_mmap: could not grow %s.\n", filename);
+        status = 0;
+    }
+    else{
+        munmap(ms.map, ms.len);
+    }
+    // Drop the unused tail
+    if (ftruncate(ms.fd, (off_t)(REBX_TRAJECTORY_HEADER_SIZE + (size_t)ms.n_out*ms.record)) != 0){
+        status = 0;
+    }
+    close(ms.fd);
+    return status;
+}
+
+// Evaluates the IAS15 interpolant of the last completed step at the
+// fraction hn of the step, writing 6*n_particles values to out.  last
+// holds the state at the start of the step.
+static void interpolate_state(struct reb_simulation* r, int n_particles, tstate* last, double hn, double* out){
+    // The 'br' field contains the set of coefficients from the last
+    // completed step.
+    interpolate_b(r->dt_last_done, dpcast(r->ri_ias15.br), n_particles, last, hn, out);
+}
+
+// Same as interpolate_state, for a step of length dt with coefficients b.
+static void interpolate_b(const double dt, const struct reb_dpconst7 b, int n_particles, const tstate* last, double hn, double* out){
+
+    double s[9]; // Summation coefficients
+
+    s[0] = dt * hn;
+
+    s[1] = s[0] * s[0] / 2.;
+    s[2] = s[1] * hn / 3.;
+    s[3] = s[2] * hn / 2.;
+    s[4] = 3. * s[3] * hn / 5.;
+    s[5] = 2. * s[4] * hn / 3.;
+    s[6] = 5. * s[5] * hn / 7.;
+    s[7] = 3. * s[6] * hn / 4.;
+    s[8] = 7. * s[7] * hn / 9.;
+
+    // Predict positions using b values
+    for(int j=0;j<n_particles;j++) {  
+	const int k0 = 3*j+0;
+	const int k1 = 3*j+1;
+	const int k2 = 3*j+2;
+
+	out[6*j+0] = last[j].x + (s[8]*b.p6[k0] + s[7]*b.p5[k0] + s[6]*b.p4[k0] + s[5]*b.p3[k0] + s[4]*b.p2[k0] + s[3]*b.p1[k0] + s[2]*b.p0[k0] + s[1]*last[j].ax + s[0]*last[j].vx );
+	out[6*j+1] = last[j].y + (s[8]*b.p6[k1] + s[7]*b.p5[k1] + s[6]*b.p4[k1] + s[5]*b.p3[k1] + s[4]*b.p2[k1] + s[3]*b.p1[k1] + s[2]*b.p0[k1] + s[1]*last[j].ay + s[0]*last[j].vy );
+	out[6*j+2] = last[j].z + (s[8]*b.p6[k2] + s[7]*b.p5[k2] + s[6]*b.p4[k2] + s[5]*b.p3[k2] + s[4]*b.p2[k2] + s[3]*b.p1[k2] + s[2]*b.p0[k2] + s[1]*last[j].az + s[0]*last[j].vz );
+    }
+
+    s[0] = dt * hn;
+    s[1] =      s[0] * hn / 2.;
+    s[2] = 2. * s[1] * hn / 3.;
+    s[3] = 3. * s[2] * hn / 4.;
+    s[4] = 4. * s[3] * hn / 5.;
+    s[5] = 5. * s[4] * hn / 6.;
+    s[6] = 6. * s[5] * hn / 7.;
+    s[7] = 7. * s[6] * hn / 8.;
+
+    // Predict velocities using b values
+    for(int j=0;j<n_particles;j++) {
+	const int k0 = 3*j+0;
+	const int k1 = 3*j+1;
+	const int k2 = 3*j+2;
+
+	out[6*j+3] = last[j].vx + s[7]*b.p6[k0] + s[6]*b.p5[k0] + s[5]*b.p4[k0] + s[4]*b.p3[k0] + s[3]*b.p2[k0] + s[2]*b.p1[k0] + s[1]*b.p0[k0] + s[0]*last[j].ax;
+	out[6*j+4] = last[j].vy + s[7]*b.p6[k1] + s[6]*b.p5[k1] + s[5]*b.p4[k1] + s[4]*b.p3[k1] + s[3]*b.p2[k1] + s[2]*b.p1[k1] + s[1]*b.p0[k1] + s[0]*last[j].ay;
+	out[6*j+5] = last[j].vz + s[7]*b.p6[k2] + s[6]*b.p5[k2] + s[5]*b.p4[k2] + s[4]*b.p3[k2] + s[3]*b.p2[k2] + s[2]*b.p1[k2] + s[1]*b.p0[k2] + s[0]*last[j].az;
     }
+}
+
+void store_function(struct reb_simulation* r, int n_out, int n_particles, tstate* last, double* outtime, double* outstate){
+    store_step(r->t, r->dt_last_done, dpcast(r->ri_ias15.br), n_out, n_particles, last, outtime, outstate);
+}
+
+// Same as store_function, for a step of length dt ending at t with
+// coefficients b.
+static void store_step(const double t, const double dt, const struct reb_dpconst7 b, int n_out, int n_particles, const tstate* last, double* outtime, double* outstate){
+    
+    outtime[n_out] = last[0].t;    
 
-    free(x0);
-    free(v0);
-    free(a0);
+    for(int j=0; j<n_particles; j++){
+	int offset = (n_out*n_particles+j)*6;
+	outstate[offset+0] = last[j].x;
+	outstate[offset+1] = last[j].y;	
+	outstate[offset+2] = last[j].z;
+	outstate[offset+3] = last[j].vx;	
+	outstate[offset+4] = last[j].vy;
+	outstate[offset+5] = last[j].vz;	
+    }
+
+    // Loop over interval using Gauss-Radau spacings      
+    for(int n=1;n<8;n++) {                          
+	outtime[n_out+n] = t + dt * (h[n] - 1.0);
+	interpolate_b(dt, b, n_particles, last, h[n], outstate + (n_out+n)*n_particles*6);
+    }
 
 }
@@ -46,6 +46,7 @@
  * Field (C type)               Required    Description
  * ============================ =========== ==================================================================
  * c (double)                   Yes         Speed of light in the units used for the simulation.
+ * gr_reuse_gravity (int)       No          If nonzero, take the Newtonian accelerations from REBOUND's gravity rather than recomputing them (only when gr runs first, with basic or compensated gravity, no softening, and all particles active or the test particles massless; otherwise they are recomputed).
  * ============================ =========== ==================================================================
  *
  * **Particle Parameters**
@@ -70,20 +71,51 @@
 #include "reboundx.h"
 #include "rebxtools.h"
 
-static void rebx_calculate_gr(struct reb_simulation* const sim, struct reb_particle* const particles, const int N, const double C2, const double G, const int max_iterations){
-    
-    struct reb_particle* const ps = malloc(N*sizeof(*ps));
-    struct reb_particle* const ps_j = malloc(N*sizeof(*ps_j));
+// REBOUND's gravity equals the pairwise sum below only without softening
+// and when every pair with mass was included, i.e. all particles are
+// active, or the test particles are massless, or a single test particle
+// acts on the active ones (testparticle_type 1 only skips test-test pairs)
+static int rebx_gr_gravity_matches(const struct reb_simulation* const sim, const struct reb_particle* const particles, const int N){
+    if (sim->softening != 0.){
+        return 0;
+    }
+    if (sim->N_active == -1 || sim->N_active >= N){
+        return 1;
+    }
+    if (sim->testparticle_type == 1 && N - sim->N_active <= 1){
+        return 1;
+    }
+    for (int i=sim->N_active; i<N; i++){
+        if (particles[i].m != 0.){
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static void rebx_calculate_gr(struct reb_simulation* const sim, struct reb_particle* const particles, const int N, const double C2, const double G, const int max_iterations, const int reuse_gravity){
+    struct rebx_extras* const rebx = sim->extras;
+    const size_t mark = rebx_scratch_mark(rebx);
+    struct reb_particle* const ps = rebx_scratch_alloc(rebx, N*sizeof(*ps));
+    struct reb_particle* const ps_j = rebx_scratch_alloc(rebx, N*sizeof(*ps_j));
+    if (ps == NULL || ps_j == NULL){
+        rebx_scratch_release(rebx, mark);
+        return;
+    }
     memcpy(ps, particles, N*sizeof(*ps));
     
+    // REBOUND's own gravity can stand in for the Newtonian accelerations
+    // as long as no other force has added to them yet
+    const int newtonian_done = reuse_gravity && particles == sim->particles && rebx->accelerations_newtonian && rebx_gr_gravity_matches(sim, particles, N);
+
     // Calculate Newtonian accelerations 
-    for(int i=0; i<N; i++){
+    for(int i=0; i<N && !newtonian_done; i++){
         ps[i].ax = 0.;
         ps[i].ay = 0.;
         ps[i].az = 0.;
     }
 
-    for(int i=0; i<N; i++){
+    for(int i=0; i<N && !newtonian_done; i++){
         const struct reb_particle pi = ps[i];
         for(int j=i+1; j<N; j++){
             const struct reb_particle pj = ps[j];
@@ -166,24 +198,33 @@ static void rebx_calculate_gr(struct reb_simulation* const sim, struct reb_parti
         particles[i].az += ps[i].az;
     }
     
-    free(ps);
-    free(ps_j);
+    rebx_scratch_release(rebx, mark);
 }
 
+enum {GR_PARAM_C, GR_PARAM_MAX_ITERATIONS, GR_PARAM_REUSE_GRAVITY};   // slots in force->param_cache
+
 void rebx_gr(struct reb_simulation* const sim, struct rebx_force* const force, struct reb_particle* const particles, const int N){
-    double* c = rebx_get_param(sim->extras, force->ap, "c");
+    void** const params = force->param_cache;
+    if (rebx_param_cache_stale(sim->extras, &force->param_generation)){
+        params[GR_PARAM_C] = rebx_get_param(sim->extras, force->ap, "c");
+        params[GR_PARAM_MAX_ITERATIONS] = rebx_get_param(sim->extras, force->ap, "max_iterations");
+        params[GR_PARAM_REUSE_GRAVITY] = rebx_get_param(sim->extras, force->ap, "gr_reuse_gravity");
+    }
+    const int* const reuse = params[GR_PARAM_REUSE_GRAVITY];
+    const int reuse_gravity = reuse != NULL && *reuse;
+    double* c = params[GR_PARAM_C];
     if (c == NULL){
         reb_error(sim, "REBOUNDx Error: Need to set speed of light in gr effect.  See examples in documentation.\n");
         return;
     }
     const double C2 = (*c)*(*c);
-    int* max_iterations = rebx_get_param(sim->extras, force->ap, "max_iterations");
+    int* max_iterations = params[GR_PARAM_MAX_ITERATIONS];
     if(max_iterations != NULL){
-        rebx_calculate_gr(sim, particles, N, C2, sim->G, *max_iterations);
+        rebx_calculate_gr(sim, particles, N, C2, sim->G, *max_iterations, reuse_gravity);
     }
     else{
         const int default_max_iterations = 10;
-        rebx_calculate_gr(sim, particles, N, C2, sim->G, default_max_iterations);
+        rebx_calculate_gr(sim, particles, N, C2, sim->G, default_max_iterations, reuse_gravity);
     }
 }
 
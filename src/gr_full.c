@@ -58,80 +58,140 @@
 #include "rebound.h"
 #include "reboundx.h"
 
-static void rebx_calculate_gr_full(struct reb_simulation* const sim, struct reb_particle* const particles, const int N, const double C2, const double G, const int max_iterations, const int gravity_ignore_10){
+// Below this many bodies the pairwise loops stay serial
+#define REBX_GR_FULL_MIN_PARALLEL 64
+
+// Workspace kept on the force between calls, so that large N neither
+// overflows the stack nor reallocates every substep.
+struct rebx_gr_full_workspace{
+    int N_alloc;
+    double* rs;         // N*N pairwise distances
+    double* drs;        // N*N*3 pairwise separations r_i - r_j
+    double* phi;        // N potentials sum_{k!=i} G m_k/r_ik
+    double* a_const;    // N*3 constant term
+    double* a_newton;   // N*3 Newtonian term
+    double* a_new;      // N*3 current iterate
+    double* a_old;      // N*3 previous iterate
+};
+
+void rebx_gr_full_free_arrays(struct rebx_extras* const rebx, struct rebx_force* const force){
+    struct rebx_gr_full_workspace* const ws = rebx_get_param(rebx, force->ap, "gr_full_workspace");
+    if (ws != NULL){
+        free(ws->rs);
+        free(ws);
+    }
+}
+
+static struct rebx_gr_full_workspace* rebx_gr_full_workspace(struct reb_simulation* const sim, struct rebx_force* const force, const int N){
+    struct rebx_extras* const rebx = sim->extras;
+    struct rebx_gr_full_workspace* ws = rebx_get_param(rebx, force->ap, "gr_full_workspace");
+    if (ws == NULL){
+        ws = calloc(1, sizeof(*ws));
+        if (ws == NULL){
+            reb_error(sim, "REBOUNDx Error: Could not allocate memory for gr_full.\n");
+            return NULL;
+        }
+        rebx_set_param_pointer(rebx, &force->ap, "gr_full_workspace", ws);
+        rebx_set_param_pointer(rebx, &force->ap, "free_arrays", rebx_gr_full_free_arrays);
+    }
+    if (N > ws->N_alloc){
+        // One block: rs, drs, then the per-body arrays
+        double* const block = realloc(ws->rs, ((size_t)N*N*4 + (size_t)N*13)*sizeof(double));
+        if (block == NULL){
+            reb_error(sim, "REBOUNDx Error: Could not allocate memory for gr_full.\n");
+            return NULL;
+        }
+        ws->N_alloc = N;
+        ws->rs = block;
+    }
+    ws->drs = ws->rs + (size_t)N*N;
+    ws->phi = ws->drs + (size_t)N*N*3;
+    ws->a_const = ws->phi + N;
+    ws->a_newton = ws->a_const + 3*N;
+    ws->a_new = ws->a_newton + 3*N;
+    ws->a_old = ws->a_new + 3*N;
+    return ws;
+}
+
+static void rebx_calculate_gr_full(struct reb_simulation* const sim, struct rebx_gr_full_workspace* const ws, struct reb_particle* const particles, const int N, const double C2, const double G, const int max_iterations, const int gravity_ignore_10){
     
-    double a_const[N][3]; // array that stores the value of the constant term
-    double a_newton[N][3]; // stores the Newtonian term
-    double a_new[N][3]; // stores the newly calculated term
-    double rs[N][N];
-    double drs[N][N][3];
+    double* const a_const = ws->a_const;   // stores the value of the constant term
+    double* const a_newton = ws->a_newton; // stores the Newtonian term
+    double* const a_new = ws->a_new;       // stores the newly calculated term
+    double* const a_old = ws->a_old;       // stores the previously calculated term
+    double* const rs = ws->rs;
+    double* const drs = ws->drs;
+    double* const phi = ws->phi;
+#define RS(i,j) rs[(size_t)(i)*N + (j)]
+#define DRS(i,j,k) drs[((size_t)(i)*N + (j))*3 + (k)]
 
+    // Each pair is filled in by the iteration of its lower index only
+#pragma omp parallel for schedule(dynamic, 16) if(N >= REBX_GR_FULL_MIN_PARALLEL)
     for (int i=0; i<N; i++){
         // compute the Newtonian term 
-        a_newton[i][0] = particles[i].ax;
-        a_newton[i][1] = particles[i].ay;
-        a_newton[i][2] = particles[i].az;
-        a_new[i][0] = 0.;
-        a_new[i][1] = 0.;
-        a_new[i][2] = 0.;
+        a_newton[3*i+0] = particles[i].ax;
+        a_newton[3*i+1] = particles[i].ay;
+        a_newton[3*i+2] = particles[i].az;
+        a_new[3*i+0] = 0.;
+        a_new[3*i+1] = 0.;
+        a_new[3*i+2] = 0.;
 
         for(int j=i+1; j<N; j++){
-            if (j!=i){
-                drs[i][j][0] = particles[i].x - particles[j].x;
-                drs[i][j][1] = particles[i].y - particles[j].y;
-                drs[i][j][2] = particles[i].z - particles[j].z;
-                drs[j][i][0] = -drs[i][j][0];
-                drs[j][i][1] = -drs[i][j][1];
-                drs[j][i][2] = -drs[i][j][2];
-                rs[i][j] = sqrt(drs[i][j][0]*drs[i][j][0] + drs[i][j][1]*drs[i][j][1] + drs[i][j][2]*drs[i][j][2]);
-                rs[j][i] = rs[i][j];
-            }
+            DRS(i,j,0) = particles[i].x - particles[j].x;
+            DRS(i,j,1) = particles[i].y - particles[j].y;
+            DRS(i,j,2) = particles[i].z - particles[j].z;
+            DRS(j,i,0) = -DRS(i,j,0);
+            DRS(j,i,1) = -DRS(i,j,1);
+            DRS(j,i,2) = -DRS(i,j,2);
+            RS(i,j) = sqrt(DRS(i,j,0)*DRS(i,j,0) + DRS(i,j,1)*DRS(i,j,1) + DRS(i,j,2)*DRS(i,j,2));
+            RS(j,i) = RS(i,j);
         }
     }
 
-    if (gravity_ignore_10){
-        const double prefact = -G/(rs[0][1]*rs[0][1]*rs[0][1]);
+    if (gravity_ignore_10 && N > 1){
+        const double prefact = -G/(RS(0,1)*RS(0,1)*RS(0,1));
         const double prefact0 = prefact*particles[0].m;
         const double prefact1 = prefact*particles[1].m;
-        a_newton[0][0] += prefact1*drs[0][1][0];
-        a_newton[0][1] += prefact1*drs[0][1][1];
-        a_newton[0][2] += prefact1*drs[0][1][2];
-        a_newton[1][0] -= prefact0*drs[0][1][0];
-        a_newton[1][1] -= prefact0*drs[0][1][1];
-        a_newton[1][2] -= prefact0*drs[0][1][2];
+        a_newton[0] += prefact1*DRS(0,1,0);
+        a_newton[1] += prefact1*DRS(0,1,1);
+        a_newton[2] += prefact1*DRS(0,1,2);
+        a_newton[3] -= prefact0*DRS(0,1,0);
+        a_newton[4] -= prefact0*DRS(0,1,1);
+        a_newton[5] -= prefact0*DRS(0,1,2);
+    }
+
+    // The potential sums in the constant term only depend on one body, so
+    // they are done once here rather than for every pair
+#pragma omp parallel for schedule(static) if(N >= REBX_GR_FULL_MIN_PARALLEL)
+    for (int i=0; i<N; i++){
+        double sum = 0.;
+        for (int k=0; k<N; k++){
+            if (k != i){
+                sum += G*particles[k].m/RS(i,k);
+            }
+        }
+        phi[i] = sum;
     }
 
+#pragma omp parallel for schedule(static) if(N >= REBX_GR_FULL_MIN_PARALLEL)
     for (int i=0; i<N; i++){
         // then compute the constant terms:
         double a_constx = 0.;
         double a_consty = 0.;
         double a_constz = 0.;
+        const double a1 = (4./(C2))*phi[i];
+        const double vi2 = particles[i].vx*particles[i].vx + particles[i].vy*particles[i].vy + particles[i].vz*particles[i].vz;
+        const double a3 = -vi2/(C2);
         // 1st constant part
         for (int j = 0; j< N; j++){
             if (j != i){
-                const double dxij = drs[i][j][0];
-                const double dyij = drs[i][j][1];
-                const double dzij = drs[i][j][2];
-                const double rij2 = rs[i][j]*rs[i][j];
-                const double rij3 = rij2*rs[i][j];
+                const double dxij = DRS(i,j,0);
+                const double dyij = DRS(i,j,1);
+                const double dzij = DRS(i,j,2);
+                const double rij2 = RS(i,j)*RS(i,j);
+                const double rij3 = rij2*RS(i,j);
                 
-                double a1 = 0.;
-                for (int k = 0; k< N; k++){
-                    if (k != i){
-                        a1 += (4./(C2)) * G*particles[k].m/rs[i][k];
-                    }
-                }
-
-                double a2 = 0.;
-                for (int l = 0; l< N; l++){
-                    if (l != j){
-                        a2 += (1./(C2)) * G*particles[l].m/rs[l][j];
-                    }
-                }
-
-                double a3;
-                double vi2 = particles[i].vx*particles[i].vx + particles[i].vy*particles[i].vy + particles[i].vz*particles[i].vz;
-                a3 = -vi2/(C2);
+                const double a2 = (1./(C2))*phi[j];
 
                 double a4;
                 double vj2 = particles[j].vx*particles[j].vx + particles[j].vy*particles[j].vy + particles[j].vz*particles[j].vz;
@@ -164,51 +224,48 @@ static void rebx_calculate_gr_full(struct reb_simulation* const sim, struct reb_
             }
         }  
 
-        a_const[i][0] = a_constx;
-        a_const[i][1] = a_consty;
-        a_const[i][2] = a_constz;
+        a_const[3*i+0] = a_constx;
+        a_const[3*i+1] = a_consty;
+        a_const[3*i+2] = a_constz;
     }
 
     // Now running the substitution again and again through the loop below
     for (int k=0; k<10; k++){ // you can set k as how many substitution you want to make
-        double a_old[N][3]; // initialize an arry that stores the information of previousu calculated accleration
-        for (int i =0; i <N; i++){
-            a_old[i][0] = a_new[i][0]; // when k = 0, a_new is the Newtownian term which calculated before
-            a_old[i][1] = a_new[i][1];
-            a_old[i][2] = a_new[i][2];
-        }
+        // store the information of previously calculated accleration
+        memcpy(a_old, a_new, 3*N*sizeof(*a_old)); // when k = 0, a_new is the Newtownian term which calculated before
         // now add on the non-constant term
+#pragma omp parallel for schedule(static) if(N >= REBX_GR_FULL_MIN_PARALLEL)
         for (int i = 0; i < N; i++){ // a_j is used to update a_i and vice versa
             double non_constx = 0.;
             double non_consty = 0.;
             double non_constz = 0.;
             for (int j = 0; j < N; j++){
                 if (j != i){
-                    const double dxij = drs[i][j][0];
-                    const double dyij = drs[i][j][1];
-                    const double dzij = drs[i][j][2];
-                    const double rij = rs[i][j];
+                    const double dxij = DRS(i,j,0);
+                    const double dyij = DRS(i,j,1);
+                    const double dzij = DRS(i,j,2);
+                    const double rij = RS(i,j);
                     const double rij3 = rij*rij*rij;
-                    non_constx += (G*particles[j].m*dxij/rij3)*(dxij*(a_newton[j][0]+a_old[j][0])+dyij*(a_newton[j][1]+a_old[j][1])+\
-                                dzij*(a_newton[j][2]+a_old[j][2]))/(2.*C2) + (7./(2.*C2))*G*particles[j].m*(a_newton[j][0]+a_old[j][0])/rij;
-                    non_consty += (G*particles[j].m*dyij/rij3)*(dxij*(a_newton[j][0]+a_old[j][0])+dyij*(a_newton[j][1]+a_old[j][1])+\
-                                dzij*(a_newton[j][2]+a_old[j][2]))/(2.*C2) + (7./(2.*C2))*G*particles[j].m*(a_newton[j][1]+a_old[j][1])/rij;
-                    non_constz += (G*particles[j].m*dzij/rij3)*(dxij*(a_newton[j][0]+a_old[j][0])+dyij*(a_newton[j][1]+a_old[j][1])+\
-                                dzij*(a_newton[j][2]+a_old[j][2]))/(2.*C2) + (7./(2.*C2))*G*particles[j].m*(a_newton[j][2]+a_old[j][2])/rij;
+                    const double ajx = a_newton[3*j+0]+a_old[3*j+0];
+                    const double ajy = a_newton[3*j+1]+a_old[3*j+1];
+                    const double ajz = a_newton[3*j+2]+a_old[3*j+2];
+                    non_constx += (G*particles[j].m*dxij/rij3)*(dxij*ajx+dyij*ajy+dzij*ajz)/(2.*C2) + (7./(2.*C2))*G*particles[j].m*ajx/rij;
+                    non_consty += (G*particles[j].m*dyij/rij3)*(dxij*ajx+dyij*ajy+dzij*ajz)/(2.*C2) + (7./(2.*C2))*G*particles[j].m*ajy/rij;
+                    non_constz += (G*particles[j].m*dzij/rij3)*(dxij*ajx+dyij*ajy+dzij*ajz)/(2.*C2) + (7./(2.*C2))*G*particles[j].m*ajz/rij;
                 }
             }
-            a_new[i][0] = (a_const[i][0] + non_constx);
-            a_new[i][1] = (a_const[i][1] + non_consty);
-            a_new[i][2] = (a_const[i][2] + non_constz);
+            a_new[3*i+0] = (a_const[3*i+0] + non_constx);
+            a_new[3*i+1] = (a_const[3*i+1] + non_consty);
+            a_new[3*i+2] = (a_const[3*i+2] + non_constz);
         }
         
         // break out loop if a_new is converging
         double maxdev = 0.;
         double dx, dy, dz;
         for (int i = 0; i < N; i++){
-            dx = (fabs(a_new[i][0]) < 1.e-30) ? 0. : fabs(a_new[i][0] - a_old[i][0])/a_new[i][0];
-            dy = (fabs(a_new[i][1]) < 1.e-30) ? 0. : fabs(a_new[i][1] - a_old[i][1])/a_new[i][1];
-            dz = (fabs(a_new[i][2]) < 1.e-30) ? 0. : fabs(a_new[i][2] - a_old[i][2])/a_new[i][2];
+            dx = (fabs(a_new[3*i+0]) < 1.e-30) ? 0. : fabs(a_new[3*i+0] - a_old[3*i+0])/a_new[3*i+0];
+            dy = (fabs(a_new[3*i+1]) < 1.e-30) ? 0. : fabs(a_new[3*i+1] - a_old[3*i+1])/a_new[3*i+1];
+            dz = (fabs(a_new[3*i+2]) < 1.e-30) ? 0. : fabs(a_new[3*i+2] - a_old[3*i+2])/a_new[3*i+2];
             
             if (dx > maxdev) { maxdev = dx; }
             if (dy > maxdev) { maxdev = dy; }
@@ -222,29 +279,42 @@ static void rebx_calculate_gr_full(struct reb_simulation* const sim, struct reb_
             reb_warning(sim, "10 loops in rebx_gr_full did not converge.\n");
         }
     }
+#undef RS
+#undef DRS
     // update acceleration in particles
     for (int i = 0; i <N;i++){
-        particles[i].ax += a_new[i][0];
-        particles[i].ay += a_new[i][1];
-        particles[i].az += a_new[i][2];
+        particles[i].ax += a_new[3*i+0];
+        particles[i].ay += a_new[3*i+1];
+        particles[i].az += a_new[3*i+2];
     }
 }
 
+enum {GR_FULL_PARAM_C, GR_FULL_PARAM_MAX_ITERATIONS};   // slots in gr_full->param_cache
+
 void rebx_gr_full(struct reb_simulation* const sim, struct rebx_force* const gr_full, struct reb_particle* const particles, const int N){
-    double* c = rebx_get_param(sim->extras, gr_full->ap, "c");
+    void** const params = gr_full->param_cache;
+    if (rebx_param_cache_stale(sim->extras, &gr_full->param_generation)){
+        params[GR_FULL_PARAM_C] = rebx_get_param(sim->extras, gr_full->ap, "c");
+        params[GR_FULL_PARAM_MAX_ITERATIONS] = rebx_get_param(sim->extras, gr_full->ap, "max_iterations");
+    }
+    double* c = params[GR_FULL_PARAM_C];
     if (c == NULL){
         reb_error(sim, "REBOUNDx Error: Need to set speed of light in gr effect.  See examples in documentation.\n");
         return;
     }
     const double C2 = (*c)*(*c);
     const unsigned int gravity_ignore_10 = sim->gravity_ignore_terms==1;
-    int* max_iterations = rebx_get_param(sim->extras, gr_full->ap, "max_iterations");
+    int* max_iterations = params[GR_FULL_PARAM_MAX_ITERATIONS];
+    struct rebx_gr_full_workspace* const ws = rebx_gr_full_workspace(sim, gr_full, N);
+    if (ws == NULL){
+        return;
+    }
     if(max_iterations != NULL){
-        rebx_calculate_gr_full(sim, particles, N, C2, sim->G, *max_iterations, gravity_ignore_10);
+        rebx_calculate_gr_full(sim, ws, particles, N, C2, sim->G, *max_iterations, gravity_ignore_10);
     }
     else{
         const int default_max_iterations = 10;
-        rebx_calculate_gr_full(sim, particles, N, C2, sim->G, default_max_iterations, gravity_ignore_10);
+        rebx_calculate_gr_full(sim, ws, particles, N, C2, sim->G, default_max_iterations, gravity_ignore_10);
     }
 }
 
@@ -66,15 +66,16 @@
 #include "rebound.h"
 #include "reboundx.h"
 
-static void rebx_calculate_gr_potential(struct reb_particle* const particles, const int N, const double C2, const double G){
+static void rebx_calculate_gr_potential(struct rebx_extras* const rebx, struct reb_particle* const particles, const int N, const double C2, const double G){
     const struct reb_particle source = particles[0];
     const double prefac1 = 6.*(G*source.m)*(G*source.m)/C2;
+    const struct rebx_geometry* const geo = rebx_get_geometry(rebx, particles, N, 0);
     for (int i=1; i<N; i++){
         const struct reb_particle p = particles[i];
-        const double dx = p.x - source.x;
-        const double dy = p.y - source.y;
-        const double dz = p.z - source.z;
-        const double r2 = dx*dx + dy*dy + dz*dz;
+        const double dx = geo ? geo->dx[i] : p.x - source.x;
+        const double dy = geo ? geo->dy[i] : p.y - source.y;
+        const double dz = geo ? geo->dz[i] : p.z - source.z;
+        const double r2 = geo ? geo->r2[i] : dx*dx + dy*dy + dz*dz;
         const double prefac = prefac1/(r2*r2);
         
         particles[i].ax -= prefac*dx;
@@ -87,13 +88,16 @@ static void rebx_calculate_gr_potential(struct reb_particle* const particles, co
 }
 
 void rebx_gr_potential(struct reb_simulation* const sim, struct rebx_force* const gr_potential, struct reb_particle* const particles, const int N){
-    double* c = rebx_get_param(sim->extras, gr_potential->ap, "c");
+    if (rebx_param_cache_stale(sim->extras, &gr_potential->param_generation)){
+        gr_potential->param_cache[0] = rebx_get_param(sim->extras, gr_potential->ap, "c");
+    }
+    double* c = gr_potential->param_cache[0];
     if (c == NULL){
         reb_error(sim, "REBOUNDx Error: Need to set speed of light in gr effect.  See examples in documentation.\n");
     }
     else{
         const double C2 = (*c)*(*c);
-        rebx_calculate_gr_potential(particles, N, C2, sim->G);
+        rebx_calculate_gr_potential(sim->extras, particles, N, C2, sim->G);
     }
 }
 
@@ -47,8 +47,14 @@
  * J2 (double)                  No          J2 coefficient
  * J4 (double)                  No          J4 coefficient
  * R_eq (double)                No         Equatorial radius of nonspherical body used for calculating Jn harmonics
+ * harmonics (rebx_harmonics*)  No          Field of arbitrary degree and order from rebx_create_harmonics, evaluated in addition to J2 and J4
+ * harmonics_W0 (double)        No          Angle of the body's prime meridian from the x axis at t=0 (default 0)
+ * harmonics_Wdot (double)      No          Rotation rate of the body about the z axis (default 0)
  * ============================ =========== ==================================================================
  * 
+ * J2 and J4 use closed forms about the simulation z axis.  A harmonics field is evaluated in the body frame, whose
+ * pole is the simulation z axis and whose prime meridian is at angle harmonics_W0 + harmonics_Wdot*t from the x axis,
+ * so tesseral terms rotate with the body.  The field is not copied and must outlive the simulation.
  */
 
 #include <stdlib.h>
@@ -57,20 +63,22 @@
 #include <float.h>
 #include "rebound.h"
 #include "reboundx.h"
+#include "core.h"
 
 static void rebx_calculate_J2_force(struct reb_simulation* const sim, struct reb_particle* const particles, const int N, const double J2, const double R_eq, const int source_index){
     const struct reb_particle source = particles[source_index];
     const double G = sim->G;
+    const struct rebx_geometry* const geo = rebx_get_geometry(sim->extras, particles, N, source_index);
     for (int i=0; i<N; i++){
         if(i == source_index){
             continue;
         }
         const struct reb_particle p = particles[i];
-        const double dx = p.x - source.x;
-        const double dy = p.y - source.y;
-        const double dz = p.z - source.z;
-        const double r2 = dx*dx + dy*dy + dz*dz;
-        const double r = sqrt(r2);
+        const double dx = geo ? geo->dx[i] : p.x - source.x;
+        const double dy = geo ? geo->dy[i] : p.y - source.y;
+        const double dz = geo ? geo->dz[i] : p.z - source.z;
+        const double r2 = geo ? geo->r2[i] : dx*dx + dy*dy + dz*dz;
+        const double r = geo ? geo->r[i] : sqrt(r2);
         const double costheta2 = dz*dz/r2;
         const double prefac = 3.*J2*R_eq*R_eq/r2/r2/r/2.;
         const double fac = 5.*costheta2-1.;
@@ -99,16 +107,17 @@ static void rebx_J2(struct rebx_extras* const rebx, struct reb_simulation* const
 static void rebx_calculate_J4_force(struct reb_simulation* const sim, struct reb_particle* const particles, const int N, const double J4, const double R_eq, const int source_index){
     const struct reb_particle source = particles[source_index];
     const double G = sim->G;
+    const struct rebx_geometry* const geo = rebx_get_geometry(sim->extras, particles, N, source_index);
     for (int i=0; i<N; i++){
         if(i == source_index){
             continue;
         }
         const struct reb_particle p = particles[i];
-        const double dx = p.x - source.x;
-        const double dy = p.y - source.y;
-        const double dz = p.z - source.z;
-        const double r2 = dx*dx + dy*dy + dz*dz;
-        const double r = sqrt(r2);
+        const double dx = geo ? geo->dx[i] : p.x - source.x;
+        const double dy = geo ? geo->dy[i] : p.y - source.y;
+        const double dz = geo ? geo->dz[i] : p.z - source.z;
+        const double r2 = geo ? geo->r2[i] : dx*dx + dy*dy + dz*dz;
+        const double r = geo ? geo->r[i] : sqrt(r2);
         const double costheta2 = dz*dz/r2;
         const double prefac = 5.*J4*R_eq*R_eq*R_eq*R_eq/r2/r2/r2/r/8.;
         const double fac = 63.*costheta2*costheta2-42.*costheta2 + 3.;
@@ -134,9 +143,116 @@ static void rebx_J4(struct rebx_extras* const rebx, struct reb_simulation* const
     }
 }
 
+// Particles are handed to the harmonics engine this many at a time
+#define REBX_GH_CHUNK 64
+
+// Angle of the prime meridian of a field's body at time t
+static double rebx_harmonics_meridian(struct rebx_extras* const rebx, struct rebx_node* const ap, const double t){
+    const double* const W0 = rebx_get_param(rebx, ap, "harmonics_W0");
+    const double* const Wdot = rebx_get_param(rebx, ap, "harmonics_Wdot");
+    return (W0 ? *W0 : 0.) + (Wdot ? (*Wdot)*t : 0.);
+}
+
+// Workspace for the harmonics engine kept on the force, sized for the
+// highest degree seen, so that high degree fields stay off the stack.
+struct rebx_harmonics_workspace{
+    int size;
+    double* work;
+};
+
+void rebx_gravitational_harmonics_free_arrays(struct rebx_extras* const rebx, struct rebx_force* const force){
+    struct rebx_harmonics_workspace* const ws = rebx_get_param(rebx, force->ap, "harmonics_workspace");
+    if (ws != NULL){
+        free(ws->work);
+        free(ws);
+    }
+}
+
+static double* rebx_harmonics_workspace(struct reb_simulation* const sim, struct rebx_force* const force, const int degree){
+    struct rebx_extras* const rebx = sim->extras;
+    struct rebx_harmonics_workspace* ws = rebx_get_param(rebx, force->ap, "harmonics_workspace");
+    if (ws == NULL){
+        ws = calloc(1, sizeof(*ws));
+        if (ws == NULL){
+            reb_error(sim, "REBOUNDx Error: Could not allocate memory for gravitational_harmonics.\n");
+            return NULL;
+        }
+        rebx_set_param_pointer(rebx, &force->ap, "harmonics_workspace", ws);
+        rebx_set_param_pointer(rebx, &force->ap, "free_arrays", rebx_gravitational_harmonics_free_arrays);
+    }
+    const int size = REBX_HARMONICS_WORK_SIZE(degree);
+    if (size > ws->size){
+        double* const work = realloc(ws->work, (size_t)size*sizeof(double));
+        if (work == NULL){
+            reb_error(sim, "REBOUNDx Error: Could not allocate memory for gravitational_harmonics.\n");
+            return NULL;
+        }
+        ws->work = work;
+        ws->size = size;
+    }
+    return ws->work;
+}
+
+static void rebx_calculate_harmonics_force(struct reb_simulation* const sim, struct reb_particle* const particles, const int N, const struct rebx_harmonics* const field, const double W, const int source_index, double* const work){
+    const struct reb_particle source = particles[source_index];
+    const double G = sim->G;
+    const double cosW = cos(W);
+    const double sinW = sin(W);
+    double x[REBX_GH_CHUNK], y[REBX_GH_CHUNK], z[REBX_GH_CHUNK];
+    double ax[REBX_GH_CHUNK], ay[REBX_GH_CHUNK], az[REBX_GH_CHUNK];
+    int index[REBX_GH_CHUNK];
+    for (int i0=0; i0<N; i0+=REBX_GH_CHUNK){
+        // Gather positions in the body frame, with the acceleration per unit GM
+        int n = 0;
+        for (int i=i0; i<N && i<i0+REBX_GH_CHUNK; i++){
+            if(i == source_index){
+                continue;
+            }
+            const double dx = particles[i].x - source.x;
+            const double dy = particles[i].y - source.y;
+            index[n] = i;
+            x[n] = cosW*dx + sinW*dy;
+            y[n] = -sinW*dx + cosW*dy;
+            z[n] = particles[i].z - source.z;
+            ax[n] = 0.;
+            ay[n] = 0.;
+            az[n] = 0.;
+            n++;
+        }
+        rebx_harmonics_accelerations(field, 1., n, x, y, z, ax, ay, az, work);
+        for (int k=0; k<n; k++){
+            const int i = index[k];
+            const double ux = cosW*ax[k] - sinW*ay[k];
+            const double uy = sinW*ax[k] + cosW*ay[k];
+            const double uz = az[k];
+            particles[i].ax += G*source.m*ux;
+            particles[i].ay += G*source.m*uy;
+            particles[i].az += G*source.m*uz;
+            particles[source_index].ax -= G*particles[i].m*ux;
+            particles[source_index].ay -= G*particles[i].m*uy;
+            particles[source_index].az -= G*particles[i].m*uz;
+        }
+    }
+}
+
+static void rebx_harmonics(struct rebx_extras* const rebx, struct reb_simulation* const sim, struct rebx_force* const gh, struct reb_particle* const particles, const int N){
+    for (int i=0; i<N; i++){
+        const struct rebx_harmonics* const field = rebx_get_param(rebx, particles[i].ap, "harmonics");
+        if (field != NULL){
+            double* const work = rebx_harmonics_workspace(sim, gh, field->degree);
+            if (work == NULL){
+                return;
+            }
+            const double W = rebx_harmonics_meridian(rebx, particles[i].ap, sim->t);
+            rebx_calculate_harmonics_force(sim, particles, N, field, W, i, work);
+        }
+    }
+}
+
 void rebx_gravitational_harmonics(struct reb_simulation* const sim, struct rebx_force* const gh, struct reb_particle* const particles, const int N){
     rebx_J2(sim->extras, sim, gh, particles, N);
     rebx_J4(sim->extras, sim, gh, particles, N);
+    rebx_harmonics(sim->extras, sim, gh, particles, N);
 }
 
 static double rebx_calculate_J2_potential(struct reb_simulation* const sim, const double J2, const double R_eq, const int source_index){
@@ -220,6 +336,47 @@ static double rebx_J4_potential(struct rebx_extras* const rebx, struct reb_simul
     return Htot;
 }
 
+double rebx_harmonics_field_potential(struct rebx_extras* const rebx, struct reb_simulation* const sim, const struct rebx_harmonics* const field, const int source_index){
+    const struct reb_particle* const particles = sim->particles;
+	const int _N_real = sim->N - sim->N_var;
+    const struct reb_particle source = particles[source_index];
+    const double W = rebx_harmonics_meridian(rebx, particles[source_index].ap, sim->t);
+    const double cosW = cos(W);
+    const double sinW = sin(W);
+    double x[REBX_GH_CHUNK], y[REBX_GH_CHUNK], z[REBX_GH_CHUNK], m[REBX_GH_CHUNK];
+    double H = 0.;
+    for (int i0=0; i0<_N_real; i0+=REBX_GH_CHUNK){
+        int n = 0;
+        for (int i=i0; i<_N_real && i<i0+REBX_GH_CHUNK; i++){
+            if(i == source_index){
+                continue;
+            }
+            const double dx = particles[i].x - source.x;
+            const double dy = particles[i].y - source.y;
+            x[n] = cosW*dx + sinW*dy;
+            y[n] = -sinW*dx + cosW*dy;
+            z[n] = particles[i].z - source.z;
+            m[n] = particles[i].m;
+            n++;
+        }
+        H += rebx_harmonics_potential(field, sim->G*source.m, n, x, y, z, m, NULL);
+    }
+    return H;
+}
+
+static double rebx_harmonics_potential_all(struct rebx_extras* const rebx, struct reb_simulation* const sim){
+    const int N_real = sim->N - sim->N_var;
+    struct reb_particle* const particles = sim->particles;
+    double Htot = 0.;
+    for (int i=0; i<N_real; i++){
+        const struct rebx_harmonics* const field = rebx_get_param(rebx, particles[i].ap, "harmonics");
+        if (field != NULL){
+            Htot += rebx_harmonics_field_potential(rebx, sim, field, i);
+        }
+    }
+    return Htot;
+}
+
 double rebx_gravitational_harmonics_potential(struct rebx_extras* const rebx){
     if (rebx->sim == NULL){
         rebx_error(rebx, ""); // rebx_error gives meaningful err
@@ -227,5 +384,6 @@ double rebx_gravitational_harmonics_potential(struct rebx_extras* const rebx){
     }
     double H = rebx_J2_potential(rebx, rebx->sim);
     H += rebx_J4_potential(rebx, rebx->sim);
+    H += rebx_harmonics_potential_all(rebx, rebx->sim);
     return H;
 }
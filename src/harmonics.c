@@ -0,0 +1,386 @@
+/**
+ * @file    harmonics.c
+ * @brief   Spherical harmonic gravity fields of arbitrary degree and order
+ * @author  Dan Tamayo <tamayo.daniel@gmail.com>
+ *
+ * @section     LICENSE
+ * Copyright (c) 2015 Dan Tamayo, Hanno Rein
+ *
+ * This file is part of reboundx.
+ *
+ * reboundx is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * reboundx is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with rebound.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/* The field is evaluated with Cunningham's recursion for the solid
+ * harmonics V_nm + i W_nm = (R/r)^(n+1) P_nm(sin phi) e^(i m lambda)
+ * (Montenbruck & Gill 2000, Sec. 3.2), written for fully normalized
+ * coefficients so that the terms stay of order unity at high degree.
+ *
+ * The accelerations of order m need the harmonics of orders m-1, m and
+ * m+1 at degree n+1, so the orders are swept one column at a time and
+ * only three columns are kept.  Each column holds REBX_HARMONICS_LANES
+ * points side by side, and all the loops over points are innermost so
+ * that the compiler can vectorize them.
+ *
+ * The recursion and gradient factors only depend on the degree and
+ * order, so they are computed once in rebx_create_harmonics.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include "rebound.h"
+#include "reboundx.h"
+
+#pragma omp declare target
+// Index of degree n, order m in the triangular tables
+static inline int rebx_harmonics_index(const int n, const int m){
+    return n*(n+1)/2 + m;
+}
+#pragma omp end declare target
+
+// Layout of h->factors.  The recursion factors run to degree+1, the
+// gradient factors to degree, both over the full triangle.
+enum {REBX_HARMONICS_A, REBX_HARMONICS_B, REBX_HARMONICS_F1, REBX_HARMONICS_F2, REBX_HARMONICS_F3, REBX_HARMONICS_N_FACTORS};
+
+int rebx_harmonics_factors_size(const int degree){
+    return REBX_HARMONICS_N_FACTORS*rebx_harmonics_index(degree+2, 0);
+}
+
+static inline const double* rebx_harmonics_factor(const struct rebx_harmonics* const h, const int which){
+    const int T = rebx_harmonics_index(h->degree+2, 0);
+    return h->factors + which*T;
+}
+
+struct rebx_harmonics* rebx_create_harmonics(const int degree, const int order, const double R_eq){
+    if (degree < 0 || order < 0 || order > degree || R_eq <= 0.){
+        return NULL;
+    }
+    struct rebx_harmonics* const h = calloc(1, sizeof(*h));
+    if (h == NULL){
+        return NULL;
+    }
+    h->degree = degree;
+    h->order = order;
+    h->R_eq = R_eq;
+    const int N_coeff = rebx_harmonics_index(degree+1, 0);
+    const int T = rebx_harmonics_index(degree+2, 0);
+    h->C = calloc(N_coeff, sizeof(*h->C));
+    h->S = calloc(N_coeff, sizeof(*h->S));
+    h->factors = calloc(rebx_harmonics_factors_size(degree), sizeof(*h->factors));
+    if (h->C == NULL || h->S == NULL || h->factors == NULL){
+        rebx_free_harmonics(h);
+        return NULL;
+    }
+
+    double* const a = h->factors + REBX_HARMONICS_A*T;
+    double* const b = h->factors + REBX_HARMONICS_B*T;
+    double* const f1 = h->factors + REBX_HARMONICS_F1*T;
+    double* const f2 = h->factors + REBX_HARMONICS_F2*T;
+    double* const f3 = h->factors + REBX_HARMONICS_F3*T;
+    for (int n=0; n<=degree+1; n++){
+        for (int m=0; m<=n; m++){
+            const int k = rebx_harmonics_index(n, m);
+            if (n == m){
+                // Sectoral V_mm from V_{m-1,m-1}, stored in the a slot
+                a[k] = (m == 0) ? 1. : (m == 1) ? sqrt(3.) : sqrt((2.*m+1.)/(2.*m));
+            }
+            else{
+                a[k] = sqrt((2.*n-1.)*(2.*n+1.)/((double)(n-m)*(n+m)));
+                b[k] = (n >= m+2) ? sqrt((2.*n+1.)*(n+m-1.)*(n-m-1.)/((2.*n-3.)*(n-m)*(n+m))) : 0.;
+            }
+            if (n <= degree){
+                f1[k] = sqrt((m == 0 ? 0.5 : 1.)*(2.*n+1.)/(2.*n+3.)*(n+m+1.)*(n+m+2.));
+                f2[k] = (m == 0) ? 0. : sqrt((m == 1 ? 2. : 1.)*(2.*n+1.)/(2.*n+3.)*(n-m+1.)*(n-m+2.));
+                f3[k] = sqrt((2.*n+1.)/(2.*n+3.)*(n+m+1.)*(n-m+1.));
+            }
+        }
+    }
+    return h;
+}
+
+void rebx_free_harmonics(struct rebx_harmonics* const h){
+    if (h == NULL){
+        return;
+    }
+    free(h->C);
+    free(h->S);
+    free(h->factors);
+    free(h);
+}
+
+int rebx_harmonics_set(struct rebx_harmonics* const h, const int n, const int m, const double C, const double S){
+    if (h == NULL || n < 0 || n > h->degree || m < 0 || m > n){
+        return 0;
+    }
+    const int k = rebx_harmonics_index(n, m);
+    h->C[k] = C;
+    h->S[k] = (m == 0) ? 0. : S;
+    return 1;
+}
+
+int rebx_harmonics_set_J(struct rebx_harmonics* const h, const int n, const double J){
+    return rebx_harmonics_set(h, n, 0, -J/sqrt(2.*n+1.), 0.);
+}
+
+// Fills column m of V and W (degrees m to degree+1) from column m-1,
+// or column 0 from the central term if m is 0.
+static inline void rebx_harmonics_column(const struct rebx_harmonics* const h, const int m,
+        const double* const Vp, const double* const Wp, double* const V, double* const W,
+        const double* const xr, const double* const yr, const double* const zr, const double* const rr, const double* const V00){
+    const int L = REBX_HARMONICS_LANES;
+    const int n_max = h->degree+1;
+    const double* const a = rebx_harmonics_factor(h, REBX_HARMONICS_A);
+    const double* const b = rebx_harmonics_factor(h, REBX_HARMONICS_B);
+    if (m == 0){
+        for (int l=0; l<L; l++){
+            V[l] = V00[l];
+            W[l] = 0.;
+        }
+    }
+    else{
+        const double d = a[rebx_harmonics_index(m, m)];
+        for (int l=0; l<L; l++){
+            V[m*L+l] = d*(xr[l]*Vp[(m-1)*L+l] - yr[l]*Wp[(m-1)*L+l]);
+            W[m*L+l] = d*(xr[l]*Wp[(m-1)*L+l] + yr[l]*Vp[(m-1)*L+l]);
+        }
+    }
+    for (int n=m+1; n<=n_max; n++){
+        const int k = rebx_harmonics_index(n, m);
+        const double an = a[k];
+        const double bn = b[k];
+        const int n2 = (n >= m+2) ? n-2 : n-1;   // bn is 0 if n-2 < m
+        for (int l=0; l<L; l++){
+            V[n*L+l] = an*zr[l]*V[(n-1)*L+l] - bn*rr[l]*V[n2*L+l];
+            W[n*L+l] = an*zr[l]*W[(n-1)*L+l] - bn*rr[l]*W[n2*L+l];
+        }
+    }
+}
+
+// Evaluates one set of REBX_HARMONICS_LANES points.  Adds the
+// accelerations if ax is not NULL and returns the potential per unit mass
+// (times -1) in U if it is not NULL.  work holds the three rolling
+// columns, REBX_HARMONICS_WORK_SIZE(h->degree) doubles.
+static void rebx_harmonics_lanes(const struct rebx_harmonics* const h, const double GM,
+        const double* const x, const double* const y, const double* const z,
+        double* const ax, double* const ay, double* const az, double* const U, double* const work){
+    const int L = REBX_HARMONICS_LANES;
+    const int n_col = h->degree+2;
+    const double R = h->R_eq;
+    double xr[REBX_HARMONICS_LANES], yr[REBX_HARMONICS_LANES], zr[REBX_HARMONICS_LANES];
+    double rr[REBX_HARMONICS_LANES], V00[REBX_HARMONICS_LANES];
+    double sx[REBX_HARMONICS_LANES] = {0.}, sy[REBX_HARMONICS_LANES] = {0.}, sz[REBX_HARMONICS_LANES] = {0.}, su[REBX_HARMONICS_LANES] = {0.};
+    for (int l=0; l<L; l++){
+        const double r2 = x[l]*x[l] + y[l]*y[l] + z[l]*z[l];
+        const double ir2 = 1./r2;
+        xr[l] = x[l]*R*ir2;
+        yr[l] = y[l]*R*ir2;
+        zr[l] = z[l]*R*ir2;
+        rr[l] = R*R*ir2;
+        V00[l] = R/sqrt(r2);
+    }
+
+    // Three rolling columns of V and W, orders m-1, m and m+1
+    const int n_work = n_col*L;
+    double* V[3] = {work, work + n_work, work + 2*n_work};
+    double* W[3] = {work + 3*n_work, work + 4*n_work, work + 5*n_work};
+    rebx_harmonics_column(h, 0, NULL, NULL, V[0], W[0], xr, yr, zr, rr, V00);
+    rebx_harmonics_column(h, 1, V[0], W[0], V[1], W[1], xr, yr, zr, rr, V00);
+
+    const double* const f1 = rebx_harmonics_factor(h, REBX_HARMONICS_F1);
+    const double* const f2 = rebx_harmonics_factor(h, REBX_HARMONICS_F2);
+    const double* const f3 = rebx_harmonics_factor(h, REBX_HARMONICS_F3);
+    for (int m=0; m<=h->order; m++){
+        const double* const Vm = V[m%3];
+        const double* const Wm = W[m%3];
+        const double* const Vhi = V[(m+1)%3];
+        const double* const Whi = W[(m+1)%3];
+        const double* const Vlo = V[(m+2)%3];  // order m-1, unused for m == 0
+        const double* const Wlo = W[(m+2)%3];
+        // The monopole and dipole terms are part of the N-body gravity
+        for (int n=(m > 2 ? m : 2); n<=h->degree; n++){
+            const int k = rebx_harmonics_index(n, m);
+            const double C = h->C[k];
+            const double S = h->S[k];
+            if (C == 0. && S == 0.){
+                continue;
+            }
+            const int n1 = (n+1)*L;
+            if (ax != NULL){
+                if (m == 0){
+                    const double c1 = -C*f1[k];
+                    const double c3 = -C*f3[k];
+                    for (int l=0; l<L; l++){
+                        sx[l] += c1*Vhi[n1+l];
+                        sy[l] += c1*Whi[n1+l];
+                        sz[l] += c3*Vm[n1+l];
+                    }
+                }
+                else{
+                    const double c1 = 0.5*f1[k];
+                    const double c2 = 0.5*f2[k];
+                    const double c3 = f3[k];
+                    for (int l=0; l<L; l++){
+                        sx[l] += c1*(-C*Vhi[n1+l] - S*Whi[n1+l]) + c2*(C*Vlo[n1+l] + S*Wlo[n1+l]);
+                        sy[l] += c1*(-C*Whi[n1+l] + S*Vhi[n1+l]) + c2*(-C*Wlo[n1+l] + S*Vlo[n1+l]);
+                        sz[l] += c3*(-C*Vm[n1+l] - S*Wm[n1+l]);
+                    }
+                }
+            }
+            if (U != NULL){
+                for (int l=0; l<L; l++){
+                    su[l] += C*Vm[n*L+l] + S*Wm[n*L+l];
+                }
+            }
+        }
+        if (m+2 <= h->order+1){
+            rebx_harmonics_column(h, m+2, V[(m+1)%3], W[(m+1)%3], V[(m+2)%3], W[(m+2)%3], xr, yr, zr, rr, V00);
+        }
+    }
+
+    const double GMR2 = GM/(R*R);
+    if (ax != NULL){
+        for (int l=0; l<L; l++){
+            ax[l] += GMR2*sx[l];
+            ay[l] += GMR2*sy[l];
+            az[l] += GMR2*sz[l];
+        }
+    }
+    if (U != NULL){
+        for (int l=0; l<L; l++){
+            U[l] = -GM/R*su[l];
+        }
+    }
+}
+
+// Runs rebx_harmonics_lanes over N points, padding the last set of lanes
+// with copies of the first point.  Without a workspace one is allocated
+// for the call.  Returns 0 if that fails.
+static int rebx_harmonics_evaluate(const struct rebx_harmonics* const h, const double GM, const int N,
+        const double* const x, const double* const y, const double* const z,
+        double* const ax, double* const ay, double* const az, double* const U, double* work){
+    const int L = REBX_HARMONICS_LANES;
+    double* const allocated = (work == NULL && N > 0) ? malloc(REBX_HARMONICS_WORK_SIZE(h->degree)*sizeof(double)) : NULL;
+    if (work == NULL){
+        if (allocated == NULL && N > 0){
+            return 0;
+        }
+        work = allocated;
+    }
+    for (int j0=0; j0<N; j0+=L){
+        const int nl = (N - j0 < L) ? N - j0 : L;
+        if (nl == L){
+            rebx_harmonics_lanes(h, GM, x+j0, y+j0, z+j0, ax ? ax+j0 : NULL, ay ? ay+j0 : NULL, az ? az+j0 : NULL, U ? U+j0 : NULL, work);
+            continue;
+        }
+        double px[REBX_HARMONICS_LANES], py[REBX_HARMONICS_LANES], pz[REBX_HARMONICS_LANES];
+        double pax[REBX_HARMONICS_LANES] = {0.}, pay[REBX_HARMONICS_LANES] = {0.}, paz[REBX_HARMONICS_LANES] = {0.}, pU[REBX_HARMONICS_LANES];
+        for (int l=0; l<L; l++){
+            const int j = j0 + (l < nl ? l : 0);
+            px[l] = x[j];
+            py[l] = y[j];
+            pz[l] = z[j];
+        }
+        rebx_harmonics_lanes(h, GM, px, py, pz, ax ? pax : NULL, pay, paz, U ? pU : NULL, work);
+        for (int l=0; l<nl; l++){
+            if (ax != NULL){
+                ax[j0+l] += pax[l];
+                ay[j0+l] += pay[l];
+                az[j0+l] += paz[l];
+            }
+            if (U != NULL){
+                U[j0+l] = pU[l];
+            }
+        }
+    }
+    free(allocated);
+    return 1;
+}
+
+int rebx_harmonics_accelerations(const struct rebx_harmonics* const h, const double GM, const int N,
+        const double* const x, const double* const y, const double* const z,
+        double* const ax, double* const ay, double* const az, double* const work){
+    return rebx_harmonics_evaluate(h, GM, N, x, y, z, ax, ay, az, NULL, work);
+}
+
+double rebx_harmonics_potential(const struct rebx_harmonics* const h, const double GM, const int N,
+        const double* const x, const double* const y, const double* const z, const double* const m, double* work){
+    const int L = REBX_HARMONICS_LANES;
+    double* const allocated = (work == NULL && N > 0) ? malloc(REBX_HARMONICS_WORK_SIZE(h->degree)*sizeof(double)) : NULL;
+    if (work == NULL){
+        if (allocated == NULL && N > 0){
+            return NAN;
+        }
+        work = allocated;
+    }
+    double H = 0.;
+    for (int j0=0; j0<N; j0+=L){
+        const int nl = (N - j0 < L) ? N - j0 : L;
+        double U[REBX_HARMONICS_LANES];
+        rebx_harmonics_evaluate(h, GM, nl, x+j0, y+j0, z+j0, NULL, NULL, NULL, U, work);
+        for (int l=0; l<nl; l++){
+            H += (m ? m[j0+l] : 1.)*U[l];
+        }
+    }
+    free(allocated);
+    return H;
+}
+
+#pragma omp declare target
+void rebx_harmonics_zonal_point(const int degree, const double R_eq, const double* const C, const double* const factors, const double GM,
+        const double x, const double y, const double z, double* const ax, double* const ay, double* const az){
+    // Same recursion as rebx_harmonics_column for orders 0 and 1 only
+    double V0[REBX_HARMONICS_ZONAL_MAX+2], V1[REBX_HARMONICS_ZONAL_MAX+2], W1[REBX_HARMONICS_ZONAL_MAX+2];
+    if (degree > REBX_HARMONICS_ZONAL_MAX){
+        return;
+    }
+    const int T = rebx_harmonics_index(degree+2, 0);
+    const double* const a = factors + REBX_HARMONICS_A*T;
+    const double* const b = factors + REBX_HARMONICS_B*T;
+    const double* const f1 = factors + REBX_HARMONICS_F1*T;
+    const double* const f3 = factors + REBX_HARMONICS_F3*T;
+    const double r2 = x*x + y*y + z*z;
+    const double ir2 = 1./r2;
+    const double xr = x*R_eq*ir2;
+    const double yr = y*R_eq*ir2;
+    const double zr = z*R_eq*ir2;
+    const double rr = R_eq*R_eq*ir2;
+    V0[0] = R_eq/sqrt(r2);
+    for (int n=1; n<=degree+1; n++){
+        const int k = rebx_harmonics_index(n, 0);
+        V0[n] = a[k]*zr*V0[n-1] - (n >= 2 ? b[k]*rr*V0[n-2] : 0.);
+    }
+    const double d = a[rebx_harmonics_index(1, 1)];
+    V1[1] = d*xr*V0[0];
+    W1[1] = d*yr*V0[0];
+    for (int n=2; n<=degree+1; n++){
+        const int k = rebx_harmonics_index(n, 1);
+        V1[n] = a[k]*zr*V1[n-1] - (n >= 3 ? b[k]*rr*V1[n-2] : 0.);
+        W1[n] = a[k]*zr*W1[n-1] - (n >= 3 ? b[k]*rr*W1[n-2] : 0.);
+    }
+    double sx = 0., sy = 0., sz = 0.;
+    for (int n=2; n<=degree; n++){
+        const int k = rebx_harmonics_index(n, 0);
+        sx -= C[k]*f1[k]*V1[n+1];
+        sy -= C[k]*f1[k]*W1[n+1];
+        sz -= C[k]*f3[k]*V0[n+1];
+    }
+    const double GMR2 = GM/(R_eq*R_eq);
+    *ax += GMR2*sx;
+    *ay += GMR2*sy;
+    *az += GMR2*sz;
+}
+#pragma omp end declare target
@@ -27,6 +27,11 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "rebound.h"
 #include "reboundx.h"
 #include "core.h"
@@ -34,7 +39,7 @@
 // Macro to read a single field from a binary file.
 #define CASE(typename, valueref) case REBX_BINARY_FIELD_TYPE_##typename: \
 {\
-if(!fread(valueref, field.size, 1, inf)){\
+if(!rebx_binary_read(inf, valueref, field.size)){\
 *warnings |= REBX_INPUT_BINARY_ERROR_CORRUPT;\
 }\
 break;\
@@ -47,9 +52,10 @@ if(valueref == NULL){\
 *warnings |= REBX_INPUT_BINARY_ERROR_NO_MEMORY;\
 }\
 else{\
-if(!fread(valueref, field.size, 1, inf)){\
+if(!rebx_binary_read(inf, valueref, field.size)){\
 *warnings |= REBX_INPUT_BINARY_ERROR_CORRUPT;\
 free(valueref);\
+valueref = NULL;\
 }\
 }\
 break;\
@@ -59,11 +65,97 @@ void rebx_input_skip_binary_field(FILE* inf, long field_size){
     fseek(inf, field_size, SEEK_CUR);
 }
 
-static int rebx_load_list(struct rebx_extras* rebx, enum rebx_binary_field_type expected_type, struct rebx_node** ap, FILE* inf, enum rebx_input_binary_messages* warnings);
+// Binaries are mapped into memory (or read in with a single fread if that fails),
+// so reading a field is a bounds check and a memcpy.
+struct rebx_binary_reader{
+    const char* data;
+    size_t size;
+    size_t pos;
+    int mapped;
+};
 
-static struct rebx_param* rebx_read_param(struct rebx_extras* rebx, FILE* inf, enum rebx_input_binary_messages* warnings){
+// Returns 1 if size bytes were copied to dest, like fread with a count of 1.
+static int rebx_binary_read(struct rebx_binary_reader* const inf, void* const dest, const long size){
+    if (size < 0 || (size_t)size > inf->size - inf->pos){
+        inf->pos = inf->size;
+        return 0;
+    }
+    memcpy(dest, inf->data + inf->pos, size);
+    inf->pos += size;
+    return 1;
+}
+
+static void rebx_binary_skip(struct rebx_binary_reader* const inf, const long size){
+    if (size < 0 || (size_t)size > inf->size - inf->pos){
+        inf->pos = inf->size;
+    }
+    else{
+        inf->pos += size;
+    }
+}
+
+static int rebx_binary_open(struct rebx_binary_reader* const inf, const char* const filename){
+    inf->data = NULL;
+    inf->size = 0;
+    inf->pos = 0;
+    inf->mapped = 0;
+    const int fd = open(filename, O_RDONLY);
+    if (fd < 0){
+        return 0;
+    }
+    struct stat sb;
+    if (fstat(fd, &sb) < 0){
+        close(fd);
+        return 0;
+    }
+    inf->size = sb.st_size;
+    if (inf->size > 0){
+        void* const map = mmap(NULL, inf->size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED){
+            inf->data = map;
+            inf->mapped = 1;
+        }
+    }
+    close(fd);
+    if (inf->size > 0 && !inf->mapped){
+        FILE* const f = fopen(filename, "rb");
+        char* const buf = malloc(inf->size);
+        if (f == NULL || buf == NULL || fread(buf, inf->size, 1, f) != 1){
+            if (f != NULL){
+                fclose(f);
+            }
+            free(buf);
+            inf->size = 0;
+            return 0;
+        }
+        fclose(f);
+        inf->data = buf;
+    }
+    return 1;
+}
+
+static void rebx_binary_close(struct rebx_binary_reader* const inf){
+    if (inf->mapped){
+        munmap((void*)inf->data, inf->size);
+    }
+    else{
+        free((void*)inf->data);
+    }
+    inf->data = NULL;
+}
+
+static int rebx_load_list(struct rebx_extras* rebx, enum rebx_binary_field_type expected_type, struct rebx_node** ap, struct rebx_binary_reader* inf, enum rebx_input_binary_messages* warnings);
+
+// Until rebx_param_adopt, the name and value of a param that was read in are malloced copies
+static void rebx_free_read_param(struct rebx_extras* rebx, struct rebx_param* param){
+    free(param->name);
+    free(param->value);
+    rebx_pool_free(&rebx->param_pool, param);
+}
+
+static struct rebx_param* rebx_read_param(struct rebx_extras* rebx, struct rebx_binary_reader* inf, enum rebx_input_binary_messages* warnings){
     
-    struct rebx_param* param = malloc(sizeof(*param));
+    struct rebx_param* param = rebx_pool_alloc(&rebx->param_pool);
     if (param == NULL){
         *warnings |= REBX_INPUT_BINARY_ERROR_NO_MEMORY;
         return NULL;
@@ -71,11 +163,13 @@ static struct rebx_param* rebx_read_param(struct rebx_extras* rebx, FILE* inf, e
     param->value = NULL;
     param->name = NULL;
     param->type = REBX_TYPE_NONE;
+    param->id = -1;
+    param->column = NULL;
     
     struct rebx_binary_field field;
     int reading_fields = 1;
     while (reading_fields){
-        if (!fread(&field, sizeof(field), 1, inf)){ // means we didn't reach an END field. Corrupt
+        if (!rebx_binary_read(inf, &field, sizeof(field))){ // means we didn't reach an END field. Corrupt
             *warnings |= REBX_INPUT_BINARY_ERROR_CORRUPT;
             break;
         }
@@ -96,13 +190,13 @@ static struct rebx_param* rebx_read_param(struct rebx_extras* rebx, FILE* inf, e
     // Check type and name after param has been loaded. Check value later (registered params should have value=NULL)
     if (param->type == REBX_TYPE_NONE || param->name == NULL){
         *warnings |= REBX_INPUT_BINARY_ERROR_CORRUPT;
-        rebx_free_param(param);
+        rebx_free_read_param(rebx, param);
         return NULL;
     }
     return param;
 }
 
-static int rebx_load_param(struct rebx_extras* rebx, struct rebx_node** ap, FILE* inf, enum rebx_input_binary_messages* warnings){
+static int rebx_load_param(struct rebx_extras* rebx, struct rebx_node** ap, struct rebx_binary_reader* inf, enum rebx_input_binary_messages* warnings){
     struct rebx_param* param = rebx_read_param(rebx, inf, warnings);
     
     if(param == NULL){
@@ -111,34 +205,46 @@ static int rebx_load_param(struct rebx_extras* rebx, struct rebx_node** ap, FILE
     
     if(param->value == NULL){
         *warnings |= REBX_INPUT_BINARY_WARNING_PARAM_VALUE_NULL;
-        rebx_free_param(param);
+        rebx_free_read_param(rebx, param);
         return 0;
     }
+    param->id = rebx_get_param_id(rebx, param->name);
     
     if(param->type == REBX_TYPE_FORCE){
         struct rebx_force* force = rebx_get_force(rebx, param->value);
         if (force == NULL){
             *warnings |= REBX_INPUT_BINARY_WARNING_FORCE_PARAM_NOT_LOADED;
-            rebx_free_param(param);
+            rebx_free_read_param(rebx, param);
             return 0;
         }
+        free(param->value); // name of the force
         param->value = force;
     }
+    if(!rebx_param_adopt(rebx, param)){
+        *warnings |= REBX_INPUT_BINARY_ERROR_NO_MEMORY;
+        rebx_free_param(rebx, param);
+        return 0;
+    }
     int success = rebx_add_param(rebx, ap, param);
     if(!success){
+        rebx_free_param(rebx, param);
         return 0;
     }
     return 1;
     
 }
 
-static int rebx_load_registered_param(struct rebx_extras* rebx, FILE* inf, enum rebx_input_binary_messages* warnings){
+static int rebx_load_registered_param(struct rebx_extras* rebx, struct rebx_binary_reader* inf, enum rebx_input_binary_messages* warnings){
     struct rebx_param* param = rebx_read_param(rebx, inf, warnings);
     
     if(param == NULL){
         return 0;
     }
     
+    if(rebx_get_param_id(rebx, param->name) >= 0 || !rebx_intern_param(rebx, param)){
+        rebx_free_read_param(rebx, param);
+        return 0;
+    }
     int success = rebx_add_param(rebx, &rebx->registered_params, param);
     if(!success){
         return 0;
@@ -146,9 +252,9 @@ static int rebx_load_registered_param(struct rebx_extras* rebx, FILE* inf, enum
     return 1;
 }
 
-static char* rebx_load_name(FILE* inf, enum rebx_input_binary_messages* warnings){
+static char* rebx_load_name(struct rebx_binary_reader* inf, enum rebx_input_binary_messages* warnings){
     struct rebx_binary_field field;
-    if (!fread(&field, sizeof(field), 1, inf)){
+    if (!rebx_binary_read(inf, &field, sizeof(field))){
         *warnings |= REBX_INPUT_BINARY_ERROR_CORRUPT;
         return NULL;
     }
@@ -161,7 +267,7 @@ static char* rebx_load_name(FILE* inf, enum rebx_input_binary_messages* warnings
         *warnings |= REBX_INPUT_BINARY_ERROR_NO_MEMORY;
         return NULL;
     }
-    if (!fread(name, field.size, 1, inf)){
+    if (!rebx_binary_read(inf, name, field.size)){
         *warnings |= REBX_INPUT_BINARY_ERROR_CORRUPT;
         free(name);
         return NULL;
@@ -169,7 +275,7 @@ static char* rebx_load_name(FILE* inf, enum rebx_input_binary_messages* warnings
     return name;
 }
 
-static int rebx_load_force_field(struct rebx_extras* rebx, FILE* inf, enum rebx_input_binary_messages* warnings){
+static int rebx_load_force_field(struct rebx_extras* rebx, struct rebx_binary_reader* inf, enum rebx_input_binary_messages* warnings){
     
     // Name of force always comes first so that we can load it
     char* name = rebx_load_name(inf, warnings);
@@ -186,7 +292,7 @@ static int rebx_load_force_field(struct rebx_extras* rebx, FILE* inf, enum rebx_
     struct rebx_binary_field field;
     int reading_fields = 1;
     while (reading_fields){
-        if (!fread(&field, sizeof(field), 1, inf)){
+        if (!rebx_binary_read(inf, &field, sizeof(field))){
             *warnings |= REBX_INPUT_BINARY_ERROR_CORRUPT;
             return 0;
         }
@@ -198,6 +304,14 @@ static int rebx_load_force_field(struct rebx_extras* rebx, FILE* inf, enum rebx_
                 }
                 break;
             }
+            case REBX_BINARY_FIELD_TYPE_COUNTERS:
+            {
+                if (field.size != sizeof(force->counters) || !rebx_binary_read(inf, &force->counters, sizeof(force->counters))){
+                    *warnings |= REBX_INPUT_BINARY_ERROR_CORRUPT;
+                    return 0;
+                }
+                break;
+            }
             case REBX_BINARY_FIELD_TYPE_END:
             {
                 reading_fields=0;
@@ -206,7 +320,7 @@ static int rebx_load_force_field(struct rebx_extras* rebx, FILE* inf, enum rebx_
             default:
             {
                 *warnings |= REBX_INPUT_BINARY_WARNING_FIELD_UNKNOWN;
-                rebx_input_skip_binary_field(inf, field.size);
+                rebx_binary_skip(inf, field.size);
                 break;
             }
         }
@@ -216,7 +330,7 @@ static int rebx_load_force_field(struct rebx_extras* rebx, FILE* inf, enum rebx_
 }
 
 // Force is already loaded in allocated_forces. Need to get from that list and add to sim
-static int rebx_load_additional_force_field(struct rebx_extras* rebx, FILE* inf, enum rebx_input_binary_messages* warnings){
+static int rebx_load_additional_force_field(struct rebx_extras* rebx, struct rebx_binary_reader* inf, enum rebx_input_binary_messages* warnings){
     
     char* name = rebx_load_name(inf, warnings);
     if(name == NULL){
@@ -232,7 +346,7 @@ static int rebx_load_additional_force_field(struct rebx_extras* rebx, FILE* inf,
     struct rebx_binary_field field;
     int reading_fields = 1;
     while (reading_fields){
-        if (!fread(&field, sizeof(field), 1, inf)){
+        if (!rebx_binary_read(inf, &field, sizeof(field))){
             *warnings |= REBX_INPUT_BINARY_ERROR_CORRUPT;
             return 0;
         }
@@ -245,7 +359,7 @@ static int rebx_load_additional_force_field(struct rebx_extras* rebx, FILE* inf,
             default:
             {
                 *warnings |= REBX_INPUT_BINARY_WARNING_FIELD_UNKNOWN;
-                rebx_input_skip_binary_field(inf, field.size);
+                rebx_binary_skip(inf, field.size);
                 break;
             }
         }
@@ -255,7 +369,7 @@ static int rebx_load_additional_force_field(struct rebx_extras* rebx, FILE* inf,
     return success;
 }
 
-static int rebx_load_operator_field(struct rebx_extras* rebx, FILE* inf, enum rebx_input_binary_messages* warnings){
+static int rebx_load_operator_field(struct rebx_extras* rebx, struct rebx_binary_reader* inf, enum rebx_input_binary_messages* warnings){
     // Name of force always comes first so that we can load it
     char* name = rebx_load_name(inf, warnings);
     if(name == NULL){
@@ -271,7 +385,7 @@ static int rebx_load_operator_field(struct rebx_extras* rebx, FILE* inf, enum re
     struct rebx_binary_field field;
     int reading_fields = 1;
     while (reading_fields){
-        if (!fread(&field, sizeof(field), 1, inf)){
+        if (!rebx_binary_read(inf, &field, sizeof(field))){
             *warnings |= REBX_INPUT_BINARY_ERROR_CORRUPT;
             break;
         }
@@ -283,6 +397,14 @@ static int rebx_load_operator_field(struct rebx_extras* rebx, FILE* inf, enum re
                 }
                 break;
             }
+            case REBX_BINARY_FIELD_TYPE_COUNTERS:
+            {
+                if (field.size != sizeof(operator->counters) || !rebx_binary_read(inf, &operator->counters, sizeof(operator->counters))){
+                    *warnings |= REBX_INPUT_BINARY_ERROR_CORRUPT;
+                    return 0;
+                }
+                break;
+            }
             case REBX_BINARY_FIELD_TYPE_END:
             {
                 reading_fields=0;
@@ -291,7 +413,7 @@ static int rebx_load_operator_field(struct rebx_extras* rebx, FILE* inf, enum re
             default:
             {
                 *warnings |= REBX_INPUT_BINARY_WARNING_FIELD_UNKNOWN;
-                rebx_input_skip_binary_field(inf, field.size);
+                rebx_binary_skip(inf, field.size);
                 break;
             }
         }
@@ -300,7 +422,7 @@ static int rebx_load_operator_field(struct rebx_extras* rebx, FILE* inf, enum re
     return 1;
 }
 
-static int rebx_load_step_field(struct rebx_extras* rebx, FILE* inf, enum rebx_input_binary_messages* warnings, struct rebx_node** ap){
+static int rebx_load_step_field(struct rebx_extras* rebx, struct rebx_binary_reader* inf, enum rebx_input_binary_messages* warnings, struct rebx_node** ap){
     char* name = rebx_load_name(inf, warnings);
     if(name == NULL){
         return 0;
@@ -316,7 +438,7 @@ static int rebx_load_step_field(struct rebx_extras* rebx, FILE* inf, enum rebx_i
     struct rebx_binary_field field;
     int reading_fields = 1;
     while (reading_fields){
-        if (!fread(&field, sizeof(field), 1, inf)){
+        if (!rebx_binary_read(inf, &field, sizeof(field))){
             *warnings |= REBX_INPUT_BINARY_ERROR_CORRUPT;
             break;
         }
@@ -347,10 +469,11 @@ static int rebx_load_step_field(struct rebx_extras* rebx, FILE* inf, enum rebx_i
     return success;
 }
 
-static int rebx_load_particle(struct rebx_extras* rebx, FILE* inf, enum rebx_input_binary_messages* warnings){
+// With replace set (archive deltas) the particle's current params are dropped first
+static int rebx_load_particle(struct rebx_extras* rebx, struct rebx_binary_reader* inf, enum rebx_input_binary_messages* warnings, const int replace){
     struct reb_particle* p = NULL;
     struct rebx_binary_field field;
-    if (!fread(&field, sizeof(field), 1, inf)){
+    if (!rebx_binary_read(inf, &field, sizeof(field))){
         *warnings |= REBX_INPUT_BINARY_ERROR_CORRUPT;
         return 0;
     }
@@ -360,16 +483,23 @@ static int rebx_load_particle(struct rebx_extras* rebx, FILE* inf, enum rebx_inp
         return 0;
     }
     int index;
-    if(!fread(&index, field.size, 1, inf)){
+    if(!rebx_binary_read(inf, &index, field.size)){
         *warnings |= REBX_INPUT_BINARY_ERROR_CORRUPT;
         return 0;
     }
     
-    p = &rebx->sim->particles[index]; // checked sim is valid in init_from_binary
+    if (index < 0 || index >= rebx->sim->N){ // checked sim is valid in init_from_binary
+        return 0;
+    }
+    p = &rebx->sim->particles[index];
+    if (replace){
+        rebx_free_particle_ap(p);
+        p->ap = NULL;
+    }
     
     int reading_fields = 1;
     while (reading_fields){
-        if (!fread(&field, sizeof(field), 1, inf)){
+        if (!rebx_binary_read(inf, &field, sizeof(field))){
             *warnings |= REBX_INPUT_BINARY_ERROR_CORRUPT;
             return 0;
         }
@@ -389,7 +519,7 @@ static int rebx_load_particle(struct rebx_extras* rebx, FILE* inf, enum rebx_inp
             default:
             {
                 *warnings |= REBX_INPUT_BINARY_WARNING_FIELD_UNKNOWN;
-                rebx_input_skip_binary_field(inf, field.size);
+                rebx_binary_skip(inf, field.size);
                 break;
             }
         }
@@ -397,11 +527,11 @@ static int rebx_load_particle(struct rebx_extras* rebx, FILE* inf, enum rebx_inp
     return 1;
 }
 
-static int rebx_load_rebx(struct rebx_extras* rebx, FILE* inf, enum rebx_input_binary_messages* warnings){
+static int rebx_load_rebx(struct rebx_extras* rebx, struct rebx_binary_reader* inf, enum rebx_input_binary_messages* warnings){
     struct rebx_binary_field field;
     int reading_fields = 1;
     while (reading_fields){
-        if (!fread(&field, sizeof(field), 1, inf)){
+        if (!rebx_binary_read(inf, &field, sizeof(field))){
             *warnings |= REBX_INPUT_BINARY_ERROR_CORRUPT;
             break;
         }
@@ -415,7 +545,7 @@ static int rebx_load_rebx(struct rebx_extras* rebx, FILE* inf, enum rebx_input_b
             {
                 if (!rebx_load_list(rebx, REBX_BINARY_FIELD_TYPE_REGISTERED_PARAM, &rebx->registered_params, inf, warnings)){
                     *warnings |= REBX_INPUT_BINARY_ERROR_CORRUPT;
-                    rebx_input_skip_binary_field(inf, field.size);
+                    rebx_binary_skip(inf, field.size);
                 }
                 break;
             }
@@ -423,7 +553,7 @@ static int rebx_load_rebx(struct rebx_extras* rebx, FILE* inf, enum rebx_input_b
             {
                 if (!rebx_load_list(rebx, REBX_BINARY_FIELD_TYPE_FORCE, NULL, inf, warnings)){
                     *warnings |= REBX_INPUT_BINARY_ERROR_CORRUPT;
-                    rebx_input_skip_binary_field(inf, field.size);
+                    rebx_binary_skip(inf, field.size);
                 }
                 break;
             }
@@ -431,7 +561,7 @@ static int rebx_load_rebx(struct rebx_extras* rebx, FILE* inf, enum rebx_input_b
             {
                 if (!rebx_load_list(rebx, REBX_BINARY_FIELD_TYPE_OPERATOR, NULL, inf, warnings)){
                     *warnings |= REBX_INPUT_BINARY_ERROR_CORRUPT;
-                    rebx_input_skip_binary_field(inf, field.size);
+                    rebx_binary_skip(inf, field.size);
                 }
                 break;
             }
@@ -439,7 +569,7 @@ static int rebx_load_rebx(struct rebx_extras* rebx, FILE* inf, enum rebx_input_b
             {
                 if (!rebx_load_list(rebx, REBX_BINARY_FIELD_TYPE_ADDITIONAL_FORCE, NULL, inf, warnings)){
                     *warnings |= REBX_INPUT_BINARY_ERROR_CORRUPT;
-                    rebx_input_skip_binary_field(inf, field.size);
+                    rebx_binary_skip(inf, field.size);
                 }
                 break;
             }
@@ -447,7 +577,7 @@ static int rebx_load_rebx(struct rebx_extras* rebx, FILE* inf, enum rebx_input_b
             {
                 if (!rebx_load_list(rebx, REBX_BINARY_FIELD_TYPE_STEP, &rebx->pre_timestep_modifications, inf, warnings)){
                     *warnings |= REBX_INPUT_BINARY_ERROR_CORRUPT;
-                    rebx_input_skip_binary_field(inf, field.size);
+                    rebx_binary_skip(inf, field.size);
                 }
                 break;
             }
@@ -455,14 +585,14 @@ static int rebx_load_rebx(struct rebx_extras* rebx, FILE* inf, enum rebx_input_b
             {
                 if (!rebx_load_list(rebx, REBX_BINARY_FIELD_TYPE_STEP, &rebx->post_timestep_modifications, inf, warnings)){
                     *warnings |= REBX_INPUT_BINARY_ERROR_CORRUPT;
-                    rebx_input_skip_binary_field(inf, field.size);
+                    rebx_binary_skip(inf, field.size);
                 }
                 break;
             }
             default:
             {
                 *warnings |= REBX_INPUT_BINARY_WARNING_FIELD_UNKNOWN;
-                rebx_input_skip_binary_field(inf, field.size);
+                rebx_binary_skip(inf, field.size);
                 break;
             }
         }
@@ -470,9 +600,9 @@ static int rebx_load_rebx(struct rebx_extras* rebx, FILE* inf, enum rebx_input_b
     return 1;
 }
 
-static int rebx_load_snapshot(struct rebx_extras* rebx, FILE* inf, enum rebx_input_binary_messages* warnings){
+static int rebx_load_snapshot(struct rebx_extras* rebx, struct rebx_binary_reader* inf, enum rebx_input_binary_messages* warnings){
     struct rebx_binary_field field;
-    if (!fread(&field, sizeof(field), 1, inf)){
+    if (!rebx_binary_read(inf, &field, sizeof(field))){
         *warnings |= REBX_INPUT_BINARY_ERROR_CORRUPT;
         return 0;
     }
@@ -483,7 +613,7 @@ static int rebx_load_snapshot(struct rebx_extras* rebx, FILE* inf, enum rebx_inp
 
     int reading_fields = 1;
     while (reading_fields){
-        if (!fread(&field, sizeof(field), 1, inf)){
+        if (!rebx_binary_read(inf, &field, sizeof(field))){
             *warnings |= REBX_INPUT_BINARY_ERROR_CORRUPT;
             break;
         }
@@ -492,15 +622,20 @@ static int rebx_load_snapshot(struct rebx_extras* rebx, FILE* inf, enum rebx_inp
             {
                 if (!rebx_load_rebx(rebx, inf, warnings)){
                     *warnings |= REBX_INPUT_BINARY_ERROR_REBX_NOT_LOADED;
-                    rebx_input_skip_binary_field(inf, field.size);
+                    rebx_binary_skip(inf, field.size);
                 }
                 break;
             }
+            case REBX_BINARY_FIELD_TYPE_TIME:   // only in archives, used when indexing
+            {
+                rebx_binary_skip(inf, field.size);
+                break;
+            }
             case REBX_BINARY_FIELD_TYPE_PARTICLES:
             {
                 if (!rebx_load_list(rebx, REBX_BINARY_FIELD_TYPE_PARTICLE, NULL, inf, warnings)){
                     *warnings |= REBX_INPUT_BINARY_ERROR_CORRUPT;
-                    rebx_input_skip_binary_field(inf, field.size);
+                    rebx_binary_skip(inf, field.size);
                 }
                 break;
             }
@@ -512,7 +647,7 @@ static int rebx_load_snapshot(struct rebx_extras* rebx, FILE* inf, enum rebx_inp
             default:
             {
                 *warnings |= REBX_INPUT_BINARY_WARNING_LIST_UNKNOWN;
-                rebx_input_skip_binary_field(inf, field.size);
+                rebx_binary_skip(inf, field.size);
                 break;
             }
         }
@@ -522,11 +657,11 @@ static int rebx_load_snapshot(struct rebx_extras* rebx, FILE* inf, enum rebx_inp
 }
 
 // Only fails (returns 0) if binary is in wrong format
-static int rebx_load_list(struct rebx_extras* rebx, enum rebx_binary_field_type expected_type, struct rebx_node** ap, FILE* inf, enum rebx_input_binary_messages* warnings){
+static int rebx_load_list(struct rebx_extras* rebx, enum rebx_binary_field_type expected_type, struct rebx_node** ap, struct rebx_binary_reader* inf, enum rebx_input_binary_messages* warnings){
     struct rebx_binary_field field;
     int reading_fields = 1;
     while (reading_fields){
-        if (!fread(&field, sizeof(field), 1, inf)){
+        if (!rebx_binary_read(inf, &field, sizeof(field))){
             return 0;
         }
         
@@ -545,7 +680,7 @@ static int rebx_load_list(struct rebx_extras* rebx, enum rebx_binary_field_type
             {
                 if(!rebx_load_param(rebx, ap, inf, warnings)){
                     *warnings |= REBX_INPUT_BINARY_WARNING_PARAM_NOT_LOADED;
-                    rebx_input_skip_binary_field(inf, field.size);
+                    rebx_binary_skip(inf, field.size);
                 }
                 break;
             }
@@ -553,7 +688,7 @@ static int rebx_load_list(struct rebx_extras* rebx, enum rebx_binary_field_type
             {
                 if(!rebx_load_registered_param(rebx, inf, warnings)){
                     *warnings |= REBX_INPUT_BINARY_ERROR_REGISTERED_PARAM_NOT_LOADED;
-                    rebx_input_skip_binary_field(inf, field.size);
+                    rebx_binary_skip(inf, field.size);
                 }
                 break;
             }
@@ -561,7 +696,7 @@ static int rebx_load_list(struct rebx_extras* rebx, enum rebx_binary_field_type
             {
                 if (!rebx_load_force_field(rebx, inf, warnings)){
                     *warnings |= REBX_INPUT_BINARY_WARNING_FORCE_NOT_LOADED;
-                    rebx_input_skip_binary_field(inf, field.size);
+                    rebx_binary_skip(inf, field.size);
                 }
                 break;
             }
@@ -569,7 +704,7 @@ static int rebx_load_list(struct rebx_extras* rebx, enum rebx_binary_field_type
             {
                 if (!rebx_load_additional_force_field(rebx, inf, warnings)){
                     *warnings |= REBX_INPUT_BINARY_WARNING_ADDITIONAL_FORCE_NOT_LOADED;
-                    rebx_input_skip_binary_field(inf, field.size);
+                    rebx_binary_skip(inf, field.size);
                 }
                 break;
             }
@@ -577,7 +712,7 @@ static int rebx_load_list(struct rebx_extras* rebx, enum rebx_binary_field_type
             {
                 if (!rebx_load_operator_field(rebx, inf, warnings)){
                     *warnings |= REBX_INPUT_BINARY_WARNING_OPERATOR_NOT_LOADED;
-                    rebx_input_skip_binary_field(inf, field.size);
+                    rebx_binary_skip(inf, field.size);
                 }
                 break;
             }
@@ -585,15 +720,17 @@ static int rebx_load_list(struct rebx_extras* rebx, enum rebx_binary_field_type
             {
                 if (!rebx_load_step_field(rebx, inf, warnings, ap)){
                     *warnings |= REBX_INPUT_BINARY_WARNING_STEP_NOT_LOADED;
-                    rebx_input_skip_binary_field(inf, field.size);
+                    rebx_binary_skip(inf, field.size);
                 }
                 break;
             }
             case REBX_BINARY_FIELD_TYPE_PARTICLE:
             {
-                if (!rebx_load_particle(rebx, inf, warnings)){
+                const size_t start = inf->pos;
+                if (!rebx_load_particle(rebx, inf, warnings, 0)){
                     *warnings |= REBX_INPUT_BINARY_WARNING_PARTICLE_PARAMS_NOT_LOADED;
-                    rebx_input_skip_binary_field(inf, field.size);
+                    inf->pos = start;
+                    rebx_binary_skip(inf, field.size);
                 }
                 break;
             }
@@ -607,41 +744,247 @@ static int rebx_load_list(struct rebx_extras* rebx, enum rebx_binary_field_type
     return 1;
 }
 
-static void rebx_input_read_header(FILE* inf, enum rebx_input_binary_messages* warnings){
-    long objects = 0;
+static void rebx_input_check_header(const char* const readbuf, enum rebx_input_binary_messages* warnings){
     // Input header.
     const char str[] = "REBOUNDx Binary File. Version: ";
     const char zero = '\0';
-    char readbuf[65], curvbuf[65];
+    char curvbuf[65];
     sprintf(curvbuf,"%s%s",str,rebx_version_str);
     memcpy(curvbuf+strlen(curvbuf)+1,rebx_githash_str,sizeof(char)*(62-strlen(curvbuf)));
     curvbuf[63] = zero;
     
-    objects += fread(readbuf,sizeof(*str),64,inf);
     // Note: following compares version, but ignores githash.
     if(strcmp(readbuf,curvbuf)!=0){
         *warnings |= REBX_INPUT_BINARY_WARNING_VERSION;
     }
 }
 
+static void rebx_input_read_header(FILE* inf, enum rebx_input_binary_messages* warnings){
+    char readbuf[65] = {0};
+    long objects = 0;
+    objects += fread(readbuf,sizeof(char),64,inf);
+    rebx_input_check_header(readbuf, warnings);
+}
+
 void rebx_init_extras_from_binary(struct rebx_extras* rebx, const char* const filename, enum rebx_input_binary_messages* warnings){
     if (rebx->sim == NULL){
         rebx_error(rebx, ""); // rebx_error gives meaningful err
         return;
     }
-    FILE* inf = fopen(filename,"rb");
-    if (!inf){
+    struct rebx_binary_reader inf;
+    if (!rebx_binary_open(&inf, filename)){
         *warnings |= REBX_INPUT_BINARY_ERROR_NOFILE;
         return;
     }
     
-    rebx_input_read_header(inf, warnings);
-    rebx_load_snapshot(rebx, inf, warnings);
+    char readbuf[65] = {0};
+    if (inf.size > 0){
+        memcpy(readbuf, inf.data, inf.size < 64 ? inf.size : 64);
+    }
+    rebx_binary_skip(&inf, 64);
+    rebx_input_check_header(readbuf, warnings);
+    rebx_load_snapshot(rebx, &inf, warnings);
     
-    fclose(inf);
+    rebx_binary_close(&inf);
     return;
 }
 
+static void rebx_input_report_warnings(struct reb_simulation* sim, const enum rebx_input_binary_messages warnings);
+
+// Only the particle params stored in a delta are replaced
+static int rebx_load_delta_snapshot(struct rebx_extras* rebx, struct rebx_binary_reader* inf, enum rebx_input_binary_messages* warnings){
+    struct rebx_binary_field field;
+    if (!rebx_binary_read(inf, &field, sizeof(field)) || field.type != REBX_BINARY_FIELD_TYPE_DELTA_SNAPSHOT){
+        *warnings |= REBX_INPUT_BINARY_ERROR_CORRUPT;
+        return 0;
+    }
+    int reading_fields = 1;
+    while (reading_fields){
+        if (!rebx_binary_read(inf, &field, sizeof(field))){
+            *warnings |= REBX_INPUT_BINARY_ERROR_CORRUPT;
+            return 0;
+        }
+        switch (field.type){
+            case REBX_BINARY_FIELD_TYPE_PARTICLES:
+            {
+                struct rebx_binary_field particle;
+                while (1){
+                    if (!rebx_binary_read(inf, &particle, sizeof(particle)) || (particle.type != REBX_BINARY_FIELD_TYPE_PARTICLE && particle.type != REBX_BINARY_FIELD_TYPE_END)){
+                        *warnings |= REBX_INPUT_BINARY_ERROR_CORRUPT;
+                        return 0;
+                    }
+                    if (particle.type == REBX_BINARY_FIELD_TYPE_END){
+                        break;
+                    }
+                    const size_t start = inf->pos;
+                    if (!rebx_load_particle(rebx, inf, warnings, 1)){
+                        *warnings |= REBX_INPUT_BINARY_WARNING_PARTICLE_PARAMS_NOT_LOADED;
+                        inf->pos = start;
+                        rebx_binary_skip(inf, particle.size);
+                    }
+                }
+                break;
+            }
+            case REBX_BINARY_FIELD_TYPE_END:
+            {
+                reading_fields=0;
+                break;
+            }
+            default:    // TIME, or fields added later
+            {
+                if (field.type != REBX_BINARY_FIELD_TYPE_TIME){
+                    *warnings |= REBX_INPUT_BINARY_WARNING_FIELD_UNKNOWN;
+                }
+                rebx_binary_skip(inf, field.size);
+                break;
+            }
+        }
+    }
+    return 1;
+}
+
+// Offsets, types and times of the snapshots in an archive, from walking the top level field headers.
+struct rebx_archive_index{
+    long N;
+    size_t* offsets;
+    int* keyframe;
+    double* t;
+};
+
+static void rebx_archive_index_free(struct rebx_archive_index* const index){
+    free(index->offsets);
+    free(index->keyframe);
+    free(index->t);
+}
+
+static int rebx_archive_index_build(struct rebx_binary_reader* inf, struct rebx_archive_index* const index){
+    long N_alloc = 0;
+    index->N = 0;
+    index->offsets = NULL;
+    index->keyframe = NULL;
+    index->t = NULL;
+    inf->pos = 0;
+    rebx_binary_skip(inf, 64);  // header
+    struct rebx_binary_field field;
+    while (1){
+        const size_t offset = inf->pos;
+        if (!rebx_binary_read(inf, &field, sizeof(field))){
+            break;
+        }
+        if (field.type != REBX_BINARY_FIELD_TYPE_SNAPSHOT && field.type != REBX_BINARY_FIELD_TYPE_DELTA_SNAPSHOT){
+            break;
+        }
+        if (field.size < 0 || (size_t)field.size > inf->size - inf->pos){ // truncated, e.g. by a crash while writing
+            break;
+        }
+        if (index->N == N_alloc){
+            N_alloc = N_alloc ? 2*N_alloc : 64;
+            size_t* const offsets = realloc(index->offsets, N_alloc*sizeof(*offsets));
+            if (offsets != NULL){
+                index->offsets = offsets;
+            }
+            int* const keyframe = realloc(index->keyframe, N_alloc*sizeof(*keyframe));
+            if (keyframe != NULL){
+                index->keyframe = keyframe;
+            }
+            double* const t = realloc(index->t, N_alloc*sizeof(*t));
+            if (t != NULL){
+                index->t = t;
+            }
+            if (offsets == NULL || keyframe == NULL || t == NULL){
+                return 0;
+            }
+        }
+        index->offsets[index->N] = offset;
+        index->keyframe[index->N] = (field.type == REBX_BINARY_FIELD_TYPE_SNAPSHOT);
+        index->t[index->N] = NAN;   // binaries from rebx_output_binary have no time
+        struct rebx_binary_field first;
+        const size_t start = inf->pos;
+        if (rebx_binary_read(inf, &first, sizeof(first)) && first.type == REBX_BINARY_FIELD_TYPE_TIME && first.size == sizeof(double)){
+            rebx_binary_read(inf, &index->t[index->N], sizeof(double));
+        }
+        index->N++;
+        inf->pos = start;
+        rebx_binary_skip(inf, field.size);
+    }
+    return 1;
+}
+
+static int rebx_archive_open(const char* const filename, struct rebx_binary_reader* inf, struct rebx_archive_index* const index){
+    if (!rebx_binary_open(inf, filename)){
+        return 0;
+    }
+    if (!rebx_archive_index_build(inf, index)){
+        rebx_archive_index_free(index);
+        rebx_binary_close(inf);
+        return 0;
+    }
+    return 1;
+}
+
+long rebx_archive_N_snapshots(const char* const filename){
+    struct rebx_binary_reader inf;
+    struct rebx_archive_index index;
+    if (!rebx_archive_open(filename, &inf, &index)){
+        return -1;
+    }
+    const long N = index.N;
+    rebx_archive_index_free(&index);
+    rebx_binary_close(&inf);
+    return N;
+}
+
+long rebx_archive_find_time(const char* const filename, const double t){
+    struct rebx_binary_reader inf;
+    struct rebx_archive_index index;
+    if (!rebx_archive_open(filename, &inf, &index)){
+        return -1;
+    }
+    long snapshot = 0;
+    for (long k=0; k<index.N; k++){
+        if (index.t[k] <= t){
+            snapshot = k;
+        }
+    }
+    rebx_archive_index_free(&index);
+    rebx_binary_close(&inf);
+    return snapshot;
+}
+
+void rebx_init_extras_from_archive(struct rebx_extras* rebx, const char* const filename, const long snapshot, enum rebx_input_binary_messages* warnings){
+    if (rebx->sim == NULL){
+        rebx_error(rebx, ""); // rebx_error gives meaningful err
+        return;
+    }
+    struct rebx_binary_reader inf;
+    struct rebx_archive_index index;
+    if (!rebx_archive_open(filename, &inf, &index)){
+        *warnings |= REBX_INPUT_BINARY_ERROR_NOFILE;
+        return;
+    }
+    const long k = snapshot < 0 ? index.N + snapshot : snapshot;
+    long keyframe = k;
+    while (keyframe >= 0 && keyframe < index.N && !index.keyframe[keyframe]){
+        keyframe--;
+    }
+    if (k < 0 || k >= index.N || keyframe < 0){
+        rebx_error(rebx, "REBOUNDx Error: Snapshot not found in archive (or the archive has no keyframe before it).\n");
+    }
+    else{
+        char readbuf[65] = {0};
+        memcpy(readbuf, inf.data, inf.size < 64 ? inf.size : 64);
+        rebx_input_check_header(readbuf, warnings);
+        inf.pos = index.offsets[keyframe];
+        rebx_load_snapshot(rebx, &inf, warnings);
+        for (long j=keyframe+1; j<=k; j++){
+            inf.pos = index.offsets[j];
+            rebx_load_delta_snapshot(rebx, &inf, warnings);
+        }
+    }
+    rebx_archive_index_free(&index);
+    rebx_binary_close(&inf);
+}
+
 struct rebx_extras* rebx_create_extras_from_binary(struct reb_simulation* sim, const char* const filename){
     if (sim == NULL){
         fprintf(stderr, "REBOUNDx Error: Simulation pointer passed to rebx_create_extras_from_binary was NULL.\n");
@@ -652,7 +995,24 @@ struct rebx_extras* rebx_create_extras_from_binary(struct reb_simulation* sim, c
     struct rebx_extras* rebx = malloc(sizeof(*rebx));
     rebx_initialize(sim, rebx);
     rebx_init_extras_from_binary(rebx, filename, &warnings);
-    
+    rebx_input_report_warnings(sim, warnings);
+    return rebx;
+}
+
+struct rebx_extras* rebx_create_extras_from_archive(struct reb_simulation* sim, const char* const filename, const long snapshot){
+    if (sim == NULL){
+        fprintf(stderr, "REBOUNDx Error: Simulation pointer passed to rebx_create_extras_from_archive was NULL.\n");
+        return NULL;
+    }
+    enum rebx_input_binary_messages warnings = REBX_INPUT_BINARY_WARNING_NONE;
+    struct rebx_extras* rebx = malloc(sizeof(*rebx));
+    rebx_initialize(sim, rebx);
+    rebx_init_extras_from_archive(rebx, filename, snapshot, &warnings);
+    rebx_input_report_warnings(sim, warnings);
+    return rebx;
+}
+
+static void rebx_input_report_warnings(struct reb_simulation* sim, const enum rebx_input_binary_messages warnings){
     if (warnings & REBX_INPUT_BINARY_ERROR_NOFILE){
         reb_error(sim,"REBOUNDx: Cannot open binary file. Check filename.");
     }
@@ -701,7 +1061,6 @@ struct rebx_extras* rebx_create_extras_from_binary(struct reb_simulation* sim, c
     if (warnings & REBX_INPUT_BINARY_WARNING_FORCE_PARAM_NOT_LOADED){
         reb_warning(sim,"REBOUNDx: A force parameter failed to load from the list of REBOUNDx implemented forces. Custom forces can't be saved to a REBOUNDx binary, and function points must be reset when a simulation is reloaded.");
     }
-    return rebx;
 }
 
 FILE* rebx_input_inspect_binary(const char* const filename, enum rebx_input_binary_messages* warnings){
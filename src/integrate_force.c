@@ -48,7 +48,7 @@ void rebx_integrate_force(struct reb_simulation* const sim, struct rebx_operator
     switch(integrator){
         case REBX_INTEGRATOR_IMPLICIT_MIDPOINT:
         {
-            rebx_integrator_implicit_midpoint_integrate(sim, dt, force);
+            rebx_integrator_implicit_midpoint_integrate(sim, operator, dt, force);
             break;
         }
         case REBX_INTEGRATOR_RK2:
@@ -61,6 +61,11 @@ void rebx_integrate_force(struct reb_simulation* const sim, struct rebx_operator
             rebx_integrator_rk4_integrate(sim, dt, force);
             break;
         }
+        case REBX_INTEGRATOR_DP45:
+        {
+            rebx_integrator_dp45_integrate(sim, operator, dt, force);
+            break;
+        }
         case REBX_INTEGRATOR_EULER:
         {
             rebx_integrator_euler_integrate(sim, dt, force);
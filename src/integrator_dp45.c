@@ -0,0 +1,243 @@
+/**
+ * @file    integrator_dp45.c
+ * @brief   Adaptive Dormand-Prince 5(4) Runge Kutta method
+ * @author  Dan Tamayo <tamayo.daniel@gmail.com>, Hanno Rein
+ *
+ * @section LICENSE
+ * Copyright (c) 2017 Dan Tamayo, Hanno Rein
+ *
+ * This file is part of reboundx.
+ *
+ * reboundx is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * reboundx is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with rebound.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/* Integrates dv/dt = a(x, v) across the operator step with embedded 5th/4th
+ * order Dormand-Prince substeps (Dormand & Prince 1980; Hairer, Norsett &
+ * Wanner, Solving ODEs I, II.5), using the 5th order solution and the first
+ * same as last property, so accepted substeps cost six force evaluations.
+ *
+ * dp45_epsilon (double, operator)  Velocity error allowed per substep, relative to each particle's speed. Defaults to 1e-10.
+ * dp45_dt (double, force)          Last substep size. Kept on the force (and saved with it), so the next
+ *                                  operator call starts from it rather than from the full step.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <math.h>
+#include <float.h>
+#include "rebound.h"
+#include "reboundx.h"
+#include "core.h"
+
+#define REBX_DP45_DEFAULT_EPSILON 1e-10
+#define REBX_DP45_MAX_SUBSTEPS 100000
+#define REBX_DP45_SAFETY 0.9
+#define REBX_DP45_MIN_FACTOR 0.2
+#define REBX_DP45_MAX_FACTOR 5.
+#define REBX_DP45_SPEED_FLOOR 1e-3  // errors are relative to at least this fraction of the fastest speed, so bodies at rest don't force tiny substeps
+
+// Buffers kept on the force between calls, grown as needed.
+struct rebx_dp45_workspace{
+    int N_alloc;
+    struct reb_particle* ps;    // particles the force is evaluated on
+    double* v0;                 // 3N velocities at the start of the substep
+    double* v;                  // 3N 5th order velocities at the end of the substep
+    double* k;                  // 7*3N stage accelerations
+};
+
+void rebx_dp45_free_arrays(struct rebx_extras* const rebx, struct rebx_force* const force){
+    struct rebx_dp45_workspace* const ws = rebx_get_param(rebx, force->ap, "dp45_workspace");
+    if (ws != NULL){
+        free(ws->ps);
+        free(ws->v0);
+        free(ws);
+    }
+}
+
+static struct rebx_dp45_workspace* rebx_dp45_workspace(struct reb_simulation* const sim, struct rebx_force* const force, const int N){
+    struct rebx_extras* const rebx = sim->extras;
+    struct rebx_dp45_workspace* ws = rebx_get_param(rebx, force->ap, "dp45_workspace");
+    if (ws == NULL){
+        ws = calloc(1, sizeof(*ws));
+        if (ws == NULL){
+            reb_error(sim, "REBOUNDx Error: Could not allocate memory for dp45 integrator.\n");
+            return NULL;
+        }
+        rebx_set_param_pointer(rebx, &force->ap, "dp45_workspace", ws);
+        rebx_set_param_pointer(rebx, &force->ap, "free_arrays", rebx_dp45_free_arrays);
+    }
+    if (N > ws->N_alloc){
+        struct reb_particle* const ps = realloc(ws->ps, N*sizeof(*ps));
+        if (ps != NULL){
+            ws->ps = ps;
+        }
+        // One block: v0, v, then the stages
+        double* const block = realloc(ws->v0, (size_t)N*3*9*sizeof(double));
+        if (block != NULL){
+            ws->v0 = block;
+        }
+        if (ps == NULL || block == NULL){
+            reb_error(sim, "REBOUNDx Error: Could not allocate memory for dp45 integrator.\n");
+            return NULL;
+        }
+        ws->N_alloc = N;
+    }
+    ws->v = ws->v0 + (size_t)N*3;
+    ws->k = ws->v + (size_t)N*3;
+    return ws;
+}
+
+// Dormand-Prince tableau
+static const double rebx_dp45_a[7][6] = {
+    {0.},
+    {1./5.},
+    {3./40., 9./40.},
+    {44./45., -56./15., 32./9.},
+    {19372./6561., -25360./2187., 64448./6561., -212./729.},
+    {9017./3168., -355./33., 46732./5247., 49./176., -5103./18656.},
+    {35./384., 0., 500./1113., 125./192., -2187./6784., 11./84.},   // = 5th order weights
+};
+// 5th minus 4th order weights
+static const double rebx_dp45_e[7] = {71./57600., 0., -71./16695., 71./1920., -17253./339200., 22./525., -1./40.};
+
+// Evaluates the force with velocities v into stage k.
+static void rebx_dp45_evaluate(struct reb_simulation* const sim, struct rebx_force* const force, struct reb_particle* const ps, const double* const v, double* const k, const int N){
+    for(int i=0; i<N; i++){
+        ps[i].vx = v[3*i];
+        ps[i].vy = v[3*i+1];
+        ps[i].vz = v[3*i+2];
+        ps[i].ax = 0.;
+        ps[i].ay = 0.;
+        ps[i].az = 0.;
+    }
+    force->update_accelerations(sim, force, ps, N);
+    for(int i=0; i<N; i++){
+        k[3*i] = ps[i].ax;
+        k[3*i+1] = ps[i].ay;
+        k[3*i+2] = ps[i].az;
+    }
+}
+
+void rebx_integrator_dp45_integrate(struct reb_simulation* const sim, struct rebx_operator* const operator, const double dt, struct rebx_force* const force){
+    struct rebx_extras* rebx = sim->extras;
+    const int N = sim->N - sim->N_var;
+    const int N3 = 3*N;
+    if (N == 0 || dt == 0.){
+        return;
+    }
+    struct rebx_dp45_workspace* const ws = rebx_dp45_workspace(sim, force, N);
+    if (ws == NULL){
+        return;
+    }
+
+    double epsilon = REBX_DP45_DEFAULT_EPSILON;
+    const double* const epsilon_param = operator ? rebx_get_param(rebx, operator->ap, "dp45_epsilon") : NULL;
+    if (epsilon_param != NULL){
+        epsilon = *epsilon_param;
+    }
+    double* h_param = rebx_get_param(rebx, force->ap, "dp45_dt");
+    if (h_param == NULL){
+        rebx_set_param_double(rebx, &force->ap, "dp45_dt", dt);
+        h_param = rebx_get_param(rebx, force->ap, "dp45_dt");
+    }
+    double h = *h_param;
+    if (h == 0. || !isfinite(h) || (h > 0.) != (dt > 0.)){  // first call, or integrating the other way now
+        h = dt;
+    }
+
+    struct reb_particle* const ps = ws->ps;
+    double* const v0 = ws->v0;
+    double* const v = ws->v;
+    double* const k = ws->k;
+    memcpy(ps, sim->particles, N*sizeof(*ps));
+    for(int i=0; i<N; i++){
+        v0[3*i] = sim->particles[i].vx;
+        v0[3*i+1] = sim->particles[i].vy;
+        v0[3*i+2] = sim->particles[i].vz;
+    }
+    double vmax2 = 0.;
+    for(int j=0; j<N3; j+=3){
+        vmax2 = fmax(vmax2, v0[j]*v0[j] + v0[j+1]*v0[j+1] + v0[j+2]*v0[j+2]);
+    }
+    const double vfloor2 = REBX_DP45_SPEED_FLOOR*REBX_DP45_SPEED_FLOOR*vmax2;
+    rebx_dp45_evaluate(sim, force, ps, v0, k, N);  // k1
+
+    double t = 0.;
+    int substeps = 0;
+    while (fabs(t) < fabs(dt)){
+        const int last = fabs(h) >= fabs(dt - t);
+        const double hstep = last ? dt - t : h;
+
+        for(int s=1; s<7; s++){
+            for(int j=0; j<N3; j++){
+                double dv = 0.;
+                for(int r=0; r<s; r++){
+                    dv += rebx_dp45_a[s][r]*k[r*N3+j];
+                }
+                v[j] = v0[j] + hstep*dv;
+            }
+            rebx_dp45_evaluate(sim, force, ps, v, &k[s*N3], N);
+        }
+        // v now holds the 5th order solution (stage 7 is evaluated there)
+        double err2 = 0.;
+        for(int i=0; i<N; i++){
+            double e2 = 0.;
+            double v02 = 0.;
+            double v2 = 0.;
+            for(int j=3*i; j<3*i+3; j++){
+                double e = 0.;
+                for(int r=0; r<7; r++){
+                    e += rebx_dp45_e[r]*k[r*N3+j];
+                }
+                e2 += hstep*hstep*e*e;
+                v02 += v0[j]*v0[j];
+                v2 += v[j]*v[j];
+            }
+            const double scale2 = epsilon*epsilon*fmax(fmax(v02, v2), vfloor2);
+            err2 += scale2 > 0. ? e2/scale2 : (e2 == 0. ? 0. : DBL_MAX);
+        }
+        const double err = sqrt(err2/N);
+
+        double factor = err > 0. ? REBX_DP45_SAFETY*pow(err, -0.2) : REBX_DP45_MAX_FACTOR;
+        factor = fmin(REBX_DP45_MAX_FACTOR, fmax(REBX_DP45_MIN_FACTOR, factor));
+        substeps++;
+        const int give_up = substeps >= REBX_DP45_MAX_SUBSTEPS || fabs(hstep) <= 4.*DBL_EPSILON*fabs(dt);
+        if (err <= 1. || give_up){
+            if (err > 1.){
+                reb_warning(sim, "REBOUNDx: dp45 integrator could not reach the requested dp45_epsilon within one operator step. Accepting the current substep.");
+            }
+            t = last ? dt : t + hstep;
+            memcpy(v0, v, N3*sizeof(*v0));
+            memcpy(k, &k[6*N3], N3*sizeof(*k));    // first same as last
+            if (!last || hstep == h){   // don't let a step shortened to land on dt shrink the next one
+                h = hstep*factor;
+            }
+            if (give_up && !last){
+                h = dt - t;
+            }
+        }
+        else{
+            h = hstep*factor;
+        }
+    }
+    *h_param = h;
+
+    for(int i=0; i<N; i++){
+        sim->particles[i].vx = v0[3*i];
+        sim->particles[i].vy = v0[3*i+1];
+        sim->particles[i].vz = v0[3*i+2];
+    }
+}
@@ -30,95 +30,136 @@
 #include "rebound.h"
 #include "reboundx.h"
 
-static void avg_particles(struct reb_particle* const ps_avg, struct reb_particle* const ps1, struct reb_particle* const ps2, int N){
-    for(int i=0; i<N; i++){
-        ps_avg[i].x = 0.5*(ps1[i].x + ps2[i].x);
-        ps_avg[i].y = 0.5*(ps1[i].y + ps2[i].y);
-        ps_avg[i].z = 0.5*(ps1[i].z + ps2[i].z);
-        ps_avg[i].vx = 0.5*(ps1[i].vx + ps2[i].vx);
-        ps_avg[i].vy = 0.5*(ps1[i].vy + ps2[i].vy);
-        ps_avg[i].vz = 0.5*(ps1[i].vz + ps2[i].vz);
-        ps_avg[i].ax = 0.;
-        ps_avg[i].ay = 0.;
-        ps_avg[i].az = 0.;
-        ps_avg[i].m = 0.5*(ps1[i].m + ps2[i].m);
-    }
-}
+/* Solves v_final = v + dt*a((x, (v + v_final)/2)) by fixed point iteration on
+ * the velocities (positions and masses don't change). Set on the operator:
+ *
+ * im_tolerance (double)        Relative velocity change below which the iteration stops. Defaults to DBL_EPSILON.
+ * im_max_iterations (int)      Cap on the iterations (force evaluations). Defaults to 10.
+ * im_anderson (int)            If nonzero, mixes the last two iterates (Anderson acceleration of depth one,
+ *                              i.e. a vector Aitken/secant step). Helps for strong velocity-dependent forces.
+ */
+
+#define REBX_IM_DEFAULT_MAX_ITERATIONS 10
 
-static int compare(struct reb_particle* ps1, struct reb_particle* ps2, int N){
+// Returns |g - v|^2/|g|^2.
+static double rebx_im_residual(const double* const g, const double* const v, const int N3){
     double tot2 = 0.;
     double deltatot2 = 0.;
-    for(int i=0; i<N; i++){
-        const double dvx = ps1[i].vx - ps2[i].vx;
-        const double dvy = ps1[i].vy - ps2[i].vy;
-        const double dvz = ps1[i].vz - ps2[i].vz;
-        deltatot2 += dvx*dvx + dvy*dvy + dvz*dvz;
-        tot2 += ps1[i].vx*ps1[i].vx + ps1[i].vy*ps1[i].vy + ps1[i].vz*ps1[i].vz;
+    for(int k=0; k<N3; k++){
+        const double dv = g[k] - v[k];
+        deltatot2 += dv*dv;
+        tot2 += g[k]*g[k];
     }
-    if (deltatot2/tot2 < DBL_EPSILON*DBL_EPSILON){
-        return 1;
-    }
-    else{
-        return 0;
-    }
-}
-
-void rebx_im_free_arrays(struct rebx_extras* rebx, struct rebx_force* force){
-    struct reb_particle* const ps_final = rebx_get_param(rebx, force->ap, "ps_final");
-    free(ps_final);
-    struct reb_particle* const ps_prev = rebx_get_param(rebx, force->ap, "ps_prev");
-    free(ps_prev);
-    struct reb_particle* const ps_avg = rebx_get_param(rebx, force->ap, "ps_avg");
-    free(ps_avg);
-}
-
-static struct reb_particle* setup(struct rebx_extras* rebx, struct rebx_force* force, const int N){
-    rebx_set_param_pointer(rebx, &force->ap, "free_arrays", rebx_im_free_arrays);
-    struct reb_particle* const ps_final = malloc(N*sizeof(*ps_final));
-    rebx_set_param_pointer(rebx, &force->ap, "im_ps_final", ps_final);
-    struct reb_particle* const ps_prev = malloc(N*sizeof(*ps_prev));
-    rebx_set_param_pointer(rebx, &force->ap, "im_ps_prev", ps_prev);
-    struct reb_particle* const ps_avg = malloc(N*sizeof(*ps_avg));
-    rebx_set_param_pointer(rebx, &force->ap, "im_ps_avg", ps_avg);
-    
-    return ps_final;
+    return deltatot2/tot2;
 }
 
-void rebx_integrator_implicit_midpoint_integrate(struct reb_simulation* const sim, const double dt, struct rebx_force* const force){
+void rebx_integrator_implicit_midpoint_integrate(struct reb_simulation* const sim, struct rebx_operator* const operator, const double dt, struct rebx_force* const force){
     struct rebx_extras* rebx = sim->extras;
     const int N = sim->N - sim->N_var;
-    struct reb_particle* ps_final = rebx_get_param(rebx, force->ap, "im_ps_final");
-    if (ps_final == NULL){
-        ps_final = setup(rebx, force, N);
+    const int N3 = 3*N;
+    
+    double tolerance = DBL_EPSILON;
+    int max_iterations = REBX_IM_DEFAULT_MAX_ITERATIONS;
+    int anderson = 0;
+    if (operator != NULL){
+        const double* const tolerance_param = rebx_get_param(rebx, operator->ap, "im_tolerance");
+        const int* const max_iterations_param = rebx_get_param(rebx, operator->ap, "im_max_iterations");
+        const int* const anderson_param = rebx_get_param(rebx, operator->ap, "im_anderson");
+        if (tolerance_param != NULL){
+            tolerance = *tolerance_param;
+        }
+        if (max_iterations_param != NULL){
+            max_iterations = *max_iterations_param;
+        }
+        if (anderson_param != NULL){
+            anderson = *anderson_param;
+        }
+    }
+    if (max_iterations < 1){
+        max_iterations = 1;
+    }
+
+    // Borrowed for this step only. The force is evaluated on ps_avg, whose
+    // positions and masses are set once; the iteration itself runs on packed
+    // velocities: v is the current guess for v_final, and g what the force
+    // at the midpoint of v_orig and v gives back.
+    const size_t mark = rebx_scratch_mark(rebx);
+    struct reb_particle* const ps_avg = rebx_scratch_alloc(rebx, N*sizeof(*ps_avg));
+    double* const v_orig = rebx_scratch_alloc(rebx, N3*sizeof(*v_orig));
+    double* const v = rebx_scratch_alloc(rebx, N3*sizeof(*v));
+    double* const g = rebx_scratch_alloc(rebx, N3*sizeof(*g));
+    double* const g_prev = anderson ? rebx_scratch_alloc(rebx, N3*sizeof(*g_prev)) : NULL;
+    double* const f_prev = anderson ? rebx_scratch_alloc(rebx, N3*sizeof(*f_prev)) : NULL;
+    if (ps_avg == NULL || v_orig == NULL || v == NULL || g == NULL || (anderson && (g_prev == NULL || f_prev == NULL))){
+        rebx_scratch_release(rebx, mark);
+        return;
     }
-    // These should not fail since we check above and setup if not there
-    struct reb_particle* const ps_prev = rebx_get_param(rebx, force->ap, "im_ps_prev");
-    struct reb_particle* const ps_avg = rebx_get_param(rebx, force->ap, "im_ps_avg");
-    struct reb_particle* const ps_orig = sim->particles;
-    memcpy(ps_final, sim->particles, N*sizeof(*ps_final));
-    memcpy(ps_avg, sim->particles, N*sizeof(*ps_orig));
-    int n, converged;
-    for(n=0;n<10;n++){
-        memcpy(ps_prev, ps_final, N*sizeof(*ps_prev));
+    memcpy(ps_avg, sim->particles, N*sizeof(*ps_avg));
+    for(int i=0; i<N; i++){
+        v_orig[3*i] = sim->particles[i].vx;
+        v_orig[3*i+1] = sim->particles[i].vy;
+        v_orig[3*i+2] = sim->particles[i].vz;
+    }
+    memcpy(v, v_orig, N3*sizeof(*v));
+    
+    int n;
+    for(n=0;n<max_iterations;n++){
+        if (n > 0){
+            for(int i=0; i<N; i++){
+                ps_avg[i].vx = 0.5*(v_orig[3*i] + v[3*i]);
+                ps_avg[i].vy = 0.5*(v_orig[3*i+1] + v[3*i+1]);
+                ps_avg[i].vz = 0.5*(v_orig[3*i+2] + v[3*i+2]);
+                ps_avg[i].ax = 0.;
+                ps_avg[i].ay = 0.;
+                ps_avg[i].az = 0.;
+            }
+        }
         force->update_accelerations(sim, force, ps_avg, N);
         for(int i=0; i<N; i++){
-            ps_final[i].vx = ps_orig[i].vx + dt*ps_avg[i].ax;
-            ps_final[i].vy = ps_orig[i].vy + dt*ps_avg[i].ay;
-            ps_final[i].vz = ps_orig[i].vz + dt*ps_avg[i].az;
+            g[3*i] = v_orig[3*i] + dt*ps_avg[i].ax;
+            g[3*i+1] = v_orig[3*i+1] + dt*ps_avg[i].ay;
+            g[3*i+2] = v_orig[3*i+2] + dt*ps_avg[i].az;
         }
-        converged = compare(ps_final, ps_prev, N);
-        if (converged){
+        if (rebx_im_residual(g, v, N3) < tolerance*tolerance){
             break;
         }
-        avg_particles(ps_avg, ps_orig, ps_final, N);
+        if (!anderson || n == 0){
+            if (anderson){
+                for(int k=0; k<N3; k++){
+                    f_prev[k] = g[k] - v[k];
+                    g_prev[k] = g[k];
+                }
+            }
+            memcpy(v, g, N3*sizeof(*v));
+            continue;
+        }
+        // With residuals f = g - v, take the combination of the last two
+        // images g that minimizes the linearized residual.
+        double num = 0.;
+        double den = 0.;
+        for(int k=0; k<N3; k++){
+            const double f = g[k] - v[k];
+            const double df = f - f_prev[k];
+            num += f*df;
+            den += df*df;
+        }
+        const double theta = den > 0. ? num/den : 0.;
+        for(int k=0; k<N3; k++){
+            const double gk = g[k];
+            f_prev[k] = gk - v[k];
+            v[k] = gk - theta*(gk - g_prev[k]);
+            g_prev[k] = gk;
+        }
     }
-    const int default_max_iterations = 10;
-    if(n==default_max_iterations){
-        reb_warning(sim, "REBOUNDx: 10 iterations in integrator_implicit_midpoint.c failed to converge. This is typically because the perturbation is too strong for the current implementation.");
+    if(n==max_iterations){
+        char str[300];
+        sprintf(str, "REBOUNDx: %d iterations in integrator_implicit_midpoint.c failed to converge. This is typically because the perturbation is too strong for the current implementation.", max_iterations);
+        reb_warning(sim, str);
     }
     for(int i=0; i<N; i++){
-        sim->particles[i].vx = ps_final[i].vx;
-        sim->particles[i].vy = ps_final[i].vy;
-        sim->particles[i].vz = ps_final[i].vz;
+        sim->particles[i].vx = g[3*i];
+        sim->particles[i].vy = g[3*i+1];
+        sim->particles[i].vz = g[3*i+2];
     }
+    rebx_scratch_release(rebx, mark);
 }
@@ -62,9 +62,11 @@
 
 void rebx_modify_mass(struct reb_simulation* const sim, struct rebx_operator* const operator, const double dt){
     const int _N_real = sim->N - sim->N_var;
+    const int tau_mass_id = rebx_get_param_id(sim->extras, "tau_mass");
+    const struct rebx_column* const tau_mass_column = rebx_get_column(sim->extras, tau_mass_id);
 	for(int i=0; i<_N_real; i++){
 		struct reb_particle* const p = &sim->particles[i];
-        const double* const tau_mass = rebx_get_param(sim->extras, p->ap, "tau_mass");
+        const double* const tau_mass = tau_mass_column ? rebx_column_get(tau_mass_column, i) : rebx_get_param_by_id(sim->extras, p->ap, tau_mass_id);
         if (tau_mass != NULL){
 		    p->m += p->m*dt/(*tau_mass);
         }
@@ -77,47 +77,56 @@
 #include <math.h>
 #include "rebound.h"
 #include "reboundx.h"
+#include "rebxtools.h"
 
-static struct reb_particle rebx_calculate_modify_orbits_direct(struct reb_simulation* const sim, struct rebx_operator* const operator, struct reb_particle* p, struct reb_particle* primary, const double dt){
+static void rebx_calculate_modify_orbits_direct(struct reb_simulation* const sim, struct rebx_operator* const operator, struct rebxtools_orbits* const orbits, const double dt){
     struct rebx_extras* const rebx = sim->extras;
-    int err=0;
-    struct reb_orbit o = reb_tools_particle_to_orbit_err(sim->G, *p, *primary, &err);
-    if(err){        // mass of primary was 0 or p = primary.  Return same particle without doing anything.
-        return *p;
-    }
-    const double* const tau_a = rebx_get_param(rebx, p->ap, "tau_a");
-    const double* const tau_e = rebx_get_param(rebx, p->ap, "tau_e");
-    const double* const tau_inc = rebx_get_param(rebx, p->ap, "tau_inc");
-    const double* const tau_omega = rebx_get_param(rebx, p->ap, "tau_omega");
-    const double* const tau_Omega = rebx_get_param(rebx, p->ap, "tau_Omega");
-    
-    const double a0 = o.a;
-    const double e0 = o.e;
-    const double inc0 = o.inc;
+    const int tau_a_id = rebx_get_param_id(rebx, "tau_a");
+    const int tau_e_id = rebx_get_param_id(rebx, "tau_e");
+    const int tau_inc_id = rebx_get_param_id(rebx, "tau_inc");
+    const int tau_omega_id = rebx_get_param_id(rebx, "tau_omega");
+    const int tau_Omega_id = rebx_get_param_id(rebx, "tau_Omega");
+    const double* const p_param = rebx_get_param(rebx, operator->ap, "p");
 
-	if(tau_a != NULL){
-    	o.a += a0*dt/(*tau_a);
-	}
-	if(tau_e != NULL){
-    	o.e += e0*dt/(*tau_e);
-	}
-	if(tau_inc != NULL){
-    	o.inc += inc0*dt/(*tau_inc);
-	}
-	if(tau_omega != NULL){
-    	o.omega += 2.*M_PI*dt/(*tau_omega);
-	}
-    if(tau_Omega != NULL){
-		o.Omega += 2.*M_PI*dt/(*tau_Omega);
-	}
-   
-    if(tau_e != NULL){
-        const double* const p_param = rebx_get_param(sim->extras, operator->ap, "p");
-        if(p_param != NULL){
-			o.a += 2.*a0*e0*e0*(*p_param)*dt/(*tau_e); // Coupling term between e and a
-		}
+    for (int k=0; k<orbits->N; k++){
+        if(orbits->err[k]){        // mass of primary was 0 or p = primary.  Leave the particle as it is.
+            continue;
+        }
+        struct rebx_node* const ap = sim->particles[orbits->index[k]].ap;
+        const double* const tau_a = rebx_get_param_by_id(rebx, ap, tau_a_id);
+        const double* const tau_e = rebx_get_param_by_id(rebx, ap, tau_e_id);
+        const double* const tau_inc = rebx_get_param_by_id(rebx, ap, tau_inc_id);
+        const double* const tau_omega = rebx_get_param_by_id(rebx, ap, tau_omega_id);
+        const double* const tau_Omega = rebx_get_param_by_id(rebx, ap, tau_Omega_id);
+        if (tau_a == NULL && tau_e == NULL && tau_inc == NULL && tau_omega == NULL && tau_Omega == NULL){
+            orbits->err[k] = -1;    // nothing to do, skip the conversion back
+            continue;
+        }
+
+        const double a0 = orbits->a[k];
+        const double e0 = orbits->e[k];
+        const double inc0 = orbits->inc[k];
+
+        if(tau_a != NULL){
+            orbits->a[k] += a0*dt/(*tau_a);
+        }
+        if(tau_e != NULL){
+            orbits->e[k] += e0*dt/(*tau_e);
+        }
+        if(tau_inc != NULL){
+            orbits->inc[k] += inc0*dt/(*tau_inc);
+        }
+        if(tau_omega != NULL){
+            orbits->omega[k] += 2.*M_PI*dt/(*tau_omega);
+        }
+        if(tau_Omega != NULL){
+            orbits->Omega[k] += 2.*M_PI*dt/(*tau_Omega);
+        }
+
+        if(tau_e != NULL && p_param != NULL){
+            orbits->a[k] += 2.*a0*e0*e0*(*p_param)*dt/(*tau_e); // Coupling term between e and a
+        }
     }
-    return reb_tools_orbit_to_particle(sim->G, *primary, p->m, o.a, o.e, o.inc, o.Omega, o.omega, o.f);
 }
 
 void rebx_modify_orbits_direct(struct reb_simulation* const sim, struct rebx_operator* const operator, const double dt){
@@ -128,5 +137,5 @@ void rebx_modify_orbits_direct(struct reb_simulation* const sim, struct rebx_ope
 	}
     const int back_reactions_inclusive = 1;
     const char* reference_name = "primary";
-    rebxtools_com_ptm(sim, operator, coordinates, back_reactions_inclusive, reference_name, rebx_calculate_modify_orbits_direct, dt);
+    rebxtools_com_ptm_orbits(sim, operator, coordinates, back_reactions_inclusive, reference_name, rebx_calculate_modify_orbits_direct, dt);
 }
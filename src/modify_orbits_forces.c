@@ -74,14 +74,30 @@
 #include "reboundx.h"
 #include "rebxtools.h"
 
-static struct reb_vec3d rebx_calculate_modify_orbits_forces(struct reb_simulation* const sim, struct rebx_force* const force, struct reb_particle* p, struct reb_particle* source){
+// Looked up once per call rather than once per particle
+struct rebx_modify_orbits_forces_params{
+    struct rebx_extras* rebx;
+    int tau_a_id;
+    int tau_e_id;
+    int tau_inc_id;
+    const struct rebx_column* tau_a;    // NULL if not kept in a column
+    const struct rebx_column* tau_e;
+    const struct rebx_column* tau_inc;
+};
+
+static inline const double* rebx_modify_orbits_forces_param(const struct rebx_modify_orbits_forces_params* const params, const struct rebx_column* const column, const int id, const int i, const struct reb_particle* const p){
+    return column ? rebx_column_get(column, i) : rebx_get_param_by_id(params->rebx, p->ap, id);
+}
+
+static inline struct reb_vec3d rebx_calculate_modify_orbits_forces(struct reb_simulation* const sim, struct rebx_force* const force, const void* const ctx, const int i, struct reb_particle* const p, const struct reb_particle* const source){
+    const struct rebx_modify_orbits_forces_params* const params = ctx;
     double tau_a = INFINITY;
     double tau_e = INFINITY;
     double tau_inc = INFINITY;
     
-    const double* const tau_a_ptr = rebx_get_param(sim->extras, p->ap, "tau_a");
-    const double* const tau_e_ptr = rebx_get_param(sim->extras, p->ap, "tau_e");
-    const double* const tau_inc_ptr = rebx_get_param(sim->extras, p->ap, "tau_inc");
+    const double* const tau_a_ptr = rebx_modify_orbits_forces_param(params, params->tau_a, params->tau_a_id, i, p);
+    const double* const tau_e_ptr = rebx_modify_orbits_forces_param(params, params->tau_e, params->tau_e_id, i, p);
+    const double* const tau_inc_ptr = rebx_modify_orbits_forces_param(params, params->tau_inc, params->tau_inc_id, i, p);
 
     const double dvx = p->vx - source->vx;
     const double dvy = p->vy - source->vy;
@@ -117,13 +133,25 @@ static struct reb_vec3d rebx_calculate_modify_orbits_forces(struct reb_simulatio
     return a;
 }
 
+REBX_COM_FORCE_KERNELS(rebx_modify_orbits_forces_com, rebx_calculate_modify_orbits_forces)
+
 void rebx_modify_orbits_forces(struct reb_simulation* const sim, struct rebx_force* const force, struct reb_particle* const particles, const int N){
-    int* ptr = rebx_get_param(sim->extras, force->ap, "coordinates");
+    struct rebx_extras* const rebx = sim->extras;
+    int* ptr = rebx_get_param(rebx, force->ap, "coordinates");
     enum REBX_COORDINATES coordinates = REBX_COORDINATES_JACOBI; // Default
     if (ptr != NULL){
         coordinates = *ptr;
     }
     const int back_reactions_inclusive = 1;
     const char* reference_name = "primary";
-    rebx_com_force(sim, force, coordinates, back_reactions_inclusive, reference_name, rebx_calculate_modify_orbits_forces, particles, N);
+    struct rebx_modify_orbits_forces_params params = {
+        .rebx = rebx,
+        .tau_a_id = rebx_get_param_id(rebx, "tau_a"),
+        .tau_e_id = rebx_get_param_id(rebx, "tau_e"),
+        .tau_inc_id = rebx_get_param_id(rebx, "tau_inc"),
+    };
+    params.tau_a = rebx_get_column(rebx, params.tau_a_id);
+    params.tau_e = rebx_get_column(rebx, params.tau_e_id);
+    params.tau_inc = rebx_get_column(rebx, params.tau_inc_id);
+    rebx_modify_orbits_forces_com(sim, force, coordinates, back_reactions_inclusive, reference_name, &params, particles, N);
 }
@@ -24,7 +24,9 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <stddef.h>
 #include "reboundx.h"
 #include "core.h"
 
@@ -85,43 +87,81 @@
 Macros to remove repetition in writing fields.
 *************************************************************/
 
+// The whole binary is assembled in memory and written with a single fwrite.
+// Object sizes are patched in place in the buffer, so nothing is flushed or
+// seeked until the end.
+struct rebx_binary_buffer{
+    char* data;
+    size_t size;
+    size_t capacity;
+    int failed;         // set if the buffer could not grow; later writes are dropped
+    int no_counters;    // set to leave out the call counters, which change every step
+};
+
+static void rebx_buffer_write(struct rebx_binary_buffer* const buf, const void* const src, const size_t size){
+    if (buf->failed || size == 0){
+        return;
+    }
+    if (buf->size + size > buf->capacity){
+        size_t capacity = buf->capacity ? buf->capacity : 4096;
+        while (capacity < buf->size + size){
+            capacity *= 2;
+        }
+        char* const data = realloc(buf->data, capacity);
+        if (data == NULL){
+            buf->failed = 1;
+            return;
+        }
+        buf->data = data;
+        buf->capacity = capacity;
+    }
+    memcpy(buf->data + buf->size, src, size);
+    buf->size += size;
+}
+
+// Field headers are zeroed first so that struct padding doesn't put stray bytes in the file.
+static void rebx_buffer_write_field(struct rebx_binary_buffer* const buf, const enum rebx_binary_field_type type, const long size){
+    struct rebx_binary_field field;
+    memset(&field, 0, sizeof(field));
+    field.type = type;
+    field.size = size;
+    rebx_buffer_write(buf, &field, sizeof(field));
+}
+
 // Write a data field of binary_field_type typename with size typesize
 // valueptr is a pointer to the memory to write
 #define REBX_WRITE_DATA_FIELD(typename, valueptr, typesize) {\
-struct rebx_binary_field field = {.type = REBX_BINARY_FIELD_TYPE_##typename, .size=typesize};\
-fwrite(&field, sizeof(field), 1, of);\
-fwrite(valueptr,typesize,1,of);\
+rebx_buffer_write_field(buf, REBX_BINARY_FIELD_TYPE_##typename, typesize);\
+rebx_buffer_write(buf, valueptr, typesize);\
 }
 
-/*  For the arbitrary objects, we write a preliminary field struct without a size (since we don't know it yet), and cache the file position to measure how large the object is later.*/
+/*  For the arbitrary objects, we write a preliminary field struct without a size (since we don't know it yet), and cache the buffer offset to measure how large the object is later.*/
 #define REBX_START_OBJECT_FIELD(name, typename)\
-long pos_start_header_##name = ftell(of);\
-struct rebx_binary_field header_##name = {.type = REBX_BINARY_FIELD_TYPE_##typename, .size=0};\
-fwrite(&header_##name, sizeof(header_##name), 1, of);\
-long pos_start_##name = ftell(of);\
+const size_t pos_start_header_##name = buf->size;\
+rebx_buffer_write_field(buf, REBX_BINARY_FIELD_TYPE_##typename, 0);\
+const size_t pos_start_##name = buf->size;\
 
-/*  After we write all the data we need for the particular object, we calculate how long this segment is, and update the field struct with this size so we have option of skipping the whole object when reading.*/
+/*  After we write all the data we need for the particular object, we calculate how long this segment is, and update the size in the buffer so we have option of skipping the whole object when reading.*/
 
 #define REBX_END_OBJECT_FIELD(name) {\
 REBX_WRITE_DATA_FIELD(END,        NULL,             0);\
-long pos_end_##name = ftell(of);\
-header_##name.size = pos_end_##name - pos_start_##name;\
-fseek(of, pos_start_header_##name, SEEK_SET);\
-fwrite(&header_##name, sizeof(header_##name), 1, of);\
-fseek(of, 0, SEEK_END);\
+if (!buf->failed){\
+const long size_##name = buf->size - pos_start_##name;\
+memcpy(buf->data + pos_start_header_##name + offsetof(struct rebx_binary_field, size), &size_##name, sizeof(size_##name));\
+}\
 }
 
 /*  Write a list of listtype (e.g., ALLOCATED_FORCES) with nodes of type nodetype (e.g. ALLOCATED_FORCE), to the passed linkedlist (e.g. rebx->allocated_forces)*/
 
 #define REBX_WRITE_LIST_FIELD(listtype, nodetype, linkedlist) {\
 REBX_START_OBJECT_FIELD(list, listtype);\
-rebx_write_list(rebx, REBX_BINARY_FIELD_TYPE_##nodetype, linkedlist, of);\
+rebx_write_list(rebx, REBX_BINARY_FIELD_TYPE_##nodetype, linkedlist, buf);\
 REBX_END_OBJECT_FIELD(list);\
 }
 
-static void rebx_write_list(struct rebx_extras* rebx, enum rebx_binary_field_type list_type, struct rebx_node* list, FILE* of);
+static void rebx_write_list(struct rebx_extras* rebx, enum rebx_binary_field_type list_type, struct rebx_node* list, struct rebx_binary_buffer* buf);
 
-static void rebx_write_force_param(struct rebx_extras* rebx, struct rebx_param* param, FILE* of){
+static void rebx_write_force_param(struct rebx_extras* rebx, struct rebx_param* param, struct rebx_binary_buffer* buf){
     REBX_START_OBJECT_FIELD(force_param, PARAM);
     REBX_WRITE_DATA_FIELD(PARAM_TYPE, &param->type,     sizeof(param->type));
     REBX_WRITE_DATA_FIELD(NAME,       param->name,      strlen(param->name) + 1);
@@ -130,13 +170,13 @@ static void rebx_write_force_param(struct rebx_extras* rebx, struct rebx_param*
     REBX_END_OBJECT_FIELD(force_param);
 }
 
-static void rebx_write_param(struct rebx_extras* rebx, struct rebx_param* param, FILE* of){
+static void rebx_write_param(struct rebx_extras* rebx, struct rebx_param* param, struct rebx_binary_buffer* buf){
     if (param->type == REBX_TYPE_POINTER){ // Don't write pointers because we won't know how to load them when we read binary. Need to add type to store in binaries.
         return;
     }
     
     if (param->type == REBX_TYPE_FORCE){ // Force already written to allocated_force list. For parce PARAMETERS we agree to store force name in param->value so that the reallocated force can be linked up when we read binary
-        rebx_write_force_param(rebx, param, of);
+        rebx_write_force_param(rebx, param, buf);
         return;
     }
     REBX_START_OBJECT_FIELD(param, PARAM);
@@ -146,36 +186,42 @@ static void rebx_write_param(struct rebx_extras* rebx, struct rebx_param* param,
     REBX_END_OBJECT_FIELD(param);
 }
 
-static void rebx_write_registered_param(struct rebx_extras* rebx, struct rebx_param* param, FILE* of){
+static void rebx_write_registered_param(struct rebx_extras* rebx, struct rebx_param* param, struct rebx_binary_buffer* buf){
     REBX_START_OBJECT_FIELD(registered_param, REGISTERED_PARAM);
     REBX_WRITE_DATA_FIELD(PARAM_TYPE, &param->type,     sizeof(param->type));
     REBX_WRITE_DATA_FIELD(NAME,       param->name,      strlen(param->name) + 1);
     REBX_END_OBJECT_FIELD(registered_param);
 }
 
-static void rebx_write_force(struct rebx_extras* rebx, struct rebx_force* force, FILE* of){
+static void rebx_write_force(struct rebx_extras* rebx, struct rebx_force* force, struct rebx_binary_buffer* buf){
     REBX_START_OBJECT_FIELD(force, FORCE);
     // must write name first so that force can be loaded on read
     REBX_WRITE_DATA_FIELD(NAME, force->name, strlen(force->name) + 1);
     REBX_WRITE_LIST_FIELD(PARAM_LIST, PARAM, force->ap);
+    if (force->counters.calls > 0 && !buf->no_counters){
+        REBX_WRITE_DATA_FIELD(COUNTERS, &force->counters, sizeof(force->counters));
+    }
     REBX_END_OBJECT_FIELD(force);
 }
 
 // Same as force, but only holds the name for later loading, rather than the whole parameter list
-static void rebx_write_additional_force(struct rebx_extras* rebx, struct rebx_force* force, FILE* of){
+static void rebx_write_additional_force(struct rebx_extras* rebx, struct rebx_force* force, struct rebx_binary_buffer* buf){
     REBX_START_OBJECT_FIELD(additional_force, ADDITIONAL_FORCE);
     REBX_WRITE_DATA_FIELD(NAME, force->name, strlen(force->name) + 1);
     REBX_END_OBJECT_FIELD(additional_force);
 }
 
-static void rebx_write_operator(struct rebx_extras* rebx, struct rebx_operator* operator, FILE* of){
+static void rebx_write_operator(struct rebx_extras* rebx, struct rebx_operator* operator, struct rebx_binary_buffer* buf){
     REBX_START_OBJECT_FIELD(operator, OPERATOR);
     REBX_WRITE_DATA_FIELD(NAME, operator->name, strlen(operator->name) + 1);
     REBX_WRITE_LIST_FIELD(PARAM_LIST, PARAM, operator->ap);
+    if (operator->counters.calls > 0 && !buf->no_counters){
+        REBX_WRITE_DATA_FIELD(COUNTERS, &operator->counters, sizeof(operator->counters));
+    }
     REBX_END_OBJECT_FIELD(operator);
 }
 
-static void rebx_write_step(struct rebx_extras* rebx, struct rebx_step* step, FILE* of){
+static void rebx_write_step(struct rebx_extras* rebx, struct rebx_step* step, struct rebx_binary_buffer* buf){
     REBX_START_OBJECT_FIELD(step, STEP);
     // Need operator name to load it from source when reading it back in
     REBX_WRITE_DATA_FIELD(NAME, step->operator->name,   strlen(step->operator->name) + 1);
@@ -183,14 +229,14 @@ static void rebx_write_step(struct rebx_extras* rebx, struct rebx_step* step, FI
     REBX_END_OBJECT_FIELD(step);
 }
 
-static void rebx_write_particle(struct rebx_extras* rebx, struct reb_particle* particle, int index, FILE* of){
+static void rebx_write_particle(struct rebx_extras* rebx, struct reb_particle* particle, int index, struct rebx_binary_buffer* buf){
     REBX_START_OBJECT_FIELD(particle, PARTICLE);
     REBX_WRITE_DATA_FIELD(PARTICLE_INDEX,    &index, sizeof(index));
     REBX_WRITE_LIST_FIELD(PARAM_LIST, PARAM, particle->ap);
     REBX_END_OBJECT_FIELD(particle);
 }
 
-static void rebx_write_rebx(struct rebx_extras* rebx, FILE* of){
+static void rebx_write_rebx(struct rebx_extras* rebx, struct rebx_binary_buffer* buf){
     REBX_START_OBJECT_FIELD(rebx_structure, REBX_STRUCTURE);
     REBX_WRITE_LIST_FIELD(REGISTERED_PARAMETERS, REGISTERED_PARAM, rebx->registered_params);
     REBX_WRITE_LIST_FIELD(ALLOCATED_FORCES, FORCE, rebx->allocated_forces);
@@ -202,17 +248,17 @@ static void rebx_write_rebx(struct rebx_extras* rebx, FILE* of){
 }
 
 // Write a particle field for each particle with a list of its parameters
-static void rebx_write_particles(struct rebx_extras* rebx, FILE* of){
+static void rebx_write_particles(struct rebx_extras* rebx, struct rebx_binary_buffer* buf){
     struct reb_simulation* sim = rebx->sim; // checked sim valid in output_binray
     
     REBX_START_OBJECT_FIELD(particle_list, PARTICLES);
     for (int i=0; i<sim->N; i++){
-        rebx_write_particle(rebx, &sim->particles[i], i, of);
+        rebx_write_particle(rebx, &sim->particles[i], i, buf);
     }
     REBX_END_OBJECT_FIELD(particle_list);
 }
 
-static void rebx_write_list(struct rebx_extras* rebx, enum rebx_binary_field_type list_type, struct rebx_node* list, FILE* of){
+static void rebx_write_list(struct rebx_extras* rebx, enum rebx_binary_field_type list_type, struct rebx_node* list, struct rebx_binary_buffer* buf){
     
     int N = rebx_len(list);
     while (N > 0){
@@ -223,66 +269,256 @@ static void rebx_write_list(struct rebx_extras* rebx, enum rebx_binary_field_typ
         switch(list_type){
             case REBX_BINARY_FIELD_TYPE_REGISTERED_PARAM:
             {
-                rebx_write_registered_param(rebx, current->object, of);
+                rebx_write_registered_param(rebx, current->object, buf);
                 break;
             }
             case REBX_BINARY_FIELD_TYPE_FORCE:
             {
-                rebx_write_force(rebx, current->object, of);
+                rebx_write_force(rebx, current->object, buf);
                 break;
             }
             case REBX_BINARY_FIELD_TYPE_ADDITIONAL_FORCE:
             {
-                rebx_write_additional_force(rebx, current->object, of);
+                rebx_write_additional_force(rebx, current->object, buf);
                 break;
             }
             case REBX_BINARY_FIELD_TYPE_OPERATOR:
             {
-                rebx_write_operator(rebx, current->object, of);
+                rebx_write_operator(rebx, current->object, buf);
                 break;
             }
             case REBX_BINARY_FIELD_TYPE_PARAM:
             {
-                rebx_write_param(rebx, current->object, of);
+                rebx_write_param(rebx, current->object, buf);
                 break;
             }
             case REBX_BINARY_FIELD_TYPE_STEP:
             {
-                rebx_write_step(rebx, current->object, of);
+                rebx_write_step(rebx, current->object, buf);
                 break;
             }
+            default:
+            {
+                char str[300];
+                sprintf(str, "REBOUNDx error: rebx_write_list does not know how to write a list of field type %d.\n", list_type);
+                rebx_error(rebx, str);
+                return;
+            }
         }
         N--;
     }
 }
 
-// Could be extended to include time or steps_done to make an archive
-static void rebx_write_snapshot(struct rebx_extras* rebx, FILE* of){
+static void rebx_write_header(struct rebx_binary_buffer* buf){
+    const char str[] = "REBOUNDx Binary File. Version: ";
+    char zero = '\0';
+    size_t lenheader = strlen(str)+strlen(rebx_version_str);
+    rebx_buffer_write(buf, str, strlen(str));
+    rebx_buffer_write(buf, rebx_version_str, strlen(rebx_version_str));
+    rebx_buffer_write(buf, &zero, 1);
+    rebx_buffer_write(buf, rebx_githash_str, 62-lenheader);
+    rebx_buffer_write(buf, &zero, 1);
+}
+
+// Snapshot for rebx_output_binary. Archive snapshots are put together in rebx_output_archive
+static void rebx_write_snapshot(struct rebx_extras* rebx, struct rebx_binary_buffer* buf){
     REBX_START_OBJECT_FIELD(snapshot, SNAPSHOT);
-    rebx_write_rebx(rebx, of);
-    rebx_write_particles(rebx, of);
+    rebx_write_rebx(rebx, buf);
+    rebx_write_particles(rebx, buf);
     REBX_END_OBJECT_FIELD(snapshot);
 }
 
 void rebx_output_binary(struct rebx_extras* rebx, char* filename){
+    if (rebx->sim == NULL){
+        rebx_error(rebx, ""); // rebx_error gives meaningful err
+        return;
+    }
+    struct rebx_binary_buffer buffer = {0};
+    struct rebx_binary_buffer* const buf = &buffer;
+    rebx_write_header(buf);
+    rebx_write_snapshot(rebx, buf);
+    if (buf->failed){
+        rebx_error(rebx, "REBOUNDx error: Ran out of memory assembling binary in rebx_output_binary.");
+        free(buf->data);
+        return;
+    }
+
     FILE* of = fopen(filename,"wb");
     if (of==NULL){
         rebx_error(rebx, "REBOUNDx error: Can not open file passed to rebx_output_binary.");
+        free(buf->data);
+        return;
     }
-    if (rebx->sim == NULL){
+    if (fwrite(buf->data, buf->size, 1, of) != 1){
+        rebx_error(rebx, "REBOUNDx error: Could not write binary in rebx_output_binary.");
+    }
+    fclose(of);
+    free(buf->data);
+}
+
+/* Archives are a header followed by a series of snapshots:
+
+ SNAPSHOT {type=SNAPSHOT, size=skip_to_next_snapshot}          keyframe, same as in rebx_output_binary plus the time
+    TIME
+    REBX ... END (REBX)
+    PARTICLES ... END (PARTICLES)
+ END (SNAPSHOT)
+ DELTA_SNAPSHOT {type=DELTA_SNAPSHOT, size=skip_to_next_snapshot}
+    TIME
+    PARTICLES {type=PARTICLES, size=skip_to_END(DELTA_SNAPSHOT)}
+        PARTICLE ... END (PARTICLE)                              only particles whose params changed, with their full param list
+    END (PARTICLES)
+ END (DELTA_SNAPSHOT)
+ ...
+
+ To find what changed, the writer keeps the serialized REBOUNDx structure and each particle's
+ serialized PARTICLE object from the last snapshot and compares bytes.
+*/
+
+struct rebx_archive{
+    char* filename;
+    long since_keyframe;                    // snapshots written since the last keyframe
+    int N;                                  // particles at the last snapshot
+    int N_alloc;
+    struct rebx_binary_buffer structure;    // REBX_STRUCTURE object as last written
+    struct rebx_binary_buffer scratch;
+    struct rebx_binary_buffer* particles;   // PARTICLE objects as last written
+};
+
+void rebx_free_archive(struct rebx_archive* archive){
+    if (archive == NULL){
+        return;
+    }
+    for (int i=0; i<archive->N_alloc; i++){
+        free(archive->particles[i].data);
+    }
+    free(archive->particles);
+    free(archive->structure.data);
+    free(archive->scratch.data);
+    free(archive->filename);
+    free(archive);
+}
+
+// Replaces the contents of dest with size bytes from src
+static void rebx_buffer_set(struct rebx_binary_buffer* const dest, const char* const src, const size_t size){
+    dest->size = 0;
+    dest->failed = 0;
+    rebx_buffer_write(dest, src, size);
+}
+
+static struct rebx_archive* rebx_archive_start(struct rebx_extras* rebx, const char* const filename){
+    struct rebx_archive* archive = rebx->archive;
+    if (archive != NULL && strcmp(archive->filename, filename) == 0){
+        return archive;
+    }
+    rebx_free_archive(archive);
+    rebx->archive = NULL;
+    archive = calloc(1, sizeof(*archive));
+    if (archive == NULL){
+        return NULL;
+    }
+    archive->filename = malloc(strlen(filename) + 1);
+    if (archive->filename == NULL){
+        free(archive);
+        return NULL;
+    }
+    strcpy(archive->filename, filename);
+    archive->N = -1;    // forces a keyframe
+    rebx->archive = archive;
+    return archive;
+}
+
+void rebx_output_archive(struct rebx_extras* rebx, const char* const filename, const int keyframe_interval){
+    struct reb_simulation* const sim = rebx->sim;
+    if (sim == NULL){
         rebx_error(rebx, ""); // rebx_error gives meaningful err
         return;
     }
-    // Write header.
-    const char str[] = "REBOUNDx Binary File. Version: ";
-    char zero = '\0';
-    size_t lenheader = strlen(str)+strlen(rebx_version_str);
-    fwrite(str,sizeof(char),strlen(str),of);
-    fwrite(rebx_version_str,sizeof(char), strlen(rebx_version_str),of);
-    fwrite(&zero,sizeof(char),1,of);
-    fwrite(rebx_githash_str,sizeof(char),62-lenheader,of);
-    fwrite(&zero,sizeof(char),1,of);
+    struct rebx_archive* const archive = rebx_archive_start(rebx, filename);
+    if (archive == NULL){
+        rebx_error(rebx, "REBOUNDx error: Ran out of memory in rebx_output_archive.");
+        return;
+    }
+    if (sim->N > archive->N_alloc){
+        struct rebx_binary_buffer* const particles = realloc(archive->particles, sim->N*sizeof(*particles));
+        if (particles == NULL){
+            rebx_error(rebx, "REBOUNDx error: Ran out of memory in rebx_output_archive.");
+            return;
+        }
+        memset(particles + archive->N_alloc, 0, (sim->N - archive->N_alloc)*sizeof(*particles));
+        archive->particles = particles;
+        archive->N_alloc = sim->N;
+    }
 
-    rebx_write_snapshot(rebx, of);
+    FILE* of = fopen(filename, "ab");
+    if (of == NULL){
+        rebx_error(rebx, "REBOUNDx error: Can not open file passed to rebx_output_archive.");
+        return;
+    }
+    fseek(of, 0, SEEK_END);
+    const int new_file = (ftell(of) == 0);
+
+    struct rebx_binary_buffer* scratch = &archive->scratch;
+    scratch->size = 0;
+    scratch->failed = 0;
+    scratch->no_counters = 1;     // otherwise every snapshot would look like a structure change
+    rebx_write_rebx(rebx, scratch);
+    const int keyframe = new_file || archive->N != sim->N
+        || (keyframe_interval > 0 && archive->since_keyframe + 1 >= keyframe_interval)
+        || scratch->size != archive->structure.size
+        || memcmp(scratch->data, archive->structure.data, scratch->size) != 0;
+
+    struct rebx_binary_buffer buffer = {0};
+    struct rebx_binary_buffer* const buf = &buffer;
+    if (new_file){
+        rebx_write_header(buf);
+    }
+    const size_t pos_start_header_snapshot = buf->size;
+    rebx_buffer_write_field(buf, keyframe ? REBX_BINARY_FIELD_TYPE_SNAPSHOT : REBX_BINARY_FIELD_TYPE_DELTA_SNAPSHOT, 0);
+    const size_t pos_start_snapshot = buf->size;
+    REBX_WRITE_DATA_FIELD(TIME, &sim->t, sizeof(sim->t));
+    if (keyframe){
+        rebx_buffer_write(buf, scratch->data, scratch->size);
+        struct rebx_binary_buffer tmp = archive->structure;
+        archive->structure = archive->scratch;
+        archive->scratch = tmp;
+    }
+    REBX_START_OBJECT_FIELD(particle_list, PARTICLES);
+    for (int i=0; i<sim->N; i++){
+        const size_t start = buf->size;
+        rebx_write_particle(rebx, &sim->particles[i], i, buf);
+        if (buf->failed){
+            break;
+        }
+        struct rebx_binary_buffer* const last = &archive->particles[i];
+        const size_t size = buf->size - start;
+        if (!keyframe && size == last->size && memcmp(buf->data + start, last->data, size) == 0){
+            buf->size = start;  // unchanged, drop it again
+        }
+        else{
+            rebx_buffer_set(last, buf->data + start, size);
+            if (last->failed){
+                buf->failed = 1;
+            }
+        }
+    }
+    REBX_END_OBJECT_FIELD(particle_list);
+    REBX_END_OBJECT_FIELD(snapshot);
+
+    if (buf->failed || archive->structure.failed){
+        rebx_error(rebx, "REBOUNDx error: Ran out of memory in rebx_output_archive.");
+        archive->N = -1;    // cached state can't be trusted, start over with a keyframe
+    }
+    else{
+        if (fwrite(buf->data, buf->size, 1, of) != 1){
+            rebx_error(rebx, "REBOUNDx error: Could not write to archive in rebx_output_archive.");
+            archive->N = -1;
+        }
+        else{
+            archive->N = sim->N;
+            archive->since_keyframe = keyframe ? 0 : archive->since_keyframe + 1;
+        }
+    }
     fclose(of);
+    free(buf->data);
 }
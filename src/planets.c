@@ -1,7 +1,11 @@
+#define _DEFAULT_SOURCE     // madvise under -std=c99
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <fcntl.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
@@ -81,18 +85,31 @@ void jpl_work(double *P, int ncm, int ncf, int niv, double t0, double t1, double
  */
 
 struct _jpl_s * jpl_init(void)
+{
+//      return jpl_init_path("/home/blah/wherever/linux_p1550p2650.430");
+        return jpl_init_path("linux_p1550p2650.430");
+}
+
+/*
+ *  jpl_init_path
+ *
+ *  As jpl_init, but for the given file.  The returned structure is only
+ *  read from afterwards, so it may be shared between threads.
+ *
+ */
+
+struct _jpl_s * jpl_init_path(const char *path)
 {
         struct _jpl_s *jpl;
         struct stat sb;
-        char buf[256];
         ssize_t ret;
         off_t off;
         int fd, p;
 
-//      snprintf(buf, sizeof(buf), "/home/blah/wherever/linux_p1550p2650.430");
-        snprintf(buf, sizeof(buf), "linux_p1550p2650.430");
+        if (path == NULL)
+                return NULL;
 
-        if ((fd = open(buf, O_RDONLY)) < 0)
+        if ((fd = open(path, O_RDONLY)) < 0)
                 return NULL;
 
         jpl = malloc(sizeof(struct _jpl_s));
@@ -156,7 +173,7 @@ struct _jpl_s * jpl_init(void)
         // memory map the file, which makes us thread-safe with kernel caching
         jpl->map = mmap(NULL, jpl->len, PROT_READ, MAP_SHARED, fd, 0);
 
-        if (jpl->map == NULL)
+        if (jpl->map == MAP_FAILED)
                 goto err;
 
         // this file descriptor is no longer needed since we are memory mapped
@@ -173,6 +190,138 @@ err:    close(fd);
         return NULL;
 }
 
+/*
+ *  jpl_advise, jpl_lock
+ *
+ *  Pass an madvise() hint, or (un)lock in memory, the records which cover
+ *  the epochs from jd0 to jd1 (in either order).
+ *
+ */
+
+static int _jpl_span(struct _jpl_s *jpl, double jd0, double jd1, void **ptr, size_t *len)
+{
+        u_int32_t b0, b1;
+        size_t pg, off, end;
+        double t;
+
+        if (jpl == NULL || jpl->map == NULL)
+                return -1;
+
+        if (jd0 > jd1)
+                { t = jd0; jd0 = jd1; jd1 = t; }
+
+        // clamp to the file
+        if (jd0 < jpl->beg) jd0 = jpl->beg;
+        if (jd1 > jpl->end) jd1 = jpl->end;
+        if (jd0 > jd1)
+                return -1;
+
+        b0 = (u_int32_t)((jd0 - jpl->beg) / jpl->inc);
+        b1 = (u_int32_t)((jd1 - jpl->beg) / jpl->inc);
+
+        // page align the start, as madvise and mlock want
+        pg  = (size_t)sysconf(_SC_PAGESIZE);
+        off = (b0 + 2) * jpl->rec;
+        end = (b1 + 3) * jpl->rec;
+        off -= off % pg;
+
+        if (end > jpl->len)
+                end = jpl->len;
+
+        *ptr = (char *)jpl->map + off;
+        *len = end - off;
+        return 0;
+}
+
+int jpl_advise(struct _jpl_s *jpl, double jd0, double jd1, int advice)
+{
+        void *ptr;
+        size_t len;
+
+        if (_jpl_span(jpl, jd0, jd1, &ptr, &len) < 0)
+                return -1;
+
+        return madvise(ptr, len, advice);
+}
+
+int jpl_lock(struct _jpl_s *jpl, double jd0, double jd1, int on)
+{
+        void *ptr;
+        size_t len;
+
+        if (_jpl_span(jpl, jd0, jd1, &ptr, &len) < 0)
+                return -1;
+
+        return (on) ? mlock(ptr, len) : munlock(ptr, len);
+}
+
+/*
+ *  jpl_extract
+ *
+ *  Write a new ephemeris file holding only the records which cover the
+ *  epochs from jd0 to jd1 (in either order).  The two header records are
+ *  copied with the start and end epochs adjusted, so the result is read
+ *  by jpl_init_path like the original.
+ *
+ */
+
+int jpl_extract(const char *src, const char *dst, double jd0, double jd1)
+{
+        struct _jpl_s *jpl;
+        u_int32_t b0, b1, nrec;
+        double beg, end, t;
+        char *hdr;
+        FILE *fp;
+        int ret;
+
+        if ((jpl = jpl_init_path(src)) == NULL)
+                return -1;
+
+        if (jd0 > jd1)
+                { t = jd0; jd0 = jd1; jd1 = t; }
+
+        // clamp to the file
+        if (jd0 < jpl->beg) jd0 = jpl->beg;
+        if (jd1 > jpl->end) jd1 = jpl->end;
+
+        nrec = (u_int32_t)(jpl->len / jpl->rec) - 2;
+
+        if (jd0 > jd1 || nrec == 0)
+                { jpl_free(jpl); return -1; }
+
+        b0 = (u_int32_t)((jd0 - jpl->beg) / jpl->inc);
+        b1 = (u_int32_t)((jd1 - jpl->beg) / jpl->inc);
+
+        if (b1 >= nrec) b1 = nrec - 1;
+        if (b0 > b1) b0 = b1;
+
+        beg = jpl->beg + b0 * jpl->inc;
+        end = jpl->beg + (b1 + 1) * jpl->inc;
+
+        if ((fp = fopen(dst, "wb")) == NULL)
+                { jpl_free(jpl); return -1; }
+
+        // header records, with the new span
+        if ((hdr = malloc(2 * jpl->rec)) == NULL)
+                { fclose(fp); jpl_free(jpl); return -1; }
+
+        memcpy(hdr, jpl->map, 2 * jpl->rec);
+        memcpy(hdr + 0x0A5C, &beg, sizeof(double));
+        memcpy(hdr + 0x0A5C + sizeof(double), &end, sizeof(double));
+
+        fwrite(hdr, jpl->rec, 2, fp);
+        fwrite((char *)jpl->map + (b0 + 2) * jpl->rec, jpl->rec, b1 - b0 + 1, fp);
+
+        ret = ferror(fp) ? -1 : 0;
+
+        if (fclose(fp) != 0)
+                ret = -1;
+
+        free(hdr);
+        jpl_free(jpl);
+        return ret;
+}
+
 /*
  *  jpl_free
  *
@@ -294,3 +443,112 @@ int jpl_calc(struct _jpl_s *pl, struct mpos_s *now, double jde, int n, int m)
         now->jde = jde;
         return 0;
 }
+
+/*
+ *  jpl_calc_all
+ *
+ *  Caculate the barycentric position+velocity+acceleration of all 11 bodies
+ *  in body[] order with a single pass over the record.  The EMB and lunar
+ *  series are only evaluated once, and the Chebyshev basis is shared by
+ *  every component with the same number of intervals.
+ *
+ */
+
+int jpl_calc_all(struct _jpl_s *pl, struct mpos_s *now, double jde)
+{
+        static const int _jpl[11] = {
+                JPL_SUN, JPL_MER, JPL_VEN, -1, -1, JPL_MAR,
+                JPL_JUP, JPL_SAT, JPL_URA, JPL_NEP, JPL_PLU };
+        double T[24], S[24], U[24];
+        double t, t0, t1, c, *z, *P;
+        struct mpos_s emb, lun;
+        u_int32_t blk;
+        int i, j, k, m, n, p, b, niv, ncf;
+
+        if (pl == NULL || now == NULL)
+                return -1;
+
+        // check if covered by this file
+        if (jde < pl->beg || jde > pl->end || pl->map == NULL)
+                return -1;
+
+        // compute record number and 'offset' into record
+        blk = (u_int32_t)((jde - pl->beg) / pl->inc);
+        t = fmod(jde - pl->beg, pl->inc) / pl->inc;
+        z = pl->map + (blk + 2) * pl->rec;
+
+        niv = ncf = 0;
+        b = 0; c = 0.0;
+
+        for (i = 0; i < 13; i++) {
+                struct mpos_s *cur;
+
+                // the last two slots are the Earth-Moon pair
+                if (i < 11) {
+                        if ((k = _jpl[i]) < 0)
+                                continue;
+                        cur = &now[i];
+                } else {
+                        k = (i == 11) ? JPL_EMB : JPL_LUN;
+                        cur = (i == 11) ? &emb : &lun;
+                }
+
+                // only rebuild the basis if the sub-interval changed
+                if (pl->niv[k] != niv || pl->ncf[k] > ncf) {
+                        niv = pl->niv[k];
+                        ncf = pl->ncf[k];
+
+                        t1 = t * (double)niv;
+                        t0 = 2.0 * fmod(t1, 1.0) - 1.0;
+                        c = (double)(niv * 2) / pl->inc / 86400.0;
+                        b = (int)t1;
+
+                        T[0] = 1.0; T[1] = t0;
+                        S[0] = 0.0; S[1] = 1.0;
+                        U[0] = 0.0; U[1] = 0.0; U[2] = 4.0;
+
+                        for (p = 2; p < ncf; p++) {
+                                T[p] = 2.0 * t0 * T[p-1] - T[p-2];
+                                S[p] = 2.0 * t0 * S[p-1] + 2.0 * T[p-1] - S[p-2];
+                        }
+                        for (p = 3; p < ncf; p++) {
+                                U[p] = 2.0 * t0 * U[p-1] + 4.0 * S[p-1] - U[p-2];
+                        }
+                }
+
+                P = &z[pl->off[k]];
+
+                for (m = 0; m < 3; m++) {
+                        double u = 0.0, v = 0.0, w = 0.0;
+                        n = pl->ncf[k] * (m + b * pl->ncm[k]);
+
+                        for (p = 0; p < pl->ncf[k]; p++) {
+                                u += T[p] * P[n+p];
+                                v += S[p] * P[n+p];
+                                w += U[p] * P[n+p];
+                        }
+
+                        cur->u[m] = u;
+                        cur->v[m] = v * c;
+                        cur->w[m] = w * c * c;
+                }
+        }
+
+        // Earth and Moon from the EMB and geocentric Moon
+        for (j = 0; j < 2; j++) {
+                double f = (j == 0) ? -1.0 / (1.0 + pl->cem) : pl->cem / (1.0 + pl->cem);
+                struct mpos_s *cur = &now[j == 0 ? 3 : 4];
+
+                vecpos_set(cur->u, emb.u);
+                vecpos_off(cur->u, lun.u, f);
+                vecpos_set(cur->v, emb.v);
+                vecpos_off(cur->v, lun.v, f);
+                vecpos_set(cur->w, emb.w);
+                vecpos_off(cur->w, lun.w, f);
+        }
+
+        for (i = 0; i < 11; i++)
+                now[i].jde = jde;
+
+        return 0;
+}
@@ -1,7 +1,12 @@
 struct _jpl_s * jpl_init(void);
+struct _jpl_s * jpl_init_path(const char *path);
 int jpl_free(struct _jpl_s *jpl);
 void jpl_work(double *P, int ncm, int ncf, int niv, double t0, double t1, double *u, double *v, double *w);
 int jpl_calc(struct _jpl_s *jpl, struct mpos_s *now, double jde, int n, int m);
+int jpl_calc_all(struct _jpl_s *jpl, struct mpos_s *now, double jde);
+int jpl_advise(struct _jpl_s *jpl, double jd0, double jd1, int advice);
+int jpl_lock(struct _jpl_s *jpl, double jd0, double jd1, int on);
+int jpl_extract(const char *src, const char *dst, double jd0, double jd1);
 
 // these are the body codes for the user to specify
 enum {
@@ -22,7 +27,7 @@ enum {
         _NUM_TEST,
 };
 
-int body[11];
+extern int body[11];
 
 // these are array indices for the internal interface
 enum {
@@ -66,53 +66,156 @@
 #include <stdlib.h>
 #include "reboundx.h"
 
-static void rebx_calculate_radiation_forces(struct rebx_extras* const rebx, struct reb_simulation* const sim, const double c, const int source_index, struct reb_particle* const particles, const int N){
+// Below this many grains the kernel stays serial
+#define REBX_RADIATION_MIN_PARALLEL 1024
+
+// Sources and grains resolved from the particle params, kept on the force so
+// that each step only walks compact arrays. Rebuilt whenever a param is added,
+// a particle is removed, or the particle array changes.
+struct rebx_radiation_workspace{
+    unsigned long generation;           // rebx->param_generation when resolved
+    const struct reb_particle* particles;
+    int N;
+    int N_alloc;
+    int N_sources;
+    int N_grains;
+    int* sources;                       // indices of particles with radiation_source set (or just 0)
+    int* grains;                        // indices of particles with beta set
+    const double** beta;                // where each grain's beta lives, so changed values are picked up
+};
+
+void rebx_radiation_free_arrays(struct rebx_extras* const rebx, struct rebx_force* const force){
+    struct rebx_radiation_workspace* const ws = rebx_get_param(rebx, force->ap, "radiation_workspace");
+    if (ws != NULL){
+        free(ws->sources);
+        free(ws->grains);
+        free(ws->beta);
+        free(ws);
+    }
+}
+
+static int rebx_radiation_resolve(struct rebx_extras* const rebx, struct rebx_radiation_workspace* const ws, struct reb_particle* const particles, const int N){
+    if (N > ws->N_alloc){
+        int* const sources = realloc(ws->sources, N*sizeof(*sources));
+        if (sources != NULL){
+            ws->sources = sources;
+        }
+        int* const grains = realloc(ws->grains, N*sizeof(*grains));
+        if (grains != NULL){
+            ws->grains = grains;
+        }
+        const double** const beta = realloc(ws->beta, N*sizeof(*beta));
+        if (beta != NULL){
+            ws->beta = beta;
+        }
+        if (sources == NULL || grains == NULL || beta == NULL){
+            return 0;
+        }
+        ws->N_alloc = N;
+    }
+
+    const int source_id = rebx_get_param_id(rebx, "radiation_source");
+    const int beta_id = rebx_get_param_id(rebx, "beta");
+    const struct rebx_column* const beta_column = rebx_get_column(rebx, beta_id);
+    ws->N_sources = 0;
+    ws->N_grains = 0;
+    for (int i=0; i<N; i++){
+        if (rebx_get_param_by_id(rebx, particles[i].ap, source_id) != NULL){
+            ws->sources[ws->N_sources++] = i;
+        }
+        const double* const beta = beta_column ? rebx_column_get(beta_column, i) : rebx_get_param_by_id(rebx, particles[i].ap, beta_id);
+        if (beta != NULL){ // only particles with beta set feel radiation forces
+            ws->grains[ws->N_grains] = i;
+            ws->beta[ws->N_grains] = beta;
+            ws->N_grains++;
+        }
+    }
+    if (ws->N_sources == 0 && N > 0){
+        ws->sources[ws->N_sources++] = 0;   // default source to index 0 if "radiation_source" not found on any particle
+    }
+    // a column lookup above can itself bump the generation, so record it last
+    ws->generation = rebx->param_generation;
+    ws->particles = particles;
+    ws->N = N;
+    return 1;
+}
+
+static struct rebx_radiation_workspace* rebx_radiation_workspace(struct reb_simulation* const sim, struct rebx_force* const force, struct reb_particle* const particles, const int N){
+    struct rebx_extras* const rebx = sim->extras;
+    struct rebx_radiation_workspace* ws = rebx_get_param(rebx, force->ap, "radiation_workspace");
+    if (ws == NULL){
+        ws = calloc(1, sizeof(*ws));
+        if (ws == NULL){
+            reb_error(sim, "REBOUNDx Error: Could not allocate memory for radiation_forces.\n");
+            return NULL;
+        }
+        rebx_set_param_pointer(rebx, &force->ap, "radiation_workspace", ws);
+        rebx_set_param_pointer(rebx, &force->ap, "free_arrays", rebx_radiation_free_arrays);
+    }
+    if (ws->generation != rebx->param_generation || ws->particles != particles || ws->N != N){
+        if (!rebx_radiation_resolve(rebx, ws, particles, N)){
+            ws->generation = 0;
+            reb_error(sim, "REBOUNDx Error: Could not allocate memory for radiation_forces.\n");
+            return NULL;
+        }
+    }
+    return ws;
+}
+
+static void rebx_calculate_radiation_forces(struct rebx_extras* const rebx, struct reb_simulation* const sim, const struct rebx_radiation_workspace* const ws, const double c, const int source_index, struct reb_particle* const particles, const int N){
     const struct reb_particle source = particles[source_index];
     const double mu = sim->G*source.m;
+    const double cinv = 1./c;
+    const struct rebx_geometry* const geo = rebx_get_geometry(rebx, particles, N, source_index);
+    const int N_grains = ws->N_grains;
+    const int* const grains = ws->grains;
+    const double* const* const beta = ws->beta;
 
-    for (int i=0;i<N;i++){
-        
+#pragma omp parallel for schedule(static) if(N_grains >= REBX_RADIATION_MIN_PARALLEL)
+    for (int k=0;k<N_grains;k++){
+        const int i = grains[k];
         if(i == source_index) continue;
         
-        const double* beta = rebx_get_param(rebx, particles[i].ap, "beta");
-        if(beta == NULL) continue; // only particles with beta set feel radiation forces
-        
         const struct reb_particle p = particles[i];
-        const double dx = p.x - source.x; 
-        const double dy = p.y - source.y;
-        const double dz = p.z - source.z;
-        const double dr = sqrt(dx*dx + dy*dy + dz*dz); // distance to star
+        const double dx = geo ? geo->dx[i] : p.x - source.x; 
+        const double dy = geo ? geo->dy[i] : p.y - source.y;
+        const double dz = geo ? geo->dz[i] : p.z - source.z;
+        const double dr = geo ? geo->r[i] : sqrt(dx*dx + dy*dy + dz*dz); // distance to star
+        const double drinv = 1./dr;
         
         const double dvx = p.vx - source.vx;
         const double dvy = p.vy - source.vy;
         const double dvz = p.vz - source.vz;
-        const double rdot = (dx*dvx + dy*dvy + dz*dvz)/dr; // radial velocity
-        const double a_rad = *beta*mu/(dr*dr);
+        const double rdot = (dx*dvx + dy*dvy + dz*dvz)*drinv; // radial velocity
+        const double a_rad = *beta[k]*mu*drinv*drinv;
 
         // Equation (5) of Burns, Lamy & Soter (1979)
+        const double radial = a_rad*(1.-rdot*cinv)*drinv;
+        const double drag = a_rad*cinv;
 
-        particles[i].ax += a_rad*((1.-rdot/c)*dx/dr - dvx/c);
-        particles[i].ay += a_rad*((1.-rdot/c)*dy/dr - dvy/c);
-        particles[i].az += a_rad*((1.-rdot/c)*dz/dr - dvz/c);
+        particles[i].ax += radial*dx - drag*dvx;
+        particles[i].ay += radial*dy - drag*dvy;
+        particles[i].az += radial*dz - drag*dvz;
 	}
 }
 
 void rebx_radiation_forces(struct reb_simulation* const sim, struct rebx_force* const radiation_forces, struct reb_particle* const particles, const int N){
     struct rebx_extras* const rebx = sim->extras;
-    double* c = rebx_get_param(rebx, radiation_forces->ap, "c");
+    if (rebx_param_cache_stale(rebx, &radiation_forces->param_generation)){
+        radiation_forces->param_cache[0] = rebx_get_param(rebx, radiation_forces->ap, "c");
+    }
+    double* c = radiation_forces->param_cache[0];
     if (c == NULL){
         reb_error(sim, "Need to set speed of light in radiation_forces effect.  See examples in documentation.\n");
+        return;
     }
     
-    int source_found=0;
-    for (int i=0; i<N; i++){
-        if (rebx_get_param(rebx, particles[i].ap, "radiation_source") != NULL){
-            source_found = 1;
-            rebx_calculate_radiation_forces(rebx, sim, *c, i, particles, N);
-        }
+    const struct rebx_radiation_workspace* const ws = rebx_radiation_workspace(sim, radiation_forces, particles, N);
+    if (ws == NULL){
+        return;
     }
-    if (!source_found){
-        rebx_calculate_radiation_forces(rebx, sim, *c, 0, particles, N);    // default source to index 0 if "radiation_source" not found on any particle
+    for (int s=0; s<ws->N_sources; s++){
+        rebx_calculate_radiation_forces(rebx, sim, ws, *c, ws->sources[s], particles, N);
     }
 }
 
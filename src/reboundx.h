@@ -124,6 +124,9 @@ enum rebx_binary_field_type{
     REBX_BINARY_FIELD_TYPE_PARTICLES=24,
     REBX_BINARY_FIELD_TYPE_FORCE=25,
     REBX_BINARY_FIELD_TYPE_SNAPSHOT=26,
+    REBX_BINARY_FIELD_TYPE_DELTA_SNAPSHOT=27,
+    REBX_BINARY_FIELD_TYPE_TIME=28,
+    REBX_BINARY_FIELD_TYPE_COUNTERS=29,
 };
 
 /**
@@ -160,6 +163,7 @@ enum rebx_integrator {
     REBX_INTEGRATOR_RK4 = 1,
     REBX_INTEGRATOR_EULER = 2,
     REBX_INTEGRATOR_RK2 = 3,
+    REBX_INTEGRATOR_DP45 = 4,
 };
 
 /****************************************
@@ -183,6 +187,62 @@ struct rebx_param{
     char* name;                 ///< For searching linked lists and informative errors
     enum rebx_param_type type;  ///< Needed to cast value
     void* value;                ///< Pointer to parameter value
+    int id;                     ///< Interned id of the name (see rebx_get_param_id). -1 if the name was not registered.
+    struct rebx_column* column; ///< Column whose row value points into, or NULL if value is its own allocation.
+};
+
+/**
+ * @brief Dense storage for one per-particle parameter.
+ * @details Opt in with rebx_add_column. The values of that parameter on all particles are then kept contiguously, one row per particle, instead of in separate allocations. Each particle keeps its rebx_param node, whose value points at its row, so the usual parameter functions keep working. After rebx_get_column, row i belongs to sim->particles[i]. 
+ */
+struct rebx_column{
+    int id;                     ///< Interned id of the parameter stored
+    enum rebx_param_type type;  ///< REBX_TYPE_DOUBLE or REBX_TYPE_INT
+    void* values;               ///< N_rows values
+    uint8_t* present;           ///< Bitmap with bit i set if row i holds a value
+    struct rebx_param** owner;  ///< Param whose value points at each row, NULL if the row is empty
+    int N_rows;                 ///< Rows in use (sim->N when in sync)
+    int N_alloc;                ///< Rows allocated
+};
+
+/**
+ * @brief Separations of all particles from one source particle.
+ * @details Filled at most once per call to the additional forces by rebx_get_geometry, and shared between the forces that measure particles from the same source. Row i holds particles[i] - particles[source]. The source's own row is zero.
+ */
+struct rebx_geometry{
+    int source;                 ///< Index of the particle separations are measured from
+    unsigned long epoch;        ///< rebx->geometry_epoch when the rows were filled
+    int N_alloc;                ///< Rows allocated
+    double* dx;                 ///< x separation
+    double* dy;                 ///< y separation
+    double* dz;                 ///< z separation
+    double* r2;                 ///< Squared distance
+    double* r;                  ///< Distance
+    double* r3inv;              ///< 1/r^3
+};
+
+/**
+ * @brief Gravity field of a body as a spherical harmonic expansion, see rebx_create_harmonics.
+ * @details Coefficients are fully normalized and stored by degree n and order m at index n*(n+1)/2 + m, in the body frame (z along the pole, x through the prime meridian).
+ */
+struct rebx_harmonics{
+    int degree;                 ///< Maximum degree
+    int order;                  ///< Maximum order (0 for a zonal field)
+    double R_eq;                ///< Reference radius of the coefficients
+    double* C;                  ///< Normalized cosine coefficients
+    double* S;                  ///< Normalized sine coefficients
+    double* factors;            ///< Recursion factors, filled by rebx_create_harmonics
+};
+
+#define REBX_PARAM_CACHE_SIZE 12    ///< Number of resolved param pointers a force or operator can cache
+
+/**
+ * @brief Call counters kept on each force and operator while enabled with rebx_set_counters.
+ */
+struct rebx_counters{
+    unsigned long calls;        ///< Number of calls from the force and operator lists
+    double time;                ///< Cumulative wall time spent in those calls, in seconds
+    unsigned long particles;    ///< Sum over calls of the number of (real) particles in the simulation
 };
 
 /**
@@ -195,6 +255,9 @@ struct rebx_force{
     // See comments in params.py in __init__
     enum rebx_force_type force_type;    ///< Force type for internal logic
     void (*update_accelerations) (struct reb_simulation* const sim, struct rebx_force* const force, struct reb_particle* const particles, const int N); ///< Function pointer to add additional accelerations
+    unsigned long param_generation;     ///< rebx->param_generation when param_cache was last filled. 0 if never.
+    void* param_cache[REBX_PARAM_CACHE_SIZE]; ///< Pointers to the force's own params, resolved from ap by the force. See rebx_param_cache_stale.
+    struct rebx_counters counters;  ///< Call counters. Only updated while rebx->counters_enabled is set.
 };
 
 /**
@@ -207,6 +270,9 @@ struct rebx_operator{
     // See comments in params.py in __init__
     enum rebx_operator_type operator_type;  ///< Operator type for internal logic
     void (*step_function) (struct reb_simulation* sim, struct rebx_operator* operator, const double dt);       ///< Function pointer to execute step
+    unsigned long param_generation;     ///< rebx->param_generation when param_cache was last filled. 0 if never.
+    void* param_cache[REBX_PARAM_CACHE_SIZE]; ///< Pointers to the operator's own params, resolved from ap by the operator. See rebx_param_cache_stale.
+    struct rebx_counters counters;  ///< Call counters. Only updated while rebx->counters_enabled is set.
 };
 
 /**
@@ -226,6 +292,17 @@ struct rebx_binary_field{
     long size;                          ///< Size in bytes of the object data (not including this structure). So you can skip ahead.
 };
 
+/**
+ * @brief Pool of equally sized objects, allocated in slabs (internal).
+ * @details Freed objects go on a free list for reuse, and everything is returned to the system at once when rebx is freed.
+ */
+struct rebx_pool{
+    size_t size;                        ///< Bytes per object
+    int N_next;                         ///< Number of objects in the next slab
+    void* free_list;                    ///< Objects ready to hand out, each holding a pointer to the next
+    struct rebx_pool_slab* slabs;       ///< Slabs allocated so far, newest first
+};
+
 /**
  * @brief Main REBOUNDx structure.
  * @details These fields are used internally by REBOUNDx and generally should not be changed manually by the user. Use the API instead.
@@ -240,6 +317,41 @@ struct rebx_extras {
     struct rebx_node* registered_params;            ///< Linked list of rebx_params with all the parameter names registered with their type (for type safety)
     struct rebx_node* allocated_forces;             ///< For memory management
     struct rebx_node* allocated_operators;          ///< For memory management
+
+    struct rebx_param** id_params;                  ///< Registered params indexed by their interned id
+    int N_registered_params;                        ///< Number of registered params (and ids handed out)
+    int* param_ids;                                 ///< Open addressing hash table from registered names to ids. -1 marks empty slots.
+    int param_ids_size;                             ///< Number of slots in param_ids (a power of two)
+    unsigned long param_generation;                 ///< Bumped whenever a param is added to any list or a pointer param is reassigned
+    struct rebx_column** columns;                   ///< Column stores indexed by param id, NULL for params kept in lists
+    int N_columns;                                  ///< Length of columns
+    int columns_dirty;                              ///< Set when particles may have been removed or reordered, so rows must be matched up again
+    struct rebx_geometry* geometry;                 ///< Separations from each source asked for through rebx_get_geometry
+    int N_geometry;                                 ///< Number of sources in geometry
+    const struct reb_particle* geometry_particles;  ///< Particle array geometry is valid for. NULL when no cache is being kept.
+    int geometry_N;                                 ///< Number of particles geometry is valid for
+    unsigned long geometry_epoch;                   ///< Bumped at every call to the additional forces
+    int accelerations_newtonian;                    ///< 1 while sim->particles hold only REBOUND's full Newtonian gravity, i.e. before the first REBOUNDx force has run
+    struct rebx_scratch_block* scratch;             ///< Scratch arena blocks, current one first. See rebx_scratch_alloc.
+    size_t scratch_used;                            ///< Bytes of the arena handed out
+    int in_step_list;                               ///< 1 while the pre or post timestep operators are being run
+    int whfast_deferred;                            ///< 1 while a kepler, jump or interaction step has left the current state in sim->ri_whfast.p_jh, with sim->particles out of date
+    struct rebx_archive* archive;                   ///< What was last written by rebx_output_archive, so later snapshots only store changes. NULL until first used.
+    int counters_enabled;                           ///< 1 if the call counters on forces and operators are being updated (see rebx_set_counters)
+    struct rebx_pool node_pool;                     ///< Nodes of parameter lists
+    struct rebx_pool param_pool;                    ///< rebx_params
+    struct rebx_pool value_pool;                    ///< Values of double, int and uint32 parameters not kept in a column
+};
+
+/**
+ * @brief A block of the scratch arena (internal).
+ */
+struct rebx_scratch_block{
+    struct rebx_scratch_block* next;    ///< Previously filled block
+    size_t base;                        ///< Arena offset of the first byte of data
+    size_t size;                        ///< Bytes of data
+    char* data;                         ///< Storage, aligned start of mem
+    void* mem;                          ///< Allocation holding data
 };
 
 /****************************************
@@ -264,7 +376,7 @@ struct rebx_extras* rebx_attach(struct reb_simulation* sim);
 
 /**
  * @brief Detaches REBOUNDx from simulation, resetting all the simulation's function pointers that REBOUNDx has set.
- * @details This does not free the memory allocated by REBOUNDx (call rebx_free).
+ * @details This does not free the memory allocated by REBOUNDx (call rebx_free). The particles' params are stored by REBOUNDx, so they are removed from the particles.
  * @param sim Pointer to the simulation from which to remove REBOUNDx
  */
 void rebx_detach(struct reb_simulation* sim, struct rebx_extras* rebx);
@@ -300,6 +412,47 @@ struct rebx_extras* rebx_create_extras_from_binary(struct reb_simulation* sim, c
  * @param warnings Pointer to an array of warnings to be populated during loading. 
  */
 void rebx_init_extras_from_binary(struct rebx_extras* rebx, const char* const filename, enum rebx_input_binary_messages* warnings);
+
+/**
+ * @brief Appends a snapshot of all particle parameters to a REBOUNDx archive, meant to be called alongside each SimulationArchive snapshot.
+ * @details The first snapshot, and any after the forces, operators or number of particles change, is written in full (a keyframe) in the same format as rebx_output_binary, so the archive can also be opened with rebx_create_extras_from_binary. Other snapshots only store the parameter lists of particles whose parameters changed.
+ * @param rebx Pointer to the rebx_extras instance
+ * @param filename Filename of the archive. Created if it doesn't exist.
+ * @param keyframe_interval If > 0, also write a keyframe at least every keyframe_interval snapshots, which bounds how many snapshots have to be replayed on reading.
+ */
+void rebx_output_archive(struct rebx_extras* rebx, const char* const filename, const int keyframe_interval);
+
+/**
+ * @brief Number of snapshots in a REBOUNDx archive (1 for a file written with rebx_output_binary).
+ * @param filename Filename of the archive.
+ * @return Number of snapshots, or -1 if the file can't be read.
+ */
+long rebx_archive_N_snapshots(const char* const filename);
+
+/**
+ * @brief Index of the last snapshot in a REBOUNDx archive written at or before time t.
+ * @param filename Filename of the archive.
+ * @param t Simulation time.
+ * @return Snapshot index, 0 if all snapshots are later than t, or -1 if the file can't be read.
+ */
+long rebx_archive_find_time(const char* const filename, const double t);
+
+/**
+ * @brief Loads a snapshot from a REBOUNDx archive, replaying the changes since the nearest keyframe before it.
+ * @param sim Pointer to the simulation to which the effects and parameters should be added.
+ * @param filename Filename of the archive.
+ * @param snapshot Index of the snapshot. Negative values count from the end.
+ */
+struct rebx_extras* rebx_create_extras_from_archive(struct reb_simulation* sim, const char* const filename, const long snapshot);
+
+/**
+ * @brief Similar to rebx_create_extras_from_archive(), but takes an extras instance (must be attached to a simulation) and allows for manual message handling.
+ * @param rebx Pointer to a rebx_extras instance to be updated.
+ * @param filename Filename of the archive.
+ * @param snapshot Index of the snapshot. Negative values count from the end.
+ * @param warnings Pointer to an array of warnings to be populated during loading. 
+ */
+void rebx_init_extras_from_archive(struct rebx_extras* rebx, const char* const filename, const long snapshot, enum rebx_input_binary_messages* warnings);
 /** @} */
 /** @} */
 
@@ -325,6 +478,10 @@ void rebx_init_extras_from_binary(struct rebx_extras* rebx, const char* const fi
 //struct rebx_effect* rebx_add(struct rebx_extras* rebx, const char* name);
 int rebx_add_operator(struct rebx_extras* rebx, struct rebx_operator* operator);
 int rebx_add_operator_step(struct rebx_extras* rebx, struct rebx_operator* operator, const double dt_fraction, enum rebx_timing timing);
+// Adds the N stages to the timing list, to run in the order given and before the steps already there (as with rebx_add_operator_step). Neighbouring stages of the same drift/kepler/jump/interaction operator are merged, including the last one with the step it then runs into.
+int rebx_add_operator_steps(struct rebx_extras* rebx, struct rebx_operator* const* operators, const double* dt_fractions, const int N, enum rebx_timing timing);
+// Adds a named splitting of one timestep alternating operators A and B ("leapfrog", "saba2", "saba3", "saba4", "yoshida4"). Starts and ends with A.
+int rebx_add_splitting(struct rebx_extras* rebx, const char* scheme, struct rebx_operator* A, struct rebx_operator* B, enum rebx_timing timing);
 int rebx_add_force(struct rebx_extras* rebx, struct rebx_force* force);
 struct rebx_operator* rebx_load_operator(struct rebx_extras* const rebx, const char* name);
 struct rebx_force* rebx_load_force(struct rebx_extras* const rebx, const char* name);
@@ -365,6 +522,50 @@ struct rebx_force* rebx_get_force(struct rebx_extras* const rebx, const char* co
  */
 struct rebx_force* rebx_get_force(struct rebx_extras* const rebx, const char* const name);
 struct rebx_operator* rebx_get_operator(struct rebx_extras* const rebx, const char* const name);
+
+/**
+ * @brief Turns the call counters on all forces and operators on or off.
+ * @details While enabled, every call made from the force list and the pre and post timestep operator lists adds to the counters field of the force or operator: one call, its wall time and the number of particles in the simulation. This costs two clock reads per call. Counters are kept when they are turned off, and are saved with rebx_output_binary.
+ * @param rebx Pointer to the rebx_extras instance
+ * @param enabled 1 to enable, 0 to disable.
+ */
+void rebx_set_counters(struct rebx_extras* const rebx, const int enabled);
+
+/**
+ * @brief Zeroes the call counters on all forces and operators.
+ * @param rebx Pointer to the rebx_extras instance
+ */
+void rebx_reset_counters(struct rebx_extras* const rebx);
+
+/**
+ * @brief Gets the separations of all particles from a source, shared between forces in the current step.
+ * @details The cache is only kept while REBOUNDx runs two or more forces one after another on sim->particles. Forces modify accelerations but not positions, so the separations stay valid until the last force has run. Effects should fall back to computing separations themselves when this returns NULL.
+ * @param rebx Pointer to the rebx_extras instance
+ * @param particles Particle array passed to update_accelerations
+ * @param N Number of particles passed to update_accelerations
+ * @param source_index Index of the particle to measure from
+ * @return Pointer to the separations, or NULL if no cache is kept for these particles.
+ */
+const struct rebx_geometry* rebx_get_geometry(struct rebx_extras* const rebx, const struct reb_particle* const particles, const int N, const int source_index);
+
+/**
+ * @brief Borrows memory from the scratch arena shared by all effects.
+ * @details Memory is handed out from a stack, so an effect takes a mark with rebx_scratch_mark, allocates what it needs, and gives it all back with rebx_scratch_release before returning. Effects called from within another one (e.g. a force integrated by implicit_midpoint) nest naturally. When the arena overflows, a new block is added so earlier pointers stay valid. Once everything has been released, the blocks are merged into one sized to the largest use seen, so the arena stops allocating after the first timestep.
+ * @param size Bytes needed.
+ * @return Pointer aligned to 64 bytes, or NULL on allocation failure.
+ */
+void* rebx_scratch_alloc(struct rebx_extras* const rebx, const size_t size);
+size_t rebx_scratch_mark(struct rebx_extras* const rebx);
+void rebx_scratch_release(struct rebx_extras* const rebx, const size_t mark);
+
+/**
+ * @brief Checks whether the param pointers a force or operator cached in its param_cache need resolving again.
+ * @details Adding a param or reassigning a pointer param bumps rebx->param_generation, since those are the only changes that can move a param's value. Values changed in place through rebx_set_param_* on an existing param show through the cached pointers. Effects call this at the top of their update with &force->param_generation (or &operator->param_generation).
+ * @param rebx Pointer to the rebx_extras instance
+ * @param generation Generation at which the cache was filled. Brought up to date if it is behind.
+ * @return 1 if the caller must re-fill its cache, 0 if the cached pointers are still valid.
+ */
+int rebx_param_cache_stale(struct rebx_extras* const rebx, unsigned long* const generation);
 /** @} */
 /** @} */
 
@@ -405,6 +606,80 @@ void rebx_set_param_double(struct rebx_extras* const rebx, struct rebx_node** ap
 void rebx_set_param_int(struct rebx_extras* const rebx, struct rebx_node** apptr, const char* const param_name, int val);
 void rebx_set_param_uint32(struct rebx_extras* const rebx, struct rebx_node** apptr, const char* const param_name, uint32_t val);
 void rebx_register_param(struct rebx_extras* const rebx, const char* name, enum rebx_param_type type);
+
+/**
+ * @brief Gets the integer id interned for a registered parameter name.
+ * @details Ids are handed out as names are registered and stay fixed for the lifetime of rebx. Effects that look up the same parameter on many particles should get the id once and use rebx_get_param_by_id, which avoids comparing strings.
+ * @param param_name Name of the parameter.
+ * @return The id, or -1 if the name is not registered.
+ */
+int rebx_get_param_id(struct rebx_extras* const rebx, const char* const param_name);
+
+/**
+ * @brief Gets a parameter from a particle or effect by its interned id.
+ * @param ap Pointer from which to get the param
+ * @param id Id from rebx_get_param_id.
+ * @return A void pointer to the parameter. NULL if not found.
+ */
+void* rebx_get_param_by_id(struct rebx_extras* const rebx, struct rebx_node* ap, const int id);
+struct rebx_param* rebx_get_param_struct_by_id(struct rebx_extras* const rebx, struct rebx_node* ap, const int id);
+
+/**
+ * @brief Stores a registered double or int particle parameter in a rebx_column.
+ * @details Values already set on particles are moved into the column. Pointers returned by rebx_get_param for the parameter may move whenever particles are added or removed, so get them again rather than keeping them across timesteps.
+ * @param param_name Name of the parameter.
+ * @return Pointer to the column, or NULL on error.
+ */
+struct rebx_column* rebx_add_column(struct rebx_extras* const rebx, const char* const param_name);
+
+/**
+ * @brief Gets the column for a parameter, with row i matched to sim->particles[i].
+ * @details Effects call this once per update and then read rows with rebx_column_get. Matching rows up again after particles were removed walks every particle's parameter list once. Otherwise this is O(1).
+ * @param id Id from rebx_get_param_id.
+ * @return Pointer to the column, or NULL if the parameter is not stored in one.
+ */
+struct rebx_column* rebx_get_column(struct rebx_extras* const rebx, const int id);
+
+/**
+ * @brief Pointer to row i of a column, or NULL if particle i does not have the parameter set.
+ */
+static inline void* rebx_column_get(const struct rebx_column* const col, const int i){
+    if (!(col->present[i >> 3] & (1u << (i & 7)))){
+        return NULL;
+    }
+    return (char*)col->values + (size_t)i*(col->type == REBX_TYPE_DOUBLE ? sizeof(double) : sizeof(int));
+}
+
+/**
+ * @brief Sets a double parameter on many particles in one call.
+ * @details The parameter is stored in a column (see rebx_add_column), so values of particles that already have it are written in place.
+ * @param param_name Name of a registered double parameter.
+ * @param values n values.
+ * @param indices n indices into sim->particles, or NULL for particles 0 to n-1.
+ * @param n Number of values.
+ * @return Number of values set. Less than n on error.
+ */
+int rebx_set_param_double_array(struct rebx_extras* const rebx, const char* const param_name, const double* const values, const int* const indices, const int n);
+
+/**
+ * @brief Same as rebx_set_param_double_array, for an int parameter.
+ */
+int rebx_set_param_int_array(struct rebx_extras* const rebx, const char* const param_name, const int* const values, const int* const indices, const int n);
+
+/**
+ * @brief Gets a double parameter from many particles in one call.
+ * @param param_name Name of a registered double parameter.
+ * @param values Filled in with n values. Entries for particles without the parameter are left as they are.
+ * @param indices n indices into sim->particles, or NULL for particles 0 to n-1.
+ * @param n Number of values.
+ * @return Number of particles that had the parameter.
+ */
+int rebx_get_param_double_array(struct rebx_extras* const rebx, const char* const param_name, double* const values, const int* const indices, const int n);
+
+/**
+ * @brief Same as rebx_get_param_double_array, for an int parameter.
+ */
+int rebx_get_param_int_array(struct rebx_extras* const rebx, const char* const param_name, int* const values, const int* const indices, const int n);
 /** @} */
 /** @} */
 
@@ -503,6 +778,158 @@ double rebx_central_force_potential(struct rebx_extras* const rebx);
  */
 double rebx_gravitational_harmonics_potential(struct rebx_extras* const rebx);
 
+/**
+ * @brief Calculates the total energy including the potentials of all attached conservative effects.
+ * @details Sums the classical energy and the gr_potential, gravitational_harmonics, central_force and tides_precession potentials in a single (OpenMP parallel) pass over the particles.
+ * If gr or gr_full is attached, its Hamiltonian replaces the classical energy. Effects that are loaded but not added are ignored.
+ * @param rebx pointer to the REBOUNDx extras instance.
+ * @return Total energy (double).
+ */
+double rebx_total_energy(struct rebx_extras* const rebx);
+
+/**
+ * @brief Allocates a spherical harmonic gravity field with all coefficients zero.
+ * @details Set the coefficients with rebx_harmonics_set or rebx_harmonics_set_J. Attach the field to a particle with rebx_set_param_pointer(rebx, &p->ap, "harmonics", h) for the gravitational_harmonics effect. The field is not copied, so it must outlive the simulation; free it with rebx_free_harmonics.
+ * @param degree Maximum degree.
+ * @param order Maximum order, at most degree (0 for a zonal field).
+ * @param R_eq Reference radius of the coefficients.
+ * @return Pointer to the field, or NULL if the arguments are invalid or allocation failed.
+ */
+struct rebx_harmonics* rebx_create_harmonics(const int degree, const int order, const double R_eq);
+
+/**
+ * @brief Frees a field allocated by rebx_create_harmonics.
+ * @param h Pointer to the field.
+ */
+void rebx_free_harmonics(struct rebx_harmonics* const h);
+
+/**
+ * @brief Sets one pair of fully normalized coefficients.
+ * @param h Pointer to the field.
+ * @param n Degree, 0 <= n <= h->degree.
+ * @param m Order, 0 <= m <= n. Orders above h->order are stored but not evaluated.
+ * @param C Normalized cosine coefficient.
+ * @param S Normalized sine coefficient (ignored for m = 0).
+ * @return 1 on success, 0 if n or m are out of range.
+ */
+int rebx_harmonics_set(struct rebx_harmonics* const h, const int n, const int m, const double C, const double S);
+
+/**
+ * @brief Sets a zonal coefficient from the unnormalized J_n = -C_n0.
+ * @param h Pointer to the field.
+ * @param n Degree.
+ * @param J Zonal harmonic J_n.
+ * @return 1 on success, 0 if n is out of range.
+ */
+int rebx_harmonics_set_J(struct rebx_harmonics* const h, const int n, const double J);
+
+#define REBX_HARMONICS_LANES 8      ///< Points the harmonics engine evaluates together
+#define REBX_HARMONICS_WORK_SIZE(degree) (6*((degree)+2)*REBX_HARMONICS_LANES) ///< Doubles of workspace needed for a field of the given degree
+
+/**
+ * @brief Adds the accelerations from degrees 2 and up of a field at N points.
+ * @details Positions and accelerations are relative to the body, in its body frame.
+ * @param h Pointer to the field.
+ * @param GM Gravitational parameter of the body.
+ * @param N Number of points.
+ * @param x,y,z Positions of the points.
+ * @param ax,ay,az Accelerations the field's are added to.
+ * @param work Workspace of REBX_HARMONICS_WORK_SIZE(h->degree) doubles, or NULL to allocate one for the call.
+ * @return 1 on success, 0 if the workspace could not be allocated.
+ */
+int rebx_harmonics_accelerations(const struct rebx_harmonics* const h, const double GM, const int N, const double* const x, const double* const y, const double* const z, double* const ax, double* const ay, double* const az, double* const work);
+
+/**
+ * @brief Calculates the potential energy from degrees 2 and up of a field for N points.
+ * @param h Pointer to the field.
+ * @param GM Gravitational parameter of the body.
+ * @param N Number of points.
+ * @param x,y,z Positions of the points relative to the body, in its body frame.
+ * @param m Masses of the points. If NULL, returns the sum of the potentials per unit mass.
+ * @param work Workspace as for rebx_harmonics_accelerations, or NULL.
+ * @return Potential energy (double), or NaN if the workspace could not be allocated.
+ */
+double rebx_harmonics_potential(const struct rebx_harmonics* const h, const double GM, const int N, const double* const x, const double* const y, const double* const z, const double* const m, double* work);
+
+#define REBX_HARMONICS_ZONAL_MAX 32 ///< Highest degree rebx_harmonics_zonal_point evaluates
+
+/**
+ * @brief Adds the acceleration from the zonal terms of a field at a single point.
+ * @details Takes the field's arrays rather than the field so that it can run in OpenMP target regions, with C and factors mapped to the device. Does nothing for degrees above REBX_HARMONICS_ZONAL_MAX.
+ * @param degree h->degree
+ * @param R_eq h->R_eq
+ * @param C h->C
+ * @param factors h->factors
+ * @param GM Gravitational parameter of the body.
+ * @param x,y,z Position relative to the body, in its body frame.
+ * @param ax,ay,az Acceleration the field's is added to.
+ */
+void rebx_harmonics_zonal_point(const int degree, const double R_eq, const double* const C, const double* const factors, const double GM, const double x, const double y, const double z, double* const ax, double* const ay, double* const az);
+
+/**
+ * @brief Number of doubles in the factors array of a field of the given degree.
+ * @param degree Maximum degree of the field.
+ * @return Length of h->factors.
+ */
+int rebx_harmonics_factors_size(const int degree);
+
+/**
+ * @brief Opens the JPL planetary ephemeris and massive asteroid files for ephemeris_forces.
+ * @details The returned handle is read-only once opened, so it can be shared between simulations on different threads.
+ * Attach it to an ephemeris_forces effect with rebx_set_param_pointer(rebx, &force->ap, "ephemeris", eph).
+ * Forces without an ephemeris param fall back to linux_p1550p2650.430 and sb431-n16s.bsp in the working directory.
+ * If the environment variable REBX_EPHEM_INDEX is set, the segment index of the asteroid file is cached in asteroids_path.idx and reused on later starts.
+ * @param planets_path Path to the DE430 binary file.
+ * @param asteroids_path Path to the SPK file for the massive asteroids. Can be NULL if N_ast is 0.
+ * @return Pointer to the handle, or NULL if a file could not be opened.
+ */
+struct rebx_ephemeris* rebx_ephemeris_open(const char* const planets_path, const char* const asteroids_path);
+
+/**
+ * @brief Locks the ephemeris records covering a time window resident in memory.
+ * @details Useful on nodes with slow or network-backed storage. Subject to the process' mlock limit (ulimit -l).
+ * To instead read ahead of a running integration, set the "ephem_prefetch" param on the ephemeris_forces effect to the number of 32-day DE430 blocks to prefetch.
+ * @param eph Pointer to the handle.
+ * @param jd0 Start of the window (JD, TDB).
+ * @param jd1 End of the window (JD, TDB).
+ * @return 1 on success, 0 if any part of the window could not be locked.
+ */
+int rebx_ephemeris_lock(struct rebx_ephemeris* const eph, const double jd0, const double jd1);
+
+/**
+ * @brief Releases a window locked with rebx_ephemeris_lock.
+ * @param eph Pointer to the handle.
+ * @param jd0 Start of the window (JD, TDB).
+ * @param jd1 End of the window (JD, TDB).
+ * @return 1 on success, 0 otherwise.
+ */
+int rebx_ephemeris_unlock(struct rebx_ephemeris* const eph, const double jd0, const double jd1);
+
+/**
+ * @brief Writes compact copies of the ephemeris files covering only a window of time.
+ * @details The outputs are in the same formats as the inputs, so they can be passed to rebx_ephemeris_open, or used by ephem() through the REBX_EPHEM_PLANETS and REBX_EPHEM_ASTEROIDS environment variables.
+ * They are typically a few MB for a window of several years.
+ * @param planets_in DE430 file to read.
+ * @param asteroids_in SPK file of massive asteroids to read. May be NULL to skip the asteroids.
+ * @param planets_out DE file to write.
+ * @param asteroids_out SPK file to write. May be NULL to skip the asteroids.
+ * @param jd0 Start of the window (JD, TDB).
+ * @param jd1 End of the window (JD, TDB).
+ * @param n_ast Number of asteroids to keep, in file order as for N_ast. -1 keeps them all.
+ * @return 1 on success, 0 otherwise.
+ */
+int rebx_ephemeris_extract(const char* const planets_in, const char* const asteroids_in,
+                           const char* const planets_out, const char* const asteroids_out,
+                           const double jd0, const double jd1, const int n_ast);
+
+/**
+ * @brief Closes a handle returned by rebx_ephemeris_open.
+ * @details Must only be called once no simulation uses the handle anymore.
+ * REBOUNDx does not free handles attached to forces.
+ * @param eph Pointer to the handle.
+ */
+void rebx_ephemeris_close(struct rebx_ephemeris* const eph);
+
 /** @} */
 /** @} */
 
@@ -588,7 +1015,6 @@ void rebx_input_skip_binary_field(FILE* inf, long field_size);
 /** @} */
 
 void rebx_error(struct rebx_extras* rebx, const char* const msg);
-#endif
 
 // Added gravitational constant G for the GR stuff (2020 Feb 26)
 // Added vx, vy, vz (2020 Feb 27)
@@ -613,3 +1039,320 @@ void ephem(const double G, const int i, const double t, double* const m,
 	   double* const vx, double* const vy, double* const vz,
 	   double* const ax, double* const ay, double* const az);
 
+/**
+ * @brief Output of an ephemeris propagation.
+ * @details States are stored as x, y, z, vx, vy, vz for each particle at each output time.
+ * The arrays are allocated with malloc and belong to the caller.
+ */
+typedef struct {
+    double* t;                      ///< Output times, n_out of them.
+    double* state;                  ///< States, 6*n_particles*n_out of them.
+    int n_out;                      ///< Number of output times.
+    int n_particles;                ///< Number of particles.
+} timestate;
+
+/**
+ * @brief One independent arc for integration_function_arcs.
+ */
+typedef struct {
+    double tstart;                  ///< Start time (JD, TDB).
+    double tstep;                   ///< Initial time step in days. Negative to integrate backwards.
+    double trange;                  ///< Time span in days, with the same sign as tstep.
+    int geocentric;                 ///< 1 if instate is geocentric, 0 if barycentric.
+    int n_particles;                ///< Number of particles in the arc.
+    double* instate;                ///< 6*n_particles initial positions and velocities.
+    timestate ts;                   ///< Output, filled in as by integration_function.
+    int status;                     ///< Return value of the integration (1 on success).
+} arcstate;
+
+/**
+ * @brief Integrates test particles from tstart over trange with ephemeris_forces.
+ * @param tstart Start time (JD, TDB).
+ * @param tstep Initial time step in days.
+ * @param trange Time span in days.
+ * @param geocentric 1 if instate is geocentric, 0 if barycentric.
+ * @param n_particles Number of particles.
+ * @param instate 6*n_particles initial positions and velocities.
+ * @param ts Output states at the Gauss-Radau substeps of every step.
+ * @return 1 on success, 0 if the output could not be allocated.
+ */
+int integration_function(double tstart, double tstep, double trange,
+			 int geocentric,
+			 int n_particles,
+			 double* instate,
+			 timestate *ts);
+
+/**
+ * @brief Same as integration_function, but with an explicit ephemeris handle.
+ * @param eph Handle from rebx_ephemeris_open, or NULL for the default files.
+ * @param tstart Start time (JD, TDB).
+ * @param tstep Initial time step in days.
+ * @param trange Time span in days.
+ * @param geocentric 1 if instate is geocentric, 0 if barycentric.
+ * @param n_particles Number of particles.
+ * @param instate 6*n_particles initial positions and velocities.
+ * @param ts Output states at the Gauss-Radau substeps of every step. Free with rebx_free_timestate.
+ * @return 1 on success, 0 if the output could not be allocated.
+ */
+int integration_function_eph(struct rebx_ephemeris* eph,
+			 double tstart, double tstep, double trange,
+			 int geocentric,
+			 int n_particles,
+			 double* instate,
+			 timestate *ts);
+
+/**
+ * @brief Frees the arrays of a timestate filled in by integration_function and its variants.
+ * @details For callers that can't call free() from the same C runtime, e.g. through ctypes. The timestate itself is not freed.
+ * @param ts Pointer to the timestate.
+ */
+void rebx_free_timestate(timestate* ts);
+
+/**
+ * @brief Receives the output of integration_function_stream one step at a time.
+ * @param ctx The pointer passed to integration_function_stream.
+ * @param n Number of output times in this chunk.
+ * @param n_particles Number of particles.
+ * @param t n output times.
+ * @param state 6*n_particles*n states, laid out as in timestate.
+ * @return 0 to continue, anything else to stop the integration.
+ * @details The buffers are reused for the next step, so copy out anything that needs to be kept.
+ */
+typedef int (*rebx_ephem_sink)(void* ctx, int n, int n_particles, const double* t, const double* state);
+
+/**
+ * @brief Integrates test particles like integration_function, passing the output to sink as it is produced.
+ * @details Only one step of output is ever held in memory, so this is suitable for long arcs or many particles.
+ * @param eph Handle from rebx_ephemeris_open, or NULL for the default files.
+ * @param tstart Start time (JD, TDB).
+ * @param tstep Initial time step in days.
+ * @param trange Time span in days.
+ * @param geocentric 1 if instate is geocentric, 0 if barycentric.
+ * @param n_particles Number of particles.
+ * @param instate 6*n_particles initial positions and velocities.
+ * @param sink Called with the Gauss-Radau substeps after every step.
+ * @param ctx Passed through to sink.
+ * @return 1 on success, 0 if sink stopped the integration.
+ */
+int integration_function_stream(struct rebx_ephemeris* eph,
+			 double tstart, double tstep, double trange,
+			 int geocentric,
+			 int n_particles,
+			 double* instate,
+			 rebx_ephem_sink sink, void* ctx);
+
+/**
+ * @brief Same as integration_function_stream, but with the output produced on a separate thread.
+ * @details After each step the integration thread only copies the step's starting state and IAS15 coefficients into a small ring of buffers. A writer thread evaluates the Gauss-Radau interpolants and calls sink, while the next step is integrated.
+ * sink is called from the writer thread, one step at a time and in order. If it asks to stop, up to a few more steps may already have been integrated, and are discarded.
+ * If the buffers or the thread can't be set up, this falls back to integration_function_stream.
+ * @param eph Handle from rebx_ephemeris_open, or NULL for the default files.
+ * @param tstart Start time (JD, TDB).
+ * @param tstep Initial time step in days.
+ * @param trange Time span in days.
+ * @param geocentric 1 if instate is geocentric, 0 if barycentric.
+ * @param n_particles Number of particles.
+ * @param instate 6*n_particles initial positions and velocities.
+ * @param sink Called with the Gauss-Radau substeps after every step, from the writer thread.
+ * @param ctx Passed through to sink.
+ * @return 1 on success, 0 if sink stopped the integration.
+ */
+int integration_function_stream_async(struct rebx_ephemeris* eph,
+			 double tstart, double tstep, double trange,
+			 int geocentric,
+			 int n_particles,
+			 double* instate,
+			 rebx_ephem_sink sink, void* ctx);
+
+/**
+ * @brief Integrates test particles and returns their states only at the requested epochs.
+ * @details Each epoch is evaluated from the IAS15 interpolant of the step that contains it, so the step size is unaffected by the epochs. The integration stops at the last epoch.
+ * @param eph Handle from rebx_ephemeris_open, or NULL for the default files.
+ * @param tstart Start time (JD, TDB).
+ * @param tstep Initial time step in days. Negative to integrate backwards.
+ * @param geocentric 1 if instate is geocentric, 0 if barycentric.
+ * @param n_particles Number of particles.
+ * @param instate 6*n_particles initial positions and velocities.
+ * @param n_epochs Number of epochs.
+ * @param epochs Epochs (JD, TDB), sorted in the direction of integration and not before tstart.
+ * @param outstate 6*n_particles*n_epochs states, laid out as in timestate. Allocated by the caller.
+ * @return Number of epochs filled in. Less than n_epochs if the epochs were not sorted or the integration stopped early.
+ */
+int integration_function_epochs(struct rebx_ephemeris* eph,
+			 double tstart, double tstep,
+			 int geocentric,
+			 int n_particles,
+			 double* instate,
+			 int n_epochs, const double* epochs,
+			 double* outstate);
+
+/**
+ * @brief Integrates many independent arcs in parallel, one simulation per arc.
+ * @details All simulations share the one read-only ephemeris handle. Arcs are handed out to threads one at a time. The threads are pthreads, so this runs in parallel without OpenMP too.
+ * @param eph Handle from rebx_ephemeris_open, or NULL for the default files.
+ * @param n_arcs Number of arcs.
+ * @param arcs Array of arcs. The outputs and status of each arc are filled in.
+ * @param n_threads Number of threads to use. 0 uses the OpenMP default if compiled with OpenMP, and one per processor otherwise.
+ * @return Number of arcs that failed.
+ */
+int integration_function_arcs(struct rebx_ephemeris* eph, const int n_arcs, arcstate* const arcs, const int n_threads);
+
+/**
+ * @brief Integrates test particles backwards and forwards from one epoch at the same time.
+ * @details The simulation is set up and the accelerations at tstart are evaluated once. The backward direction starts from a copy of it, and the two directions are integrated on two threads, sharing the one read-only ephemeris handle, and joined into one trajectory in increasing time. tstart appears once. The threads are pthreads, so this runs in parallel without OpenMP too.
+ * @param eph Handle from rebx_ephemeris_open, or NULL for the default files.
+ * @param tstart Start time (JD, TDB).
+ * @param tstep Initial time step in days. The sign is ignored.
+ * @param trange_back Time to integrate backwards from tstart, in days. 0 to only integrate forwards.
+ * @param trange_forward Time to integrate forwards from tstart, in days. 0 to only integrate backwards.
+ * @param geocentric 1 if instate is geocentric, 0 if barycentric.
+ * @param n_particles Number of particles.
+ * @param instate 6*n_particles initial positions and velocities at tstart.
+ * @param ts Filled in with the outputs, in increasing time. Free with rebx_free_timestate.
+ * @return 1 on success, 0 if either direction failed, in which case ts is empty.
+ */
+int integration_function_bidirectional(struct rebx_ephemeris* eph,
+			 double tstart, double tstep, double trange_back, double trange_forward,
+			 int geocentric,
+			 int n_particles,
+			 double* instate,
+			 timestate *ts);
+
+/**
+ * @brief Light-time corrected positions of test particles, from an integrated trajectory, as seen by an observer at many epochs.
+ * @details For each observation and particle the light time is iterated in the barycentric frame until it changes by less than 1e-12 days. The particle position at the retarded time is interpolated from the 8 outputs of ts nearest to it. The observer is the Earth's center from the DE430 file, at the observation epoch, plus an offset, e.g. of an observatory. The observations are split evenly between threads.
+ * @param eph Handle from rebx_ephemeris_open, or NULL for the default files.
+ * @param ts Trajectory from integration_function_eph or one of its variants, with the times in order.
+ * @param geocentric 1 if ts is geocentric, 0 if barycentric. A geocentric trajectory is moved to the barycentric frame with the Earth at the retarded time, so the positions returned are the same either way.
+ * @param n_obs Number of observations.
+ * @param t_obs Observation epochs (JD, TDB).
+ * @param observer 3*n_obs offsets of the observer from the Earth's center, in au, or NULL for the Earth's center.
+ * @param n_threads Number of threads to use. 0 uses the OpenMP default if compiled with OpenMP, and one per processor otherwise.
+ * @param outpos 3*n_particles*n_obs positions of the particles at the retarded times relative to the observer at t_obs, in au, for each observation and then each particle. Allocated by the caller.
+ * @param outlt n_particles*n_obs light times in days, or NULL if not needed.
+ * @return Number of observation and particle pairs that fell outside ts, or outside the DE430 file. Their outputs are NaN.
+ */
+int rebx_ephemeris_observe(struct rebx_ephemeris* eph, const timestate* ts, int geocentric,
+			 int n_obs, const double* t_obs, const double* observer,
+			 int n_threads, double* outpos, double* outlt);
+
+/**
+ * @brief Integrates test particles like integration_function_epochs, but in groups that each take their own step size.
+ * @details The particles are split into groups by their shortest free-fall time sqrt(r^3/GM) about the Sun and planets, within a factor of 4 of each other, and each group is integrated with its own IAS15 simulation. A particle in a close encounter then only slows down its own group. The groups are handed out to threads, share the one read-only ephemeris handle, and look up the perturbers through one shared cache, so a substep time that several groups reach is only looked up once.
+ * The simulations are kept from one epoch to the next, and step to every epoch exactly. There the particles are grouped again, as encounters come and go, and a particle that changes group is moved from one simulation to the other. Only the groups it leaves or joins start their IAS15 predictor over.
+ * @param eph Handle from rebx_ephemeris_open, or NULL for the default files.
+ * @param tstart Start time (JD, TDB).
+ * @param tstep Initial time step in days. Negative to integrate backwards.
+ * @param geocentric 1 if instate is geocentric, 0 if barycentric.
+ * @param n_particles Number of particles.
+ * @param instate 6*n_particles initial positions and velocities.
+ * @param n_epochs Number of epochs.
+ * @param epochs Epochs (JD, TDB), sorted in the direction of integration and not before tstart.
+ * @param outstate 6*n_particles*n_epochs states, laid out as in timestate. Allocated by the caller.
+ * @param n_threads Number of threads to use. 0 uses the OpenMP default if compiled with OpenMP, and one per processor otherwise.
+ * @return Number of epochs filled in for all particles. Less than n_epochs if the epochs were not sorted or the memory could not be allocated, in which case it is 0.
+ */
+int integration_function_groups(struct rebx_ephemeris* eph,
+			 double tstart, double tstep,
+			 int geocentric,
+			 int n_particles,
+			 double* instate,
+			 int n_epochs, const double* epochs,
+			 double* outstate,
+			 const int n_threads);
+
+/**
+ * @brief Why integration_function_retire retired a particle.
+ */
+enum REBX_RETIRE {
+    REBX_RETIRE_NONE = 0,           ///< Still active at the end of the integration.
+    REBX_RETIRE_IMPACT = 1,         ///< Came within impact_radius of the Earth center.
+    REBX_RETIRE_ESCAPE = 2,         ///< Went beyond escape_distance from the barycenter.
+    REBX_RETIRE_CALLBACK = 3,       ///< Retired by the retire callback.
+    REBX_RETIRE_EPHEMERIS = 4,      ///< The next step would have left the time span of the planet or asteroid ephemeris.
+};
+
+/**
+ * @brief Decides whether a particle should be retired, for integration_function_retire.
+ * @param ctx The ctx pointer of the rebx_retirement.
+ * @param id Index of the particle in instate.
+ * @param t Current time (JD, TDB).
+ * @param state Current x, y, z, vx, vy, vz, in the same frame as instate.
+ * @return Nonzero to retire the particle.
+ */
+typedef int (*rebx_retire_fn)(void* ctx, int id, double t, const double* state);
+
+/**
+ * @brief Retirement criteria and results for integration_function_retire.
+ * @details The criteria are checked at the end of every step. A criterion of 0 (or a NULL callback) is not used. The result arrays are allocated by the caller.
+ */
+typedef struct {
+    double impact_radius;           ///< Retire particles closer than this to the Earth center (AU).
+    double escape_distance;         ///< Retire particles farther than this from the solar system barycenter, also for geocentric instates (AU).
+    rebx_retire_fn retire;          ///< Called for every active particle that meets no other criterion.
+    void* ctx;                      ///< Passed through to retire.
+    int* reason;                    ///< n_particles enum REBX_RETIRE values.
+    double* t;                      ///< n_particles retirement times, for retired particles.
+    double* state;                  ///< 6*n_particles states at retirement, for retired particles.
+} rebx_retirement;
+
+/**
+ * @brief Integrates test particles like integration_function_epochs, taking out particles that impact the Earth, escape, or can no longer be integrated.
+ * @details Retired particles are removed from the simulation in one batch per step, so they stop costing force evaluations. Their time and state at retirement and the reason are written to ret, and their states at later epochs are NaN.
+ * Particles are checked at the end of every step, so an impact needs a step that ends inside impact_radius. IAS15 shrinks its steps on approach, which makes this a good approximation as long as impact_radius is not much smaller than the Earth.
+ * @param eph Handle from rebx_ephemeris_open, or NULL for the default files.
+ * @param tstart Start time (JD, TDB).
+ * @param tstep Initial time step in days. Negative to integrate backwards.
+ * @param geocentric 1 if instate is geocentric, 0 if barycentric.
+ * @param n_particles Number of particles.
+ * @param instate 6*n_particles initial positions and velocities.
+ * @param n_epochs Number of epochs.
+ * @param epochs Epochs (JD, TDB), sorted in the direction of integration and not before tstart.
+ * @param outstate 6*n_particles*n_epochs states, laid out as in timestate. Allocated by the caller.
+ * @param ret Retirement criteria, and the arrays for the results.
+ * @return Number of epochs filled in. Less than n_epochs if the epochs were not sorted or the integration stopped early.
+ */
+int integration_function_retire(struct rebx_ephemeris* eph,
+			 double tstart, double tstep,
+			 int geocentric,
+			 int n_particles,
+			 double* instate,
+			 int n_epochs, const double* epochs,
+			 double* outstate,
+			 rebx_retirement* ret);
+
+#define REBX_TRAJECTORY_VERSION 1
+#define REBX_TRAJECTORY_HEADER_SIZE 32
+
+/**
+ * @brief Integrates test particles like integration_function, writing the output straight into a memory-mapped file rather than keeping it in memory.
+ * @details The file starts with a REBX_TRAJECTORY_HEADER_SIZE byte header,
+ * 
+ *     char magic[8] = "REBXTRAJ", int32 version, int32 n_particles, int64 n_out, int64 record_size,
+ * 
+ * followed by n_out records of record_size bytes, one per output time in order: the time, then
+ * x, y, z, vx, vy, vz for each particle (all doubles in native byte order). n_out is kept current
+ * during the integration, so a file can be read while it is being written or after a failed run.
+ * From numpy, 
+ * 
+ *     np.memmap(filename, dtype=[('t', 'f8'), ('state', 'f8', (n_particles, 6))], mode='r', offset=32, shape=(n_out,))
+ * 
+ * maps the records without copying. The file is written from a separate thread, as in integration_function_stream_async.
+ * @param eph Handle from rebx_ephemeris_open, or NULL for the default files.
+ * @param tstart Start time (JD, TDB).
+ * @param tstep Initial time step in days.
+ * @param trange Time span in days.
+ * @param geocentric 1 if instate is geocentric, 0 if barycentric.
+ * @param n_particles Number of particles.
+ * @param instate 6*n_particles initial positions and velocities.
+ * @param filename File to write. Overwritten if it exists.
+ * @return 1 on success, 0 if the file could not be created or grown.
+ */
+int integration_function_mmap(struct rebx_ephemeris* eph,
+			 double tstart, double tstep, double trange,
+			 int geocentric,
+			 int n_particles,
+			 double* instate,
+			 const char* filename);
+
+#endif
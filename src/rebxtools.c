@@ -1,6 +1,7 @@
 #include <math.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include "rebxtools.h"
 #include "reboundx.h"
 
@@ -67,7 +68,11 @@ void rebx_com_force(struct reb_simulation* const sim, struct rebx_force* const f
         }
     }
 
-    
+    // Back reactions are summed up rather than applied to every particle for
+    // every particle. In barycentric coordinates they all go to everyone; in
+    // Jacobi coordinates particle j gets those of all particles i > j (and
+    // of itself if inclusive), which is the running sum as we count down.
+    struct reb_vec3d back = {0};
     for(int i=N-1; i>=0; i--){ // Run through backwards so each iteration does not depend on previous ones in Jacobi coordinates.
         if (i==refindex){
             continue;
@@ -86,23 +91,27 @@ void rebx_com_force(struct reb_simulation* const sim, struct rebx_force* const f
         switch(coordinates){
             case REBX_COORDINATES_BARYCENTRIC:
                 massratio = p->m/com.m;
-                for(int j=0; j < N; j++){
-                    particles[j].ax -= massratio*a.x;
-                    particles[j].ay -= massratio*a.y;
-                    particles[j].az -= massratio*a.z;
-                }
+                back.x += massratio*a.x;
+                back.y += massratio*a.y;
+                back.z += massratio*a.z;
                 break;
             case REBX_COORDINATES_JACOBI:
                 if(back_reactions_inclusive){
                     massratio = p->m/(com.m + p->m);
+                    back.x += massratio*a.x;
+                    back.y += massratio*a.y;
+                    back.z += massratio*a.z;
                 }
                 else{
                     massratio = p->m/com.m;
                 }
-                for(int j=0; j < i + back_reactions_inclusive; j++){    // stop at j=i if inclusive, at i-1 if not
-                    particles[j].ax -= massratio*a.x;
-                    particles[j].ay -= massratio*a.y;
-                    particles[j].az -= massratio*a.z;
+                p->ax -= back.x;
+                p->ay -= back.y;
+                p->az -= back.z;
+                if(!back_reactions_inclusive){
+                    back.x += massratio*a.x;
+                    back.y += massratio*a.y;
+                    back.z += massratio*a.z;
                 }
                 break;
             case REBX_COORDINATES_PARTICLE:
@@ -123,6 +132,32 @@ void rebx_com_force(struct reb_simulation* const sim, struct rebx_force* const f
                 reb_error(sim, "Coordinates not supported in REBOUNDx.\n");
         }
     }
+    if (coordinates == REBX_COORDINATES_BARYCENTRIC){
+        for(int j=0; j < N; j++){
+            particles[j].ax -= back.x;
+            particles[j].ay -= back.y;
+            particles[j].az -= back.z;
+        }
+    }
+    else if (coordinates == REBX_COORDINATES_JACOBI && N > 0){
+        particles[0].ax -= back.x;  // skipped above, but interior to everyone
+        particles[0].ay -= back.y;
+        particles[0].az -= back.z;
+    }
+}
+
+int rebx_com_reference(struct reb_simulation* const sim, const char* reference_name, struct reb_particle* const particles, const int N){
+    struct rebx_extras* const rebx = sim->extras;
+    const int reference_id = rebx_get_param_id(rebx, reference_name);
+    for (int i=0; i < N; i++){
+        if (rebx_get_param_by_id(rebx, particles[i].ap, reference_id)){
+            return i;
+        }
+    }
+    char str[200];
+    sprintf(str, "Coordinates set to REBX_COORDINATES_PARTICLE, but %s param was not found in any particle.  Need to set parameter.\n", reference_name);
+    reb_error(sim, str);
+    return -1;
 }
 
 static inline void rebx_subtract_posvel(struct reb_particle* p, struct reb_particle* diff, const double massratio){
@@ -134,6 +169,15 @@ static inline void rebx_subtract_posvel(struct reb_particle* p, struct reb_parti
     p->vz -= massratio*diff->vz;
 }
 
+static inline void rebx_add_posvel(struct reb_particle* p, struct reb_particle* diff, const double massratio){
+    p->x += massratio*diff->x;
+    p->y += massratio*diff->y;
+    p->z += massratio*diff->z;
+    p->vx += massratio*diff->vx;
+    p->vy += massratio*diff->vy;
+    p->vz += massratio*diff->vz;
+}
+
 void rebxtools_com_ptm(struct reb_simulation* const sim, struct rebx_operator* const operator, const enum REBX_COORDINATES coordinates, const int back_reactions_inclusive, const char* reference_name, struct reb_particle (*calculate_step) (struct reb_simulation* const sim, struct rebx_operator* const operator, struct reb_particle* p, struct reb_particle* source, const double dt), const double dt){
     struct rebx_extras* const rebx = sim->extras;
     const int N_real = sim->N - sim->N_var;
@@ -160,12 +204,21 @@ void rebxtools_com_ptm(struct reb_simulation* const sim, struct rebx_operator* c
         }
     }
 
-    
+    // As in rebx_com_force the back reactions are kept as a running sum.
+    // Here they shift positions, which the later steps see, so each particle
+    // is brought up to date with the sum just before its step. In
+    // barycentric coordinates the particles already stepped are owed the
+    // reactions of those stepped after them, so their steps are stored
+    // relative to the sum at the time and the final sum is taken off at the end.
+    struct reb_particle back = {0};
     for(int i=N_real-1; i>=0; i--){ // Run through backwards so each iteration does not depend on previous ones in Jacobi coordinates.
         if (i==refindex){
             continue;
         }
         struct reb_particle* p = &sim->particles[i];
+        if (coordinates == REBX_COORDINATES_BARYCENTRIC || coordinates == REBX_COORDINATES_JACOBI){
+            rebx_subtract_posvel(p, &back, 1.);
+        }
         if (coordinates == REBX_COORDINATES_JACOBI){
             com = reb_get_com_without_particle(com, *p);
         }
@@ -183,20 +236,18 @@ void rebxtools_com_ptm(struct reb_simulation* const sim, struct rebx_operator* c
         switch(coordinates){
             case REBX_COORDINATES_BARYCENTRIC:
                 massratio = p->m/com.m;
-                for(int j=0; j < N_real; j++){
-                    rebx_subtract_posvel(&sim->particles[j], &diff, massratio);
-                }
+                rebx_subtract_posvel(p, &back, -1.);
+                rebx_add_posvel(&back, &diff, massratio);
                 break;
             case REBX_COORDINATES_JACOBI:
                 if(back_reactions_inclusive){
                     massratio = p->m/(com.m + p->m);
+                    rebx_subtract_posvel(p, &diff, massratio);
                 }
                 else{
                     massratio = p->m/com.m;
                 }
-                for(int j=0; j < i + back_reactions_inclusive; j++){    // stop at j=i if inclusive, at i-1 if not
-                    rebx_subtract_posvel(&sim->particles[j], &diff, massratio);
-                }
+                rebx_add_posvel(&back, &diff, massratio);
                 break;
             case REBX_COORDINATES_PARTICLE:
                 if(back_reactions_inclusive){
@@ -212,6 +263,369 @@ void rebxtools_com_ptm(struct reb_simulation* const sim, struct rebx_operator* c
                 reb_error(sim, "Coordinates not supported in REBOUNDx.\n");
         }
     }
+    if (coordinates == REBX_COORDINATES_BARYCENTRIC){
+        for(int j=0; j < N_real; j++){
+            rebx_subtract_posvel(&sim->particles[j], &back, 1.);
+        }
+    }
+    else if (coordinates == REBX_COORDINATES_JACOBI && N_real > 0){
+        rebx_subtract_posvel(&sim->particles[0], &back, 1.);
+    }
+}
+
+#define REBXTOOLS_ORBITS_MIN_PARALLEL 1024
+#define REBXTOOLS_ORBITS_TINY 1.e-308   // as in REBOUND's particle/orbit conversions
+#define REBXTOOLS_ORBITS_MIN_INC 1.e-8
+
+int rebxtools_orbits_resize(struct rebxtools_orbits* const orbits, const int N){
+    if (N > orbits->N_alloc){
+        // One block: GM, the relative state, the elements, then state0
+        double* const block = realloc(orbits->GM, (size_t)N*19*sizeof(double));
+        if (block != NULL){
+            orbits->GM = block;
+        }
+        int* const ints = realloc(orbits->index, (size_t)N*2*sizeof(int));
+        if (ints != NULL){
+            orbits->index = ints;
+        }
+        if (block == NULL || ints == NULL){
+            return 0;
+        }
+        orbits->N_alloc = N;
+    }
+    double* const block = orbits->GM;
+    const size_t n = orbits->N_alloc;
+    orbits->dx = block + n;
+    orbits->dy = block + 2*n;
+    orbits->dz = block + 3*n;
+    orbits->dvx = block + 4*n;
+    orbits->dvy = block + 5*n;
+    orbits->dvz = block + 6*n;
+    orbits->a = block + 7*n;
+    orbits->e = block + 8*n;
+    orbits->inc = block + 9*n;
+    orbits->Omega = block + 10*n;
+    orbits->omega = block + 11*n;
+    orbits->f = block + 12*n;
+    orbits->state0 = block + 13*n;
+    orbits->err = orbits->index + n;
+    orbits->N = N;
+    return 1;
+}
+
+void rebxtools_orbits_free(struct rebxtools_orbits* const orbits){
+    if (orbits != NULL){
+        free(orbits->GM);
+        free(orbits->index);
+        free(orbits);
+    }
+}
+
+// acos(num/denom), using the sign of disambiguator to pick the half plane.
+// 0 or pi if num exceeds denom by roundoff, and 0 if denom is 0.
+static inline double rebxtools_acos2(const double num, const double denom, const double disambiguator){
+    const double cosine = num/denom;
+    double val = (cosine <= -1.) ? M_PI : 0.;
+    if (cosine > -1. && cosine < 1.){
+        val = acos(cosine);
+        if (disambiguator < 0.){
+            val = -val;
+        }
+    }
+    return val;
+}
+
+// Same algorithm as reb_tools_particle_to_orbit_err, restricted to the elements
+// needed to convert back. err is 1 if GM is not positive, 2 if dx=dy=dz=0.
+void rebxtools_particles_to_orbits(struct rebxtools_orbits* const orbits){
+    const int N = orbits->N;
+    const double* restrict const GM = orbits->GM;
+    const double* restrict const dxs = orbits->dx;
+    const double* restrict const dys = orbits->dy;
+    const double* restrict const dzs = orbits->dz;
+    const double* restrict const dvxs = orbits->dvx;
+    const double* restrict const dvys = orbits->dvy;
+    const double* restrict const dvzs = orbits->dvz;
+    double* restrict const as = orbits->a;
+    double* restrict const es = orbits->e;
+    double* restrict const incs = orbits->inc;
+    double* restrict const Omegas = orbits->Omega;
+    double* restrict const omegas = orbits->omega;
+    double* restrict const fs = orbits->f;
+    int* restrict const err = orbits->err;
+#pragma omp parallel for schedule(static) if(N >= REBXTOOLS_ORBITS_MIN_PARALLEL)
+    for (int k=0; k<N; k++){
+        const double mu = GM[k];
+        const double dx = dxs[k];
+        const double dy = dys[k];
+        const double dz = dzs[k];
+        const double dvx = dvxs[k];
+        const double dvy = dvys[k];
+        const double dvz = dvzs[k];
+        const double d = sqrt(dx*dx + dy*dy + dz*dz);
+        err[k] = !(mu > REBXTOOLS_ORBITS_TINY) ? 1 : (d <= REBXTOOLS_ORBITS_TINY ? 2 : 0);
+        if (err[k]){
+            as[k] = es[k] = incs[k] = Omegas[k] = omegas[k] = fs[k] = NAN;
+            continue;
+        }
+        const double v2 = dvx*dvx + dvy*dvy + dvz*dvz;
+        const double vcirc2 = mu/d;
+        const double hx = dy*dvz - dz*dvy;
+        const double hy = dz*dvx - dx*dvz;
+        const double hz = dx*dvy - dy*dvx;
+        const double h = sqrt(hx*hx + hy*hy + hz*hz);
+        const double vdiff2 = v2 - vcirc2;
+        const double rvr = dx*dvx + dy*dvy + dz*dvz;
+        const double muinv = 1./mu;
+        const double ex = muinv*(vdiff2*dx - rvr*dvx);
+        const double ey = muinv*(vdiff2*dy - rvr*dvy);
+        const double ez = muinv*(vdiff2*dz - rvr*dvz);
+        const double e = sqrt(ex*ex + ey*ey + ez*ez);
+        const double inc = rebxtools_acos2(hz, h, 1.);
+        const double nx = -hy;          // along the ascending node, zhat cross h
+        const double ny = hx;
+        const double n = sqrt(nx*nx + ny*ny);
+        const double Omega = rebxtools_acos2(nx, n, ny);
+        double omega, f;
+        if (inc < REBXTOOLS_ORBITS_MIN_INC || inc > M_PI - REBXTOOLS_ORBITS_MIN_INC){ // nearly planar, go through the longitudes
+            const double pomega = rebxtools_acos2(ex, e, ey);
+            const double theta = rebxtools_acos2(dx, d, dy);
+            if (inc < M_PI/2.){
+                omega = pomega - Omega;
+                f = theta - pomega;
+            }
+            else{
+                omega = Omega - pomega;
+                f = pomega - theta;
+            }
+        }
+        else{
+            const double wpf = rebxtools_acos2(nx*dx + ny*dy, n*d, dz);
+            omega = rebxtools_acos2(nx*ex + ny*ey, n*e, ez);
+            f = wpf - omega;
+        }
+        as[k] = -mu/(v2 - 2.*vcirc2);
+        es[k] = e;
+        incs[k] = inc;
+        Omegas[k] = Omega;
+        omegas[k] = omega;
+        fs[k] = f;
+    }
+}
+
+// Same as reb_tools_orbit_to_particle, writing relative positions and velocities.
+// Entries with err set are left alone. Invalid elements give NaNs, as in REBOUND,
+// and set err to REBOUND's code.
+void rebxtools_orbits_to_particles(struct rebxtools_orbits* const orbits){
+    const int N = orbits->N;
+    const double* restrict const GM = orbits->GM;
+    double* restrict const dxs = orbits->dx;
+    double* restrict const dys = orbits->dy;
+    double* restrict const dzs = orbits->dz;
+    double* restrict const dvxs = orbits->dvx;
+    double* restrict const dvys = orbits->dvy;
+    double* restrict const dvzs = orbits->dvz;
+    const double* restrict const as = orbits->a;
+    const double* restrict const es = orbits->e;
+    const double* restrict const incs = orbits->inc;
+    const double* restrict const Omegas = orbits->Omega;
+    const double* restrict const omegas = orbits->omega;
+    const double* restrict const fs = orbits->f;
+    int* restrict const err = orbits->err;
+#pragma omp parallel for schedule(static) if(N >= REBXTOOLS_ORBITS_MIN_PARALLEL)
+    for (int k=0; k<N; k++){
+        if (err[k]){
+            continue;
+        }
+        const double a = as[k];
+        const double e = es[k];
+        const double cf = cos(fs[k]);
+        const double sf = sin(fs[k]);
+        const int code = (e == 1.) ? 1 : (e < 0.) ? 2 : (e > 1. && a > 0.) ? 3 : (e < 1. && a < 0.) ? 4 : (e*cf < -1.) ? 5 : 0;
+        if (code){
+            err[k] = code;
+            dxs[k] = dys[k] = dzs[k] = dvxs[k] = dvys[k] = dvzs[k] = NAN;
+            continue;
+        }
+        const double r = a*(1.-e*e)/(1. + e*cf);
+        const double v0 = sqrt(GM[k]/a/(1.-e*e));
+        const double cO = cos(Omegas[k]);
+        const double sO = sin(Omegas[k]);
+        const double co = cos(omegas[k]);
+        const double so = sin(omegas[k]);
+        const double ci = cos(incs[k]);
+        const double si = sin(incs[k]);
+
+        // Murray & Dermott Eq 2.122 and 2.36 rotated as in Sec. 2.8
+        dxs[k] = r*(cO*(co*cf-so*sf) - sO*(so*cf+co*sf)*ci);
+        dys[k] = r*(sO*(co*cf-so*sf) + cO*(so*cf+co*sf)*ci);
+        dzs[k] = r*(so*cf+co*sf)*si;
+        dvxs[k] = v0*((e+cf)*(-ci*co*sO - cO*so) - sf*(co*cO - ci*so*sO));
+        dvys[k] = v0*((e+cf)*(ci*co*cO - sO*so) - sf*(co*sO + ci*so*cO));
+        dvzs[k] = v0*((e+cf)*co*si - sf*si*so);
+    }
+}
+
+static void rebxtools_orbits_free_arrays(struct rebx_extras* const rebx, struct rebx_operator* const operator){
+    rebxtools_orbits_free(rebx_get_param(rebx, operator->ap, "orbits_workspace"));
+}
+
+static inline void rebxtools_orbits_push(struct rebxtools_orbits* const orbits, const int k, const int i, const double G, const struct reb_particle* const p, const struct reb_particle* const primary){
+    orbits->index[k] = i;
+    orbits->GM[k] = primary->m > 0. ? G*(p->m + primary->m) : 0.;
+    orbits->dx[k] = p->x - primary->x;
+    orbits->dy[k] = p->y - primary->y;
+    orbits->dz[k] = p->z - primary->z;
+    orbits->dvx[k] = p->vx - primary->vx;
+    orbits->dvy[k] = p->vy - primary->vy;
+    orbits->dvz[k] = p->vz - primary->vz;
+}
+
+// Batched counterpart of rebxtools_com_ptm for steps that act on orbital elements.
+// All relative orbits are set up first (Jacobi ones against the exact interior
+// centers of mass), converted to elements together, handed to calculate_orbits,
+// converted back, and the changes applied with the same back reactions as
+// rebxtools_com_ptm.
+void rebxtools_com_ptm_orbits(struct reb_simulation* const sim, struct rebx_operator* const operator, const enum REBX_COORDINATES coordinates, const int back_reactions_inclusive, const char* reference_name, void (*calculate_orbits) (struct reb_simulation* const sim, struct rebx_operator* const operator, struct rebxtools_orbits* const orbits, const double dt), const double dt){
+    struct rebx_extras* const rebx = sim->extras;
+    const int N_real = sim->N - sim->N_var;
+    struct reb_particle* const particles = sim->particles;
+    if (N_real < 2){
+        return;
+    }
+    struct rebxtools_orbits* orbits = rebx_get_param(rebx, operator->ap, "orbits_workspace");
+    if (orbits == NULL){
+        orbits = calloc(1, sizeof(*orbits));
+        if (orbits == NULL){
+            reb_error(sim, "REBOUNDx Error: Could not allocate memory for orbital element conversions.\n");
+            return;
+        }
+        rebx_set_param_pointer(rebx, &operator->ap, "orbits_workspace", orbits);
+        rebx_set_param_pointer(rebx, &operator->ap, "free_arrays", rebxtools_orbits_free_arrays);
+    }
+    if (!rebxtools_orbits_resize(orbits, N_real)){
+        reb_error(sim, "REBOUNDx Error: Could not allocate memory for orbital element conversions.\n");
+        return;
+    }
+
+    struct reb_particle com = {0};
+    int refindex = -1;
+    int K = 0;
+    switch(coordinates){
+        case REBX_COORDINATES_BARYCENTRIC:
+            com = reb_get_com(sim);
+            for (int i=0; i<N_real; i++){
+                rebxtools_orbits_push(orbits, K++, i, sim->G, &particles[i], &com);
+            }
+            break;
+        case REBX_COORDINATES_JACOBI:
+            com = particles[0];
+            for (int i=1; i<N_real; i++){
+                const struct reb_particle* const p = &particles[i];
+                rebxtools_orbits_push(orbits, K++, i, sim->G, p, &com);
+                const double m = com.m + p->m;
+                if (m > 0.){
+                    com.x = (com.x*com.m + p->x*p->m)/m;
+                    com.y = (com.y*com.m + p->y*p->m)/m;
+                    com.z = (com.z*com.m + p->z*p->m)/m;
+                    com.vx = (com.vx*com.m + p->vx*p->m)/m;
+                    com.vy = (com.vy*com.m + p->vy*p->m)/m;
+                    com.vz = (com.vz*com.m + p->vz*p->m)/m;
+                }
+                com.m = m;
+            }
+            break;
+        case REBX_COORDINATES_PARTICLE:
+            for (int i=0; i<N_real; i++){
+                if (rebx_get_param(rebx, particles[i].ap, reference_name)){
+                    refindex = i;
+                    break;
+                }
+            }
+            if (refindex < 0){
+                char str[200];
+                sprintf(str, "Coordinates set to REBX_COORDINATES_PARTICLE, but %s param was not found in any particle.  Need to set parameter.\n", reference_name);
+                reb_error(sim, str);
+                return;
+            }
+            com = particles[refindex];
+            for (int i=0; i<N_real; i++){
+                if (i != refindex){
+                    rebxtools_orbits_push(orbits, K++, i, sim->G, &particles[i], &com);
+                }
+            }
+            break;
+        default:
+            reb_error(sim, "Coordinates not supported in REBOUNDx.\n");
+            return;
+    }
+    orbits->N = K;
+
+    const size_t n = orbits->N_alloc;
+    double* const state[6] = {orbits->dx, orbits->dy, orbits->dz, orbits->dvx, orbits->dvy, orbits->dvz};
+    for (int j=0; j<6; j++){
+        memcpy(orbits->state0 + j*n, state[j], K*sizeof(double));
+    }
+    rebxtools_particles_to_orbits(orbits);
+    calculate_orbits(sim, operator, orbits, dt);
+    rebxtools_orbits_to_particles(orbits);
+
+    // Entries left alone have zero diff. Jacobi interior masses are peeled off
+    // from the outside in, like the back reactions.
+    double m_interior = 0.;
+    for (int i=0; i<N_real; i++){
+        m_interior += particles[i].m;
+    }
+    struct reb_particle back = {0};
+    for (int k=K-1; k>=0; k--){
+        struct reb_particle* const p = &particles[orbits->index[k]];
+        struct reb_particle diff = {0};
+        diff.x = orbits->dx[k] - orbits->state0[k];
+        diff.y = orbits->dy[k] - orbits->state0[n+k];
+        diff.z = orbits->dz[k] - orbits->state0[2*n+k];
+        diff.vx = orbits->dvx[k] - orbits->state0[3*n+k];
+        diff.vy = orbits->dvy[k] - orbits->state0[4*n+k];
+        diff.vz = orbits->dvz[k] - orbits->state0[5*n+k];
+        double massratio;
+        switch(coordinates){
+            case REBX_COORDINATES_BARYCENTRIC:
+                rebx_add_posvel(p, &diff, 1.);
+                rebx_add_posvel(&back, &diff, p->m/com.m);
+                break;
+            case REBX_COORDINATES_JACOBI:
+                m_interior -= p->m;
+                rebx_subtract_posvel(p, &back, 1.);
+                if(back_reactions_inclusive){
+                    massratio = p->m/(m_interior + p->m);
+                    rebx_add_posvel(p, &diff, 1. - massratio);
+                }
+                else{
+                    massratio = p->m/m_interior;
+                    rebx_add_posvel(p, &diff, 1.);
+                }
+                rebx_add_posvel(&back, &diff, massratio);
+                break;
+            default:    // REBX_COORDINATES_PARTICLE
+                if(back_reactions_inclusive){
+                    massratio = p->m/(com.m + p->m);
+                    rebx_add_posvel(p, &diff, 1. - massratio);
+                }
+                else{
+                    massratio = p->m/com.m;
+                    rebx_add_posvel(p, &diff, 1.);
+                }
+                rebx_subtract_posvel(&particles[refindex], &diff, massratio);
+                break;
+        }
+    }
+    if (coordinates == REBX_COORDINATES_BARYCENTRIC){
+        for(int j=0; j < N_real; j++){
+            rebx_subtract_posvel(&particles[j], &back, 1.);
+        }
+    }
+    else if (coordinates == REBX_COORDINATES_JACOBI){
+        rebx_subtract_posvel(&particles[0], &back, 1.);
+    }
 }
 
 /*static const struct reb_orbit reb_orbit_nan = {.d = NAN, .v = NAN, .h = NAN, .P = NAN, .n = NAN, .a = NAN, .e = NAN, .inc = NAN, .Omega = NAN, .omega = NAN, .pomega = NAN, .f = NAN, .M = NAN, .l = NAN};
@@ -36,11 +36,160 @@ enum REBX_COORDINATES;
 
 void rebx_com_force(struct reb_simulation* const sim, struct rebx_force* const force, const enum REBX_COORDINATES coordinates, const int back_reactions_inclusive, const char* reference_name, struct reb_vec3d (*calculate_force) (struct reb_simulation* const sim, struct rebx_force* const force, struct reb_particle* p, struct reb_particle* source), struct reb_particle* const particles, const int N);
 
+int rebx_com_reference(struct reb_simulation* const sim, const char* reference_name, struct reb_particle* const particles, const int N); // First particle with reference_name set, or -1 after an error
+
+/* REBX_COM_FORCE_KERNELS(name, calculate) defines
+ *
+ *     static void name(struct reb_simulation* const sim, struct rebx_force* const force, const enum REBX_COORDINATES coordinates, const int back_reactions_inclusive, const char* reference_name, const void* const ctx, struct reb_particle* const particles, const int N)
+ *
+ * which does the same as rebx_com_force, for a force calculated by
+ *
+ *     static inline struct reb_vec3d calculate(struct reb_simulation* const sim, struct rebx_force* const force, const void* const ctx, const int i, struct reb_particle* const p, const struct reb_particle* const source)
+ *
+ * There is a separate loop for each coordinate system and back reaction
+ * case, and calculate is called directly, so it can be inlined into the
+ * loop rather than called through a pointer for every particle. ctx is
+ * passed through for anything looked up once per call (e.g. param ids and
+ * columns), and i is the index of p in particles. The arithmetic is the
+ * same as in rebx_com_force. Needs rebound.h and reboundx.h.
+ */
+#define REBX_COM_FORCE_LOOP(calculate, coordinates, inclusive) {\
+    struct reb_vec3d back = {0};\
+    for(int i=N-1; i>=0; i--){\
+        if (i==refindex){\
+            continue;\
+        }\
+        struct reb_particle* const p = &particles[i];\
+        if (coordinates == REBX_COORDINATES_JACOBI){\
+            com = reb_get_com_without_particle(com, *p);\
+        }\
+        const struct reb_vec3d a = calculate(sim, force, ctx, i, p, &com);\
+        p->ax += a.x;\
+        p->ay += a.y;\
+        p->az += a.z;\
+        const double massratio = (inclusive && coordinates != REBX_COORDINATES_BARYCENTRIC) ? p->m/(com.m + p->m) : p->m/com.m;\
+        if (coordinates == REBX_COORDINATES_PARTICLE){\
+            if (inclusive){\
+                p->ax -= massratio*a.x;\
+                p->ay -= massratio*a.y;\
+                p->az -= massratio*a.z;\
+            }\
+            particles[refindex].ax -= massratio*a.x;\
+            particles[refindex].ay -= massratio*a.y;\
+            particles[refindex].az -= massratio*a.z;\
+            continue;\
+        }\
+        if (coordinates == REBX_COORDINATES_JACOBI && inclusive){\
+            back.x += massratio*a.x;\
+            back.y += massratio*a.y;\
+            back.z += massratio*a.z;\
+        }\
+        if (coordinates == REBX_COORDINATES_JACOBI){\
+            p->ax -= back.x;\
+            p->ay -= back.y;\
+            p->az -= back.z;\
+        }\
+        if (coordinates == REBX_COORDINATES_BARYCENTRIC || !inclusive){\
+            back.x += massratio*a.x;\
+            back.y += massratio*a.y;\
+            back.z += massratio*a.z;\
+        }\
+    }\
+    if (coordinates == REBX_COORDINATES_BARYCENTRIC){\
+        for(int j=0; j < N; j++){\
+            particles[j].ax -= back.x;\
+            particles[j].ay -= back.y;\
+            particles[j].az -= back.z;\
+        }\
+    }\
+    else if (coordinates == REBX_COORDINATES_JACOBI && N > 0){\
+        particles[0].ax -= back.x;\
+        particles[0].ay -= back.y;\
+        particles[0].az -= back.z;\
+    }\
+}
+
+#define REBX_COM_FORCE_KERNEL(name, calculate, coordinates, inclusive)\
+static void name(struct reb_simulation* const sim, struct rebx_force* const force, const void* const ctx, struct reb_particle* const particles, const int N, struct reb_particle com, const int refindex)\
+REBX_COM_FORCE_LOOP(calculate, coordinates, inclusive)
+
+#define REBX_COM_FORCE_KERNELS(name, calculate)\
+REBX_COM_FORCE_KERNEL(name##_barycentric, calculate, REBX_COORDINATES_BARYCENTRIC, 0)\
+REBX_COM_FORCE_KERNEL(name##_jacobi_inclusive, calculate, REBX_COORDINATES_JACOBI, 1)\
+REBX_COM_FORCE_KERNEL(name##_jacobi_exclusive, calculate, REBX_COORDINATES_JACOBI, 0)\
+REBX_COM_FORCE_KERNEL(name##_particle_inclusive, calculate, REBX_COORDINATES_PARTICLE, 1)\
+REBX_COM_FORCE_KERNEL(name##_particle_exclusive, calculate, REBX_COORDINATES_PARTICLE, 0)\
+static void name(struct reb_simulation* const sim, struct rebx_force* const force, const enum REBX_COORDINATES coordinates, const int back_reactions_inclusive, const char* reference_name, const void* const ctx, struct reb_particle* const particles, const int N){\
+    const struct reb_particle com = reb_get_com(sim); /* full com for jacobi and barycentric coordinates */\
+    switch(coordinates){\
+        case REBX_COORDINATES_BARYCENTRIC:\
+            name##_barycentric(sim, force, ctx, particles, N, com, -1);\
+            break;\
+        case REBX_COORDINATES_JACOBI: /* no jacobi coordinate for the 0th particle, so it is skipped */\
+            if (back_reactions_inclusive){\
+                name##_jacobi_inclusive(sim, force, ctx, particles, N, com, 0);\
+            }\
+            else{\
+                name##_jacobi_exclusive(sim, force, ctx, particles, N, com, 0);\
+            }\
+            break;\
+        case REBX_COORDINATES_PARTICLE:\
+        {\
+            const int refindex = rebx_com_reference(sim, reference_name, particles, N);\
+            if (refindex < 0){\
+                return;\
+            }\
+            if (back_reactions_inclusive){\
+                name##_particle_inclusive(sim, force, ctx, particles, N, particles[refindex], refindex);\
+            }\
+            else{\
+                name##_particle_exclusive(sim, force, ctx, particles, N, particles[refindex], refindex);\
+            }\
+            break;\
+        }\
+        default:\
+            reb_error(sim, "Coordinates not supported in REBOUNDx.\n");\
+    }\
+}
+
 void rebxtools_com_ptm(struct reb_simulation* const sim, struct rebx_operator* const operator, const enum REBX_COORDINATES coordinates, const int back_reactions_inclusive, const char* reference_name, struct reb_particle (*calculate_step) (struct reb_simulation* const sim, struct rebx_operator* const operator, struct reb_particle* p, struct reb_particle* source, const double dt), const double dt);
 
 double rebx_Edot(struct reb_particle* const ps, const int N);
 
 void rebx_calculate_jacobi_masses(const struct reb_particle* const ps, double* const m_j, const int N);
+
+// Batch of two-body orbits stored as arrays, so conversions run down contiguous columns.
+// dx..dvz are positions and velocities relative to each primary and GM is G times the sum of the two masses.
+struct rebxtools_orbits{
+    int N;
+    int N_alloc;
+    int* index;             // particle each entry belongs to
+    int* err;               // set by rebxtools_particles_to_orbits; nonzero entries are skipped by rebxtools_orbits_to_particles
+    double* GM;
+    double* dx;
+    double* dy;
+    double* dz;
+    double* dvx;
+    double* dvy;
+    double* dvz;
+    double* a;
+    double* e;
+    double* inc;
+    double* Omega;
+    double* omega;
+    double* f;
+    double* state0;         // 6N relative state before conversion, kept by rebxtools_com_ptm_orbits
+};
+
+int rebxtools_orbits_resize(struct rebxtools_orbits* const orbits, const int N);
+
+void rebxtools_orbits_free(struct rebxtools_orbits* const orbits);
+
+void rebxtools_particles_to_orbits(struct rebxtools_orbits* const orbits);
+
+void rebxtools_orbits_to_particles(struct rebxtools_orbits* const orbits);
+
+void rebxtools_com_ptm_orbits(struct reb_simulation* const sim, struct rebx_operator* const operator, const enum REBX_COORDINATES coordinates, const int back_reactions_inclusive, const char* reference_name, void (*calculate_orbits) (struct reb_simulation* const sim, struct rebx_operator* const operator, struct rebxtools_orbits* const orbits, const double dt), const double dt);
 /*
 struct reb_orbit rebxtools_particle_to_orbit_err(double G, struct reb_particle* p, struct reb_particle* primary, int* err);
 
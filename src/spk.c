@@ -5,6 +5,7 @@
 // https://naif.jpl.nasa.gov/pub/naif/toolkit_docs/C/req/spk.html
 // https://naif.jpl.nasa.gov/pub/naif/toolkit_docs/C/req/naif_ids.html
 
+#define _DEFAULT_SOURCE     // madvise under -std=c99
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
@@ -16,6 +17,7 @@
 #include <string.h>
 #include <unistd.h>
 #include <time.h>
+#include <stdint.h>
 #include "spk.h"
 
 
@@ -55,7 +57,14 @@ int spk_free(struct spk_s *pl)
 
 
 /*
- *  spk_init
+ *  spk_init, spk_init_index
+ *
+ *  Map the kernel and index its segments, walking the summary records from
+ *  FWARD in the mapped file.  The index arrays are sized to the number of
+ *  segments of each target.  spk_init_index can also keep the index in a
+ *  sidecar file 'idx', which is read instead if it matches the kernel size
+ *  and modification time, and (re)written otherwise.  A sidecar which
+ *  cannot be written is not an error.
  *
  */
 
@@ -63,15 +72,6 @@ int spk_free(struct spk_s *pl)
 static double inline _jul(double eph)
 	{ return 2451545.0 + eph / 86400.0; }
 
-// check for any non-7bit ascii characters
-static int _com(const char *buf)
-{
-	for (int n = 0; n < 1024; n++)
-		{ if (buf[n] < 0) return 0; }
-
-	return 1;
-}
-
 // display output strings to console
 static void _sho(const char *buf)
 {
@@ -82,41 +82,211 @@ static void _sho(const char *buf)
 		n += fprintf(stdout, "%s\n", &buf[n]) - 1;
 }
 
+#define _SPK_IDX	"SPKIDX01"		// sidecar magic
+
+struct idx_s {
+	char mag[8];		// _SPK_IDX
+	int64_t len;		// kernel size
+	int64_t mod;		// ... and modification time
+	int32_t num;		// number of targets
+	int32_t ind[_SPK_MAX];	// segments of each, then tar, cen, beg, res
+	int32_t tar[_SPK_MAX];
+	int32_t cen[_SPK_MAX];
+	double beg[_SPK_MAX];
+	double res[_SPK_MAX];
+};
+
+// walk the summaries, counting (one == NULL) or filling the index, returns
+// 0 or -1 if the file is malformed
+static int _sum(struct spk_s *pl, int **one, int **two)
+{
+	const struct sum_s *sum;
+	const double *val;
+	int m, n, b, B, c;
+	size_t nrec;
+
+	nrec = pl->len / 1024;
+	memcpy(&n, (char *)pl->map + 76, sizeof(int));
+
+	if (one != NULL)
+		memset(pl->ind, 0, sizeof(pl->ind));
+
+	while (n > 0) {
+		if ((size_t)n > nrec)
+			return -1;
+
+		val = (const double *)((char *)pl->map + (size_t)(n - 1) * 1024);
+		B = (int)val[2];
+
+		if (B < 0 || 24 + B * sizeof(struct sum_s) > 1024)
+			return -1;
+
+		for (b = 0; b < B; b++) {
+			sum = (const struct sum_s *)((const char *)val + 24 + b * sizeof(struct sum_s));
+
+			// targets are numbered in order of appearance
+			for (m = 0; m < pl->num; m++)
+				if (pl->tar[m] == sum->tar) break;
+
+			if (m == pl->num) {
+				if (one != NULL || m == _SPK_MAX)
+					return -1;
+				pl->num++;
+				pl->tar[m] = sum->tar;
+				pl->cen[m] = sum->cen;
+				pl->beg[m] = _jul(sum->beg);
+				pl->res[m] = _jul(sum->end) - pl->beg[m];
+			}
+
+			c = pl->ind[m]++;
+
+			if (one != NULL) {
+				one[m][c] = sum->one;
+				two[m][c] = sum->two;
+			}
+		}
+
+		n = (int)val[0];
+	}
+
+	return 0;
+}
+
+// read the sidecar, 0 if it was good
+static int _idx_get(struct spk_s *pl, const char *idx, const struct stat *sb)
+{
+	struct idx_s hdr;
+	FILE *fp;
+	int m;
+
+	if ((fp = fopen(idx, "rb")) == NULL)
+		return -1;
+
+	if (fread(&hdr, sizeof(hdr), 1, fp) != 1
+	 || memcmp(hdr.mag, _SPK_IDX, 8) != 0
+	 || hdr.len != (int64_t)sb->st_size
+	 || hdr.mod != (int64_t)sb->st_mtime
+	 || hdr.num < 0 || hdr.num > _SPK_MAX)
+		goto err;
+
+	pl->num = hdr.num;
+
+	for (m = 0; m < pl->num; m++) {
+		pl->tar[m] = hdr.tar[m];
+		pl->cen[m] = hdr.cen[m];
+		pl->beg[m] = hdr.beg[m];
+		pl->res[m] = hdr.res[m];
+		pl->ind[m] = hdr.ind[m];
+		pl->one[m] = malloc(pl->ind[m] * sizeof(int));
+		pl->two[m] = malloc(pl->ind[m] * sizeof(int));
+
+		if (pl->one[m] == NULL || pl->two[m] == NULL
+		 || fread(pl->one[m], sizeof(int), pl->ind[m], fp) != (size_t)pl->ind[m]
+		 || fread(pl->two[m], sizeof(int), pl->ind[m], fp) != (size_t)pl->ind[m])
+			goto err;
+	}
+
+	fclose(fp);
+	return 0;
+
+err:	for (m = 0; m < pl->num; m++) {
+		free(pl->one[m]);
+		free(pl->two[m]);
+		pl->one[m] = pl->two[m] = NULL;
+	}
+	pl->num = 0;
+	memset(pl->ind, 0, sizeof(pl->ind));
+	fclose(fp);
+	return -1;
+}
+
+// write the sidecar, via a temporary so that readers never see half of it
+static void _idx_put(struct spk_s *pl, const char *idx, const struct stat *sb)
+{
+	struct idx_s hdr;
+	char *tmp;
+	FILE *fp;
+	int m, ok;
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.mag, _SPK_IDX, 8);
+	hdr.len = sb->st_size;
+	hdr.mod = sb->st_mtime;
+	hdr.num = pl->num;
+
+	for (m = 0; m < pl->num; m++) {
+		hdr.tar[m] = pl->tar[m];
+		hdr.cen[m] = pl->cen[m];
+		hdr.beg[m] = pl->beg[m];
+		hdr.res[m] = pl->res[m];
+		hdr.ind[m] = pl->ind[m];
+	}
+
+	if ((tmp = malloc(strlen(idx) + 16)) == NULL)
+		return;
+
+	sprintf(tmp, "%s.%d", idx, (int)getpid());
+
+	if ((fp = fopen(tmp, "wb")) == NULL)
+		{ free(tmp); return; }
+
+	ok = fwrite(&hdr, sizeof(hdr), 1, fp) == 1;
+
+	for (m = 0; m < pl->num && ok; m++) {
+		ok &= fwrite(pl->one[m], sizeof(int), pl->ind[m], fp) == (size_t)pl->ind[m];
+		ok &= fwrite(pl->two[m], sizeof(int), pl->ind[m], fp) == (size_t)pl->ind[m];
+	}
+
+	ok &= fclose(fp) == 0;
+
+	if (!ok || rename(tmp, idx) < 0)
+		unlink(tmp);
+
+	free(tmp);
+}
+
 struct spk_s * spk_init(const char *path)
+	{ return spk_init_index(path, NULL); }
+
+struct spk_s * spk_init_index(const char *path, const char *idx)
 {
 	struct spk_s *pl;
 	struct stat sb;
-	char buf[1024];
-	struct sum_s *sum;
-	double *val;
 	int fd, nd, ni, nc;
-	int m, n, c, b, B;
-	off_t off;
-	int num;
+	int m;
 
 	if ((fd = open(path, O_RDONLY)) < 0)
 		return NULL;
 
 	pl = malloc(sizeof(struct spk_s));
 	memset(pl, 0, sizeof(struct spk_s));
-	val = (double *)buf;
-	sum = (struct sum_s *)buf;
 
 	if (fstat(fd, &sb) < 0)
 		goto err;
 
-	// LOCIDW
-	if (read(fd, buf, 8) != 8)
+	if (sb.st_size < 1024) {
+		errno = EILSEQ;
 		goto err;
+	}
 
-	if (strncmp(buf, "DAF/SPK", 7) != 0) {
+	// memory map : kernel caching and thread safe
+	pl->len = sb.st_size;
+	pl->map = mmap(NULL, pl->len, PROT_READ, MAP_SHARED, fd, 0);
+
+	if (pl->map == MAP_FAILED) {
+		pl->map = NULL;
+		goto err;
+	}
+
+	// LOCIDW
+	if (strncmp(pl->map, "DAF/SPK", 7) != 0) {
 		errno = EILSEQ;
 		goto err;
 	}
 
 	// ND, NI
-	read(fd, &nd, sizeof(int));
-	read(fd, &ni, sizeof(int));
+	memcpy(&nd, (char *)pl->map + 8, sizeof(int));
+	memcpy(&ni, (char *)pl->map + 12, sizeof(int));
 
 	// length of each segment, must match our sum_s struct
 	nc = 8 * ( nd + (ni + 1) / 2 );
@@ -126,66 +296,30 @@ struct spk_s * spk_init(const char *path)
 		goto err;
 	}
 
-	// could check the other headers, but we really don't care
-	// so find the first summary record (after potential comments)
-	off = lseek(fd, 1024, SEEK_SET);
-	read(fd, buf, 1024);
+	if (idx == NULL || _idx_get(pl, idx, &sb) < 0) {
+		// count first, so the index can be allocated to size
+		if (_sum(pl, NULL, NULL) < 0) {
+			errno = EILSEQ;
+			goto err;
+		}
 
-	while (_com(buf) > 0) {
-	//	_sho(buf);
-		off = lseek(fd, 0, SEEK_CUR);
-		read(fd, buf, 1024);
-	}
+		for (m = 0; m < pl->num; m++) {
+			pl->one[m] = malloc(pl->ind[m] * sizeof(int));
+			pl->two[m] = malloc(pl->ind[m] * sizeof(int));
 
-	// we are at the first summary block, validate
-	if (val[1] != 0.0) {
-		errno = EILSEQ;
-		goto err;
-	}
-
-	// okay, let's go
-	m = 0;
-next:	n = (int)val[0] - 1;
-	B = (int)val[2];
-
-	for (b = 0; b < B; b++) {
-		sum = (struct sum_s *)&buf[24 + b * sizeof(struct sum_s)];
-
-//		fprintf(stdout, "beg %.1f end %.1f tar %d cen %d ref %d ver %d one %d two %d\n",
-//				_jul(sum->beg), _jul(sum->end), sum->tar, sum->cen,
-//				sum->ref, sum->ver, sum->one, sum->two);
-
-		// pick out new target!
-		if (sum->tar != pl->tar[m]) {
-			m = pl->num++;
-			pl->tar[m] = sum->tar;
-			pl->cen[m] = sum->cen;
-			pl->beg[m] = _jul(sum->beg);
-			pl->res[m] = _jul(sum->end) - pl->beg[m];
-			pl->one[m] = calloc(32768, sizeof(int));
-			pl->two[m] = calloc(32768, sizeof(int));
+			if (pl->one[m] == NULL || pl->two[m] == NULL)
+				goto err;
 		}
 
-		// add index
-		c = pl->ind[m]++;
-		pl->one[m][c] = sum->one;
-		pl->two[m][c] = sum->two;
-	}
+		if (_sum(pl, pl->one, pl->two) < 0) {
+			errno = EILSEQ;
+			goto err;
+		}
 
-	if (n >= 0) {
-		// this could probably be more elegant if the mmap happened sooner
-		off = lseek(fd, n * 1024, SEEK_SET);
-		read(fd, buf, 1024);
-		goto next;
+		if (idx != NULL)
+			_idx_put(pl, idx, &sb);
 	}
 
-	// memory map : kernel caching and thread safe
-	pl->len = sb.st_size;
-	pl->map = mmap(NULL, pl->len, PROT_READ, MAP_SHARED, fd, 0);
-
-	if (pl->map == NULL)
-		goto err;
-
 	if (close(fd) < 0)
 		{ ; }
 	if (madvise(pl->map, pl->len, MADV_RANDOM) < 0)
@@ -194,6 +328,13 @@ next:	n = (int)val[0] - 1;
 	return pl;
 
 err:	perror(path);
+	close(fd);
+	for (m = 0; m < pl->num; m++) {
+		free(pl->one[m]);
+		free(pl->two[m]);
+	}
+	if (pl->map != NULL)
+		munmap(pl->map, pl->len);
 	free(pl);
 	return NULL;
 }
@@ -288,3 +429,456 @@ int spk_calc(struct spk_s *pl, int m, double jde, struct mpos_s *pos)
 	return 0;
 }
 
+
+
+/*
+ *  spk_advise, spk_lock
+ *
+ *  Pass an madvise() hint, or (un)lock in memory, the records of every
+ *  target which cover the epochs from jd0 to jd1 (in either order).
+ *
+ */
+
+// byte offset of the record covering jde in segment n of target m,
+// plus the length of the record
+static size_t _off(struct spk_s *pl, int m, int n, double jde, size_t *len)
+{
+	double *val;
+	int b, R;
+
+	val = pl->map + sizeof(double) * (pl->two[m][n] - 1);
+	R = (int)val[-1];
+	b = (int)((jde - _jul(val[-3])) / (val[-2] / 86400.0));
+
+	if (b < 0)
+		b = 0;
+
+	*len = sizeof(double) * R;
+	return sizeof(double) * (pl->one[m][n] - 1) + sizeof(double) * b * R;
+}
+
+static int _map(struct spk_s *pl, double jd0, double jd1, int advice, int lock)
+{
+	size_t pg, off, end, len;
+	int m, n, n0, n1, ret;
+	double t;
+
+	if (pl == NULL || pl->map == NULL)
+		return -1;
+
+	if (jd0 > jd1)
+		{ t = jd0; jd0 = jd1; jd1 = t; }
+
+	pg = (size_t)sysconf(_SC_PAGESIZE);
+	ret = 0;
+
+	for (m = 0; m < pl->num; m++) {
+		n0 = (int)((jd0 - pl->beg[m]) / pl->res[m]);
+		n1 = (int)((jd1 - pl->beg[m]) / pl->res[m]);
+
+		// clamp to the segments we have
+		if (n0 < 0) n0 = 0;
+		if (n1 >= pl->ind[m]) n1 = pl->ind[m] - 1;
+
+		for (n = n0; n <= n1; n++) {
+			off = (n == n0) ? _off(pl, m, n, jd0, &len) : sizeof(double) * (pl->one[m][n] - 1);
+			end = (n == n1) ? _off(pl, m, n, jd1, &len) + len : sizeof(double) * pl->two[m][n];
+
+			if (end > pl->len)
+				end = pl->len;
+			off -= off % pg;
+
+			if (end <= off)
+				continue;
+
+			if (lock > 0)
+				ret |= mlock(pl->map + off, end - off);
+			else if (lock < 0)
+				ret |= munlock(pl->map + off, end - off);
+			else
+				ret |= madvise(pl->map + off, end - off, advice);
+		}
+	}
+
+	return (ret != 0) ? -1 : 0;
+}
+
+int spk_advise(struct spk_s *pl, double jd0, double jd1, int advice)
+	{ return _map(pl, jd0, jd1, advice, 0); }
+
+int spk_lock(struct spk_s *pl, double jd0, double jd1, int on)
+	{ return _map(pl, jd0, jd1, 0, (on) ? 1 : -1); }
+
+
+/*
+ *  spk_span
+ *
+ *  Find the epochs covered by all of the first 'num' targets.  The segments
+ *  of a target are consecutive and of equal length, starting at beg.
+ *
+ */
+int spk_span(struct spk_s *pl, int num, double *jd0, double *jd1)
+{
+	int m;
+
+	if (pl == NULL || num < 0 || num > pl->num)
+		return -1;
+
+	*jd0 = -INFINITY;
+	*jd1 = INFINITY;
+
+	for (m = 0; m < num; m++) {
+		if (pl->beg[m] > *jd0)
+			*jd0 = pl->beg[m];
+		if (pl->beg[m] + pl->ind[m] * pl->res[m] < *jd1)
+			*jd1 = pl->beg[m] + pl->ind[m] * pl->res[m];
+	}
+
+	return 0;
+}
+
+
+/*
+ *  spk_calc_all
+ *
+ *  Compute the position and velocity of the first 'num' targets.  The record
+ *  used for each target is remembered in 'cur', so it only has to be found
+ *  again once jde leaves its span, and the Chebyshev polynomials are only set
+ *  up again when a target uses a different record layout from the previous
+ *  one.  A zeroed spk_cur_s is a valid starting point.
+ *
+ */
+
+// locate the record covering jde for target m, returns NULL if none
+static double * _rec(struct spk_s *pl, struct spk_cur_s *cur, int m, double jde)
+{
+	double *val;
+	int n, b, R;
+
+	n = (int)((jde - pl->beg[m]) / pl->res[m]);
+
+	if (n < 0 || n >= pl->ind[m])
+		return NULL;
+
+	// find location of 'directory' describing the data records
+	val = pl->map + sizeof(double) * (pl->two[m][n] - 1);
+
+	// record size and number of coefficients per coordinate
+	R = (int)val[-1];
+	cur->ncf[m] = (R - 2) / 3; // must be < 32 !!
+
+	// pick out the precise record
+	b = (int)((jde - _jul(val[-3])) / (val[-2] / 86400.0));
+	val = pl->map + sizeof(double) * (pl->one[m][n] - 1)
+			+ sizeof(double) * b * R;
+
+	// span covered by this record
+	cur->lo[m] = _jul(val[0] - val[1]);
+	cur->hi[m] = _jul(val[0] + val[1]);
+
+	return val;
+}
+
+int spk_calc_all(struct spk_s *pl, struct spk_cur_s *cur, int num, double jde, struct mpos_s *pos)
+{
+	double T[32], S[32];
+	double *val, t, mid, rad;
+	int m, n, b, p, P;
+
+	if (pl == NULL || cur == NULL || pos == NULL)
+		return -1;
+	if (num < 0 || num > pl->num)
+		return -1;
+
+	mid = rad = 0.0;
+	t = 0.0;
+	P = 0;
+
+	for (m = 0; m < num; m++) {
+		pos[m].jde = jde;
+
+		// only look the record up again if we left it
+		if (cur->rec[m] == NULL || jde < cur->lo[m] || jde >= cur->hi[m]) {
+			if ((cur->rec[m] = _rec(pl, cur, m, jde)) == NULL)
+				return -1;
+		}
+
+		val = cur->rec[m];
+
+		// set up Chebyshev polynomials, unless they are already good
+		if (m == 0 || val[0] != mid || val[1] != rad || cur->ncf[m] > P) {
+			mid = val[0];
+			rad = val[1];
+			P = cur->ncf[m];
+
+			// scale to interpolation units
+			t = (jde - _jul(mid)) / (rad / 86400.0);
+
+			T[0] = 1.0; S[0] = 0.0;
+			T[1] = t;   S[1] = 1.0;
+
+			for (p = 2; p < P; p++) {
+				T[p] = 2.0 * t * T[p-1] - T[p-2];
+				S[p] = 2.0 * t * S[p-1] + 2.0 * T[p-1] - S[p-2];
+			}
+		}
+
+		for (n = 0; n < 3; n++) {
+			double u = 0.0, v = 0.0;
+			b = 2 + n * cur->ncf[m];
+
+			// sum interpolation stuff
+			for (p = 0; p < cur->ncf[m]; p++) {
+				u += val[b + p] * T[p];
+				v += val[b + p] * S[p];
+			}
+
+			// restore units to [AU] and [AU/day]
+			pos[m].u[n] = u / 149597870.7;
+			pos[m].v[n] = v / (149597870.7 / 86400.0) / rad;
+			pos[m].w[n] = 0.0;
+		}
+	}
+
+	return 0;
+}
+
+
+/*
+ *  spk_extract
+ *
+ *  Write a new kernel holding only the first 'num' targets of 'src' (all of
+ *  them if num < 0), cut down to the segments which overlap jd0 to jd1.  A
+ *  target with a single such segment has it trimmed to the records covering
+ *  the window, otherwise whole segments are kept so that they stay evenly
+ *  spaced.  Targets keep their order, and the result is an ordinary DAF/SPK
+ *  file that spk_init can read.
+ *
+ */
+
+#define _SPK_REC	1024			// DAF record length
+#define _SPK_SUM	((_SPK_REC - 24) / 40)	// summaries per record
+
+struct ext_s {
+	struct sum_s sum;	// summary as it will be written
+	const struct sum_s *old;	// ... and as it is in the source
+	const char *nam;	// segment name in the source
+	int b0, b1;		// records kept, or -1 for the whole segment
+};
+
+// convert julian day number to SPK epoch
+static double inline _eph(double jde)
+	{ return (jde - 2451545.0) * 86400.0; }
+
+int spk_extract(const char *src, const char *dst, int num, double jd0, double jd1)
+{
+	struct ext_s *ext;
+	const struct sum_s *sum;
+	const double *val;
+	struct stat sb;
+	char *map, *buf;
+	FILE *fp;
+	int tar[_SPK_MAX], cnt[_SPK_MAX];
+	int fd, nd, ni, n, b, m, k, K, ntar, ret;
+	int nsr, addr, rec;
+	double s0, s1, t;
+
+	if (src == NULL || dst == NULL)
+		return -1;
+
+	if (jd0 > jd1)
+		{ t = jd0; jd0 = jd1; jd1 = t; }
+
+	s0 = _eph(jd0);
+	s1 = _eph(jd1);
+
+	if ((fd = open(src, O_RDONLY)) < 0)
+		return -1;
+
+	if (fstat(fd, &sb) < 0)
+		{ close(fd); return -1; }
+
+	map = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+
+	if (map == MAP_FAILED)
+		return -1;
+
+	ext = NULL;
+	buf = NULL;
+	fp = NULL;
+	ret = -1;
+
+	if (sb.st_size < _SPK_REC || strncmp(map, "DAF/SPK", 7) != 0)
+		{ errno = EILSEQ; goto err; }
+
+	memcpy(&nd, map + 8, sizeof(int));
+	memcpy(&ni, map + 12, sizeof(int));
+
+	if (8 * ( nd + (ni + 1) / 2 ) != sizeof(struct sum_s))
+		{ errno = EILSEQ; goto err; }
+
+	// walk the summary records from FWARD, keeping what we want
+	memcpy(&n, map + 76, sizeof(int));
+	ntar = K = k = 0;
+
+	while (n > 0) {
+		if ((off_t)n * _SPK_REC > sb.st_size)
+			{ errno = EILSEQ; goto err; }
+
+		val = (const double *)(map + (n - 1) * _SPK_REC);
+
+		for (b = 0; b < (int)val[2]; b++) {
+			sum = (const struct sum_s *)(map + (n - 1) * _SPK_REC + 24 + b * sizeof(struct sum_s));
+
+			for (m = 0; m < ntar; m++)
+				if (tar[m] == sum->tar) break;
+
+			if (m == ntar) {
+				if (num >= 0 && ntar >= num)
+					continue;
+				if (ntar == _SPK_MAX)
+					{ errno = E2BIG; goto err; }
+				tar[ntar] = sum->tar;
+				cnt[ntar++] = 0;
+			}
+
+			if (sum->end < s0 || sum->beg > s1)
+				continue;
+
+			if (sum->ver != 2)
+				{ errno = EILSEQ; goto err; }
+
+			if (k == K) {
+				struct ext_s *tmp;
+				K = (K > 0) ? 2 * K : 256;
+				if ((tmp = realloc(ext, K * sizeof(struct ext_s))) == NULL)
+					goto err;
+				ext = tmp;
+			}
+
+			ext[k].sum = *sum;
+			ext[k].old = sum;
+			ext[k].nam = map + n * _SPK_REC + b * sizeof(struct sum_s);
+			ext[k].b0 = ext[k].b1 = -1;
+			cnt[m]++;
+			k++;
+		}
+
+		n = (int)val[0];
+	}
+
+	// every target we keep must still be covered, or the order would shift
+	for (m = 0; m < ntar; m++)
+		if (cnt[m] == 0)
+			{ errno = ERANGE; goto err; }
+
+	// summary and name records come first, then the data
+	nsr = (k + _SPK_SUM - 1) / _SPK_SUM;
+	addr = (1 + 2 * nsr) * (_SPK_REC / 8) + 1;
+
+	for (n = 0; n < k; n++) {
+		struct sum_s *s = &ext[n].sum;
+		const double *dir = (const double *)map + s->two - 4;
+		double init = dir[0], len = dir[1];
+		int R = (int)dir[2], N = (int)dir[3];
+
+		for (m = 0; m < ntar; m++)
+			if (tar[m] == s->tar) break;
+
+		// trim a lone segment to the records covering the window
+		if (cnt[m] == 1) {
+			b = (int)floor((s0 - init) / len);
+			ext[n].b0 = (b < 0) ? 0 : (b >= N) ? N - 1 : b;
+			b = (int)floor((s1 - init) / len);
+			ext[n].b1 = (b < 0) ? 0 : (b >= N) ? N - 1 : b;
+
+			s->beg = init + ext[n].b0 * len;
+			s->end = init + (ext[n].b1 + 1) * len;
+			N = ext[n].b1 - ext[n].b0 + 1;
+		}
+
+		s->one = addr;
+		s->two = addr + N * R + 4 - 1;
+		addr = s->two + 1;
+	}
+
+	if ((fp = fopen(dst, "wb")) == NULL)
+		goto err;
+
+	if ((buf = malloc(_SPK_REC)) == NULL)
+		goto err;
+
+	// file record, pointing at the new summaries
+	memcpy(buf, map, _SPK_REC);
+	rec = 2;
+	memcpy(buf + 76, &rec, sizeof(int));
+	rec = 2 * nsr;
+	memcpy(buf + 80, &rec, sizeof(int));
+	memcpy(buf + 84, &addr, sizeof(int));
+	fwrite(buf, _SPK_REC, 1, fp);
+
+	for (n = 0; n < nsr; n++) {
+		double *hdr = (double *)buf;
+		int n0 = n * _SPK_SUM;
+		int n1 = (n0 + _SPK_SUM < k) ? n0 + _SPK_SUM : k;
+
+		memset(buf, 0, _SPK_REC);
+		hdr[0] = (n < nsr - 1) ? 2 * n + 4 : 0;
+		hdr[1] = (n > 0) ? 2 * n : 0;
+		hdr[2] = n1 - n0;
+
+		for (b = n0; b < n1; b++)
+			memcpy(buf + 24 + (b - n0) * sizeof(struct sum_s), &ext[b].sum, sizeof(struct sum_s));
+
+		fwrite(buf, _SPK_REC, 1, fp);
+
+		memset(buf, ' ', _SPK_REC);
+
+		for (b = n0; b < n1; b++)
+			memcpy(buf + (b - n0) * sizeof(struct sum_s), ext[b].nam, sizeof(struct sum_s));
+
+		fwrite(buf, _SPK_REC, 1, fp);
+	}
+
+	// segment data, with the directory rewritten for trimmed segments
+	for (n = 0; n < k; n++) {
+		const double *one;
+
+		sum = ext[n].old;
+		one = (const double *)map + sum->one - 1;
+
+		if (ext[n].b0 < 0) {
+			fwrite(one, sizeof(double), sum->two - sum->one + 1, fp);
+		} else {
+			const double *dir = (const double *)map + sum->two - 4;
+			double out[4];
+			int R = (int)dir[2];
+
+			fwrite(one + ext[n].b0 * R, sizeof(double), (ext[n].b1 - ext[n].b0 + 1) * R, fp);
+
+			out[0] = dir[0] + ext[n].b0 * dir[1];
+			out[1] = dir[1];
+			out[2] = dir[2];
+			out[3] = ext[n].b1 - ext[n].b0 + 1;
+			fwrite(out, sizeof(double), 4, fp);
+		}
+	}
+
+	// pad out the last record
+	n = (int)(ftell(fp) % _SPK_REC);
+
+	if (n > 0) {
+		memset(buf, 0, _SPK_REC);
+		fwrite(buf, _SPK_REC - n, 1, fp);
+	}
+
+	ret = ferror(fp) ? -1 : 0;
+
+err:	if (fp != NULL && fclose(fp) != 0)
+		ret = -1;
+	munmap(map, sb.st_size);
+	free(ext);
+	free(buf);
+	return ret;
+}
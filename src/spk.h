@@ -66,11 +66,25 @@ struct spk_s {
 	size_t len;			// map length
 };
 
+// the current record of each target, kept by the caller so that a
+// single spk_s can be shared read-only between threads
+struct spk_cur_s {
+	double *rec[_SPK_MAX];		// current record (NULL if none)
+	double lo[_SPK_MAX];		// ... and its epoch span
+	double hi[_SPK_MAX];
+	int ncf[_SPK_MAX];		// ... coefficients per coordinate
+};
 
 int spk_free(struct spk_s *pl);
 struct spk_s * spk_init(const char *path);
+struct spk_s * spk_init_index(const char *path, const char *idx);
 int spk_find(struct spk_s *pl, int m);
 int spk_calc(struct spk_s *pl, int tar, double jde, struct mpos_s *pos);
+int spk_advise(struct spk_s *pl, double jd0, double jd1, int advice);
+int spk_lock(struct spk_s *pl, double jd0, double jd1, int on);
+int spk_span(struct spk_s *pl, int num, double *jd0, double *jd1);
+int spk_calc_all(struct spk_s *pl, struct spk_cur_s *cur, int num, double jde, struct mpos_s *pos);
+int spk_extract(const char *src, const char *dst, int num, double jd0, double jd1);
 
 #endif // _SPK_H
 
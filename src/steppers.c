@@ -60,53 +60,167 @@
  *
  */
 
+#include <stdlib.h>
 #include <math.h>
 #include "rebound.h"
 #include "reboundx.h"
 
 // will do IAS with gravity + any additional_forces
+//
+// Operator params:
+// ias15_warm_start (int)   If set, keep the IAS15 state between calls and start from the last step size
+//                          instead of resetting and starting at 1e-4 of the operator step.
+// ias15_own_state (int)    If set, step with an IAS15 state kept on the operator, leaving sim->ri_ias15 alone.
+// ias15_dt (double)        Step size the next warm started call starts from. Written by the operator.
+
+void rebx_ias15_free_arrays(struct rebx_extras* const rebx, struct rebx_operator* const operator){
+    struct reb_simulation_integrator_ias15* const state = rebx_get_param(rebx, operator->ap, "ias15_state");
+    if (state == NULL){
+        return;
+    }
+    // Hand the arrays to REBOUND to free, through a blank simulation so no live one is touched
+    struct reb_simulation* const tmp = calloc(1, sizeof(*tmp));
+    if (tmp != NULL){
+        tmp->ri_ias15 = *state;
+        reb_integrator_ias15_reset(tmp);
+        free(tmp);
+    }
+    free(state);
+}
+
+static struct reb_simulation_integrator_ias15* rebx_ias15_state(struct reb_simulation* const sim, struct rebx_operator* const operator){
+    struct rebx_extras* const rebx = sim->extras;
+    struct reb_simulation_integrator_ias15* state = rebx_get_param(rebx, operator->ap, "ias15_state");
+    if (state == NULL){
+        state = calloc(1, sizeof(*state));  // no arrays yet, IAS15 allocates them on the first step
+        if (state == NULL){
+            reb_error(sim, "REBOUNDx Error: Could not allocate memory for ias15 operator.\n");
+            return NULL;
+        }
+        state->epsilon = sim->ri_ias15.epsilon;
+        state->min_dt = sim->ri_ias15.min_dt;
+        state->epsilon_global = sim->ri_ias15.epsilon_global;
+        rebx_set_param_pointer(rebx, &operator->ap, "ias15_state", state);
+        rebx_set_param_pointer(rebx, &operator->ap, "free_arrays", rebx_ias15_free_arrays);
+    }
+    return state;
+}
 
 void rebx_ias15_step(struct reb_simulation* const sim, struct rebx_operator* const operator, const double dt){
+    struct rebx_extras* const rebx = sim->extras;
+    const int* const warm_start = rebx_get_param(rebx, operator->ap, "ias15_warm_start");
+    const int* const own_state = rebx_get_param(rebx, operator->ap, "ias15_own_state");
+    const int warm = warm_start != NULL && *warm_start;
+    
+    struct reb_simulation_integrator_ias15* state = NULL;
+    struct reb_simulation_integrator_ias15 host_state;
+    if (own_state != NULL && *own_state){
+        state = rebx_ias15_state(sim, operator);
+        if (state == NULL){
+            return;
+        }
+        host_state = sim->ri_ias15;
+        sim->ri_ias15 = *state;
+    }
+
     const double old_t = sim->t;
     const double t_needed = old_t + dt;
     const double old_dt = sim->dt;
     sim->gravity_ignore_terms = 0;
-    reb_integrator_ias15_reset(sim);
     
-    sim->dt = 0.0001*dt; // start with a small timestep.
+    double dt_start = 0.0001*dt; // start with a small timestep.
+    const double* const dt_param = rebx_get_param(rebx, operator->ap, "ias15_dt");
+    if (!warm){
+        reb_integrator_ias15_reset(sim);
+    }
+    else if (dt_param != NULL && *dt_param > 0.){
+        dt_start = *dt_param;
+    }
     
+    // The final step is cut short to land on t_needed, so remember the
+    // step IAS15 proposed after the last full one for the next call.
+    double dt_next = dt_start;
+    int cut = 0;
+    sim->dt = dt_start;
+    if (sim->t+sim->dt > t_needed){
+        sim->dt = t_needed-sim->t;
+        cut = 1;
+    }
     while(sim->t < t_needed && fabs(sim->dt/old_dt)>1e-14 ){
         reb_update_acceleration(sim);
         reb_integrator_ias15_part2(sim);
+        if (!cut){
+            dt_next = sim->dt;
+        }
+        cut = 0;
         if (sim->t+sim->dt > t_needed){
             sim->dt = t_needed-sim->t;
+            cut = 1;
         }
     }
+    if (warm){
+        rebx_set_param_double(rebx, &operator->ap, "ias15_dt", dt_next);
+    }
+    if (state != NULL){
+        *state = sim->ri_ias15;
+        sim->ri_ias15 = host_state;
+    }
     sim->t = old_t;
     sim->dt = old_dt; // reset in case this is part of a chain of steps
 }
 
-void rebx_kepler_step(struct reb_simulation* const sim, struct rebx_operator* const operator, const double dt){
+// When run from the operator lists, consecutive kepler, jump and interaction
+// steps hand the WHFast coordinates in sim->ri_whfast.p_jh on to each other,
+// and the conversion back to sim->particles waits until something else runs
+// (see rebx_pre_timestep_modifications). Called on their own they convert
+// back right away as before.
+
+static void rebx_whfast_begin(struct reb_simulation* const sim){
+    struct rebx_extras* const rebx = sim->extras;
+    if (rebx->whfast_deferred){
+        return; // p_jh is already the current state
+    }
     reb_integrator_whfast_init(sim);
     reb_integrator_whfast_from_inertial(sim);
+}
+
+static void rebx_whfast_end(struct reb_simulation* const sim){
+    struct rebx_extras* const rebx = sim->extras;
+    if (rebx->in_step_list){
+        rebx->whfast_deferred = 1;
+    }
+    else{
+        reb_integrator_whfast_to_inertial(sim);
+    }
+}
+
+void rebx_whfast_sync(struct reb_simulation* const sim){
+    struct rebx_extras* const rebx = sim->extras;
+    if (rebx->whfast_deferred){
+        rebx->whfast_deferred = 0;
+        reb_integrator_whfast_to_inertial(sim);
+    }
+}
+
+void rebx_kepler_step(struct reb_simulation* const sim, struct rebx_operator* const operator, const double dt){
+    rebx_whfast_begin(sim);
     reb_whfast_kepler_step(sim, dt);
     reb_whfast_com_step(sim, dt);
-    reb_integrator_whfast_to_inertial(sim);
+    rebx_whfast_end(sim);
 }
 
 void rebx_jump_step(struct reb_simulation* const sim, struct rebx_operator* const operator, const double dt){
-    reb_integrator_whfast_init(sim);
-    reb_integrator_whfast_from_inertial(sim);
+    rebx_whfast_begin(sim);
     reb_whfast_jump_step(sim, dt);
-    reb_integrator_whfast_to_inertial(sim);
+    rebx_whfast_end(sim);
 }
 
 void rebx_interaction_step(struct reb_simulation* const sim, struct rebx_operator* const operator, const double dt){
-    reb_integrator_whfast_init(sim);
-    reb_integrator_whfast_from_inertial(sim);
+    rebx_whfast_begin(sim);
+    rebx_whfast_sync(sim);  // gravity and forces need inertial positions; p_jh stays current
     reb_update_acceleration(sim);
     reb_whfast_interaction_step(sim, dt);
-    reb_integrator_whfast_to_inertial(sim);
+    rebx_whfast_end(sim);
 }
 
 void rebx_drift_step(struct reb_simulation* const sim, struct rebx_operator* const operator, const double dt){
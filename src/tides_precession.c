@@ -37,7 +37,7 @@
  *
  * This adds precession from the tidal interactions between the particles in the simulation and the central body, both from tides raised on the primary and on the other bodies.
  * In all cases, we need to set masses for all the particles that will feel these tidal forces. After that, we can choose to include tides raised on the primary, on the "planets", or both, by setting the respective bodies' R_tides (physical radius) and k1 (apsidal motion constant, half the tidal Love number).
- * You can specify the primary with a "primary" flag.
+ * You can specify the primary with a "tides_primary" flag.
  * If not set, the primary will default to the particle at the 0 index in the particles array.
  * 
  * **Effect Parameters**
@@ -51,7 +51,7 @@
  * ============================ =========== ==================================================================
  * R_tides (float)              Yes         Physical radius (required for contribution from tides raised on the body).
  * k1 (float)                   Yes         Apsidal motion constant (half the tidal Love number k2).
- * primary (int)                No          Set to 1 to specify the primary.  Defaults to treating particles[0] as primary if not set.
+ * tides_primary (int)          No          Set to 1 to specify the primary.  Defaults to treating particles[0] as primary if not set.
  * ============================ =========== ==================================================================
  * 
  */
@@ -77,6 +77,7 @@ static void rebx_calculate_tides_precession(struct rebx_extras* const rebx, stru
     }
     const double fac0 = k10*R0*R0*R0*R0*R0; 
     const int _N_real = sim->N - sim->N_var;
+    const struct rebx_geometry* const geo = rebx_get_geometry(rebx, particles, _N_real, source_index);
     double k1p, Rp;
     for (int i=0;i<_N_real;i++){
         if(i == source_index) continue;
@@ -100,10 +101,10 @@ static void rebx_calculate_tides_precession(struct rebx_extras* const rebx, stru
         }
         
         fac += k1p*Rp*Rp*Rp*Rp*Rp/mratio;
-        const double dx = p->x - source->x; 
-        const double dy = p->y - source->y;
-        const double dz = p->z - source->z;
-        const double dr2 = dx*dx + dy*dy + dz*dz; 
+        const double dx = geo ? geo->dx[i] : p->x - source->x; 
+        const double dy = geo ? geo->dy[i] : p->y - source->y;
+        const double dz = geo ? geo->dz[i] : p->z - source->z;
+        const double dr2 = geo ? geo->r2[i] : dx*dx + dy*dy + dz*dz; 
         const double prefac = -3*sim->G*(m0 + p->m)/(dr2*dr2*dr2*dr2)*fac;
 
         p->ax += prefac*dx;
@@ -190,13 +191,13 @@ double rebx_tides_precession_potential(struct rebx_extras* const rebx){
     int source_found=0;
     double H=0.;
     for (int i=0; i<N_real; i++){
-        if (rebx_get_param(rebx, particles[i].ap, "primary") != NULL){
+        if (rebx_get_param(rebx, particles[i].ap, "tides_primary") != NULL){
             source_found = 1;
             H = rebx_calculate_tides_precession_potential(rebx, sim, i);
         }
     }
     if (!source_found){
-        H = rebx_calculate_tides_precession_potential(rebx, sim, 0);    // default source to index 0 if "primary" not found on any particle
+        H = rebx_calculate_tides_precession_potential(rebx, sim, 0);    // default source to index 0 if "tides_primary" not found on any particle
     }
     return H;
 }
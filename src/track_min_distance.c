@@ -55,41 +55,195 @@
  * min_distance_orbit (reb_orbit)   No          Parameter to store orbital elements at moment corresponding to min_distance (heliocentric)
  * ================================ =========== =======================================================
  *
+ * Between calls the relative motion is interpolated (cubic Hermite in the positions and velocities at both ends), so if the
+ * radial velocity changes sign during a step, the minimum within the step is found rather than just the closer endpoint.
+ *
  */
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <math.h>
+#include <float.h>
 #include "rebound.h"
 #include "reboundx.h"
 
-void rebx_track_min_distance(struct reb_simulation* const sim, struct rebx_operator* const operator, const double dt){
-    const struct rebx_extras* const rebx = sim->extras;
-    const int N = sim->N - sim->N_var;
+// Trackers are resolved from the particle params once and rebuilt whenever a
+// param is added, a particle is removed, or the particle array changes.
+struct rebx_min_distance_tracker{
+    int index;                  // particle tracking its distance
+    int source;                 // particle distance is measured from
+    double* min_distance;
+    struct reb_orbit* orbit;    // NULL if not set
+    double dr[3];               // relative position and velocity at the last call
+    double dv[3];
+};
+
+struct rebx_min_distance_workspace{
+    unsigned long generation;   // rebx->param_generation when resolved
+    const struct reb_particle* particles;
+    int N;
+    int N_alloc;
+    int N_trackers;
+    int have_previous;          // trackers hold the state at time t
+    double t;
+    struct rebx_min_distance_tracker* trackers;
+};
+
+void rebx_track_min_distance_free_arrays(struct rebx_extras* const rebx, struct rebx_operator* const operator){
+    struct rebx_min_distance_workspace* const ws = rebx_get_param(rebx, operator->ap, "min_distance_workspace");
+    if (ws != NULL){
+        free(ws->trackers);
+        free(ws);
+    }
+}
+
+static int rebx_track_min_distance_resolve(struct reb_simulation* const sim, struct rebx_min_distance_workspace* const ws, const int N){
+    struct rebx_extras* const rebx = sim->extras;
+    if (N > ws->N_alloc){
+        struct rebx_min_distance_tracker* const trackers = realloc(ws->trackers, N*sizeof(*trackers));
+        if (trackers == NULL){
+            return 0;
+        }
+        ws->trackers = trackers;
+        ws->N_alloc = N;
+    }
+    const int distance_id = rebx_get_param_id(rebx, "min_distance");
+    const int from_id = rebx_get_param_id(rebx, "min_distance_from");
+    const int orbit_id = rebx_get_param_id(rebx, "min_distance_orbit");
+    ws->N_trackers = 0;
     for(int i=0; i<N; i++){
         struct reb_particle* const p = &sim->particles[i];
-        double* min_distance = rebx_get_param(rebx, p->ap, "min_distance");
-        if (min_distance != NULL){
-            const uint32_t* const target = rebx_get_param(rebx, p->ap, "min_distance_from");
-            struct reb_particle* source;
-            if (target == NULL){
-                source = &sim->particles[0];
-            }
-            else{
-                source = reb_get_particle_by_hash(sim, *target);
-            }
-            const double dx = p->x-source->x;
-            const double dy = p->y-source->y;
-            const double dz = p->z-source->z;
-            const double r2 = dx*dx + dy*dy + dz*dz;
-            if (r2 < *min_distance*(*min_distance)){
-                *min_distance = sqrt(r2);
-                struct reb_orbit* const orbit = rebx_get_param(rebx, p->ap, "min_distance_orbit");
-                if (orbit != NULL){
-                    *orbit = reb_tools_particle_to_orbit(sim->G, *p, *source);
-                }
+        double* const min_distance = rebx_get_param_by_id(rebx, p->ap, distance_id);
+        if (min_distance == NULL){
+            continue;
+        }
+        int source = 0;
+        const uint32_t* const target = rebx_get_param_by_id(rebx, p->ap, from_id);
+        if (target != NULL){
+            const struct reb_particle* const from = reb_get_particle_by_hash(sim, *target);
+            if (from == NULL){
+                reb_warning(sim, "REBOUNDx Warning: Particle with hash in min_distance_from not found. Not tracking its distance.\n");
+                continue;
             }
+            source = (int)(from - sim->particles);
+        }
+        struct rebx_min_distance_tracker* const tracker = &ws->trackers[ws->N_trackers++];
+        tracker->index = i;
+        tracker->source = source;
+        tracker->min_distance = min_distance;
+        tracker->orbit = rebx_get_param_by_id(rebx, p->ap, orbit_id);
+    }
+    ws->generation = rebx->param_generation;
+    ws->particles = sim->particles;
+    ws->N = N;
+    ws->have_previous = 0;  // indices may have moved, state from the last call can't be trusted
+    return 1;
+}
+
+// Relative position (and velocity) at fraction s of a step of length h
+// on the cubic Hermite interpolant through both ends.
+static void rebx_min_distance_interpolate(const double* const r0, const double* const v0, const double* const r1, const double* const v1, const double h, const double s, double* const r, double* const v){
+    const double s2 = s*s;
+    const double s3 = s2*s;
+    const double h00 = 2.*s3 - 3.*s2 + 1.;
+    const double h10 = s3 - 2.*s2 + s;
+    const double h01 = -2.*s3 + 3.*s2;
+    const double h11 = s3 - s2;
+    const double d00 = 6.*s2 - 6.*s;
+    const double d10 = 3.*s2 - 4.*s + 1.;
+    const double d11 = 3.*s2 - 2.*s;
+    for (int k=0; k<3; k++){
+        r[k] = h00*r0[k] + h10*h*v0[k] + h01*r1[k] + h11*h*v1[k];
+        v[k] = (d00*(r0[k] - r1[k]))/h + d10*v0[k] + d11*v1[k];
+    }
+}
+
+// Called only when the radial velocity goes from negative to positive
+// across the step, so r.v brackets a root in s. Returns the squared
+// distance there and fills in the relative state.
+static double rebx_min_distance_refine(const double* const r0, const double* const v0, const double* const r1, const double* const v1, const double h, double* const r, double* const v){
+    double lo = 0.;
+    double hi = 1.;
+    for (int iter=0; iter<60 && hi - lo > 4.*DBL_EPSILON; iter++){
+        const double mid = 0.5*(lo + hi);
+        rebx_min_distance_interpolate(r0, v0, r1, v1, h, mid, r, v);
+        if (r[0]*v[0] + r[1]*v[1] + r[2]*v[2] < 0.){
+            lo = mid;
+        }
+        else{
+            hi = mid;
         }
     }
+    rebx_min_distance_interpolate(r0, v0, r1, v1, h, 0.5*(lo + hi), r, v);
+    return r[0]*r[0] + r[1]*r[1] + r[2]*r[2];
+}
+
+static void rebx_min_distance_record(struct reb_simulation* const sim, const struct rebx_min_distance_tracker* const tracker, const double r2, const double* const r, const double* const v){
+    *tracker->min_distance = sqrt(r2);
+    if (tracker->orbit != NULL){
+        const struct reb_particle source = sim->particles[tracker->source];
+        struct reb_particle p = sim->particles[tracker->index];
+        p.x = source.x + r[0];
+        p.y = source.y + r[1];
+        p.z = source.z + r[2];
+        p.vx = source.vx + v[0];
+        p.vy = source.vy + v[1];
+        p.vz = source.vz + v[2];
+        *tracker->orbit = reb_tools_particle_to_orbit(sim->G, p, source);
+    }
 }
 
+void rebx_track_min_distance(struct reb_simulation* const sim, struct rebx_operator* const operator, const double dt){
+    struct rebx_extras* const rebx = sim->extras;
+    const int N = sim->N - sim->N_var;
+    struct rebx_min_distance_workspace* ws = rebx_get_param(rebx, operator->ap, "min_distance_workspace");
+    if (ws == NULL){
+        ws = calloc(1, sizeof(*ws));
+        if (ws == NULL){
+            reb_error(sim, "REBOUNDx Error: Could not allocate memory for track_min_distance.\n");
+            return;
+        }
+        rebx_set_param_pointer(rebx, &operator->ap, "min_distance_workspace", ws);
+        rebx_set_param_pointer(rebx, &operator->ap, "free_arrays", rebx_track_min_distance_free_arrays);
+    }
+    if (ws->generation != rebx->param_generation || ws->particles != sim->particles || ws->N != N){
+        if (!rebx_track_min_distance_resolve(sim, ws, N)){
+            ws->generation = 0;
+            reb_error(sim, "REBOUNDx Error: Could not allocate memory for track_min_distance.\n");
+            return;
+        }
+    }
+
+    const double h = sim->t - ws->t;
+    const int interpolate = ws->have_previous && h > 0.;
+    for(int k=0; k<ws->N_trackers; k++){
+        struct rebx_min_distance_tracker* const tracker = &ws->trackers[k];
+        const struct reb_particle* const p = &sim->particles[tracker->index];
+        const struct reb_particle* const source = &sim->particles[tracker->source];
+        const double dr[3] = {p->x - source->x, p->y - source->y, p->z - source->z};
+        const double dv[3] = {p->vx - source->vx, p->vy - source->vy, p->vz - source->vz};
+        const double r2 = dr[0]*dr[0] + dr[1]*dr[1] + dr[2]*dr[2];
+        const double min2 = *tracker->min_distance*(*tracker->min_distance);
+
+        // Cheap test for a minimum inside the step: the radial velocity changed sign
+        const double rdot0 = tracker->dr[0]*tracker->dv[0] + tracker->dr[1]*tracker->dv[1] + tracker->dr[2]*tracker->dv[2];
+        const double rdot1 = dr[0]*dv[0] + dr[1]*dv[1] + dr[2]*dv[2];
+        double rmin[3], vmin[3];
+        double rmin2 = INFINITY;
+        if (interpolate && rdot0 < 0. && rdot1 > 0.){
+            rmin2 = rebx_min_distance_refine(tracker->dr, tracker->dv, dr, dv, h, rmin, vmin);
+        }
+        if (rmin2 < r2 && rmin2 < min2){
+            rebx_min_distance_record(sim, tracker, rmin2, rmin, vmin);
+        }
+        else if (r2 < min2){
+            rebx_min_distance_record(sim, tracker, r2, dr, dv);
+        }
+        for (int j=0; j<3; j++){
+            tracker->dr[j] = dr[j];
+            tracker->dv[j] = dv[j];
+        }
+    }
+    ws->t = sim->t;
+    ws->have_previous = 1;
+}